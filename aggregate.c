@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "aggregate.h"
+
+// Copy a record into the arena, packed
+static char *arena_store(AGG_TABLE *table, const void *key, uint32_t key_len, const void *value, uint32_t value_len) {
+    size_t arena_memory = table->arena.memory;
+    char *data = arena_alloc_bytes(&table->arena, (size_t)key_len + value_len);
+
+    if (data != NULL) {
+        table->memory += table->arena.memory - arena_memory;
+        memcpy(data, key, key_len);
+        memcpy(data + key_len, value, value_len);
+    }
+    return data;
+}
+
+// Double the slots, reinserting the entries (their data stays where it is in the arena)
+static int grow_slots(AGG_TABLE *table) {
+    size_t capacity = table->capacity ? table->capacity * 2 : AGG_MIN_CAPACITY;
+    AGG_ENTRY *slots = calloc(capacity, sizeof(AGG_ENTRY));
+    size_t idx;
+
+    if (slots == NULL) {
+        return ERROR;
+    }
+    for (idx = 0; idx < table->capacity; idx++) {
+        if (table->slots[idx].data != NULL) {
+            size_t slot = table->slots[idx].hash & (capacity - 1);
+            while (slots[slot].data != NULL) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            slots[slot] = table->slots[idx];
+        }
+    }
+    free(table->slots);
+    table->memory += (capacity - table->capacity) * sizeof(AGG_ENTRY);
+    table->slots = slots;
+    table->capacity = capacity;
+    return SUCCESS;
+}
+
+/* Start an empty table.
+   @param merge: The merge function for records of a key already in the table, or NULL to keep the first value.
+   @param chunk_size: The size of the arena chunks, AGG_CHUNK_SIZE if 0. A smaller size suits a small memory budget.
+ */
+void agg_table_init(AGG_TABLE *table, AGG_MERGE merge, size_t chunk_size) {
+    memset(table, 0, sizeof(*table));
+    table->merge = merge;
+    arena_init(&table->arena, chunk_size > 0 ? chunk_size : AGG_CHUNK_SIZE);
+}
+
+/* Add a record, merging it into the value of its key if the key is already in the table.
+   @ret: 0 on success, -1 if out of memory or if the merge function failed.
+ */
+int agg_table_add(AGG_TABLE *table, const void *key, uint32_t key_len, const void *value, uint32_t value_len) {
+    uint32_t hash = itm_hash(key, key_len);
+    size_t slot;
+
+    // Keep the load factor under 3/4
+    if ((table->entry_num + 1) * 4 > table->capacity * 3 && grow_slots(table) != SUCCESS) {
+        return ERROR;
+    }
+
+    for (slot = hash & (table->capacity - 1); table->slots[slot].data != NULL; slot = (slot + 1) & (table->capacity - 1)) {
+        AGG_ENTRY *entry = &table->slots[slot];
+        if (entry->hash == hash && entry->key_len == key_len && memcmp(entry->data, key, key_len) == 0) {
+            if (table->merge == NULL) {
+                return SUCCESS;
+            }
+            return table->merge(entry->data + key_len, entry->value_len, value, value_len) == 0 ? SUCCESS : ERROR;
+        }
+    }
+
+    AGG_ENTRY *entry = &table->slots[slot];
+    if ((entry->data = arena_store(table, key, key_len, value, value_len)) == NULL) {
+        return ERROR;
+    }
+    entry->hash = hash;
+    entry->key_len = key_len;
+    entry->value_len = value_len;
+    table->entry_num++;
+    return SUCCESS;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const AGG_ENTRY *x = *(AGG_ENTRY *const *)a, *y = *(AGG_ENTRY *const *)b;
+    return itm_compare_keys(x->data, x->key_len, y->data, y->key_len);
+}
+
+/* The entries of the table, sorted by key (in the order of itm_compare_keys()).
+   @ret: An array of entry_num pointers to free() once done, or NULL if out of memory.
+ */
+AGG_ENTRY **agg_table_sorted(AGG_TABLE *table) {
+    AGG_ENTRY **sorted = malloc((table->entry_num ? table->entry_num : 1) * sizeof(AGG_ENTRY *));
+    size_t idx, num = 0;
+
+    if (sorted == NULL) {
+        return NULL;
+    }
+    for (idx = 0; idx < table->capacity; idx++) {
+        if (table->slots[idx].data != NULL) {
+            sorted[num++] = &table->slots[idx];
+        }
+    }
+    qsort(sorted, num, sizeof(AGG_ENTRY *), compare_entries);
+    return sorted;
+}
+
+/* Write the entries as intermediate records sorted by key, then empty the table. The writer is
+   left unmarked: the file it writes is a sorted run only if this is its single batch of records.
+   @ret: 0 on success, -1 on error.
+ */
+int agg_table_write(AGG_TABLE *table, ITM_WRITER *writer) {
+    AGG_ENTRY **sorted = agg_table_sorted(table);
+    size_t idx;
+    int ret = SUCCESS;
+
+    if (sorted == NULL) {
+        return ERROR;
+    }
+    for (idx = 0; ret == SUCCESS && idx < table->entry_num; idx++) {
+        ret = itm_write(writer, sorted[idx]->data, sorted[idx]->key_len, sorted[idx]->data + sorted[idx]->key_len, sorted[idx]->value_len);
+    }
+    free(sorted);
+
+    // The next run starts from a small table again
+    AGG_MERGE merge = table->merge;
+    size_t chunk_size = table->arena.chunk_size;
+    agg_table_clear(table);
+    agg_table_init(table, merge, chunk_size);
+    return ret;
+}
+
+/* Free everything the table holds */
+void agg_table_clear(AGG_TABLE *table) {
+    arena_reset(&table->arena);
+    free(table->slots);
+    table->slots = NULL;
+    table->capacity = table->entry_num = table->memory = 0;
+}
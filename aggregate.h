@@ -0,0 +1,47 @@
+/* The hash-aggregation table behind mapreduce_emit(): an open-addressing (linear probing) table
+   whose keys and values live in an ARENA of large chunks. Records with a key already in the table
+   are merged into its value in place, with the merge function of the job.
+
+   The table tracks the memory it uses, so that its owner can write it out as a sorted run of
+   intermediate records and start over once a budget is reached. */
+
+#ifndef _AGGREGATE_H
+#define _AGGREGATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "itm.h"
+#include "arena.h"
+
+#define AGG_CHUNK_SIZE (1024 * 1024) /* The default size of the chunks the arena grows by (a larger record gets its own chunk) */
+#define AGG_MIN_CAPACITY 1024 /* The initial number of slots */
+
+/* Merge other[0, other_len) into value[0, value_len) in place. @ret: 0 on success, -1 if they cannot be merged. */
+typedef int (*AGG_MERGE)(char * value, uint32_t value_len, const char * other, uint32_t other_len);
+
+typedef struct _agg_entry
+{
+    uint32_t hash;
+    uint32_t key_len;
+    uint32_t value_len;
+    char * data; /* The key bytes then the value bytes, in the arena; NULL for an empty slot */
+}AGG_ENTRY;
+
+typedef struct _agg_table
+{
+    AGG_MERGE merge; /* NULL keeps the first value of each key */
+    AGG_ENTRY * slots;
+    size_t capacity; /* A power of two */
+    size_t entry_num;
+    ARENA arena; /* The keys and values */
+    size_t memory; /* Bytes held by the slots and the arena */
+}AGG_TABLE;
+
+void agg_table_init(AGG_TABLE * table, AGG_MERGE merge, size_t chunk_size);
+int agg_table_add(AGG_TABLE * table, const void * key, uint32_t key_len, const void * value, uint32_t value_len);
+AGG_ENTRY ** agg_table_sorted(AGG_TABLE * table);
+int agg_table_write(AGG_TABLE * table, ITM_WRITER * writer);
+void agg_table_clear(AGG_TABLE * table);
+
+#endif
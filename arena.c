@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "arena.h"
+
+// Get size bytes from the newest chunk, starting a chunk of at least chunk_size bytes if it is full
+static void *arena_take(ARENA *arena, size_t size, size_t align) {
+    ARENA_CHUNK *chunk = arena->chunks;
+    size_t start = 0;
+
+    if (chunk != NULL) {
+        start = (chunk->used + align - 1) & ~(align - 1);
+    }
+    if (chunk == NULL || start > chunk->size || chunk->size - start < size) {
+        size_t chunk_size = size > arena->chunk_size ? size : arena->chunk_size;
+        if ((chunk = malloc(sizeof(ARENA_CHUNK) + chunk_size)) == NULL) {
+            return NULL;
+        }
+        chunk->next = arena->chunks;
+        chunk->size = chunk_size;
+        arena->chunks = chunk;
+        arena->memory += sizeof(ARENA_CHUNK) + chunk_size;
+        start = 0;
+    }
+    chunk->used = start + size;
+    return chunk->data + start;
+}
+
+/* Start an empty arena.
+   @param chunk_size: The size of the chunks it grows by, ARENA_CHUNK_SIZE if 0.
+ */
+void arena_init(ARENA *arena, size_t chunk_size) {
+    arena->chunks = NULL;
+    arena->chunk_size = chunk_size > 0 ? chunk_size : ARENA_CHUNK_SIZE;
+    arena->memory = 0;
+}
+
+/* Allocate size bytes aligned to ARENA_ALIGN. They stay valid until arena_reset().
+   @ret: The memory, or NULL if out of memory.
+ */
+void *arena_alloc(ARENA *arena, size_t size) {
+    return arena_take(arena, size, ARENA_ALIGN);
+}
+
+/* Allocate size bytes with no alignment, for packed byte strings. */
+void *arena_alloc_bytes(ARENA *arena, size_t size) {
+    return arena_take(arena, size, 1);
+}
+
+/* A formatted string allocated in the arena.
+   @ret: The string, or NULL if out of memory.
+ */
+char *arena_printf(ARENA *arena, const char *fmt, ...) {
+    va_list args;
+    char *str;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    if (len < 0 || (str = arena_alloc_bytes(arena, len + 1)) == NULL) {
+        return NULL;
+    }
+    va_start(args, fmt);
+    vsnprintf(str, len + 1, fmt, args);
+    va_end(args);
+    return str;
+}
+
+/* Release everything allocated in the arena. It can be used again afterwards. */
+void arena_reset(ARENA *arena) {
+    while (arena->chunks != NULL) {
+        ARENA_CHUNK *next = arena->chunks->next;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+    arena->memory = 0;
+}
+
+// A returned buffer links to the next one through its first bytes
+typedef struct _io_buffer
+{
+    struct _io_buffer *next;
+}IO_BUFFER;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static IO_BUFFER *pool_free_list;
+static int pool_free_num;
+
+/* Get a page-aligned buffer of IO_BUFFER_SIZE bytes, recycled from the pool when one is free.
+   @ret: The buffer (to give back with io_buffer_put()), or NULL if out of memory.
+ */
+void *io_buffer_get(void) {
+    IO_BUFFER *buffer;
+
+    pthread_mutex_lock(&pool_lock);
+    if ((buffer = pool_free_list) != NULL) {
+        pool_free_list = buffer->next;
+        pool_free_num--;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (buffer == NULL) {
+        void *memory;
+        if (posix_memalign(&memory, sysconf(_SC_PAGESIZE), IO_BUFFER_SIZE) != 0) {
+            return NULL;
+        }
+        buffer = memory;
+    }
+    return buffer;
+}
+
+/* Give a buffer from io_buffer_get() back to the pool. NULL is ignored. */
+void io_buffer_put(void *buffer) {
+    IO_BUFFER *returned = buffer;
+
+    if (returned == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool_lock);
+    if (pool_free_num < IO_BUFFER_POOL_MAX) {
+        returned->next = pool_free_list;
+        pool_free_list = returned;
+        pool_free_num++;
+        returned = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    free(returned);
+}
+
+/* Free the buffers waiting in the pool, at the end of a phase. Buffers still in use are not affected. */
+void io_buffer_pool_reset(void) {
+    IO_BUFFER *buffer;
+
+    pthread_mutex_lock(&pool_lock);
+    buffer = pool_free_list;
+    pool_free_list = NULL;
+    pool_free_num = 0;
+    pthread_mutex_unlock(&pool_lock);
+
+    while (buffer != NULL) {
+        IO_BUFFER *next = buffer->next;
+        free(buffer);
+        buffer = next;
+    }
+}
@@ -0,0 +1,45 @@
+/* Worker-local allocation helpers.
+
+   An ARENA hands out memory from large chunks with a bump pointer and releases all of it at once
+   with arena_reset(): for allocations that share a lifetime, such as the file names of a
+   mapreduce() call or the records of an aggregation buffer.
+
+   The I/O buffer pool recycles page-aligned buffers of IO_BUFFER_SIZE bytes, for reads, writes
+   and stdio streams. It is shared by the threads of a process (a forked worker gets its own copy). */
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_CHUNK_SIZE (64 * 1024) /* The default size of the chunks an arena grows by */
+#define ARENA_ALIGN 16 /* The alignment of arena_alloc() */
+#define IO_BUFFER_SIZE (1024 * 1024) /* The size of the pooled I/O buffers */
+#define IO_BUFFER_POOL_MAX 64 /* Returned buffers beyond this many are freed */
+
+typedef struct _arena_chunk
+{
+    struct _arena_chunk * next;
+    size_t used;
+    size_t size;
+    char data[] __attribute__((aligned(ARENA_ALIGN))); /* malloc() memory is aligned enough for data to be too */
+}ARENA_CHUNK;
+
+typedef struct _arena
+{
+    ARENA_CHUNK * chunks; /* Newest first */
+    size_t chunk_size;
+    size_t memory; /* Bytes held by the chunks */
+}ARENA;
+
+void arena_init(ARENA * arena, size_t chunk_size);
+void * arena_alloc(ARENA * arena, size_t size);
+void * arena_alloc_bytes(ARENA * arena, size_t size);
+char * arena_printf(ARENA * arena, const char * fmt, ...) __attribute__((format(printf, 2, 3)));
+void arena_reset(ARENA * arena);
+
+void * io_buffer_get(void);
+void io_buffer_put(void * buffer);
+void io_buffer_pool_reset(void);
+
+#endif
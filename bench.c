@@ -0,0 +1,566 @@
+/* The benchmark driver: runs run-mapreduce over the sample inputs and synthetic files, sweeping the
+   number of splits and workers, and reports the median and p95 wall time, the throughput and the
+   peak RSS of each configuration as CSV or JSON. */
+
+#define _GNU_SOURCE /* strdup(), realpath() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <glob.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "common.h"
+
+#define BENCH_MAX_VALUES 32 /* The maximum number of values of a swept parameter */
+#define BENCH_SYNTH_SEED "input-warpeace.txt" /* Synthetic inputs repeat this file */
+
+typedef struct _bench_config
+{
+    const char * binary; /* run-mapreduce */
+    const char * work_dir; /* runs (and their split/intermediate files) happen in this directory */
+    const char * output; /* the CSV or JSON report */
+    int json; /* write the report as JSON instead of CSV */
+    int repeat; /* runs per configuration */
+    const char * word; /* the word searched by the finder runs */
+    int split_nums[BENCH_MAX_VALUES]; /* the split counts to sweep */
+    int split_num_count;
+    int worker_nums[BENCH_MAX_VALUES]; /* the worker counts to sweep, 0 leaves --worker-num unset */
+    int worker_num_count;
+    long long sizes[BENCH_MAX_VALUES]; /* the sizes of the synthetic inputs in bytes */
+    int size_count;
+    char ** extra_args; /* passed to run-mapreduce before the task name */
+    int extra_arg_num;
+}BENCH_CONFIG;
+
+typedef struct _run_sample
+{
+    int status; /* the exit status of run-mapreduce, -1 if it did not exit normally */
+    double wall_ms;
+    long max_rss_kb; /* the largest RSS of run-mapreduce and all its worker processes */
+}RUN_SAMPLE;
+
+void print_usage(char * cmd_name)
+{
+    printf("Usage: %s [options] [-- run-mapreduce options]\n", cmd_name);
+    printf("Options:\n");
+    printf("  --binary=PATH              the run-mapreduce binary (default ./run-mapreduce)\n");
+    printf("  --output=FILE              the report; JSON if FILE ends in .json, CSV otherwise (default bench.csv)\n");
+    printf("  --work-dir=DIR             where the runs and the synthetic inputs go (default bench-work)\n");
+    printf("  --repeat=N                 runs per configuration (default 5)\n");
+    printf("  --splits=N,N,...           split counts to sweep (default 1,4,16)\n");
+    printf("  --workers=N,N,...          worker counts to sweep, 0 for the framework default (default 0)\n");
+    printf("  --sizes=SIZE,SIZE,...      synthetic input sizes, with an optional K, M or G suffix (default 1M,100M)\n");
+    printf("  --word=WORD                the word searched by the finder runs (default the)\n");
+}
+
+enum
+{
+    OPT_BINARY = 256,
+    OPT_OUTPUT,
+    OPT_WORK_DIR,
+    OPT_REPEAT,
+    OPT_SPLITS,
+    OPT_WORKERS,
+    OPT_SIZES,
+    OPT_WORD
+};
+
+static struct option long_options[] =
+{
+    {"binary", required_argument, NULL, OPT_BINARY},
+    {"output", required_argument, NULL, OPT_OUTPUT},
+    {"work-dir", required_argument, NULL, OPT_WORK_DIR},
+    {"repeat", required_argument, NULL, OPT_REPEAT},
+    {"splits", required_argument, NULL, OPT_SPLITS},
+    {"workers", required_argument, NULL, OPT_WORKERS},
+    {"sizes", required_argument, NULL, OPT_SIZES},
+    {"word", required_argument, NULL, OPT_WORD},
+    {NULL, 0, NULL, 0}
+};
+
+// Parse a size such as 512, 64K, 100M or 10G
+static long long parse_size(const char * str)
+{
+    char * end = NULL;
+    long long size = strtoll(str, &end, 10);
+
+    if (end == str || size <= 0)
+    {
+        return -1;
+    }
+    switch (*end)
+    {
+    case '\0':
+        return size;
+    case 'k': case 'K':
+        size <<= 10;
+        break;
+    case 'm': case 'M':
+        size <<= 20;
+        break;
+    case 'g': case 'G':
+        size <<= 30;
+        break;
+    default:
+        return -1;
+    }
+    return end[1] == '\0' ? size : -1;
+}
+
+// Parse a comma-separated list of sizes (or plain numbers when is_size is 0)
+static int parse_list(const char * str, long long * values, int is_size)
+{
+    char * copy = strdup(str), * token, * save = NULL;
+    int count = 0;
+
+    for (token = strtok_r(copy, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save))
+    {
+        char * end = NULL;
+        long long value = is_size ? parse_size(token) : strtoll(token, &end, 10);
+        if (count == BENCH_MAX_VALUES || value < 0 || (!is_size && *end != '\0'))
+        {
+            free(copy);
+            return -1;
+        }
+        values[count++] = value;
+    }
+    free(copy);
+    return count;
+}
+
+static int parse_int_list(const char * str, int * values, int min)
+{
+    long long parsed[BENCH_MAX_VALUES];
+    int count = parse_list(str, parsed, 0), i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (parsed[i] < min || parsed[i] > 1 << 20)
+        {
+            return -1;
+        }
+        values[i] = parsed[i];
+    }
+    return count;
+}
+
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void remove_matching(const char * pattern)
+{
+    glob_t found;
+    size_t i;
+
+    if (glob(pattern, 0, NULL, &found) == 0)
+    {
+        for (i = 0; i < found.gl_pathc; i++)
+        {
+            unlink(found.gl_pathv[i]);
+        }
+    }
+    globfree(&found);
+}
+
+// Remove the split, intermediate and result files of a run from the working directory
+static void clean_run_files(void)
+{
+    remove_matching("split-*");
+    remove_matching("mr-*.itm");
+    remove_matching("mr*.rst");
+}
+
+/* Run argv once. A helper process forks and waits for run-mapreduce, so that its RUSAGE_CHILDREN
+   covers run-mapreduce and every worker process run-mapreduce has waited for.
+   @ret: SUCCESS when the sample was taken (whatever the exit status of the run), ERROR otherwise.
+ */
+static int run_once(char ** argv, RUN_SAMPLE * sample)
+{
+    int fds[2], status;
+    pid_t helper;
+
+    if (pipe(fds) == -1)
+    {
+        return ERROR;
+    }
+    helper = fork();
+    if (helper == -1)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return ERROR;
+    }
+    if (helper == 0)
+    {
+        RUN_SAMPLE measured = {-1, 0, 0};
+        struct rusage usage;
+        double start = now_ms();
+        pid_t child = fork();
+
+        close(fds[0]);
+        if (child == 0)
+        {
+            int null_fd = open("/dev/null", O_WRONLY);
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+            execv(argv[0], argv);
+            _exit(127);
+        }
+        if (child > 0 && waitpid(child, &status, 0) == child)
+        {
+            measured.wall_ms = now_ms() - start;
+            measured.status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+            getrusage(RUSAGE_CHILDREN, &usage);
+            measured.max_rss_kb = usage.ru_maxrss;
+        }
+        _exit(write(fds[1], &measured, sizeof(measured)) == sizeof(measured) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    status = read(fds[0], sample, sizeof(*sample)) == sizeof(*sample) ? SUCCESS : ERROR;
+    close(fds[0]);
+    waitpid(helper, NULL, 0);
+    return status;
+}
+
+static int compare_doubles(const void * a, const void * b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+// The nearest-rank percentile of sorted[0, count)
+static double percentile(const double * sorted, int count, int pct)
+{
+    int rank = (pct * count + 99) / 100;
+
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+// Write a synthetic input of size bytes by repeating seed_path, unless it already exists
+static int make_synthetic_input(const char * seed_path, const char * path, long long size)
+{
+    struct stat file_stat;
+    char buffer[64 * 1024];
+    int seed_fd, out_fd;
+    long long written = 0;
+
+    if (stat(path, &file_stat) == 0 && file_stat.st_size == size)
+    {
+        return SUCCESS;
+    }
+    printf("Generating %s (%lld bytes)\n", path, size);
+    if ((seed_fd = open(seed_path, O_RDONLY)) == -1)
+    {
+        return ERROR;
+    }
+    if ((out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+    {
+        close(seed_fd);
+        return ERROR;
+    }
+    while (written < size)
+    {
+        ssize_t bytes_read = read(seed_fd, buffer, sizeof(buffer));
+        if (bytes_read == 0)
+        {
+            lseek(seed_fd, 0, SEEK_SET); // start the seed over
+            continue;
+        }
+        if (bytes_read < 0)
+        {
+            break;
+        }
+        if (bytes_read > size - written)
+        {
+            bytes_read = size - written;
+        }
+        if (write(out_fd, buffer, bytes_read) != bytes_read)
+        {
+            break;
+        }
+        written += bytes_read;
+    }
+    close(seed_fd);
+    close(out_fd);
+    return written == size ? SUCCESS : ERROR;
+}
+
+static void write_header(FILE * out, const BENCH_CONFIG * config)
+{
+    if (config->json)
+    {
+        fprintf(out, "[");
+    }
+    else
+    {
+        fprintf(out, "task,input,bytes,split_num,worker_num,options,repeat,failures,median_ms,p95_ms,mb_per_s,max_rss_kb\n");
+    }
+}
+
+static void write_row(FILE * out, const BENCH_CONFIG * config, int row_idx, const char * task, const char * input,
+                      long long bytes, int split_num, int worker_num, const char * options, int failures,
+                      double median_ms, double p95_ms, long max_rss_kb)
+{
+    double mb_per_s = median_ms > 0 ? bytes / (1024.0 * 1024.0) / (median_ms / 1e3) : 0;
+
+    if (config->json)
+    {
+        fprintf(out, "%s\n  {\"task\": \"%s\", \"input\": \"%s\", \"bytes\": %lld, \"split_num\": %d, \"worker_num\": %d, "
+                "\"options\": \"%s\", \"repeat\": %d, \"failures\": %d, \"median_ms\": %.3f, \"p95_ms\": %.3f, "
+                "\"mb_per_s\": %.2f, \"max_rss_kb\": %ld}",
+                row_idx ? "," : "", task, input, bytes, split_num, worker_num, options, config->repeat, failures,
+                median_ms, p95_ms, mb_per_s, max_rss_kb);
+    }
+    else
+    {
+        fprintf(out, "%s,%s,%lld,%d,%d,\"%s\",%d,%d,%.3f,%.3f,%.2f,%ld\n", task, input, bytes, split_num, worker_num,
+                options, config->repeat, failures, median_ms, p95_ms, mb_per_s, max_rss_kb);
+    }
+    fflush(out);
+}
+
+static void write_footer(FILE * out, const BENCH_CONFIG * config)
+{
+    if (config->json)
+    {
+        fprintf(out, "\n]\n");
+    }
+}
+
+/* Run one configuration config->repeat times and write its row.
+   @ret: The number of failed runs.
+ */
+static int bench_config(FILE * out, const BENCH_CONFIG * config, int row_idx, const char * task,
+                        const char * input_path, const char * input_name, long long bytes,
+                        int split_num, int worker_num, const char * options)
+{
+    char split_arg[16], worker_arg[32];
+    char * argv[BENCH_MAX_VALUES + 8];
+    double * wall_ms = malloc(config->repeat * sizeof(double));
+    long max_rss_kb = 0;
+    int argc = 0, failures = 0, samples = 0, i;
+
+    if (wall_ms == NULL)
+    {
+        return config->repeat;
+    }
+    snprintf(split_arg, sizeof(split_arg), "%d", split_num);
+    snprintf(worker_arg, sizeof(worker_arg), "--worker-num=%d", worker_num);
+    argv[argc++] = (char *)config->binary;
+    for (i = 0; i < config->extra_arg_num; i++)
+    {
+        argv[argc++] = config->extra_args[i];
+    }
+    if (worker_num > 0)
+    {
+        argv[argc++] = worker_arg;
+    }
+    argv[argc++] = (char *)task;
+    argv[argc++] = (char *)input_path;
+    argv[argc++] = split_arg;
+    if (!strcmp(task, "finder"))
+    {
+        argv[argc++] = (char *)config->word;
+    }
+    argv[argc] = NULL;
+
+    for (i = 0; i < config->repeat; i++)
+    {
+        RUN_SAMPLE sample;
+        if (run_once(argv, &sample) != SUCCESS || sample.status != 0)
+        {
+            failures++;
+        }
+        else
+        {
+            wall_ms[samples++] = sample.wall_ms;
+            if (sample.max_rss_kb > max_rss_kb)
+            {
+                max_rss_kb = sample.max_rss_kb;
+            }
+        }
+        clean_run_files();
+    }
+
+    qsort(wall_ms, samples, sizeof(double), compare_doubles);
+    double median_ms = samples ? percentile(wall_ms, samples, 50) : 0;
+    double p95_ms = samples ? percentile(wall_ms, samples, 95) : 0;
+    printf("%-8s %-24s splits=%-4d workers=%-4d median=%10.3f ms p95=%10.3f ms rss=%8ld KB%s\n", task, input_name,
+           split_num, worker_num, median_ms, p95_ms, max_rss_kb, failures ? " (FAILED RUNS)" : "");
+    write_row(out, config, row_idx, task, input_name, bytes, split_num, worker_num, options, failures,
+              median_ms, p95_ms, max_rss_kb);
+    free(wall_ms);
+    return failures;
+}
+
+int main(int argc, char * argv[])
+{
+    static const char * sample_inputs[] = {"input-warpeace.txt", "input-alice30.txt", "input-moon10.txt"};
+    static const char * tasks[] = {"counter", "finder"};
+    int input_num = sizeof(sample_inputs) / sizeof(sample_inputs[0]);
+    char * cmd_name = argv[0];
+    char * input_paths[BENCH_MAX_VALUES + 3], * input_names[BENCH_MAX_VALUES + 3];
+    long long input_sizes[BENCH_MAX_VALUES + 3];
+    char options[256] = "";
+    const char * binary = "./run-mapreduce";
+    BENCH_CONFIG config;
+    FILE * out;
+    int opt, i, t, s, w, rows = 0, failures = 0;
+
+    setbuf(stdout, NULL); // no bufferring for stdio
+
+    memset(&config, 0, sizeof(config));
+    config.output = "bench.csv";
+    config.work_dir = "bench-work";
+    config.repeat = 5;
+    config.word = "the";
+    config.split_num_count = parse_int_list("1,4,16", config.split_nums, 1);
+    config.worker_num_count = parse_int_list("0", config.worker_nums, 0);
+    config.size_count = parse_list("1M,100M", config.sizes, 1);
+
+    while ((opt = getopt_long(argc, argv, "+", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case OPT_BINARY:
+            binary = optarg;
+            break;
+        case OPT_OUTPUT:
+            config.output = optarg;
+            break;
+        case OPT_WORK_DIR:
+            config.work_dir = optarg;
+            break;
+        case OPT_REPEAT:
+            if ((config.repeat = atoi(optarg)) < 1)
+            {
+                printf("%s is not a valid number of runs.\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_SPLITS:
+            if ((config.split_num_count = parse_int_list(optarg, config.split_nums, 1)) <= 0)
+            {
+                printf("%s is not a valid list of split counts.\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_WORKERS:
+            if ((config.worker_num_count = parse_int_list(optarg, config.worker_nums, 0)) <= 0)
+            {
+                printf("%s is not a valid list of worker counts.\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_SIZES:
+            // An empty list only runs the sample inputs
+            if ((config.size_count = *optarg ? parse_list(optarg, config.sizes, 1) : 0) < 0)
+            {
+                printf("%s is not a valid list of sizes.\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_WORD:
+            config.word = optarg;
+            break;
+        default:
+            print_usage(cmd_name);
+            exit(1);
+        }
+    }
+    config.extra_args = argv + optind; // whatever follows "--"
+    config.extra_arg_num = argc - optind;
+    if (config.extra_arg_num > BENCH_MAX_VALUES)
+    {
+        print_usage(cmd_name);
+        exit(1);
+    }
+    for (i = 0; i < config.extra_arg_num; i++)
+    {
+        snprintf(options + strlen(options), sizeof(options) - strlen(options), "%s%s", i ? " " : "", config.extra_args[i]);
+    }
+    config.json = strlen(config.output) > 5 && !strcmp(config.output + strlen(config.output) - 5, ".json");
+
+    // Every run happens in the working directory, so resolve the paths first
+    if ((config.binary = realpath(binary, NULL)) == NULL)
+    {
+        printf("%s does not exist, build it first.\n", binary);
+        exit(1);
+    }
+    for (i = 0; i < input_num; i++)
+    {
+        struct stat file_stat;
+        if ((input_paths[i] = realpath(sample_inputs[i], NULL)) == NULL || stat(input_paths[i], &file_stat) == -1)
+        {
+            printf("Sample input %s does not exist.\n", sample_inputs[i]);
+            exit(1);
+        }
+        input_names[i] = (char *)sample_inputs[i];
+        input_sizes[i] = file_stat.st_size;
+    }
+    if ((out = fopen(config.output, "w")) == NULL)
+    {
+        printf("Unable to open %s: %s\n", config.output, strerror(errno));
+        exit(1);
+    }
+    if ((mkdir(config.work_dir, 0755) == -1 && errno != EEXIST) || chdir(config.work_dir) == -1)
+    {
+        printf("Unable to use the working directory %s: %s\n", config.work_dir, strerror(errno));
+        exit(1);
+    }
+    for (i = 0; i < config.size_count; i++)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "synthetic-%lld.txt", config.sizes[i]);
+        if (make_synthetic_input(input_paths[0], name, config.sizes[i]) != SUCCESS) // input_paths[0] is BENCH_SYNTH_SEED
+        {
+            printf("Unable to generate %s from %s.\n", name, BENCH_SYNTH_SEED);
+            exit(1);
+        }
+        input_paths[input_num] = realpath(name, NULL);
+        input_names[input_num] = strdup(name);
+        input_sizes[input_num] = config.sizes[i];
+        input_num++;
+    }
+
+    write_header(out, &config);
+    for (t = 0; t < 2; t++)
+    {
+        for (i = 0; i < input_num; i++)
+        {
+            for (s = 0; s < config.split_num_count; s++)
+            {
+                for (w = 0; w < config.worker_num_count; w++)
+                {
+                    failures += bench_config(out, &config, rows++, tasks[t], input_paths[i], input_names[i], input_sizes[i],
+                                             config.split_nums[s], config.worker_nums[w], options);
+                }
+            }
+        }
+    }
+    write_footer(out, &config);
+    fclose(out);
+
+    printf("%d configurations written to %s\n", rows, config.output);
+    if (failures)
+    {
+        printf("%d runs failed.\n", failures);
+        exit(1);
+    }
+    exit(0);
+}
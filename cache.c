@@ -0,0 +1,227 @@
+#define _GNU_SOURCE /* gettid() through syscall() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "common.h"
+#include "arena.h"
+#include "input.h"
+#include "cache.h"
+
+#define PRIME64_1 11400714785074694791ULL
+#define PRIME64_2 14029467366897019727ULL
+#define PRIME64_3 1609587929392839161ULL
+#define PRIME64_4 9650029242287828579ULL
+#define PRIME64_5 2870177450012600261ULL
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t hash_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static uint64_t merge_lane(uint64_t acc, uint64_t lane) {
+    acc ^= hash_round(0, lane);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+static void consume_stripe(CACHE_HASHER *hasher, const unsigned char *p) {
+    hasher->lanes[0] = hash_round(hasher->lanes[0], read64(p));
+    hasher->lanes[1] = hash_round(hasher->lanes[1], read64(p + 8));
+    hasher->lanes[2] = hash_round(hasher->lanes[2], read64(p + 16));
+    hasher->lanes[3] = hash_round(hasher->lanes[3], read64(p + 24));
+}
+
+void cache_hash_init(CACHE_HASHER *hasher, uint64_t seed) {
+    memset(hasher, 0, sizeof(*hasher));
+    hasher->seed = seed;
+    hasher->lanes[0] = seed + PRIME64_1 + PRIME64_2;
+    hasher->lanes[1] = seed + PRIME64_2;
+    hasher->lanes[2] = seed;
+    hasher->lanes[3] = seed - PRIME64_1;
+}
+
+void cache_hash_update(CACHE_HASHER *hasher, const void *data, size_t len) {
+    const unsigned char *p = data, *end = p + len;
+
+    hasher->total_len += len;
+    if (hasher->stripe_len > 0) {
+        size_t fill = CACHE_STRIPE_SIZE - hasher->stripe_len;
+        if (len < fill) {
+            memcpy(hasher->stripe + hasher->stripe_len, p, len);
+            hasher->stripe_len += len;
+            return;
+        }
+        memcpy(hasher->stripe + hasher->stripe_len, p, fill);
+        consume_stripe(hasher, hasher->stripe);
+        hasher->stripe_len = 0;
+        p += fill;
+    }
+    for (; end - p >= CACHE_STRIPE_SIZE; p += CACHE_STRIPE_SIZE) {
+        consume_stripe(hasher, p);
+    }
+    memcpy(hasher->stripe, p, end - p);
+    hasher->stripe_len = end - p;
+}
+
+/* @ret: The hash of the bytes given so far; the hasher may take more afterwards. */
+uint64_t cache_hash_final(const CACHE_HASHER *hasher) {
+    const unsigned char *p = hasher->stripe, *end = p + hasher->stripe_len;
+    uint64_t hash;
+    int i;
+
+    if (hasher->total_len >= CACHE_STRIPE_SIZE) {
+        hash = rotl64(hasher->lanes[0], 1) + rotl64(hasher->lanes[1], 7) + rotl64(hasher->lanes[2], 12) + rotl64(hasher->lanes[3], 18);
+        for (i = 0; i < 4; i++) {
+            hash = merge_lane(hash, hasher->lanes[i]);
+        }
+    } else {
+        hash = hasher->seed + PRIME64_5;
+    }
+    hash += hasher->total_len;
+
+    for (; end - p >= 8; p += 8) {
+        hash ^= hash_round(0, read64(p));
+        hash = rotl64(hash, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (end - p >= 4) {
+        hash ^= (uint64_t)read32(p) * PRIME64_1;
+        hash = rotl64(hash, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        hash ^= *p * PRIME64_5;
+        hash = rotl64(hash, 11) * PRIME64_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/* Hash [offset, offset + size) of fd (the file offset is not used) into *key.
+   @ret: 0 on success, -1 on error or if the file is shorter. */
+int cache_hash_range(int fd, off_t offset, off_t size, uint64_t seed, uint64_t *key) {
+    CACHE_HASHER hasher;
+    char *buffer = io_buffer_get();
+    off_t done = 0;
+    ssize_t bytes;
+
+    if (buffer == NULL) {
+        return ERROR;
+    }
+    cache_hash_init(&hasher, seed);
+    while (done < size && (bytes = pread(fd, buffer, size - done < IO_BUFFER_SIZE ? size - done : IO_BUFFER_SIZE, offset + done)) > 0) {
+        cache_hash_update(&hasher, buffer, bytes);
+        done += bytes;
+    }
+    io_buffer_put(buffer);
+    *key = cache_hash_final(&hasher);
+    return done == size ? SUCCESS : ERROR;
+}
+
+void cache_entry_path(const char *dir, uint64_t key, int part, char *path, size_t size) {
+    snprintf(path, size, "%s/%016llx-%d.itm", dir, (unsigned long long)key, part);
+}
+
+/* @ret: 1 if the entry of key has all its part_num partitions, 0 otherwise. */
+int cache_lookup(const char *dir, uint64_t key, int part_num) {
+    char path[PATH_MAX];
+    int part;
+
+    for (part = 0; part < part_num; part++) {
+        cache_entry_path(dir, key, part, path, sizeof(path));
+        if (access(path, R_OK) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Copy the whole file fd_in into the new file at path, or into fd_out when path is NULL
+static int copy_file(int fd_in, const char *path, int fd_out) {
+    struct stat st;
+    int fd = path != NULL ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666) : fd_out, ret;
+
+    if (fd < 0) {
+        return ERROR;
+    }
+    ret = fstat(fd_in, &st) == 0 ? input_copy_range(fd_in, 0, st.st_size, fd) : ERROR;
+    if (path != NULL) {
+        close(fd);
+    }
+    return ret;
+}
+
+/* Put partition part of the entry of key in the new file at path (a hard link to the entry when
+   they are on the same file system: neither may be written in place afterwards), or copy it into fd
+   (from its offset 0) when path is NULL.
+   @ret: 0 on success, -1 if the entry is missing or the copy failed. */
+int cache_fetch(const char *dir, uint64_t key, int part, const char *path, int fd) {
+    char entry[PATH_MAX];
+    int entry_fd, ret;
+
+    cache_entry_path(dir, key, part, entry, sizeof(entry));
+    if (path != NULL) {
+        unlink(path);
+        if (link(entry, path) == 0) {
+            return SUCCESS;
+        }
+    }
+    if ((entry_fd = open(entry, O_RDONLY)) < 0) {
+        return ERROR;
+    }
+    ret = copy_file(entry_fd, path, fd);
+    close(entry_fd);
+    return ret;
+}
+
+/* Store the file at path (hard-linked when possible), or the whole file fd when path is NULL, as
+   partition part of the entry of key. It is written under a name of its own first, so that
+   concurrent stores of the same entry are harmless.
+   @ret: 0 on success, -1 on error. */
+int cache_store(const char *dir, uint64_t key, int part, const char *path, int fd) {
+    char entry[PATH_MAX], temp[PATH_MAX + 32];
+    int ret = SUCCESS;
+
+    cache_entry_path(dir, key, part, entry, sizeof(entry));
+    snprintf(temp, sizeof(temp), "%s.%d.%ld", entry, getpid(), (long)syscall(SYS_gettid));
+    unlink(temp);
+    if (path == NULL || link(path, temp) != 0) {
+        int in_fd = path != NULL ? open(path, O_RDONLY) : fd;
+        ret = in_fd >= 0 ? copy_file(in_fd, temp, -1) : ERROR;
+        if (path != NULL && in_fd >= 0) {
+            close(in_fd);
+        }
+    }
+    if (ret != SUCCESS || rename(temp, entry) != 0) {
+        unlink(temp);
+        return ERROR;
+    }
+    return SUCCESS;
+}
@@ -0,0 +1,44 @@
+/* The cache of map outputs behind MAPREDUCE_SPEC.cache_dir, for incremental re-runs.
+
+   An entry holds the intermediate files of one split, one per partition, named
+   "<dir>/<key>-<partition>.itm" with the key in 16 hex digits. A key is a 64-bit hash of the split's
+   bytes, seeded with a hash of what else decides the map output (the job's cache tag and shape, and
+   CACHE_VERSION), so a split that was mapped before finds its entry wherever it now lies in the input.
+   A job whose map output holds offsets into the input (MAPREDUCE_SPEC.cache_positions) seeds it with
+   the split's offset as well, and only finds the entries of splits that did not move.
+   Entries are written under a temporary name and renamed into place, so a reader sees a whole file
+   or none; an entry missing a partition is a miss. Nothing is ever evicted: remove the directory to
+   reset the cache.
+
+   The hash is XXH64 (the 64-bit xxHash), computed 32 bytes at a time. */
+
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CACHE_VERSION 1 /* Part of every key: bump it when the intermediate format changes */
+#define CACHE_STRIPE_SIZE 32 /* cache_hash_update() consumes whole stripes of this many bytes */
+
+typedef struct _cache_hasher
+{
+    uint64_t lanes[4];
+    uint64_t seed;
+    uint64_t total_len;
+    unsigned char stripe[CACHE_STRIPE_SIZE]; /* The bytes of an incomplete stripe */
+    size_t stripe_len;
+}CACHE_HASHER;
+
+void cache_hash_init(CACHE_HASHER * hasher, uint64_t seed);
+void cache_hash_update(CACHE_HASHER * hasher, const void * data, size_t len);
+uint64_t cache_hash_final(const CACHE_HASHER * hasher);
+int cache_hash_range(int fd, off_t offset, off_t size, uint64_t seed, uint64_t * key);
+
+void cache_entry_path(const char * dir, uint64_t key, int part, char * path, size_t size);
+int cache_lookup(const char * dir, uint64_t key, int part_num);
+int cache_fetch(const char * dir, uint64_t key, int part, const char * path, int fd);
+int cache_store(const char * dir, uint64_t key, int part, const char * path, int fd);
+
+#endif
@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "common.h"
+#include "arena.h"
+#include "cluster.h"
+
+static int send_all(int sock, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t sent = send(sock, p, len, MSG_NOSIGNAL); // A lost peer must not raise SIGPIPE
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return ERROR;
+        }
+        p += sent;
+        len -= sent;
+    }
+    return SUCCESS;
+}
+
+static int receive_all(int sock, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t received = recv(sock, p, len, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return ERROR;
+        }
+        p += received;
+        len -= received;
+    }
+    return SUCCESS;
+}
+
+// Resolve "HOST:PORT" (HOST may be empty, or a bracketed IPv6 address) for a listening or a connecting socket
+static struct addrinfo *resolve(const char *address, int passive) {
+    struct addrinfo hints = {0}, *list = NULL;
+    const char *colon = strrchr(address, ':');
+    char host[256];
+    size_t host_len;
+
+    if (colon == NULL || colon[1] == '\0' || (host_len = colon - address) >= sizeof(host)) {
+        return NULL;
+    }
+    memcpy(host, address, host_len);
+    host[host_len] = '\0';
+    if (host_len >= 2 && host[0] == '[' && host[host_len - 1] == ']') {
+        memmove(host, host + 1, host_len - 2);
+        host[host_len - 2] = '\0';
+    }
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    if (getaddrinfo(host[0] ? host : NULL, colon + 1, &hints, &list) != 0) {
+        return NULL;
+    }
+    return list;
+}
+
+// Small messages go out at once, and a peer that stalls mid-transfer (or a lost host) fails the transfer
+static void set_socket_options(int sock, int timeout_ms) {
+    int one = 1;
+
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    if (timeout_ms > 0) {
+        struct timeval timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+}
+
+/* Listen for workers on address ("HOST:PORT", or ":PORT" for every interface).
+   @ret: The listening socket, or -1.
+ */
+int cluster_listen(const char *address) {
+    struct addrinfo *list = resolve(address, 1), *ai;
+    int sock = -1, one = 1;
+
+    for (ai = list; ai != NULL && sock < 0; ai = ai->ai_next) {
+        if ((sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) {
+            continue;
+        }
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(sock, ai->ai_addr, ai->ai_addrlen) != 0 || listen(sock, CLUSTER_MAX_WORKERS) != 0) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    if (list != NULL) {
+        freeaddrinfo(list);
+    }
+    return sock;
+}
+
+/* Accept a worker on the listening socket; its transfers time out after CLUSTER_TIMEOUT_MS.
+   @ret: The socket of the worker, or -1.
+ */
+int cluster_accept(int listen_fd) {
+    int sock = accept(listen_fd, NULL, NULL);
+
+    if (sock >= 0) {
+        set_socket_options(sock, CLUSTER_TIMEOUT_MS);
+    }
+    return sock;
+}
+
+/* Connect to the coordinator at address ("HOST:PORT"), trying again for up to timeout_ms while it
+   is not listening yet. The socket has no receive timeout: a worker waits for tasks as long as needed.
+   @ret: The socket, or -1.
+ */
+int cluster_connect(const char *address, int timeout_ms) {
+    struct timespec pause = {0, 200 * 1000 * 1000};
+    int waited_ms = 0;
+
+    for (;;) {
+        struct addrinfo *list = resolve(address, 0), *ai;
+        int sock = -1;
+
+        for (ai = list; ai != NULL && sock < 0; ai = ai->ai_next) {
+            if ((sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) {
+                continue;
+            }
+            if (connect(sock, ai->ai_addr, ai->ai_addrlen) != 0) {
+                close(sock);
+                sock = -1;
+            }
+        }
+        if (list != NULL) {
+            freeaddrinfo(list);
+        }
+        if (sock >= 0) {
+            set_socket_options(sock, 0);
+            return sock;
+        }
+        if (waited_ms >= timeout_ms) {
+            return ERROR;
+        }
+        nanosleep(&pause, NULL);
+        waited_ms += 200;
+    }
+}
+
+/* Send a message of the given type, with the other fields from fields (if not NULL) and length
+   bytes of inline payload.
+   @ret: 0 on success, -1 if the peer is gone.
+ */
+int cluster_send(int sock, uint32_t type, const CLUSTER_MESSAGE *fields, const void *payload, size_t length) {
+    CLUSTER_MESSAGE message = {0};
+
+    if (length > CLUSTER_MAX_PAYLOAD) {
+        return ERROR;
+    }
+    if (fields != NULL) {
+        message = *fields;
+    }
+    message.magic = CLUSTER_MAGIC;
+    message.type = type;
+    message.length = length;
+    if (send_all(sock, &message, sizeof(message)) != SUCCESS || (length > 0 && send_all(sock, payload, length) != SUCCESS)) {
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+/* Receive a message and its inline payload, which must fit in payload_cap bytes.
+   @ret: 0 on success, -1 if the peer is gone, timed out or sent something else than a message.
+ */
+int cluster_receive(int sock, CLUSTER_MESSAGE *message, void *payload, size_t payload_cap) {
+    if (receive_all(sock, message, sizeof(*message)) != SUCCESS || message->magic != CLUSTER_MAGIC ||
+        message->length > payload_cap) {
+        return ERROR;
+    }
+    return message->length > 0 ? receive_all(sock, payload, message->length) : SUCCESS;
+}
+
+/* Stream the whole file fd (its size, then its contents from offset 0; the file offset is not used).
+   A negative fd streams an empty file.
+   @ret: 0 on success, -1 on error.
+ */
+int cluster_send_file(int sock, int fd) {
+    struct stat st;
+    uint64_t size = 0, sent = 0;
+    int ret = SUCCESS;
+
+    if (fd >= 0) {
+        if (fstat(fd, &st) != 0) {
+            return ERROR;
+        }
+        size = st.st_size;
+    }
+    if (send_all(sock, &size, sizeof(size)) != SUCCESS) {
+        return ERROR;
+    }
+    if (size == 0) {
+        return SUCCESS;
+    }
+    char *buffer = io_buffer_get();
+    if (buffer == NULL) {
+        return ERROR;
+    }
+    while (ret == SUCCESS && sent < size) {
+        ssize_t bytes_read = pread(fd, buffer, size - sent < IO_BUFFER_SIZE ? size - sent : IO_BUFFER_SIZE, sent);
+        if (bytes_read <= 0 || send_all(sock, buffer, bytes_read) != SUCCESS) {
+            ret = ERROR;
+        } else {
+            sent += bytes_read;
+        }
+    }
+    io_buffer_put(buffer);
+    return ret;
+}
+
+/* Receive a streamed file into fd, replacing its contents (written from offset 0, the file offset is
+   not used). *size receives its size, if size is not NULL.
+   @ret: 0 on success, -1 on error.
+ */
+int cluster_receive_file(int sock, int fd, uint64_t *size) {
+    uint64_t file_size, received = 0;
+    int ret = SUCCESS;
+
+    if (receive_all(sock, &file_size, sizeof(file_size)) != SUCCESS || ftruncate(fd, 0) != 0) {
+        return ERROR;
+    }
+    char *buffer = io_buffer_get();
+    if (buffer == NULL) {
+        return ERROR;
+    }
+    while (ret == SUCCESS && received < file_size) {
+        ssize_t bytes = recv(sock, buffer, file_size - received < IO_BUFFER_SIZE ? file_size - received : IO_BUFFER_SIZE, 0);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0 || pwrite(fd, buffer, bytes, received) != bytes) {
+            ret = ERROR;
+        } else {
+            received += bytes;
+        }
+    }
+    io_buffer_put(buffer);
+    if (size != NULL) {
+        *size = file_size;
+    }
+    return ret;
+}
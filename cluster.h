@@ -0,0 +1,66 @@
+/* The TCP transport of ENGINE_CLUSTER: a coordinator hands the map and reduce tasks of one job to
+   workers on other hosts.
+
+   A worker connects to the coordinator and says CLUSTER_MSG_HELLO; the coordinator answers with
+   CLUSTER_MSG_JOB (the shape of the job, and the input path, which must be on storage shared by
+   all hosts). The coordinator then sends one task at a time:
+   - CLUSTER_MSG_MAP: the byte range of a split. The worker maps it into in-memory intermediate
+     files and answers CLUSTER_MSG_MAP_DONE, followed by its reduce_num partitions.
+   - CLUSTER_MSG_REDUCE: a partition, followed by its split_num intermediate files. The worker
+     reduces them and answers CLUSTER_MSG_REDUCE_DONE, followed by the result file.
+   So the intermediate data of every finished map task is safe on the coordinator, and a worker
+   that is lost only costs the task it was running. Workers send CLUSTER_MSG_HEARTBEAT every
+   CLUSTER_HEARTBEAT_MS; one that has not been heard from for CLUSTER_TIMEOUT_MS is dropped, and its
+   task is run again on another worker. CLUSTER_MSG_EXIT ends a worker.
+
+   Each message is a CLUSTER_MESSAGE followed by its length bytes of inline payload; a file is
+   streamed as a 64-bit size followed by its contents. Integers are in host order: all the hosts
+   of a cluster must share the byte order. */
+
+#ifndef _CLUSTER_H
+#define _CLUSTER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CLUSTER_MAGIC 0x3143524d /* "MRC1" */
+#define CLUSTER_HEARTBEAT_MS 1000
+#define CLUSTER_TIMEOUT_MS 10000 /* Silence after which a worker is considered lost, and a stalled transfer fails */
+#define CLUSTER_CONNECT_TIMEOUT_MS 30000 /* How long a worker keeps trying to reach a coordinator that is not up yet */
+#define CLUSTER_MAX_WORKERS 256 /* Further connections are refused */
+#define CLUSTER_MAX_PAYLOAD 4096 /* The largest inline payload of a message */
+
+typedef enum _cluster_message_type
+{
+    CLUSTER_MSG_HELLO = 1, /* Worker: payload "host:pid" */
+    CLUSTER_MSG_JOB,       /* Coordinator: split_num and reduce_num, payload the input path */
+    CLUSTER_MSG_MAP,       /* Coordinator: map split task, the range [offset, offset + size) of the input */
+    CLUSTER_MSG_MAP_DONE,  /* Worker: status, payload MAPREDUCE_TASK_STATS; then reduce_num files if status is 0 */
+    CLUSTER_MSG_REDUCE,    /* Coordinator: reduce partition task; then split_num files */
+    CLUSTER_MSG_REDUCE_DONE, /* Worker: status, payload MAPREDUCE_TASK_STATS; then the result file if status is 0 */
+    CLUSTER_MSG_HEARTBEAT, /* Worker: still alive */
+    CLUSTER_MSG_EXIT       /* Coordinator: the job is over */
+}CLUSTER_MESSAGE_TYPE;
+
+typedef struct _cluster_message
+{
+    uint32_t magic; /* CLUSTER_MAGIC */
+    uint32_t type; /* CLUSTER_MESSAGE_TYPE */
+    int32_t task; /* The split or partition of a task message */
+    int32_t status; /* The return value of the task in CLUSTER_MSG_MAP_DONE and CLUSTER_MSG_REDUCE_DONE */
+    int32_t split_num; /* CLUSTER_MSG_JOB */
+    int32_t reduce_num; /* CLUSTER_MSG_JOB */
+    uint64_t offset; /* CLUSTER_MSG_MAP */
+    uint64_t size; /* CLUSTER_MSG_MAP */
+    uint64_t length; /* The inline payload that follows, at most CLUSTER_MAX_PAYLOAD bytes */
+}CLUSTER_MESSAGE;
+
+int cluster_listen(const char * address);
+int cluster_accept(int listen_fd);
+int cluster_connect(const char * address, int timeout_ms);
+int cluster_send(int sock, uint32_t type, const CLUSTER_MESSAGE * fields, const void * payload, size_t length);
+int cluster_receive(int sock, CLUSTER_MESSAGE * message, void * payload, size_t payload_cap);
+int cluster_send_file(int sock, int fd);
+int cluster_receive_file(int sock, int fd, uint64_t * size);
+
+#endif
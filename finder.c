@@ -0,0 +1,216 @@
+#define _GNU_SOURCE /* memrchr() */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "finder.h"
+
+static int is_word_start(const char *buf, const char *hit) {
+    return hit == buf || hit[-1] == ' ' || hit[-1] == '\n';
+}
+
+static int is_word_end(const char *hit_end, const char *end) {
+    return hit_end == end || *hit_end == ',' || *hit_end == '.' || *hit_end == ' ' || *hit_end == '\n';
+}
+
+// Report the line holding the hit at [hit, hit + word_len); returns the end of that line
+static const char *emit_line(FINDER *finder, const char *buf, const char *end, const char *hit, int word_idx,
+                             FINDER_EMIT emit, void *ctx, int *ret) {
+    const char *line = memrchr(buf, '\n', hit - buf);
+    const char *line_end = memchr(hit, '\n', end - hit);
+
+    line = line ? line + 1 : buf;
+    line_end = line_end ? line_end : end;
+    if (finder->last_line[word_idx] != line) {
+        finder->last_line[word_idx] = line;
+        *ret = emit(ctx, line, line_end - line, word_idx);
+    }
+    return line_end;
+}
+
+// Single word: Horspool search, resuming at the next line once a line has matched
+static int scan_horspool(FINDER *finder, const char *buf, size_t len, FINDER_EMIT emit, void *ctx) {
+    const char *word = finder->words[0];
+    size_t word_len = finder->word_lens[0];
+    const char *end = buf + len;
+    const char *pos = buf;
+    unsigned char last = word[word_len - 1];
+    int ret = 0;
+
+    while ((size_t)(end - pos) >= word_len) {
+        unsigned char current = pos[word_len - 1];
+        if (current == last && memcmp(pos, word, word_len - 1) == 0 &&
+            is_word_start(buf, pos) && is_word_end(pos + word_len, end)) {
+            const char *line_end = emit_line(finder, buf, end, pos, 0, emit, ctx, &ret);
+            if (ret != 0 || line_end == end) {
+                return ret;
+            }
+            pos = line_end + 1;
+            continue;
+        }
+        pos += finder->skip[current];
+    }
+    return 0;
+}
+
+// Several words: one pass of the Aho-Corasick automaton
+static int scan_aho_corasick(FINDER *finder, const char *buf, size_t len, FINDER_EMIT emit, void *ctx) {
+    const unsigned char *bytes = (const unsigned char *)buf;
+    const char *end = buf + len;
+    int state = 0, ret = 0;
+
+    for (size_t idx = 0; idx < len; idx++) {
+        state = finder->next[state * 256 + bytes[idx]];
+        for (int match = finder->word_at[state] >= 0 ? state : finder->output_link[state]; match >= 0; match = finder->output_link[match]) {
+            int word_idx = finder->word_at[match];
+            const char *hit = buf + idx + 1 - finder->word_lens[word_idx];
+            if (is_word_start(buf, hit) && is_word_end(buf + idx + 1, end)) {
+                emit_line(finder, buf, end, hit, word_idx, emit, ctx, &ret);
+                if (ret != 0) {
+                    return ret;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static int build_aho_corasick(FINDER *finder) {
+    size_t max_states = 1;
+    int word_idx, state, *queue, head = 0, tail = 0;
+
+    for (word_idx = 0; word_idx < finder->word_num; word_idx++) {
+        max_states += finder->word_lens[word_idx];
+    }
+    finder->next = malloc(max_states * 256 * sizeof(int));
+    finder->word_at = malloc(max_states * sizeof(int));
+    finder->output_link = malloc(max_states * sizeof(int));
+    int *fail = malloc(max_states * sizeof(int));
+    queue = malloc(max_states * sizeof(int));
+    if (finder->next == NULL || finder->word_at == NULL || finder->output_link == NULL || fail == NULL || queue == NULL) {
+        free(fail);
+        free(queue);
+        return ERROR;
+    }
+
+    // The trie; -1 marks a missing transition until the failure links fill it in
+    memset(finder->next, -1, 256 * sizeof(int));
+    finder->word_at[0] = -1;
+    finder->state_num = 1;
+    for (word_idx = 0; word_idx < finder->word_num; word_idx++) {
+        const unsigned char *word = (const unsigned char *)finder->words[word_idx];
+        state = 0;
+        for (size_t idx = 0; idx < finder->word_lens[word_idx]; idx++) {
+            int *transition = &finder->next[state * 256 + word[idx]];
+            if (*transition < 0) {
+                *transition = finder->state_num++;
+                memset(&finder->next[*transition * 256], -1, 256 * sizeof(int));
+                finder->word_at[*transition] = -1;
+            }
+            state = *transition;
+        }
+        if (finder->word_lens[word_idx] > 0 && finder->word_at[state] < 0) {
+            finder->word_at[state] = word_idx; // A repeated word is only reported once
+        }
+    }
+
+    // Breadth-first: failure links, output links and the missing transitions
+    fail[0] = 0;
+    finder->output_link[0] = -1;
+    for (int byte = 0; byte < 256; byte++) {
+        int *transition = &finder->next[byte];
+        if (*transition < 0) {
+            *transition = 0;
+        } else {
+            fail[*transition] = 0;
+            finder->output_link[*transition] = -1;
+            queue[tail++] = *transition;
+        }
+    }
+    while (head < tail) {
+        state = queue[head++];
+        for (int byte = 0; byte < 256; byte++) {
+            int *transition = &finder->next[state * 256 + byte];
+            int fallback = finder->next[fail[state] * 256 + byte];
+            if (*transition < 0) {
+                *transition = fallback;
+            } else {
+                fail[*transition] = fallback;
+                finder->output_link[*transition] = finder->word_at[fallback] >= 0 ? fallback : finder->output_link[fallback];
+                queue[tail++] = *transition;
+            }
+        }
+    }
+
+    free(fail);
+    free(queue);
+    return SUCCESS;
+}
+
+/* Prepare a search for words[0, word_num). The words are not copied and must outlive the finder.
+   @ret: The finder, or NULL on error.
+ */
+FINDER *finder_create(const char **words, int word_num) {
+    FINDER *finder = calloc(1, sizeof(FINDER));
+    int word_idx;
+
+    if (finder == NULL || word_num <= 0) {
+        free(finder);
+        return NULL;
+    }
+    finder->word_num = word_num;
+    finder->words = words;
+    finder->word_lens = malloc(word_num * sizeof(size_t));
+    finder->last_line = malloc(word_num * sizeof(char *));
+    if (finder->word_lens == NULL || finder->last_line == NULL) {
+        finder_destroy(finder);
+        return NULL;
+    }
+    for (word_idx = 0; word_idx < word_num; word_idx++) {
+        finder->word_lens[word_idx] = strlen(words[word_idx]);
+        finder->last_line[word_idx] = NULL;
+    }
+
+    if (word_num == 1) {
+        size_t word_len = finder->word_lens[0];
+        for (int byte = 0; byte < 256; byte++) {
+            finder->skip[byte] = word_len;
+        }
+        for (size_t idx = 0; idx + 1 < word_len; idx++) {
+            finder->skip[(unsigned char)words[0][idx]] = word_len - 1 - idx;
+        }
+    } else if (build_aho_corasick(finder) != SUCCESS) {
+        finder_destroy(finder);
+        return NULL;
+    }
+    return finder;
+}
+
+/* Report every line of buf[0, len) that holds one of the words, once per word. buf must start
+   at a line start; its end is treated as the end of a line.
+   @ret: 0 once the buffer is scanned, or the first non-zero value returned by emit.
+ */
+int finder_scan(FINDER *finder, const char *buf, size_t len, FINDER_EMIT emit, void *ctx) {
+    int word_idx;
+
+    // Lines of a new buffer are new lines, even if a previous buffer was at the same address
+    for (word_idx = 0; word_idx < finder->word_num; word_idx++) {
+        finder->last_line[word_idx] = NULL;
+    }
+    if (finder->word_num == 1) {
+        return finder->word_lens[0] > 0 ? scan_horspool(finder, buf, len, emit, ctx) : 0;
+    }
+    return scan_aho_corasick(finder, buf, len, emit, ctx);
+}
+
+void finder_destroy(FINDER *finder) {
+    if (finder != NULL) {
+        free(finder->word_lens);
+        free(finder->last_line);
+        free(finder->next);
+        free(finder->word_at);
+        free(finder->output_link);
+        free(finder);
+    }
+}
@@ -0,0 +1,33 @@
+/* The search engine of the "Word finder" task. It looks for whole words directly in a buffer of
+   lines: with a Boyer-Moore-Horspool skip table for a single word, or an Aho-Corasick automaton
+   for several. Line boundaries are only looked up (with memchr/memrchr) around a hit.
+
+   A whole word starts a line or follows a space, and ends a line or is followed by ',', '.' or ' '. */
+
+#ifndef _FINDER_H
+#define _FINDER_H
+
+#include <stddef.h>
+
+/* Called once per (line, word) match. line does not include its '\n'.
+   @ret: 0 to go on, anything else stops the scan and is returned by finder_scan(). */
+typedef int (*FINDER_EMIT)(void * ctx, const char * line, size_t line_len, int word_idx);
+
+typedef struct _finder
+{
+    int word_num;
+    const char ** words;
+    size_t * word_lens;
+    size_t skip[256]; /* Horspool skip table (single word) */
+    int state_num; /* Aho-Corasick automaton (several words) */
+    int * next; /* [state * 256 + byte], the full transition table */
+    int * word_at; /* [state], the word ending at this state, or -1 */
+    int * output_link; /* [state], the next state of the failure chain with word_at >= 0, or -1 */
+    const char ** last_line; /* [word], the line of the last match of each word, to report a line once per word */
+}FINDER;
+
+FINDER * finder_create(const char ** words, int word_num);
+int finder_scan(FINDER * finder, const char * buf, size_t len, FINDER_EMIT emit, void * ctx);
+void finder_destroy(FINDER * finder);
+
+#endif
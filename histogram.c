@@ -0,0 +1,190 @@
+#include <string.h>
+
+#include "histogram.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+// Byte counters of the vector kernels are flushed before they can wrap
+#define BLOCKS_PER_FLUSH 255
+
+// Letters handled per pass of the vector kernels (LETTER_NUM is a multiple of it)
+#define LETTER_GROUP 13
+
+// The per-letter counters of the vector kernels only stay in registers if the letter loops are unrolled
+#define UNROLL_LETTERS _Pragma("GCC unroll 13")
+
+typedef void (*COUNT_KERNEL)(const char *buf, size_t len, uint64_t *letter_counts);
+
+// Count letters one byte at a time: fold the case by setting bit 5, and keep the letter if it lands in 'a'-'z'
+static void count_letters_tail(const unsigned char *buf, size_t len, uint64_t *letter_counts) {
+    for (size_t idx = 0; idx < len; idx++) {
+        unsigned char letter = (buf[idx] | 0x20) - 'a';
+        if (letter < LETTER_NUM) {
+            letter_counts[letter]++;
+        }
+    }
+}
+
+// Portable kernel: four interleaved byte histograms, so that runs of the same letter do not
+// wait on the previous increment of one counter
+static void count_letters_scalar(const char *buf, size_t len, uint64_t *letter_counts) {
+    const unsigned char *bytes = (const unsigned char *)buf;
+    uint32_t histograms[4][256];
+    size_t idx = 0;
+
+    while (len - idx >= 4) {
+        // Sub-histograms are 32-bit: flush them every 2^32 - 1 bytes at most
+        size_t chunk_end = idx + ((len - idx) & ~(size_t)3);
+        if (chunk_end - idx > 0xfffffffcu) {
+            chunk_end = idx + 0xfffffffcu;
+        }
+
+        memset(histograms, 0, sizeof(histograms));
+        for (; idx < chunk_end; idx += 4) {
+            histograms[0][bytes[idx]]++;
+            histograms[1][bytes[idx + 1]]++;
+            histograms[2][bytes[idx + 2]]++;
+            histograms[3][bytes[idx + 3]]++;
+        }
+        for (int letter = 0; letter < LETTER_NUM; letter++) {
+            for (int h = 0; h < 4; h++) {
+                letter_counts[letter] += histograms[h]['A' + letter] + histograms[h]['a' + letter];
+            }
+        }
+    }
+    count_letters_tail(bytes + idx, len - idx, letter_counts);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// SSE2 kernel: for each letter, compare 16 folded bytes at once and subtract the 0/-1 mask from a
+// per-letter byte counter; the byte counters are summed into 64-bit totals with psadbw.
+// The letters are done in two passes over each block (which stays in L1) so that the counters
+// of a pass fit in the 16 vector registers.
+__attribute__((target("sse2")))
+static void count_letters_sse2(const char *buf, size_t len, uint64_t *letter_counts) {
+    const __m128i fold = _mm_set1_epi8(0x20);
+    const __m128i zero = _mm_setzero_si128();
+    size_t idx = 0;
+
+    while (len - idx >= sizeof(__m128i)) {
+        size_t blocks = (len - idx) / sizeof(__m128i);
+
+        if (blocks > BLOCKS_PER_FLUSH) {
+            blocks = BLOCKS_PER_FLUSH;
+        }
+        for (int first = 0; first < LETTER_NUM; first += LETTER_GROUP) {
+            __m128i counters[LETTER_GROUP];
+            int letter;
+
+            UNROLL_LETTERS
+            for (letter = 0; letter < LETTER_GROUP; letter++) {
+                counters[letter] = zero;
+            }
+            for (size_t block = 0; block < blocks; block++) {
+                __m128i folded = _mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + idx) + block), fold);
+                UNROLL_LETTERS
+                for (letter = 0; letter < LETTER_GROUP; letter++) {
+                    __m128i match = _mm_cmpeq_epi8(folded, _mm_set1_epi8('a' + first + letter));
+                    counters[letter] = _mm_sub_epi8(counters[letter], match);
+                }
+            }
+            UNROLL_LETTERS
+            for (letter = 0; letter < LETTER_GROUP; letter++) {
+                __m128i sums = _mm_sad_epu8(counters[letter], zero);
+                letter_counts[first + letter] += (uint64_t)_mm_cvtsi128_si32(sums) + (uint64_t)_mm_extract_epi16(sums, 4);
+            }
+        }
+        idx += blocks * sizeof(__m128i);
+    }
+    count_letters_tail((const unsigned char *)buf + idx, len - idx, letter_counts);
+}
+
+// AVX2 kernel: the SSE2 kernel on 32 bytes at a time
+__attribute__((target("avx2")))
+static void count_letters_avx2(const char *buf, size_t len, uint64_t *letter_counts) {
+    const __m256i fold = _mm256_set1_epi8(0x20);
+    const __m256i zero = _mm256_setzero_si256();
+    size_t idx = 0;
+
+    while (len - idx >= sizeof(__m256i)) {
+        size_t blocks = (len - idx) / sizeof(__m256i);
+
+        if (blocks > BLOCKS_PER_FLUSH) {
+            blocks = BLOCKS_PER_FLUSH;
+        }
+        for (int first = 0; first < LETTER_NUM; first += LETTER_GROUP) {
+            __m256i counters[LETTER_GROUP];
+            int letter;
+
+            UNROLL_LETTERS
+            for (letter = 0; letter < LETTER_GROUP; letter++) {
+                counters[letter] = zero;
+            }
+            for (size_t block = 0; block < blocks; block++) {
+                __m256i folded = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(buf + idx) + block), fold);
+                UNROLL_LETTERS
+                for (letter = 0; letter < LETTER_GROUP; letter++) {
+                    __m256i match = _mm256_cmpeq_epi8(folded, _mm256_set1_epi8('a' + first + letter));
+                    counters[letter] = _mm256_sub_epi8(counters[letter], match);
+                }
+            }
+            UNROLL_LETTERS
+            for (letter = 0; letter < LETTER_GROUP; letter++) {
+                __m256i sums = _mm256_sad_epu8(counters[letter], zero);
+                letter_counts[first + letter] += (uint64_t)_mm256_extract_epi64(sums, 0) + (uint64_t)_mm256_extract_epi64(sums, 1) +
+                                                 (uint64_t)_mm256_extract_epi64(sums, 2) + (uint64_t)_mm256_extract_epi64(sums, 3);
+            }
+        }
+        idx += blocks * sizeof(__m256i);
+    }
+    count_letters_tail((const unsigned char *)buf + idx, len - idx, letter_counts);
+}
+
+#endif
+
+static COUNT_KERNEL select_kernel(const char **name) {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return count_letters_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        *name = "sse2";
+        return count_letters_sse2;
+    }
+#endif
+    *name = "scalar";
+    return count_letters_scalar;
+}
+
+static COUNT_KERNEL selected_kernel;
+static const char *selected_kernel_name;
+
+static COUNT_KERNEL get_kernel(void) {
+    COUNT_KERNEL kernel = __atomic_load_n(&selected_kernel, __ATOMIC_ACQUIRE);
+    if (kernel == NULL) {
+        const char *name;
+        kernel = select_kernel(&name);
+        __atomic_store_n(&selected_kernel_name, name, __ATOMIC_RELAXED);
+        __atomic_store_n(&selected_kernel, kernel, __ATOMIC_RELEASE);
+    }
+    return kernel;
+}
+
+/* Add the case-insensitive counts of the letters of buf[0, len) to letter_counts[LETTER_NUM].
+   letter_counts[0] counts 'A' and 'a', letter_counts[25] counts 'Z' and 'z'.
+ */
+void count_letters(const char *buf, size_t len, uint64_t *letter_counts) {
+    get_kernel()(buf, len, letter_counts);
+}
+
+/* The name of the kernel used by count_letters(): "avx2", "sse2" or "scalar" */
+const char *count_letters_kernel_name(void) {
+    get_kernel();
+    return __atomic_load_n(&selected_kernel_name, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,15 @@
+/* Letter histogram kernels used by the "Letter counter" task. The best kernel for the CPU
+   (AVX2, SSE2 or portable scalar code) is picked at run time. */
+
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LETTER_NUM 26
+
+void count_letters(const char * buf, size_t len, uint64_t * letter_counts);
+const char * count_letters_kernel_name(void);
+
+#endif
@@ -0,0 +1,488 @@
+#define _GNU_SOURCE /* O_DIRECT */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <zlib.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+#include "common.h"
+#include "arena.h"
+#include "input.h"
+#include "trace.h"
+
+#define INPUT_PENDING ((ssize_t)-1 - 4096) /* results[] of a read in flight (below any -errno) */
+
+#ifdef __NR_io_uring_setup
+
+static void ring_destroy(IO_RING *ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd); // Also unregisters the buffers
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// Set up a ring of INPUT_READER_DEPTH entries and register the buffers when the kernel lets us
+static int ring_init(IO_RING *ring, char **buffers, int buffer_num) {
+    struct io_uring_params params;
+    struct iovec iovecs[INPUT_READER_DEPTH];
+    int idx;
+
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    if ((ring->fd = syscall(__NR_io_uring_setup, INPUT_READER_DEPTH, &params)) < 0) {
+        ring->fd = -1;
+        return ERROR;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        ring_destroy(ring);
+        return ERROR;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else if ((ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                     ring->fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+        ring->cq_ring = NULL;
+        ring_destroy(ring);
+        return ERROR;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        ring_destroy(ring);
+        return ERROR;
+    }
+
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = cq + params.cq_off.cqes;
+
+    // Registered buffers save the kernel a page walk per read; without them (RLIMIT_MEMLOCK) plain reads are used
+    for (idx = 0; idx < buffer_num; idx++) {
+        iovecs[idx].iov_base = buffers[idx];
+        iovecs[idx].iov_len = IO_BUFFER_SIZE;
+    }
+    ring->fixed = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iovecs, buffer_num) == 0;
+    return SUCCESS;
+}
+
+// Queue and submit the read into buffers[idx]
+static int ring_read(INPUT_READER *reader, int idx) {
+    IO_RING *ring = &reader->ring;
+    unsigned tail = *ring->sq_tail;
+    unsigned slot = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)ring->sqes + slot;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = ring->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = reader->fd;
+    sqe->off = reader->buffer_offsets[idx];
+    sqe->addr = (unsigned long)reader->buffers[idx];
+    sqe->len = reader->buffer_lengths[idx];
+    sqe->buf_index = idx;
+    sqe->user_data = idx;
+    ring->sq_array[slot] = slot;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    while (syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) < 0) {
+        if (errno != EINTR) {
+            return ERROR;
+        }
+    }
+    return SUCCESS;
+}
+
+// Wait for the read into buffers[idx], recording the other completions met on the way
+static int ring_wait(INPUT_READER *reader, int idx) {
+    IO_RING *ring = &reader->ring;
+
+    while (reader->results[idx] == INPUT_PENDING) {
+        unsigned head = *ring->cq_head;
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+                return ERROR;
+            }
+            continue;
+        }
+        struct io_uring_cqe *cqe = (struct io_uring_cqe *)ring->cqes + (head & *ring->cq_mask);
+        reader->results[cqe->user_data] = cqe->res;
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+    return SUCCESS;
+}
+
+#else
+
+static void ring_destroy(IO_RING *ring) {
+    ring->fd = -1;
+}
+
+static int ring_init(IO_RING *ring, char **buffers, int buffer_num) {
+    ring->fd = -1;
+    return ERROR;
+}
+
+static int ring_read(INPUT_READER *reader, int idx) {
+    return ERROR;
+}
+
+static int ring_wait(INPUT_READER *reader, int idx) {
+    return ERROR;
+}
+
+#endif
+
+// An O_DIRECT descriptor of the file open at fd, or -1 if its file system does not support it
+static int open_direct(int fd) {
+    char path[64];
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    return open(path, O_RDONLY | O_DIRECT);
+}
+
+// The length of the read into a buffer at the issue offset: O_DIRECT reads whole blocks, past the end if need be
+static size_t read_length(INPUT_READER *reader) {
+    off_t left = reader->end - reader->issue_offset;
+
+    if (reader->direct) {
+        left = (left + INPUT_DIRECT_ALIGN - 1) & ~(off_t)(INPUT_DIRECT_ALIGN - 1);
+    }
+    return left < IO_BUFFER_SIZE ? left : IO_BUFFER_SIZE;
+}
+
+// Issue the reads of the free buffers, in order after the last one issued
+static int issue_reads(INPUT_READER *reader) {
+    while (reader->issued < INPUT_READER_DEPTH && reader->issue_offset < reader->end) {
+        int idx = (reader->next_buffer + reader->issued) % INPUT_READER_DEPTH;
+
+        reader->buffer_offsets[idx] = reader->issue_offset;
+        reader->buffer_lengths[idx] = read_length(reader);
+        reader->results[idx] = INPUT_PENDING;
+        if (ring_read(reader, idx) != SUCCESS) {
+            return ERROR;
+        }
+        reader->issue_offset += reader->buffer_lengths[idx];
+        reader->issued++;
+    }
+    return SUCCESS;
+}
+
+// Read buffers[idx] with pread() from byte done on, to finish a short read when there is more to read before the end
+static ssize_t read_buffer(INPUT_READER *reader, int idx, ssize_t done) {
+    size_t len = reader->buffer_lengths[idx];
+
+    while ((size_t)done < len && reader->buffer_offsets[idx] + done < reader->end) {
+        ssize_t bytes_read = pread(reader->fd, reader->buffers[idx] + done, len - done, reader->buffer_offsets[idx] + done);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read < 0) {
+            return -errno;
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        done += bytes_read;
+    }
+    return done;
+}
+
+/* Start reading split->size bytes from the current offset of split->fd with split->io_backend,
+   or the next available backend.
+   @ret: 0 on success, -1 on error. */
+int input_reader_open(INPUT_READER *reader, const DATA_SPLIT *split) {
+    int idx;
+
+    memset(reader, 0, sizeof(*reader));
+    reader->ring.fd = -1;
+    reader->fd = split->fd;
+    reader->backend = split->io_backend;
+    if ((reader->deliver_offset = lseek(split->fd, 0, SEEK_CUR)) < 0) {
+        return ERROR;
+    }
+    reader->end = reader->deliver_offset + split->size;
+    reader->issue_offset = reader->deliver_offset;
+
+    // Small splits are likely in the page cache and not worth a ring
+    if (reader->backend == IO_BACKEND_AUTO) {
+        reader->backend = split->size >= (off_t)INPUT_READER_DEPTH * IO_BUFFER_SIZE ? IO_BACKEND_URING : IO_BACKEND_READ;
+    }
+    if (reader->backend == IO_BACKEND_READ) {
+        return SUCCESS;
+    }
+
+    for (idx = 0; idx < INPUT_READER_DEPTH; idx++) {
+        if ((reader->buffers[idx] = io_buffer_get()) == NULL) {
+            input_reader_close(reader);
+            return ERROR;
+        }
+    }
+    if (reader->backend == IO_BACKEND_URING && ring_init(&reader->ring, reader->buffers, INPUT_READER_DEPTH) != SUCCESS) {
+        reader->backend = IO_BACKEND_DIRECT;
+    }
+
+    // O_DIRECT reads start at a block boundary; the lead is skipped when the first buffer is handed out
+    int direct_fd = open_direct(split->fd);
+    if (direct_fd >= 0) {
+        reader->fd = direct_fd;
+        reader->direct = 1;
+        reader->issue_offset &= ~(off_t)(INPUT_DIRECT_ALIGN - 1);
+    } else if (reader->backend == IO_BACKEND_DIRECT) {
+        reader->backend = IO_BACKEND_READ;
+    }
+    if (reader->backend == IO_BACKEND_URING && issue_reads(reader) != SUCCESS) {
+        input_reader_close(reader);
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+static ssize_t next_chunk(INPUT_READER *reader, const char **chunk) {
+    if (reader->backend == IO_BACKEND_READ) {
+        // Plain read() into a single pooled buffer
+        if (reader->buffers[0] == NULL && (reader->buffers[0] = io_buffer_get()) == NULL) {
+            return -1;
+        }
+        off_t left = reader->end - reader->deliver_offset;
+        ssize_t bytes_read;
+        while ((bytes_read = read(reader->fd, reader->buffers[0], left < IO_BUFFER_SIZE ? left : IO_BUFFER_SIZE)) < 0 &&
+               errno == EINTR) {
+        }
+        if (bytes_read <= 0) {
+            return bytes_read;
+        }
+        reader->deliver_offset += bytes_read;
+        *chunk = reader->buffers[0];
+        return bytes_read;
+    }
+
+    // The buffer handed out last is free again
+    if (reader->handed_out) {
+        reader->next_buffer = (reader->next_buffer + 1) % INPUT_READER_DEPTH;
+        reader->issued--;
+        reader->handed_out = 0;
+    }
+
+    int idx = reader->next_buffer;
+    ssize_t done;
+    if (reader->backend == IO_BACKEND_URING) {
+        if (issue_reads(reader) != SUCCESS || ring_wait(reader, idx) != SUCCESS) {
+            return -1;
+        }
+        done = reader->results[idx] < 0 ? reader->results[idx] : read_buffer(reader, idx, reader->results[idx]);
+    } else {
+        // Synchronous O_DIRECT, one buffer at a time
+        reader->buffer_offsets[idx] = reader->issue_offset;
+        reader->buffer_lengths[idx] = read_length(reader);
+        reader->issue_offset += reader->buffer_lengths[idx];
+        reader->issued = 1;
+        done = read_buffer(reader, idx, 0);
+    }
+    reader->results[idx] = done;
+    reader->handed_out = 1;
+    if (done < 0) {
+        errno = -done;
+        return -1;
+    }
+
+    // Trim the block-aligned read to the split
+    off_t start = reader->deliver_offset - reader->buffer_offsets[idx];
+    off_t stop = reader->buffer_offsets[idx] + done < reader->end ? done : reader->end - reader->buffer_offsets[idx];
+    if (stop <= start) {
+        return 0; // The file is shorter than the split
+    }
+    reader->deliver_offset += stop - start;
+    *chunk = reader->buffers[idx] + start;
+    return stop - start;
+}
+
+/* Hand out the next bytes of the split, in order. The chunk stays valid until the next call.
+   @ret: The length of the chunk, 0 at the end of the split, or -1 on error. */
+ssize_t input_reader_next(INPUT_READER *reader, const char **chunk) {
+    ssize_t chunk_len;
+
+    if (reader->deliver_offset >= reader->end) {
+        return 0;
+    }
+    TRACE_BEGIN("read", reader->deliver_offset);
+    chunk_len = next_chunk(reader, chunk);
+    TRACE_END("read", chunk_len);
+    return chunk_len;
+}
+
+/* Copy up to len next bytes of the split into buf, like read() on the split.
+   @ret: The bytes copied, 0 at the end of the split, or -1 on error. */
+ssize_t input_reader_read(INPUT_READER *reader, void *buf, size_t len) {
+    if (reader->chunk_len == 0) {
+        ssize_t chunk_len;
+
+        if (reader->backend == IO_BACKEND_READ) {
+            // No staging buffer needed: read straight into buf
+            off_t left = reader->end - reader->deliver_offset;
+            ssize_t bytes_read;
+            TRACE_BEGIN("read", reader->deliver_offset);
+            while ((bytes_read = read(reader->fd, buf, (off_t)len < left ? (off_t)len : left)) < 0 && errno == EINTR) {
+            }
+            TRACE_END("read", bytes_read);
+            if (bytes_read > 0) {
+                reader->deliver_offset += bytes_read;
+            }
+            return bytes_read;
+        }
+        if ((chunk_len = input_reader_next(reader, &reader->chunk)) <= 0) {
+            return chunk_len;
+        }
+        reader->chunk_len = chunk_len;
+    }
+
+    if (len > reader->chunk_len) {
+        len = reader->chunk_len;
+    }
+    memcpy(buf, reader->chunk, len);
+    reader->chunk += len;
+    reader->chunk_len -= len;
+    return len;
+}
+
+/* Stop reading: wait for the reads in flight and release the buffers. split->fd is left open. */
+void input_reader_close(INPUT_READER *reader) {
+    int idx;
+
+    // The kernel may still write into the buffers until the reads in flight complete
+    if (reader->ring.fd >= 0) {
+        for (idx = 0; idx < INPUT_READER_DEPTH; idx++) {
+            if (reader->results[idx] == INPUT_PENDING && ring_wait(reader, idx) != SUCCESS) {
+                break;
+            }
+        }
+        ring_destroy(&reader->ring);
+    }
+    for (idx = 0; idx < INPUT_READER_DEPTH; idx++) {
+        io_buffer_put(reader->buffers[idx]);
+        reader->buffers[idx] = NULL;
+    }
+    if (reader->direct) {
+        close(reader->fd);
+        reader->direct = 0;
+    }
+}
+
+/* Whether the file at path is gzip-compressed (by its magic bytes).
+   @ret: 1 if it is, 0 if it is not or cannot be read. */
+int input_is_compressed(const char *path) {
+    unsigned char magic[2];
+    int fd = open(path, O_RDONLY);
+    ssize_t bytes_read = fd >= 0 ? read(fd, magic, sizeof(magic)) : -1;
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    return bytes_read == sizeof(magic) && magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+/* Decompress the gzip file at path (all its members) into a new file at output_path.
+   @ret: 0 on success, -1 on error (output_path is then removed). */
+int input_decompress(const char *path, const char *output_path) {
+    gzFile input = gzopen(path, "rb");
+    int output_fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    char *buffer = io_buffer_get();
+    int bytes_read = 0, ret = SUCCESS;
+
+    if (input == NULL || output_fd < 0 || buffer == NULL) {
+        ret = ERROR;
+    } else {
+        gzbuffer(input, IO_BUFFER_SIZE);
+        while ((bytes_read = gzread(input, buffer, IO_BUFFER_SIZE)) > 0) {
+            const char *p = buffer;
+            ssize_t written = 0;
+            for (; bytes_read > 0; p += written, bytes_read -= written) {
+                if ((written = write(output_fd, p, bytes_read)) < 0) {
+                    break;
+                }
+            }
+            if (written < 0) {
+                ret = ERROR;
+                break;
+            }
+        }
+        if (bytes_read < 0) {
+            ret = ERROR;
+        }
+    }
+
+    if (input != NULL) {
+        gzclose(input);
+    }
+    if (output_fd >= 0 && close(output_fd) != 0) {
+        ret = ERROR;
+    }
+    io_buffer_put(buffer);
+    if (ret != SUCCESS) {
+        unlink(output_path);
+    }
+    return ret;
+}
+
+/* Copy [offset, offset + size) of fd_in to fd_out from its offset 0 (the file offsets are not used
+   and fd_in may be read concurrently): with copy_file_range(), or through a pooled buffer where the
+   file systems do not support it.
+   @ret: 0 on success, -1 on error or if fd_in is shorter. */
+int input_copy_range(int fd_in, off_t offset, off_t size, int fd_out) {
+    off_t in_offset = offset, out_offset = 0, copied = 0;
+    ssize_t bytes;
+
+    while (copied < size && (bytes = copy_file_range(fd_in, &in_offset, fd_out, &out_offset, size - copied, 0)) > 0) {
+        copied += bytes;
+    }
+    if (copied < size) {
+        char *buffer = io_buffer_get();
+        while (buffer != NULL && copied < size &&
+               (bytes = pread(fd_in, buffer, size - copied < IO_BUFFER_SIZE ? size - copied : IO_BUFFER_SIZE, offset + copied)) > 0 &&
+               pwrite(fd_out, buffer, bytes, copied) == bytes) {
+            copied += bytes;
+        }
+        io_buffer_put(buffer);
+    }
+    return copied == size ? SUCCESS : ERROR;
+}
@@ -0,0 +1,76 @@
+/* Reading the bytes of a split through its descriptor, with the I/O backend of the job.
+
+   IO_BACKEND_READ is plain read(). IO_BACKEND_DIRECT reads with O_DIRECT into page-aligned pooled
+   buffers, so a large input does not go through (and evict) the page cache. IO_BACKEND_URING keeps
+   INPUT_READER_DEPTH reads in flight with io_uring, into registered buffers, and on an O_DIRECT
+   descriptor when the file system supports it: the device fills the next buffers while the map
+   function works on the current one.
+
+   A backend that is not available falls back at input_reader_open(): io_uring to O_DIRECT to read().
+
+   A compressed input file (gzip, possibly several concatenated members) is decompressed once with
+   input_decompress() before it is split.
+
+   input_copy_range() copies a byte range between files, in the kernel where the file systems allow it. */
+
+#ifndef _INPUT_H
+#define _INPUT_H
+
+#include <sys/types.h>
+
+#include "mapreduce.h"
+
+#define INPUT_READER_DEPTH 4 /* The buffers (and io_uring reads in flight) of a reader */
+#define INPUT_DIRECT_ALIGN 4096 /* The offset and length alignment of O_DIRECT reads */
+
+/* A minimal io_uring: the submission and completion rings mapped from the kernel */
+typedef struct _io_ring
+{
+    int fd; /* -1 when no ring is set up */
+    unsigned * sq_head;
+    unsigned * sq_tail;
+    unsigned * sq_mask;
+    unsigned * sq_array;
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned * cq_mask;
+    void * sqes; /* struct io_uring_sqe [] */
+    void * cqes; /* struct io_uring_cqe [] */
+    void * sq_ring;
+    size_t sq_ring_size;
+    void * cq_ring; /* The same mapping as sq_ring with IORING_FEAT_SINGLE_MMAP */
+    size_t cq_ring_size;
+    size_t sqes_size;
+    int fixed; /* Whether the buffers are registered (IORING_OP_READ_FIXED) */
+}IO_RING;
+
+typedef struct _input_reader
+{
+    IO_BACKEND backend; /* The backend in use, after any fallback */
+    int fd; /* The split's descriptor, or an O_DIRECT descriptor of the same file */
+    int direct; /* Whether fd is an O_DIRECT descriptor opened by the reader */
+    off_t issue_offset; /* The file offset of the next read to issue (aligned for O_DIRECT) */
+    off_t deliver_offset; /* The file offset of the next byte to hand out */
+    off_t end; /* The file offset of the end of the split */
+    char * buffers[INPUT_READER_DEPTH];
+    off_t buffer_offsets[INPUT_READER_DEPTH]; /* The file offset each buffer was read from */
+    size_t buffer_lengths[INPUT_READER_DEPTH]; /* The length of the read into each buffer */
+    ssize_t results[INPUT_READER_DEPTH]; /* The bytes read into each buffer, or -errno; INPUT_PENDING while in flight */
+    int issued; /* Reads issued and not handed out yet */
+    int next_buffer; /* The buffer to hand out next, or the one handed out last */
+    int handed_out; /* Whether next_buffer has been handed out (and is free once the caller comes back) */
+    const char * chunk; /* What input_reader_read() has not copied out yet of the last chunk */
+    size_t chunk_len;
+    IO_RING ring;
+}INPUT_READER;
+
+int input_reader_open(INPUT_READER * reader, const DATA_SPLIT * split);
+ssize_t input_reader_next(INPUT_READER * reader, const char ** chunk);
+ssize_t input_reader_read(INPUT_READER * reader, void * buf, size_t len);
+void input_reader_close(INPUT_READER * reader);
+
+int input_is_compressed(const char * path);
+int input_decompress(const char * path, const char * output_path);
+int input_copy_range(int fd_in, off_t offset, off_t size, int fd_out);
+
+#endif
@@ -0,0 +1,498 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "inverted.h"
+
+// The value of a term in INVERTED_TERMS: the posting list of the split so far, stored unaligned in the arena
+typedef struct _inverted_list
+{
+    uint64_t first; // The offset of the first line
+    uint64_t last; // The offset of the last line
+    uint32_t line_num;
+    uint32_t size; // The bytes of data
+    uint32_t capacity;
+    uint8_t * data; // The deltas after first, malloc()ed
+}INVERTED_LIST;
+
+// A term of a partition, for inverted_build()
+typedef struct _part_term
+{
+    const char * name;
+    const uint8_t * postings;
+    INVERTED_PART_TERM header;
+}PART_TERM;
+
+/* Write value as a varint at out, which has room for INVERTED_VARINT_MAX bytes.
+   @ret: The bytes written.
+ */
+size_t inverted_put_varint(uint8_t *out, uint64_t value) {
+    size_t len = 0;
+
+    while (value >= 0x80) {
+        out[len++] = (uint8_t)value | 0x80;
+        value >>= 7;
+    }
+    out[len++] = (uint8_t)value;
+    return len;
+}
+
+/* Read a varint at *pos, before end, and move *pos past it.
+   @ret: 0 on success, -1 if it runs past end or is too long.
+ */
+int inverted_get_varint(const uint8_t **pos, const uint8_t *end, uint64_t *value) {
+    const uint8_t *p = *pos;
+    uint64_t result = 0;
+    int shift;
+
+    for (shift = 0; p < end && shift < 7 * INVERTED_VARINT_MAX; shift += 7) {
+        result |= (uint64_t)(*p & 0x7f) << shift;
+        if ((*p++ & 0x80) == 0) {
+            *pos = p;
+            *value = result;
+            return SUCCESS;
+        }
+    }
+    return ERROR;
+}
+
+// The AGG_MERGE of INVERTED_TERMS: append the line of other to the list, unless it is its last line already
+static int merge_list(char *value, uint32_t value_len, const char *other, uint32_t other_len) {
+    INVERTED_LIST list, line;
+
+    if (value_len != sizeof(list) || other_len != sizeof(line)) {
+        return ERROR;
+    }
+    memcpy(&list, value, sizeof(list));
+    memcpy(&line, other, sizeof(line));
+    if (line.first == list.last) {
+        return SUCCESS; // Another term of the same line
+    }
+    if (line.first < list.last) {
+        return ERROR; // The lines of a split are added in order
+    }
+    if (list.size + INVERTED_VARINT_MAX > list.capacity) {
+        uint32_t capacity = list.capacity > 0 ? list.capacity * 2 : 16;
+        uint8_t *data = realloc(list.data, capacity);
+        if (data == NULL) {
+            return ERROR;
+        }
+        list.data = data;
+        list.capacity = capacity;
+    }
+    list.size += inverted_put_varint(list.data + list.size, line.first - list.last);
+    list.last = line.first;
+    list.line_num++;
+    memcpy(value, &list, sizeof(list));
+    return SUCCESS;
+}
+
+void inverted_terms_init(INVERTED_TERMS *terms) {
+    agg_table_init(&terms->table, merge_list, 0);
+}
+
+// Add one term of the line at offset
+static int add_term(INVERTED_TERMS *terms, const char *name, size_t len, uint64_t offset) {
+    INVERTED_LIST line = {offset, offset, 1, 0, 0, NULL};
+
+    return agg_table_add(&terms->table, name, len, &line, sizeof(line));
+}
+
+/* Add the terms of a line (without its '\n') that starts at offset in the input. The lines of a
+   split must be added in input order.
+   @ret: 0 on success, -1 if out of memory.
+ */
+int inverted_add_line(INVERTED_TERMS *terms, const char *line, size_t len, uint64_t offset) {
+    size_t start = 0, end, i;
+
+    while (start < len) {
+        if (line[start] == ' ') {
+            start++;
+            continue;
+        }
+        for (end = start; end < len && line[end] != ' '; end++) {
+        }
+
+        // The word, and each of its prefixes that a ',' or '.' ends
+        for (i = start + 1; i <= end && i - start <= INVERTED_TERM_MAX; i++) {
+            if ((i == end || line[i] == ',' || line[i] == '.') && add_term(terms, line + start, i - start, offset) != SUCCESS) {
+                return ERROR;
+            }
+        }
+        start = end;
+    }
+    return SUCCESS;
+}
+
+/* Write one record per term, in key order (a sorted run once the writer is marked sorted), with its
+   posting list as value.
+   @ret: 0 on success, -1 on error.
+ */
+int inverted_terms_write(INVERTED_TERMS *terms, ITM_WRITER *writer) {
+    AGG_ENTRY **sorted = agg_table_sorted(&terms->table);
+    uint8_t *postings = NULL;
+    size_t idx, capacity = 0;
+    int ret = SUCCESS;
+
+    if (sorted == NULL) {
+        return ERROR;
+    }
+    for (idx = 0; ret == SUCCESS && idx < terms->table.entry_num; idx++) {
+        INVERTED_LIST list;
+        memcpy(&list, sorted[idx]->data + sorted[idx]->key_len, sizeof(list));
+        if (list.size + INVERTED_VARINT_MAX > capacity) {
+            capacity = (list.size + INVERTED_VARINT_MAX) * 2;
+            uint8_t *grown = realloc(postings, capacity);
+            if (grown == NULL) {
+                ret = ERROR;
+                break;
+            }
+            postings = grown;
+        }
+        size_t size = inverted_put_varint(postings, list.first);
+        if (list.size > 0) {
+            memcpy(postings + size, list.data, list.size);
+        }
+        ret = itm_write(writer, sorted[idx]->data, sorted[idx]->key_len, postings, size + list.size);
+    }
+    free(postings);
+    free(sorted);
+    return ret;
+}
+
+/* Free everything the terms hold */
+void inverted_terms_clear(INVERTED_TERMS *terms) {
+    size_t idx;
+
+    for (idx = 0; idx < terms->table.capacity; idx++) {
+        AGG_ENTRY *entry = &terms->table.slots[idx];
+        if (entry->data != NULL) {
+            INVERTED_LIST list;
+            memcpy(&list, entry->data + entry->key_len, sizeof(list));
+            free(list.data);
+        }
+    }
+    agg_table_clear(&terms->table);
+}
+
+static int compare_offsets(const void *a, const void *b) {
+    uint64_t offset = *(const uint64_t *)a, other = *(const uint64_t *)b;
+
+    return offset < other ? -1 : offset > other;
+}
+
+/* The group reduce function of the index task: merges the posting lists of a term, one per map
+   output it was in, and writes the term as an INVERTED_PART_TERM, its name and its posting list.
+   @ret: 0 on success, -1 on error.
+ */
+int inverted_reduce(const char *key, uint32_t key_len, REDUCE_VALUES *values, FILE *output) {
+    uint64_t *offsets = NULL, offset;
+    size_t offset_num = 0, capacity = 0, i;
+    const char *value;
+    uint32_t value_len;
+    int sorted = 1, ret = 0;
+
+    while (ret == 0 && mapreduce_next_value(values, &value, &value_len) > 0) {
+        const uint8_t *pos = (const uint8_t *)value, *end = pos + value_len;
+        offset = 0;
+        while (pos < end) {
+            uint64_t delta;
+            if (inverted_get_varint(&pos, end, &delta) != SUCCESS) {
+                fprintf(stderr, "Error: Invalid posting list in intermediate data (inverted_reduce).\n");
+                ret = -1;
+                break;
+            }
+            if (offset_num == capacity) {
+                capacity = capacity > 0 ? capacity * 2 : 64;
+                uint64_t *grown = realloc(offsets, capacity * sizeof(uint64_t));
+                if (grown == NULL) {
+                    fprintf(stderr, "Error: Memory allocation failed (inverted_reduce).\n");
+                    ret = -1;
+                    break;
+                }
+                offsets = grown;
+            }
+            offset += delta;
+            // The map outputs of the splits (or chunks) come in any order
+            sorted = sorted && (offset_num == 0 || offset >= offsets[offset_num - 1]);
+            offsets[offset_num++] = offset;
+        }
+    }
+    if (ret != 0) {
+        free(offsets);
+        return -1;
+    }
+    if (!sorted) {
+        qsort(offsets, offset_num, sizeof(uint64_t), compare_offsets);
+    }
+
+    // Encode the merged list again, each line once
+    uint8_t *postings = malloc(offset_num * INVERTED_VARINT_MAX + 1);
+    INVERTED_PART_TERM term = {key_len, 0, 0};
+    uint64_t last = 0;
+    if (postings == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed (inverted_reduce).\n");
+        free(offsets);
+        return -1;
+    }
+    for (i = 0; i < offset_num; i++) {
+        if (term.line_num > 0 && offsets[i] == last) {
+            continue;
+        }
+        term.postings_size += inverted_put_varint(postings + term.postings_size, offsets[i] - last);
+        last = offsets[i];
+        term.line_num++;
+    }
+    if (fwrite(&term, sizeof(term), 1, output) != 1 || fwrite(key, 1, key_len, output) != key_len ||
+        fwrite(postings, 1, term.postings_size, output) != term.postings_size) {
+        perror("Error writing data to output file (inverted_reduce)");
+        ret = -1;
+    }
+    free(postings);
+    free(offsets);
+    return ret;
+}
+
+static int compare_part_terms(const void *a, const void *b) {
+    const PART_TERM *term = a, *other = b;
+
+    return itm_compare_keys(term->name, term->header.name_length, other->name, other->header.name_length);
+}
+
+// Read the terms of a partition's result file, mapped at data, into *terms
+static int read_part_terms(const char *data, size_t length, PART_TERM **terms, size_t *term_num, size_t *capacity) {
+    size_t pos = 0;
+
+    while (pos < length) {
+        PART_TERM term;
+        if (length - pos < sizeof(term.header)) {
+            return ERROR;
+        }
+        memcpy(&term.header, data + pos, sizeof(term.header));
+        pos += sizeof(term.header);
+        if (term.header.name_length > INVERTED_TERM_MAX || length - pos < (size_t)term.header.name_length + term.header.postings_size) {
+            return ERROR;
+        }
+        term.name = data + pos;
+        term.postings = (const uint8_t *)data + pos + term.header.name_length;
+        pos += term.header.name_length + term.header.postings_size;
+
+        if (*term_num == *capacity) {
+            size_t grown_capacity = *capacity > 0 ? *capacity * 2 : 1024;
+            PART_TERM *grown = realloc(*terms, grown_capacity * sizeof(PART_TERM));
+            if (grown == NULL) {
+                return ERROR;
+            }
+            *terms = grown;
+            *capacity = grown_capacity;
+        }
+        (*terms)[(*term_num)++] = term;
+    }
+    return SUCCESS;
+}
+
+// Write the index of the terms to output
+static int write_index(FILE *output, const PART_TERM *terms, size_t term_num, uint64_t input_size) {
+    INVERTED_HEADER header = {INVERTED_TYPE, 0, term_num, 0, input_size, sizeof(INVERTED_HEADER) + term_num * sizeof(INVERTED_TERM), 0};
+    uint64_t postings = 0;
+    uint32_t names = 0;
+    size_t i;
+    int written = 1;
+
+    for (i = 0; i < term_num; i++) {
+        names += terms[i].header.name_length;
+        header.posting_num += terms[i].header.line_num;
+    }
+    header.postings_offset = header.names_offset + names;
+    written = fwrite(&header, sizeof(header), 1, output) == 1;
+
+    names = 0;
+    for (i = 0; i < term_num && written; i++) {
+        INVERTED_TERM term = {postings, terms[i].header.postings_size, terms[i].header.line_num, names, terms[i].header.name_length};
+        written = fwrite(&term, sizeof(term), 1, output) == 1;
+        names += term.name_length;
+        postings += term.postings_size;
+    }
+    for (i = 0; i < term_num && written; i++) {
+        written = fwrite(terms[i].name, 1, terms[i].header.name_length, output) == terms[i].header.name_length;
+    }
+    for (i = 0; i < term_num && written; i++) {
+        written = fwrite(terms[i].postings, 1, terms[i].header.postings_size, output) == terms[i].header.postings_size;
+    }
+    return written ? SUCCESS : ERROR;
+}
+
+/* Build the index file at index_path from the result files of the part_num partitions of an index
+   job, for an input of input_size bytes (0 if unknown). The index is written next to it first and
+   renamed into place, so that a lookup never sees half an index.
+   @ret: 0 on success, -1 if a result file cannot be read or the index cannot be written.
+ */
+int inverted_build(const char *index_path, const char *const *part_paths, int part_num, uint64_t input_size) {
+    const char **maps = calloc(part_num, sizeof(char *));
+    size_t *lengths = calloc(part_num, sizeof(size_t));
+    PART_TERM *terms = NULL;
+    size_t term_num = 0, capacity = 0;
+    char tmp_path[PATH_MAX];
+    FILE *output = NULL;
+    int part, ret = SUCCESS;
+
+    if (maps == NULL || lengths == NULL ||
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", index_path) >= (int)sizeof(tmp_path)) {
+        free(maps);
+        free(lengths);
+        return ERROR;
+    }
+    for (part = 0; part < part_num && ret == SUCCESS; part++) {
+        int fd = open(part_paths[part], O_RDONLY);
+        struct stat st;
+
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            ret = ERROR;
+        } else if (st.st_size > 0) {
+            lengths[part] = st.st_size;
+            maps[part] = mmap(NULL, lengths[part], PROT_READ, MAP_SHARED, fd, 0);
+            if (maps[part] == MAP_FAILED) {
+                maps[part] = NULL;
+                ret = ERROR;
+            } else {
+                ret = read_part_terms(maps[part], lengths[part], &terms, &term_num, &capacity);
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    // The partitions hold distinct terms, each in key order: sorting them all gives the dictionary
+    if (ret == SUCCESS) {
+        qsort(terms, term_num, sizeof(PART_TERM), compare_part_terms);
+        ret = (output = fopen(tmp_path, "w")) != NULL ? write_index(output, terms, term_num, input_size) : ERROR;
+        if (output != NULL && fclose(output) != 0) {
+            ret = ERROR;
+        }
+        if (ret == SUCCESS && rename(tmp_path, index_path) != 0) {
+            ret = ERROR;
+        }
+        if (ret != SUCCESS && output != NULL) {
+            unlink(tmp_path);
+        }
+    }
+
+    for (part = 0; part < part_num; part++) {
+        if (maps[part] != NULL) {
+            munmap((void *)maps[part], lengths[part]);
+        }
+    }
+    free(terms);
+    free(maps);
+    free(lengths);
+    return ret;
+}
+
+/* Map the index file at path, and check its layout.
+   @ret: 0 on success, -1 if it cannot be mapped or is not an index file.
+ */
+int inverted_open(INVERTED_INDEX *index, const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+
+    memset(index, 0, sizeof(*index));
+    if (fd < 0) {
+        return ERROR;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(INVERTED_HEADER)) {
+        close(fd);
+        return ERROR;
+    }
+    index->length = st.st_size;
+    index->data = mmap(NULL, index->length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (index->data == MAP_FAILED) {
+        index->data = NULL;
+        return ERROR;
+    }
+    index->header = (const INVERTED_HEADER *)index->data;
+    index->terms = (const INVERTED_TERM *)(index->header + 1);
+
+    const INVERTED_HEADER *header = index->header;
+    if (header->type != INVERTED_TYPE ||
+        (index->length - sizeof(*header)) / sizeof(INVERTED_TERM) < header->term_num ||
+        header->names_offset != sizeof(*header) + header->term_num * sizeof(INVERTED_TERM) ||
+        header->postings_offset < header->names_offset || header->postings_offset > index->length) {
+        inverted_close(index);
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+/* Look a term up in the index, with a binary search of the dictionary.
+   @ret: The term, or NULL if it is not in the index (or its entry is corrupted).
+ */
+const INVERTED_TERM *inverted_find(const INVERTED_INDEX *index, const char *name, uint32_t name_length) {
+    const char *names = index->data + index->header->names_offset;
+    uint64_t names_size = index->header->postings_offset - index->header->names_offset;
+    uint64_t low = 0, high = index->header->term_num;
+
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        const INVERTED_TERM *term = &index->terms[mid];
+        if (term->name > names_size || names_size - term->name < term->name_length) {
+            return NULL;
+        }
+        int cmp = itm_compare_keys(names + term->name, term->name_length, name, name_length);
+        if (cmp == 0) {
+            return term;
+        }
+        if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return NULL;
+}
+
+/* Start walking the posting list of a term of the index.
+   @ret: 0 on success, -1 if the list is out of the file.
+ */
+int inverted_cursor_init(INVERTED_CURSOR *cursor, const INVERTED_INDEX *index, const INVERTED_TERM *term) {
+    uint64_t postings_size = index->length - index->header->postings_offset;
+
+    if (term->postings > postings_size || postings_size - term->postings < term->postings_size) {
+        return ERROR;
+    }
+    cursor->pos = (const uint8_t *)index->data + index->header->postings_offset + term->postings;
+    cursor->end = cursor->pos + term->postings_size;
+    cursor->offset = 0;
+    return SUCCESS;
+}
+
+/* Read the offset of the next line of the list.
+   @ret: 1 with the offset in *offset, 0 at the end of the list, -1 if the list is corrupted.
+ */
+int inverted_cursor_next(INVERTED_CURSOR *cursor, uint64_t *offset) {
+    uint64_t delta;
+
+    if (cursor->pos == cursor->end) {
+        return 0;
+    }
+    if (inverted_get_varint(&cursor->pos, cursor->end, &delta) != SUCCESS) {
+        return ERROR;
+    }
+    cursor->offset += delta;
+    *offset = cursor->offset;
+    return 1;
+}
+
+void inverted_close(INVERTED_INDEX *index) {
+    if (index->data != NULL) {
+        munmap((void *)index->data, index->length);
+        index->data = NULL;
+    }
+}
@@ -0,0 +1,102 @@
+/* An on-disk inverted index of the lines of an input: for each term, the offsets of the lines it is in.
+
+   The terms of a line are the words the finder would match in it (see finder.h): each run of
+   characters between spaces (or the ends of the line), and each prefix of it that is followed by
+   ',' or '.'. So looking a word up in the index gives the lines the "Word finder" task would report
+   for it, without reading the input again; a word with a space in it cannot be looked up.
+
+   The index task builds it in one MapReduce pass. Each map task adds the terms of its split to an
+   INVERTED_TERMS table and writes one record per term, with the postings of the split as value;
+   inverted_reduce() merges the postings of a term and writes an INVERTED_PART_TERM for it, in key
+   order, to the result file of its partition; inverted_build() then puts the partitions together.
+
+   A posting list is a sequence of varints (7 bits per byte, low bits first, the high bit set on all
+   but the last byte): the offset of the first line, then the difference with the previous line for
+   each of the others. The index file is an INVERTED_HEADER, term_num INVERTED_TERMs sorted by name
+   (in the order of itm_compare_keys()), the names, then the posting lists, in host byte order. */
+
+#ifndef _INVERTED_H
+#define _INVERTED_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "itm.h"
+#include "aggregate.h"
+#include "mapreduce.h"
+
+#define INVERTED_TYPE 0x3156524d /* "MRV1" */
+#define INVERTED_DEFAULT_FILE "mr.inv" /* The index file of --index without a path */
+#define INVERTED_TERM_MAX 256 /* Longer terms are not indexed */
+#define INVERTED_VARINT_MAX 10 /* The bytes of the longest varint of a uint64_t */
+
+typedef struct _inverted_header
+{
+    uint32_t type; /* INVERTED_TYPE */
+    uint32_t reserved;
+    uint64_t term_num;
+    uint64_t posting_num; /* The postings of all the terms */
+    uint64_t input_size; /* The size of the input that was indexed, 0 if unknown (a stream) */
+    uint64_t names_offset; /* Where the names start in the file */
+    uint64_t postings_offset; /* Where the posting lists start */
+}INVERTED_HEADER;
+
+typedef struct _inverted_term
+{
+    uint64_t postings; /* The offset of the posting list from INVERTED_HEADER.postings_offset */
+    uint32_t postings_size; /* Its bytes */
+    uint32_t line_num; /* Its postings */
+    uint32_t name; /* The offset of the name from INVERTED_HEADER.names_offset */
+    uint32_t name_length;
+}INVERTED_TERM;
+
+/* A term in the result file of a partition: the name then the posting list follow */
+typedef struct _inverted_part_term
+{
+    uint32_t name_length;
+    uint32_t line_num;
+    uint32_t postings_size;
+}INVERTED_PART_TERM;
+
+/* The terms of a split being indexed, in an AGG_TABLE whose values are the posting lists being built */
+typedef struct _inverted_terms
+{
+    AGG_TABLE table;
+}INVERTED_TERMS;
+
+/* An index file mapped in memory, read-only */
+typedef struct _inverted_index
+{
+    const char * data;
+    size_t length;
+    const INVERTED_HEADER * header;
+    const INVERTED_TERM * terms; /* [header->term_num] */
+}INVERTED_INDEX;
+
+/* Walks a posting list */
+typedef struct _inverted_cursor
+{
+    const uint8_t * pos;
+    const uint8_t * end;
+    uint64_t offset; /* The last offset read */
+}INVERTED_CURSOR;
+
+size_t inverted_put_varint(uint8_t * out, uint64_t value);
+int inverted_get_varint(const uint8_t ** pos, const uint8_t * end, uint64_t * value);
+
+void inverted_terms_init(INVERTED_TERMS * terms);
+int inverted_add_line(INVERTED_TERMS * terms, const char * line, size_t len, uint64_t offset);
+int inverted_terms_write(INVERTED_TERMS * terms, ITM_WRITER * writer);
+void inverted_terms_clear(INVERTED_TERMS * terms);
+
+int inverted_reduce(const char * key, uint32_t key_len, REDUCE_VALUES * values, FILE * output);
+int inverted_build(const char * index_path, const char * const * part_paths, int part_num, uint64_t input_size);
+
+int inverted_open(INVERTED_INDEX * index, const char * path);
+const INVERTED_TERM * inverted_find(const INVERTED_INDEX * index, const char * name, uint32_t name_length);
+int inverted_cursor_init(INVERTED_CURSOR * cursor, const INVERTED_INDEX * index, const INVERTED_TERM * term);
+int inverted_cursor_next(INVERTED_CURSOR * cursor, uint64_t * offset);
+void inverted_close(INVERTED_INDEX * index);
+
+#endif
@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "itm.h"
+#include "trace.h"
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+static int compress_writers; // Whether the writers opened from now on compress their records
+
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    for (size_t idx = 0; idx < len; idx++) {
+        hash ^= bytes[idx];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/* The FNV-1a hash of data[0, len), as used for the intermediate file checksum */
+uint32_t itm_hash(const void *data, size_t len) {
+    return fnv1a(FNV_OFFSET_BASIS, data, len);
+}
+
+/* The key order of sorted runs: bytewise, a shorter key first when one key is a prefix of the other.
+   @ret: A negative, zero or positive value as key is before, equal to or after other.
+ */
+int itm_compare_keys(const char *key, uint32_t key_len, const char *other, uint32_t other_len) {
+    int diff = memcmp(key, other, key_len < other_len ? key_len : other_len);
+
+    if (diff != 0) {
+        return diff;
+    }
+    return (key_len > other_len) - (key_len < other_len);
+}
+
+// Write all of buf[0, len) to fd, retrying short writes
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t written = write(fd, p, len);
+        if (written < 0) {
+            return ERROR;
+        }
+        p += written;
+        len -= written;
+    }
+    return SUCCESS;
+}
+
+// Write out the buffered records, compressed into one block with ITM_FLAG_COMPRESSED
+static int write_batch(ITM_WRITER *writer) {
+    if (!writer->compressed) {
+        if (write_all(writer->fd, writer->buffer, writer->buffered) != SUCCESS) {
+            return ERROR;
+        }
+    } else {
+        // One block; stored as is when it does not shrink
+        uint32_t lengths[2] = {writer->buffered, 0};
+        size_t stored = lz_compress(writer->buffer, writer->buffered, writer->block + ITM_BLOCK_HEADER_SIZE,
+                                    sizeof(writer->block) - ITM_BLOCK_HEADER_SIZE);
+        if (stored > 0 && stored < writer->buffered) {
+            lengths[1] = stored;
+            memcpy(writer->block, lengths, sizeof(lengths));
+            if (write_all(writer->fd, writer->block, ITM_BLOCK_HEADER_SIZE + stored) != SUCCESS) {
+                return ERROR;
+            }
+        } else {
+            lengths[1] = writer->buffered;
+            if (write_all(writer->fd, lengths, sizeof(lengths)) != SUCCESS ||
+                write_all(writer->fd, writer->buffer, writer->buffered) != SUCCESS) {
+                return ERROR;
+            }
+        }
+    }
+    return SUCCESS;
+}
+
+static int itm_flush(ITM_WRITER *writer) {
+    int ret;
+
+    if (writer->buffered == 0) {
+        return SUCCESS;
+    }
+    TRACE_BEGIN("write", writer->buffered);
+    ret = write_batch(writer);
+    TRACE_END("write", writer->buffered);
+    if (ret != SUCCESS) {
+        return ERROR;
+    }
+    writer->buffered = 0;
+    return SUCCESS;
+}
+
+// Append bytes to the writer's buffer, flushing it (or bypassing it for large chunks) as needed
+static int itm_append(ITM_WRITER *writer, const void *data, size_t len) {
+    writer->checksum = fnv1a(writer->checksum, data, len);
+    writer->raw_size += len;
+
+    if (writer->buffered + len > sizeof(writer->buffer)) {
+        if (itm_flush(writer) != SUCCESS) {
+            return ERROR;
+        }
+        if (len > sizeof(writer->buffer) && !writer->compressed) {
+            int ret;
+
+            TRACE_BEGIN("write", len);
+            ret = write_all(writer->fd, data, len);
+            TRACE_END("write", len);
+            return ret;
+        }
+        // Compressed blocks are always cut from the buffer
+        while (len > sizeof(writer->buffer)) {
+            memcpy(writer->buffer, data, sizeof(writer->buffer));
+            writer->buffered = sizeof(writer->buffer);
+            if (itm_flush(writer) != SUCCESS) {
+                return ERROR;
+            }
+            data = (const char *)data + sizeof(writer->buffer);
+            len -= sizeof(writer->buffer);
+        }
+    }
+    memcpy(writer->buffer + writer->buffered, data, len);
+    writer->buffered += len;
+    return SUCCESS;
+}
+
+/* Set whether the writers opened from now on compress their records in LZ blocks. Readers
+   detect compressed files on their own. It applies to the whole process (and its forks).
+ */
+void itm_set_compression(int compressed) {
+    compress_writers = compressed;
+}
+
+/* Start writing an intermediate file.
+   @param writer: The writer to initialize.
+   @param fd: The file descriptor of the (empty) intermediate file.
+   @ret: 0 on success, -1 on error.
+ */
+int itm_writer_open(ITM_WRITER *writer, int fd) {
+    ITM_HEADER header = {0};
+
+    writer->fd = fd;
+    writer->record_num = 0;
+    writer->checksum = FNV_OFFSET_BASIS;
+    writer->buffered = 0;
+    writer->sorted = 0;
+    writer->compressed = compress_writers;
+    writer->raw_size = 0;
+
+    // Reserve room for the header; it is filled in by itm_writer_close(). The blocks of a
+    // compressed file start after it, so that the header is not compressed with the records.
+    if (writer->compressed) {
+        return lseek(fd, sizeof(header), SEEK_SET) == sizeof(header) ? SUCCESS : ERROR;
+    }
+    memcpy(writer->buffer, &header, sizeof(header));
+    writer->buffered = sizeof(header);
+    return SUCCESS;
+}
+
+/* Append one key/value record to an intermediate file.
+   @ret: 0 on success, -1 on error.
+ */
+int itm_write(ITM_WRITER *writer, const void *key, uint32_t key_len, const void *value, uint32_t value_len) {
+    uint32_t lengths[2] = {key_len, value_len};
+
+    if (itm_append(writer, lengths, sizeof(lengths)) != SUCCESS ||
+        itm_append(writer, key, key_len) != SUCCESS ||
+        itm_append(writer, value, value_len) != SUCCESS) {
+        return ERROR;
+    }
+    writer->record_num++;
+    return SUCCESS;
+}
+
+/* Flush the buffered records and write the header. The file descriptor is not closed.
+   @ret: 0 on success, -1 on error.
+ */
+int itm_writer_close(ITM_WRITER *writer) {
+    ITM_HEADER header = {writer->sorted ? ITM_SORTED_MAGIC : ITM_MAGIC, writer->checksum, writer->record_num,
+                         writer->compressed ? ITM_FLAG_COMPRESSED : 0, 0, writer->raw_size};
+
+    if (itm_flush(writer) != SUCCESS ||
+        pwrite(writer->fd, &header, sizeof(header), 0) != sizeof(header)) {
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+// Decompress the blocks of a mapped compressed file into reader->raw, and walk the records there instead
+static int decompress_records(ITM_READER *reader, uint64_t raw_size) {
+    const char *block = reader->pos;
+    size_t done = 0;
+
+    if ((reader->raw = malloc(raw_size ? raw_size : 1)) == NULL) {
+        return ERROR;
+    }
+    while (block < reader->end) {
+        uint32_t lengths[2]; // The raw and the stored length of the block
+        if ((size_t)(reader->end - block) < sizeof(lengths)) {
+            return ERROR;
+        }
+        memcpy(lengths, block, sizeof(lengths));
+        block += sizeof(lengths);
+        if (lengths[1] > (size_t)(reader->end - block) || lengths[0] > raw_size - done) {
+            return ERROR;
+        }
+        if (lengths[1] == lengths[0]) {
+            memcpy(reader->raw + done, block, lengths[0]);
+        } else if (lz_decompress(block, lengths[1], reader->raw + done, lengths[0]) != SUCCESS) {
+            return ERROR;
+        }
+        block += lengths[1];
+        done += lengths[0];
+    }
+    if (done != raw_size) {
+        return ERROR;
+    }
+
+    munmap(reader->map, reader->map_length);
+    reader->map = NULL;
+    reader->pos = reader->raw;
+    reader->end = reader->raw + raw_size;
+    return SUCCESS;
+}
+
+// Map the size bytes of the intermediate file fd, and check its header and records (read them when compressed)
+static int open_mapping(ITM_READER *reader, int fd, off_t size) {
+    ITM_HEADER header;
+
+    reader->map_length = size;
+    reader->map = mmap(NULL, reader->map_length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (reader->map == MAP_FAILED) {
+        reader->map = NULL;
+        return ERROR;
+    }
+    madvise(reader->map, reader->map_length, MADV_SEQUENTIAL);
+
+    memcpy(&header, reader->map, sizeof(header));
+    reader->pos = (const char *)reader->map + sizeof(header);
+    reader->end = (const char *)reader->map + reader->map_length;
+    reader->records_left = header.record_num;
+    reader->sorted = header.magic == ITM_SORTED_MAGIC;
+
+    if ((header.flags & ITM_FLAG_COMPRESSED) && decompress_records(reader, header.raw_size) != SUCCESS) {
+        itm_reader_close(reader);
+        return ERROR;
+    }
+    if ((header.magic != ITM_MAGIC && header.magic != ITM_SORTED_MAGIC) ||
+        fnv1a(FNV_OFFSET_BASIS, reader->pos, reader->end - reader->pos) != header.checksum) {
+        itm_reader_close(reader);
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+/* Map an intermediate file for reading and verify its header and checksum.
+   @param reader: The reader to initialize.
+   @param fd: The file descriptor of the intermediate file. Its file offset is not used.
+   @ret: 0 on success, -1 if the file cannot be mapped or is corrupted.
+ */
+int itm_reader_open(ITM_READER *reader, int fd) {
+    struct stat file_stat;
+    int ret;
+
+    memset(reader, 0, sizeof(*reader));
+    if (fstat(fd, &file_stat) < 0 || file_stat.st_size < (off_t)sizeof(ITM_HEADER)) {
+        return ERROR;
+    }
+    TRACE_BEGIN("read intermediate", file_stat.st_size);
+    ret = open_mapping(reader, fd, file_stat.st_size);
+    TRACE_END("read intermediate", ret == SUCCESS ? (int64_t)(reader->end - reader->pos) : -1);
+    return ret;
+}
+
+/* Get the next record of an intermediate file. key and value point into the mapping (or into the
+   decompressed records) and stay valid until itm_reader_close().
+   @ret: 1 if a record was read, 0 at the end of the file, -1 if the file is corrupted.
+ */
+int itm_read(ITM_READER *reader, const char **key, uint32_t *key_len, const char **value, uint32_t *value_len) {
+    uint32_t lengths[2];
+
+    if (reader->records_left == 0) {
+        return reader->pos == reader->end ? 0 : ERROR;
+    }
+    if ((size_t)(reader->end - reader->pos) < sizeof(lengths)) {
+        return ERROR;
+    }
+    memcpy(lengths, reader->pos, sizeof(lengths));
+    if ((uint64_t)lengths[0] + lengths[1] > (size_t)(reader->end - reader->pos) - sizeof(lengths)) {
+        return ERROR;
+    }
+
+    *key_len = lengths[0];
+    *value_len = lengths[1];
+    *key = reader->pos + sizeof(lengths);
+    *value = *key + lengths[0];
+    reader->pos = *value + lengths[1];
+    reader->records_left--;
+    return 1;
+}
+
+void itm_reader_close(ITM_READER *reader) {
+    if (reader->map != NULL) {
+        munmap(reader->map, reader->map_length);
+    }
+    free(reader->raw);
+    memset(reader, 0, sizeof(*reader));
+}
+
+/* Get the record count (from the header) and the size of an intermediate file without mapping it.
+   @ret: 0 on success, -1 if the file has no valid header.
+ */
+int itm_stat(int fd, uint64_t *record_num, uint64_t *byte_num) {
+    struct stat file_stat;
+    ITM_HEADER header;
+
+    if (fstat(fd, &file_stat) < 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        (header.magic != ITM_MAGIC && header.magic != ITM_SORTED_MAGIC)) {
+        return ERROR;
+    }
+    *record_num = header.record_num;
+    *byte_num = file_stat.st_size;
+    return SUCCESS;
+}
+
+// A record of a mapped intermediate file, for sorting
+typedef struct _itm_record
+{
+    const char *key;
+    const char *value;
+    uint32_t key_len;
+    uint32_t value_len;
+}ITM_RECORD;
+
+static int compare_records(const void *a, const void *b) {
+    const ITM_RECORD *x = a, *y = b;
+    return itm_compare_keys(x->key, x->key_len, y->key, y->key_len);
+}
+
+/* Write the records of intermediate file fd_in to the empty file fd_out as a sorted run. The
+   records are sorted in memory by reference, an input that is already a sorted run is copied.
+   @ret: 0 on success, -1 on error.
+ */
+int itm_sort(int fd_in, int fd_out) {
+    ITM_READER reader;
+    ITM_WRITER *writer = malloc(sizeof(ITM_WRITER));
+    ITM_RECORD *records = NULL;
+    uint64_t record_num = 0, idx;
+    int ret = SUCCESS, status;
+
+    if (writer == NULL || itm_reader_open(&reader, fd_in) != SUCCESS) {
+        free(writer);
+        return ERROR;
+    }
+    if (reader.sorted) {
+        // Already a sorted run (the merged spills of an aggregation buffer): copy it through a record at a time
+        const char *key, *value;
+        uint32_t key_len, value_len;
+
+        itm_writer_open(writer, fd_out);
+        while (ret == SUCCESS && (status = itm_read(&reader, &key, &key_len, &value, &value_len)) != 0) {
+            ret = status < 0 ? ERROR : itm_write(writer, key, key_len, value, value_len);
+        }
+        writer->sorted = 1;
+        if (ret == SUCCESS) {
+            ret = itm_writer_close(writer);
+        }
+        free(writer);
+        itm_reader_close(&reader);
+        return ret;
+    }
+    if (reader.records_left > 0 && (records = malloc(reader.records_left * sizeof(ITM_RECORD))) == NULL) {
+        ret = ERROR;
+    }
+    while (ret == SUCCESS && records != NULL && (status = itm_read(&reader, &records[record_num].key, &records[record_num].key_len,
+                                                &records[record_num].value, &records[record_num].value_len)) != 0) {
+        if (status < 0) {
+            ret = ERROR;
+            break;
+        }
+        record_num++;
+    }
+    if (ret == SUCCESS) {
+        qsort(records, record_num, sizeof(ITM_RECORD), compare_records);
+    }
+
+    itm_writer_open(writer, fd_out);
+    for (idx = 0; ret == SUCCESS && idx < record_num; idx++) {
+        ret = itm_write(writer, records[idx].key, records[idx].key_len, records[idx].value, records[idx].value_len);
+    }
+    writer->sorted = 1;
+    if (ret == SUCCESS) {
+        ret = itm_writer_close(writer);
+    }
+
+    free(records);
+    free(writer);
+    itm_reader_close(&reader);
+    return ret;
+}
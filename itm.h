@@ -0,0 +1,80 @@
+/* The binary intermediate data format written by the map (and combine) functions and read by
+   the reduce functions.
+
+   An intermediate file is an ITM_HEADER followed by header.record_num records. Each record is
+   a uint32_t key length, a uint32_t value length, then the key bytes and the value bytes.
+   header.checksum is the FNV-1a hash of every byte following the header.
+
+   A sorted run (magic ITM_SORTED_MAGIC) has the same layout, with its records in ascending key
+   order (bytewise, a shorter key first when one key is a prefix of the other).
+
+   In a compressed file (ITM_FLAG_COMPRESSED) the record bytes are cut into blocks of up to
+   ITM_BUFFER_SIZE bytes, each stored as a uint32_t raw length, a uint32_t stored length, then the
+   block compressed with lz_compress(), or as is when the stored length equals the raw length. */
+
+#ifndef _ITM_H
+#define _ITM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lz.h"
+
+#define ITM_MAGIC 0x314d5249 /* "IRM1" */
+#define ITM_SORTED_MAGIC 0x31535249 /* "IRS1" */
+#define ITM_BUFFER_SIZE (64 * 1024)
+#define ITM_FLAG_COMPRESSED 0x1 /* The records are stored in LZ blocks */
+#define ITM_BLOCK_HEADER_SIZE (2 * sizeof(uint32_t))
+
+typedef struct _itm_header
+{
+    uint32_t magic; /* ITM_MAGIC, or ITM_SORTED_MAGIC for a sorted run */
+    uint32_t checksum; /* FNV-1a hash of the record bytes (before compression) */
+    uint64_t record_num; /* The number of records in the file */
+    uint32_t flags; /* ITM_FLAG_COMPRESSED */
+    uint32_t reserved; /* 0 */
+    uint64_t raw_size; /* The size of the record bytes, once decompressed */
+}ITM_HEADER;
+
+/* Buffered writer of an intermediate file */
+typedef struct _itm_writer
+{
+    int fd; /* The intermediate file, positioned at offset 0 when opened */
+    uint64_t record_num; /* Records written so far */
+    uint32_t checksum; /* Running checksum of the record bytes */
+    size_t buffered; /* Bytes waiting in buffer */
+    int sorted; /* Set before itm_writer_close() when the records were written in key order */
+    int compressed; /* Whether the records are written in LZ blocks, from itm_set_compression() when opened */
+    uint64_t raw_size; /* Record bytes written so far */
+    char buffer[ITM_BUFFER_SIZE];
+    char block[ITM_BLOCK_HEADER_SIZE + LZ_BOUND(ITM_BUFFER_SIZE)]; /* The compressed block of buffer */
+}ITM_WRITER;
+
+/* Reader walking a memory-mapped intermediate file */
+typedef struct _itm_reader
+{
+    void * map; /* The whole file mapped in memory */
+    size_t map_length;
+    char * raw; /* The decompressed records of a compressed file (the file is not kept mapped) */
+    const char * pos; /* The next record */
+    const char * end;
+    uint64_t records_left;
+    int sorted; /* Whether the file is a sorted run */
+}ITM_READER;
+
+uint32_t itm_hash(const void * data, size_t len);
+int itm_compare_keys(const char * key, uint32_t key_len, const char * other, uint32_t other_len);
+
+void itm_set_compression(int compressed);
+int itm_writer_open(ITM_WRITER * writer, int fd);
+int itm_write(ITM_WRITER * writer, const void * key, uint32_t key_len, const void * value, uint32_t value_len);
+int itm_writer_close(ITM_WRITER * writer);
+
+int itm_reader_open(ITM_READER * reader, int fd);
+int itm_read(ITM_READER * reader, const char ** key, uint32_t * key_len, const char ** value, uint32_t * value_len);
+void itm_reader_close(ITM_READER * reader);
+
+int itm_stat(int fd, uint64_t * record_num, uint64_t * byte_num);
+int itm_sort(int fd_in, int fd_out);
+
+#endif
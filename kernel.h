@@ -0,0 +1,561 @@
+/* Map kernels specialized at compile time, for the map functions of usr_functions.c.
+
+   The split loops (read or scan in place, carry the unfinished line or word over to the next chunk)
+   are always-inline functions that take the per-chunk, per-line or per-word work as a function.
+   Each map function passes its own static function, so the compiler inlines a copy of the loop into
+   it with that function as a constant: the call becomes direct, is inlined in turn and optimized with
+   the loop around it, as a template instantiated per job would be. Nothing is called through a
+   pointer per word or per line.
+
+   The records are typed the same way. KERNEL_CODEC_RECORD() defines the write, decode and read functions
+   of records whose key and value each have a codec: FIXED copies a fixed-size type as is (its size is a
+   constant, checked once per record), BYTES passes the bytes of a KERNEL_BYTES through.
+   KERNEL_RECORD() is the one of a fixed-size key and value.
+
+   KERNEL_JOB() and KERNEL_STREAM_JOB() put a job together from its typed parts, and give it the
+   map, combine and reduce functions of the MAPREDUCE_SPEC signatures, the adapters the C ABI calls:
+   - KERNEL_JOB() aggregates fixed-size keys and values in a table of its own, with the job's merge
+     function inlined into the add of each record, in the map function, the combine function and the
+     reduce function, which passes each key and its value to the job's put function in key order.
+   - KERNEL_STREAM_JOB() writes the records as the job's map function emits them, and its reduce
+     function passes them to the job's put function in the order of the intermediate files.
+
+   mapreduce_emit() and the jobs of MAPREDUCE_SPEC.emit_map_func still aggregate in the framework's
+   AGG_TABLE, through their merge_func: it spills, and its memory is budgeted, by the framework.
+
+   The includer defines _GNU_SOURCE, for memrchr(). */
+
+#ifndef _KERNEL_H
+#define _KERNEL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "mapreduce.h"
+#include "arena.h"
+#include "input.h"
+#include "itm.h"
+
+#define KERNEL_INLINE static inline __attribute__((always_inline))
+
+// Called by kernel_split_chunks() with the bytes of the split, in order. @ret: 0 to go on, anything else on error.
+typedef int (*KERNEL_CHUNK_FUNC)(void * ctx, const char * buf, size_t len);
+
+// Called by kernel_split_lines() with buffers of complete lines: buf[0, len) starts at offset in the input,
+// and the next unscanned byte is buf[end] (after the newline that cut it). @ret: 0 to go on, anything else on error.
+typedef int (*KERNEL_LINES_FUNC)(void * ctx, const char * buf, size_t len, size_t end, int64_t offset);
+
+// Called by kernel_scan_words() with each word, folded to lower case. @ret: 0 on success, -1 on error.
+typedef int (*KERNEL_WORD_FUNC)(void * ctx, const char * word, size_t len);
+
+// isalnum() and tolower() of the C locale the program runs in, without the lookups in the locale tables
+KERNEL_INLINE int kernel_is_word_byte(unsigned char c) {
+    return (unsigned char)((c | 0x20) - 'a') < 26 || (unsigned char)(c - '0') < 10;
+}
+
+KERNEL_INLINE char kernel_fold_byte(unsigned char c) {
+    return (unsigned char)(c - 'A') < 26 ? c | 0x20 : c;
+}
+
+/* Pass the bytes of a split to chunk_func: at once when it is mapped, else each chunk where the input
+   reader read it. func_name names the map function in the error messages.
+   @ret: 0 on success, -1 on error.
+ */
+KERNEL_INLINE int kernel_split_chunks(DATA_SPLIT *split, KERNEL_CHUNK_FUNC chunk_func, void *ctx, const char *func_name) {
+    INPUT_READER reader;
+    const char *chunk;
+    ssize_t bytes_read = 0;
+    int ret = 0;
+
+    if (split->base) {
+        return chunk_func(ctx, split->base, split->length) != 0 ? -1 : 0;
+    }
+    if (input_reader_open(&reader, split) != SUCCESS) {
+        fprintf(stderr, "Error: Unable to read the split in %s.\n", func_name);
+        return -1;
+    }
+    while (ret == 0 && (bytes_read = input_reader_next(&reader, &chunk)) > 0) {
+        ret = chunk_func(ctx, chunk, bytes_read);
+    }
+    input_reader_close(&reader);
+
+    if (bytes_read < 0) {
+        fprintf(stderr, "Error: File read error in %s.\n", func_name);
+        return -1;
+    }
+    return ret != 0 ? -1 : 0;
+}
+
+/* Pass the lines of a split to lines_func, in buffers of complete lines.
+   @ret: 0 on success, -1 on error.
+ */
+KERNEL_INLINE int kernel_split_lines(DATA_SPLIT *split, KERNEL_LINES_FUNC lines_func, void *ctx, const char *func_name) {
+    if (split->base) {
+        // The split is mapped: scan it in place, without copying its lines
+        return lines_func(ctx, split->base, split->length, split->length, split->offset) != 0 ? -1 : 0;
+    }
+
+    // Read the split in large chunks and scan the complete lines of each; the partial last
+    // line is carried over to the next chunk, and the buffer grows for lines longer than it
+    size_t capacity = IO_BUFFER_SIZE, filled = 0;
+    char *read_buffer = io_buffer_get();
+    int pooled = 1; // Whether read_buffer is the pooled buffer, or a larger one of its own
+    int ret = 0;
+    ssize_t bytes_read = 0;
+    off_t bytes_left = split->size; // Bytes of the split not read yet
+    int64_t offset = split->offset; // Where read_buffer starts in the input
+    INPUT_READER reader;
+
+    if (read_buffer == NULL || input_reader_open(&reader, split) != SUCCESS) {
+        fprintf(stderr, "Error: Unable to read the split in %s.\n", func_name);
+        io_buffer_put(read_buffer);
+        return -1;
+    }
+    while (ret == 0 && bytes_left > 0) {
+        if (filled == capacity) {
+            char *grown = malloc(capacity * 2);
+            if (grown == NULL) {
+                fprintf(stderr, "Error: Memory allocation failed in %s.\n", func_name);
+                ret = -1;
+                break;
+            }
+            memcpy(grown, read_buffer, filled);
+            if (pooled) {
+                io_buffer_put(read_buffer);
+            } else {
+                free(read_buffer);
+            }
+            read_buffer = grown;
+            pooled = 0;
+            capacity *= 2;
+        }
+        size_t want = capacity - filled;
+        if ((off_t)want > bytes_left) {
+            want = bytes_left;
+        }
+        if ((bytes_read = input_reader_read(&reader, read_buffer + filled, want)) <= 0) {
+            break;
+        }
+        bytes_left -= bytes_read;
+        filled += bytes_read;
+
+        char *last_newline = memrchr(read_buffer, '\n', filled);
+        if (last_newline != NULL) {
+            size_t complete = last_newline - read_buffer;
+            ret = lines_func(ctx, read_buffer, complete, complete + 1, offset);
+            offset += complete + 1;
+            filled -= complete + 1;
+            memmove(read_buffer, last_newline + 1, filled);
+        }
+    }
+
+    input_reader_close(&reader);
+
+    // Check for errors during file reading
+    if (bytes_read < 0) {
+        fprintf(stderr, "Error: File read error in %s.\n", func_name);
+        ret = -1;
+    }
+    // The last line of the input may have no newline
+    if (ret == 0 && filled > 0) {
+        ret = lines_func(ctx, read_buffer, filled, filled, offset);
+    }
+    if (pooled) {
+        io_buffer_put(read_buffer);
+    } else {
+        free(read_buffer);
+    }
+    return ret != 0 ? -1 : 0;
+}
+
+/* Pass the words (runs of letters and digits) of buf[0, len) to word_func, folded to lower case and cut
+   to their first word_max bytes. A word running into the end of the buffer is left for the next call
+   unless at_end is set.
+   @ret: The number of bytes consumed, or -1 on error.
+ */
+KERNEL_INLINE ssize_t kernel_scan_words(const char *buf, size_t len, int at_end, size_t word_max, KERNEL_WORD_FUNC word_func, void *ctx) {
+    char word[word_max];
+    size_t idx = 0, consumed = 0;
+
+    while (idx < len) {
+        // Skip the separators
+        while (idx < len && !kernel_is_word_byte(buf[idx])) {
+            idx++;
+        }
+        consumed = idx;
+
+        size_t start = idx;
+        while (idx < len && kernel_is_word_byte(buf[idx])) {
+            idx++;
+        }
+        if (idx == start || (idx == len && !at_end)) {
+            break;
+        }
+
+        size_t word_len = idx - start < word_max ? idx - start : word_max;
+        for (size_t pos = 0; pos < word_len; pos++) {
+            word[pos] = kernel_fold_byte(buf[start + pos]);
+        }
+        if (word_func(ctx, word, word_len) != SUCCESS) {
+            return -1;
+        }
+        consumed = idx;
+    }
+    return consumed;
+}
+
+/* Pass the words of a split to word_func (see kernel_scan_words()).
+   @ret: 0 on success, -1 on error.
+ */
+KERNEL_INLINE int kernel_split_words(DATA_SPLIT *split, size_t word_max, KERNEL_WORD_FUNC word_func, void *ctx, const char *func_name) {
+    if (!split || split->fd < 0) {
+        fprintf(stderr, "Error: Invalid input structure or file descriptor in %s.\n", func_name);
+        return -1;
+    }
+
+    if (split->base) {
+        // The split is mapped: scan it in place
+        return kernel_scan_words(split->base, split->length, 1, word_max, word_func, ctx) < 0 ? -1 : 0;
+    }
+
+    // Read the split in chunks; the unfinished word at the end of a chunk is moved to the front of the next one
+    char *read_buffer = io_buffer_get();
+    size_t filled = 0;
+    off_t bytes_left = split->size; // Bytes of the split not read yet
+    ssize_t bytes_read = 0, consumed = 0;
+    INPUT_READER reader;
+
+    if (read_buffer == NULL || input_reader_open(&reader, split) != SUCCESS) {
+        fprintf(stderr, "Error: Unable to read the split in %s.\n", func_name);
+        io_buffer_put(read_buffer);
+        return -1;
+    }
+    while (bytes_left > 0) {
+        size_t want = IO_BUFFER_SIZE - filled;
+        if ((off_t)want > bytes_left) {
+            want = bytes_left;
+        }
+        if ((bytes_read = input_reader_read(&reader, read_buffer + filled, want)) <= 0) {
+            break;
+        }
+        bytes_left -= bytes_read;
+        filled += bytes_read;
+
+        consumed = kernel_scan_words(read_buffer, filled, bytes_left == 0, word_max, word_func, ctx);
+        if (consumed == 0 && filled == IO_BUFFER_SIZE) {
+            consumed = kernel_scan_words(read_buffer, filled, 1, word_max, word_func, ctx); // One word fills the buffer: cut it
+        }
+        if (consumed < 0) {
+            break;
+        }
+        filled -= consumed;
+        memmove(read_buffer, read_buffer + consumed, filled);
+    }
+    input_reader_close(&reader);
+
+    if (bytes_read < 0) {
+        fprintf(stderr, "Error: File read error in %s.\n", func_name);
+    }
+    if (bytes_read >= 0 && consumed >= 0 && filled > 0) {
+        consumed = kernel_scan_words(read_buffer, filled, 1, word_max, word_func, ctx);
+    }
+    io_buffer_put(read_buffer);
+    return (bytes_read < 0 || consumed < 0) ? -1 : 0;
+}
+
+/* A key or value of the BYTES codec: its bytes are not copied */
+typedef struct _kernel_bytes
+{
+    const void * data;
+    uint32_t len;
+}KERNEL_BYTES;
+
+// The codecs of KERNEL_CODEC_RECORD(): the bytes of v, their size, and the load of v from len bytes at data
+// if they are the size of a v (1), else nothing (0)
+#define KERNEL_FIXED_DATA(v) ((const void *)&(v))
+#define KERNEL_FIXED_LEN(v) ((uint32_t)sizeof(v))
+#define KERNEL_FIXED_LOAD(v, data, len) ((len) == sizeof(v) ? (memcpy(&(v), (data), sizeof(v)), 1) : 0)
+#define KERNEL_BYTES_DATA(v) ((v).data)
+#define KERNEL_BYTES_LEN(v) ((v).len)
+#define KERNEL_BYTES_LOAD(v, bytes, length) ((v).data = (bytes), (v).len = (length), 1)
+
+// FNV-1a of a fixed-size key, unrolled by the compiler
+KERNEL_INLINE uint64_t kernel_hash(const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (size_t idx = 0; idx < len; idx++) {
+        hash = (hash ^ bytes[idx]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Define the functions of records of a key_type key and a value_type value, with the codecs key_codec
+   and value_codec (FIXED or BYTES):
+   - name_write(writer, key, value) writes a record (0 on success, -1 on error);
+   - name_decode(key_data, key_len, value_data, value_len, &key, &value) loads a record read with
+     itm_read() (1), or returns 0 if it is not of these sizes;
+   - name_read(reader, &key, &value) reads the next record of these sizes, skipping the others (1 if a
+     record was read, 0 at the end of the file, -1 if the file is corrupted). */
+#define KERNEL_CODEC_RECORD(name, key_type, key_codec, value_type, value_codec) \
+    KERNEL_INLINE int name##_write(ITM_WRITER *writer, key_type key, value_type value) { \
+        return itm_write(writer, KERNEL_##key_codec##_DATA(key), KERNEL_##key_codec##_LEN(key), \
+                         KERNEL_##value_codec##_DATA(value), KERNEL_##value_codec##_LEN(value)); \
+    } \
+    KERNEL_INLINE int name##_decode(const char *key_data, uint32_t key_len, const char *value_data, uint32_t value_len, \
+                                    key_type *key, value_type *value) { \
+        return KERNEL_##key_codec##_LOAD(*key, key_data, key_len) && KERNEL_##value_codec##_LOAD(*value, value_data, value_len); \
+    } \
+    KERNEL_INLINE int name##_read(ITM_READER *reader, key_type *key, value_type *value) { \
+        const char *key_data, *value_data; \
+        uint32_t key_len, value_len; \
+        int ret; \
+        while ((ret = itm_read(reader, &key_data, &key_len, &value_data, &value_len)) > 0) { \
+            if (name##_decode(key_data, key_len, value_data, value_len, key, value)) { \
+                return 1; \
+            } \
+        } \
+        return ret; \
+    }
+
+// The records of a fixed-size key_type key and value_type value
+#define KERNEL_RECORD(name, key_type, value_type) KERNEL_CODEC_RECORD(name, key_type, FIXED, value_type, FIXED)
+
+// Pass each intermediate file of p_fd_in[0, fd_in_num) to func(reader, ctx), and report the file that failed under job_name
+KERNEL_INLINE int kernel_each_input(int *p_fd_in, int fd_in_num, int (*func)(ITM_READER *reader, void *ctx), void *ctx, const char *job_name) {
+    if (!p_fd_in || fd_in_num <= 0) {
+        fprintf(stderr, "Error: Invalid input file descriptors or count in %s.\n", job_name);
+        return -1;
+    }
+    for (int fd_idx = 0; fd_idx < fd_in_num; fd_idx++) {
+        ITM_READER reader;
+        int ret;
+
+        if (itm_reader_open(&reader, p_fd_in[fd_idx]) != SUCCESS) {
+            fprintf(stderr, "Error: Intermediate file %d is missing or corrupted (%s).\n", fd_idx, job_name);
+            return -1;
+        }
+        ret = func(&reader, ctx);
+        itm_reader_close(&reader);
+        if (ret < 0) {
+            fprintf(stderr, "Error: Intermediate file %d is corrupted, or its records could not be used (%s).\n", fd_idx, job_name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Open a buffered stream on the result file fd_out, with a pooled buffer that kernel_close_output() gives back
+KERNEL_INLINE FILE *kernel_open_output(int fd_out, char **output_buffer) {
+    FILE *output = fdopen(dup(fd_out), "w");
+
+    *output_buffer = output != NULL ? io_buffer_get() : NULL;
+    if (*output_buffer != NULL) {
+        setvbuf(output, *output_buffer, _IOFBF, IO_BUFFER_SIZE);
+    }
+    return output;
+}
+
+// Flush and close output; fd_out stays open. @ret: 0 on success, -1 on a write error.
+KERNEL_INLINE int kernel_close_output(FILE *output, char *output_buffer) {
+    int ret = fclose(output) == 0 ? 0 : -1;
+
+    io_buffer_put(output_buffer);
+    return ret;
+}
+
+/* Define an aggregating job of fixed-size key_type keys and value_type values (compared and hashed by
+   their bytes, so without padding), whose parts are static functions of the includer:
+   - map(DATA_SPLIT *split, struct name_table *table): adds the records of the split with name_add();
+   - merge(value_type *value, value_type other): merges other into the value of its key;
+   - put(FILE *output, key_type key, value_type value): writes a key and its value to the result file.
+   It defines struct name_table and name_add(table, key, value), with merge inlined, name_gather(p_fd_in,
+   fd_in_num, table), which adds the records of intermediate files, and the adapters of MAPREDUCE_SPEC:
+   name_map(split, fd_out), name_combine(p_fd_in, fd_in_num, fd_out) and name_reduce(p_fd_in, fd_in_num, fd_out).
+   All of them return 0 on success, -1 on error. */
+#define KERNEL_JOB(name, key_type, value_type, map, merge, put) \
+    KERNEL_RECORD(name##_record, key_type, value_type) \
+    struct name##_entry { key_type key; value_type value; }; \
+    struct name##_table { \
+        struct name##_entry *entries; /* In the order the keys were added, entry_capacity of them */ \
+        int32_t *slots; /* [slot_num], the open-addressing index of entries, -1 when empty */ \
+        size_t entry_num, entry_capacity, slot_num; \
+    }; \
+    static int map(DATA_SPLIT *split, struct name##_table *table); \
+    /* Double the slots (64 at first), rehashed, and grow the entries to half of them */ \
+    static inline int name##_grow(struct name##_table *table) { \
+        size_t slot_num = table->slot_num > 0 ? table->slot_num * 2 : 64, idx; \
+        int32_t *slots = malloc(slot_num * sizeof(int32_t)); \
+        struct name##_entry *entries = realloc(table->entries, slot_num / 2 * sizeof(struct name##_entry)); \
+        if (entries != NULL) { \
+            table->entries = entries; \
+            table->entry_capacity = slot_num / 2; \
+        } \
+        if (slots == NULL || entries == NULL || slot_num / 2 > INT32_MAX) { \
+            free(slots); \
+            return -1; \
+        } \
+        memset(slots, 0xff, slot_num * sizeof(int32_t)); \
+        for (idx = 0; idx < table->entry_num; idx++) { \
+            size_t slot = kernel_hash(&entries[idx].key, sizeof(key_type)) & (slot_num - 1); \
+            while (slots[slot] >= 0) { \
+                slot = (slot + 1) & (slot_num - 1); \
+            } \
+            slots[slot] = (int32_t)idx; \
+        } \
+        free(table->slots); \
+        table->slots = slots; \
+        table->slot_num = slot_num; \
+        return 0; \
+    } \
+    KERNEL_INLINE int name##_add(struct name##_table *table, key_type key, value_type value) { \
+        if (table->entry_num == table->entry_capacity && name##_grow(table) != 0) { \
+            return -1; \
+        } \
+        size_t mask = table->slot_num - 1, slot = kernel_hash(&key, sizeof(key)) & mask; \
+        int32_t idx; \
+        while ((idx = table->slots[slot]) >= 0) { \
+            if (memcmp(&table->entries[idx].key, &key, sizeof(key)) == 0) { \
+                merge(&table->entries[idx].value, value); \
+                return 0; \
+            } \
+            slot = (slot + 1) & mask; \
+        } \
+        table->slots[slot] = (int32_t)table->entry_num; \
+        table->entries[table->entry_num].key = key; \
+        table->entries[table->entry_num].value = value; \
+        table->entry_num++; \
+        return 0; \
+    } \
+    static inline void name##_clear(struct name##_table *table) { \
+        free(table->entries); \
+        free(table->slots); \
+        memset(table, 0, sizeof(*table)); \
+    } \
+    static inline int name##_compare(const void *a, const void *b) { \
+        return memcmp(&((const struct name##_entry *)a)->key, &((const struct name##_entry *)b)->key, sizeof(key_type)); \
+    } \
+    static inline int name##_add_records(ITM_READER *reader, void *table) { \
+        key_type key; \
+        value_type value; \
+        int ret; \
+        while ((ret = name##_record_read(reader, &key, &value)) > 0) { \
+            if (name##_add(table, key, value) != 0) { \
+                return -1; \
+            } \
+        } \
+        return ret; \
+    } \
+    KERNEL_INLINE int name##_gather(int *p_fd_in, int fd_in_num, struct name##_table *table) { \
+        return kernel_each_input(p_fd_in, fd_in_num, name##_add_records, table, #name); \
+    } \
+    /* Write the records of the table, in key order, to fd_out */ \
+    static inline int name##_write_table(struct name##_table *table, int fd_out) { \
+        ITM_WRITER writer; \
+        size_t idx; \
+        qsort(table->entries, table->entry_num, sizeof(struct name##_entry), name##_compare); \
+        itm_writer_open(&writer, fd_out); \
+        for (idx = 0; idx < table->entry_num; idx++) { \
+            if (name##_record_write(&writer, table->entries[idx].key, table->entries[idx].value) != SUCCESS) { \
+                return -1; \
+            } \
+        } \
+        return itm_writer_close(&writer) == SUCCESS ? 0 : -1; \
+    } \
+    KERNEL_INLINE int name##_map(DATA_SPLIT *split, int fd_out) { \
+        struct name##_table table = {0}; \
+        int ret = map(split, &table); \
+        if (ret == 0 && (ret = name##_write_table(&table, fd_out)) != 0) { \
+            perror("Error writing to intermediate file in " #name "_map"); \
+        } \
+        name##_clear(&table); \
+        return ret != 0 ? -1 : 0; \
+    } \
+    KERNEL_INLINE int name##_combine(int *p_fd_in, int fd_in_num, int fd_out) { \
+        struct name##_table table = {0}; \
+        int ret = name##_gather(p_fd_in, fd_in_num, &table); \
+        if (ret == 0 && (ret = name##_write_table(&table, fd_out)) != 0) { \
+            perror("Error writing to intermediate file in " #name "_combine"); \
+        } \
+        name##_clear(&table); \
+        return ret; \
+    } \
+    KERNEL_INLINE int name##_reduce(int *p_fd_in, int fd_in_num, int fd_out) { \
+        struct name##_table table = {0}; \
+        char *output_buffer; \
+        FILE *output; \
+        size_t idx; \
+        int ret = name##_gather(p_fd_in, fd_in_num, &table); \
+        if (ret == 0 && (output = kernel_open_output(fd_out, &output_buffer)) == NULL) { \
+            ret = -1; \
+        } else if (ret == 0) { \
+            qsort(table.entries, table.entry_num, sizeof(struct name##_entry), name##_compare); \
+            for (idx = 0; ret == 0 && idx < table.entry_num; idx++) { \
+                ret = put(output, table.entries[idx].key, table.entries[idx].value); \
+            } \
+            if (kernel_close_output(output, output_buffer) != 0) { \
+                ret = -1; \
+            } \
+        } \
+        if (ret != 0) { \
+            perror("Error writing the result file in " #name "_reduce"); \
+        } \
+        name##_clear(&table); \
+        return ret != 0 ? -1 : 0; \
+    }
+
+/* Define a job whose records go from its map function to its reduce function as they are, in order, with
+   a key_type key and a value_type value of the codecs key_codec and value_codec. Its parts are static
+   functions of the includer:
+   - map(DATA_SPLIT *split, ITM_WRITER *writer): writes the records of the split with name_record_write();
+   - put(FILE *output, key_type key, value_type value): writes a record to the result file.
+   It defines name_record_write(), name_record_decode() and name_record_read(), and the adapters of
+   MAPREDUCE_SPEC name_map(split, fd_out) and name_reduce(p_fd_in, fd_in_num, fd_out) (0 on success,
+   -1 on error). */
+#define KERNEL_STREAM_JOB(name, key_type, key_codec, value_type, value_codec, map, put) \
+    KERNEL_CODEC_RECORD(name##_record, key_type, key_codec, value_type, value_codec) \
+    static int map(DATA_SPLIT *split, ITM_WRITER *writer); \
+    KERNEL_INLINE int name##_map(DATA_SPLIT *split, int fd_out) { \
+        ITM_WRITER writer; \
+        itm_writer_open(&writer, fd_out); \
+        if (map(split, &writer) != 0) { \
+            return -1; \
+        } \
+        if (itm_writer_close(&writer) != SUCCESS) { \
+            perror("Error writing to intermediate file in " #name "_map"); \
+            return -1; \
+        } \
+        return 0; \
+    } \
+    static inline int name##_put_records(ITM_READER *reader, void *output) { \
+        key_type key; \
+        value_type value; \
+        int ret; \
+        while ((ret = name##_record_read(reader, &key, &value)) > 0) { \
+            if (put(output, key, value) != 0) { \
+                return -1; \
+            } \
+        } \
+        return ret; \
+    } \
+    KERNEL_INLINE int name##_reduce(int *p_fd_in, int fd_in_num, int fd_out) { \
+        char *output_buffer; \
+        FILE *output = kernel_open_output(fd_out, &output_buffer); \
+        int ret; \
+        if (output == NULL) { \
+            perror("Error opening the result file in " #name "_reduce"); \
+            return -1; \
+        } \
+        ret = kernel_each_input(p_fd_in, fd_in_num, name##_put_records, output, #name); \
+        if (kernel_close_output(output, output_buffer) != 0) { \
+            perror("Error writing the result file in " #name "_reduce"); \
+            ret = -1; \
+        } \
+        return ret; \
+    }
+
+#endif
@@ -0,0 +1,173 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "common.h"
+#include "lz.h"
+
+#define LZ_LAST_LITERALS 5 /* A block ends with at least this many literals */
+#define LZ_MATCH_START_LIMIT 12 /* No match starts in the last bytes of a block */
+#define LZ_MAX_OFFSET 65535
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t hash32(uint32_t value) {
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// The bytes of the length extension of len beyond the 15 of its nibble
+static size_t length_bytes(size_t len) {
+    return len >= 15 ? (len - 15) / 255 + 1 : 0;
+}
+
+static unsigned char *write_length(unsigned char *op, size_t len) {
+    for (len -= 15; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/* Compress src[0, src_len) into dst[0, dst_cap).
+   @ret: The compressed size, or 0 if it does not fit in dst_cap bytes (LZ_BOUND(src_len) always fits).
+ */
+size_t lz_compress(const char *src, size_t src_len, char *dst, size_t dst_cap) {
+    uint32_t table[1 << LZ_HASH_BITS]; // The last position of each hashed 4-byte prefix
+    const unsigned char *base = (const unsigned char *)src, *end = base + src_len;
+    const unsigned char *ip = base, *anchor = base;
+    unsigned char *op = (unsigned char *)dst, *op_end = op + dst_cap;
+    size_t literal_len;
+
+    memset(table, 0, sizeof(table));
+    if (src_len > LZ_MATCH_START_LIMIT) {
+        const unsigned char *match_start_limit = end - LZ_MATCH_START_LIMIT, *match_end_limit = end - LZ_LAST_LITERALS;
+
+        ip++;
+        while (ip < match_start_limit) {
+            uint32_t sequence = read32(ip);
+            uint32_t *slot = &table[hash32(sequence)];
+            const unsigned char *ref = base + *slot;
+
+            *slot = ip - base;
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != sequence) {
+                ip += 1 + ((ip - anchor) >> 6); // Skip faster through data that does not compress
+                continue;
+            }
+
+            // Extend the match backwards over the pending literals, then forwards
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            uint32_t offset = ip - ref;
+            const unsigned char *match_end = ip + LZ_MIN_MATCH;
+            while (match_end < match_end_limit && *match_end == match_end[-(ptrdiff_t)offset]) {
+                match_end++;
+            }
+
+            size_t match_len = match_end - ip - LZ_MIN_MATCH;
+            literal_len = ip - anchor;
+            if ((size_t)(op_end - op) < 1 + length_bytes(literal_len) + literal_len + 2 + length_bytes(match_len)) {
+                return 0;
+            }
+            unsigned char *token = op++;
+            *token = (literal_len < 15 ? literal_len : 15) << 4 | (match_len < 15 ? match_len : 15);
+            if (literal_len >= 15) {
+                op = write_length(op, literal_len);
+            }
+            memcpy(op, anchor, literal_len);
+            op += literal_len;
+            *op++ = offset & 0xff;
+            *op++ = offset >> 8;
+            if (match_len >= 15) {
+                op = write_length(op, match_len);
+            }
+
+            ip = anchor = match_end;
+            if (ip < match_start_limit) {
+                table[hash32(read32(ip - 2))] = ip - 2 - base;
+            }
+        }
+    }
+
+    // The last literals
+    literal_len = end - anchor;
+    if ((size_t)(op_end - op) < 1 + length_bytes(literal_len) + literal_len) {
+        return 0;
+    }
+    *op++ = (literal_len < 15 ? literal_len : 15) << 4;
+    if (literal_len >= 15) {
+        op = write_length(op, literal_len);
+    }
+    memcpy(op, anchor, literal_len);
+    op += literal_len;
+    return op - (unsigned char *)dst;
+}
+
+// Read a length extension; returns NULL if it runs past end
+static const unsigned char *read_length(const unsigned char *ip, const unsigned char *end, size_t *len) {
+    unsigned char byte;
+    do {
+        if (ip >= end) {
+            return NULL;
+        }
+        byte = *ip++;
+        *len += byte;
+    } while (byte == 255);
+    return ip;
+}
+
+/* Decompress the block src[0, src_len) into exactly dst_len bytes at dst.
+   @ret: 0 on success, -1 if the block is corrupted or does not decompress to dst_len bytes.
+ */
+int lz_decompress(const char *src, size_t src_len, char *dst, size_t dst_len) {
+    const unsigned char *ip = (const unsigned char *)src, *ip_end = ip + src_len;
+    unsigned char *op = (unsigned char *)dst, *op_end = op + dst_len;
+
+    while (ip < ip_end) {
+        unsigned token = *ip++;
+        size_t literal_len = token >> 4, match_len = token & 15;
+
+        if (literal_len == 15 && (ip = read_length(ip, ip_end, &literal_len)) == NULL) {
+            return ERROR;
+        }
+        if (literal_len > (size_t)(ip_end - ip) || literal_len > (size_t)(op_end - op)) {
+            return ERROR;
+        }
+        memcpy(op, ip, literal_len);
+        op += literal_len;
+        ip += literal_len;
+        if (ip == ip_end) {
+            break; // The last sequence has no match
+        }
+
+        if (ip_end - ip < 2) {
+            return ERROR;
+        }
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (match_len == 15 && (ip = read_length(ip, ip_end, &match_len)) == NULL) {
+            return ERROR;
+        }
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - (unsigned char *)dst) || match_len > (size_t)(op_end - op)) {
+            return ERROR;
+        }
+
+        // An offset shorter than the match repeats the last offset bytes
+        const unsigned char *ref = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, ref, match_len);
+            op += match_len;
+        } else {
+            while (match_len-- > 0) {
+                *op++ = *ref++;
+            }
+        }
+    }
+    return op == op_end ? SUCCESS : ERROR;
+}
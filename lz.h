@@ -0,0 +1,21 @@
+/* A fast LZ77 block codec in the LZ4 block format, for the compressed intermediate files.
+
+   A block is a sequence of (literals, match) pairs: a token byte with the literal length in its
+   high nibble and the match length minus LZ_MIN_MATCH in its low nibble (15 meaning that more
+   length bytes follow, each adding up to 255), the literals, then a 2-byte little-endian match
+   offset. The last sequence has literals only. Matches are found with a single-entry hash table
+   of 4-byte prefixes, which favours speed over ratio. */
+
+#ifndef _LZ_H
+#define _LZ_H
+
+#include <stddef.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12 /* The compressor's hash table has 1 << LZ_HASH_BITS entries */
+#define LZ_BOUND(len) ((len) + (len) / 255 + 16) /* The largest compressed size of len bytes */
+
+size_t lz_compress(const char * src, size_t src_len, char * dst, size_t dst_cap);
+int lz_decompress(const char * src, size_t src_len, char * dst, size_t dst_len);
+
+#endif
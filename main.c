@@ -4,9 +4,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
 
 #include "mapreduce.h"
 #include "usr_functions.h"
+#include "sketch.h"
+#include "server.h"
+#include "result.h"
+#include "inverted.h"
 
 int str_is_decimal_num(char * str)
 {
@@ -53,98 +61,814 @@ int is_regular_file(char * file_path)
 
 void print_usage(char * cmd_name)
 {
-    printf("Usage: %s \"counter\"|\"finder\" file_path split_num [word_to_find]\n", cmd_name);
+    printf("Usage: %s [options] \"counter\"|\"finder\"|\"wordcount\"|\"topk\"|\"distinct\"|\"index\" file_path split_num [word_to_find ...]\n", cmd_name);
+    printf("       %s --serve=SOCKET [--runners=N]\n", cmd_name);
+    printf("       %s --connect=SOCKET [options] \"counter\"|\"finder\"|\"wordcount\"|\"topk\"|\"distinct\"|\"index\" file_path split_num [word_to_find ...]\n", cmd_name);
+    printf("Options:\n");
+    printf("  --split-mode=files|range|mmap|stream\n");
+    printf("                             write split-N files (default), let map workers read byte ranges of the input,\n");
+    printf("                             let map workers scan their byte ranges mapped in memory, or read the input as a\n");
+    printf("                             stream (a pipe, a FIFO or a Unix-domain socket) with split_num map workers taking\n");
+    printf("                             its chunks; a file_path of - is the standard input, and implies stream\n");
+    printf("  --chunk-size=BYTES         the size of the chunks of a stream (default %d)\n", MR_STREAM_CHUNK_SIZE);
+    printf("  --combine                  run the task's combine function in the map workers (counter, topk and distinct only)\n");
+    printf("  --reduce-num=R             partition the intermediate data over R concurrent reduce workers (default 1)\n");
+    printf("  --engine=fork|threads      run workers as forked processes (default), or on a thread pool with in-memory intermediate data\n");
+    printf("  --transport=files|memory   keep the intermediate data of forked workers in mr-*.itm files (default), or in memory files\n");
+    printf("  --cluster=HOST:PORT        coordinate workers on other hosts, which connect over TCP (the input must be on shared storage)\n");
+    printf("  --cluster-worker=HOST:PORT run the tasks of the coordinator at HOST:PORT, for the same task and input\n");
+    printf("  --worker-num=W             run at most W map (and reduce) workers at once; idle workers steal remaining splits\n");
+    printf("  --stream-reduce            merge intermediate files in running reducers as map tasks finish (counter, topk and distinct only)\n");
+    printf("  --emit-buffer=BYTES        the aggregation buffer budget of each map worker (wordcount only, default %d)\n", MR_EMIT_BUFFER_SIZE);
+    printf("  --io=read|direct|uring|auto\n");
+    printf("                             how map workers read unmapped splits: read() (default), O_DIRECT, io_uring with reads\n");
+    printf("                             in flight, or io_uring for large splits only; unavailable backends fall back to read()\n");
+    printf("  --compress                 write the intermediate files in LZ-compressed blocks\n");
+    printf("  --attempts=N               run a failed task, or the task of a worker that died, up to N times in all (default %d)\n", MR_TASK_ATTEMPTS);
+    printf("  --speculate                back up the slowest map tasks near the end of the map phase (fork engine, files transport)\n");
+    printf("  --pin-workers              pin the workers round-robin to the CPUs and their NUMA nodes; reducers move near their input\n");
+    printf("  --result-format=text|binary\n");
+    printf("                             write the results as text (default), or (counter and finder only) as a table of\n");
+    printf("                             64-bit counts, or as the matching lines with their offsets and line numbers and\n");
+    printf("                             a sidecar index of the words, mr.rst" RESULT_INDEX_SUFFIX " (see result.h)\n");
+    printf("  --index[=FILE]             index: write the inverted index of the input to FILE (default %s); finder: look\n", INVERTED_DEFAULT_FILE);
+    printf("                             the words up in that index instead of scanning the input (see inverted.h)\n");
+    printf("  --trace=FILE               write a Chrome trace of the phases, forks, waits, tasks and reads and writes of the\n");
+    printf("                             workers to FILE, to open in Perfetto or chrome://tracing (see trace.h)\n");
+    printf("  --memory-budget=BYTES      run only as many tasks at once as BYTES holds, and spill the worker buffers to\n");
+    printf("                             temporary files in the working directory (not with --stream-reduce or --compress)\n");
+    printf("  --max-inflight=N           run at most N map (and reduce) tasks at once (not with --stream-reduce)\n");
+    printf("  --top=K                    the number of words reported by topk, at most %d (default %d)\n", SKETCH_TOPK_MAX, TOP_WORDS_DEFAULT);
+    printf("  --cache=DIR                reuse the intermediate files of splits mapped before, kept in DIR (not with --cluster)\n");
+    printf("  --stats-json=FILE          write the phase timings and the per-task and per-worker counters to FILE as JSON\n");
+    printf("--serve runs N (default: one per CPU) pre-forked job runners on the Unix-domain socket SOCKET until SIGINT or\n");
+    printf("SIGTERM; --connect runs the job on such a server, in the current directory, instead of in this process.\n");
 }
 
+void write_task_stats_json(FILE * out, const char * name, const MAPREDUCE_TASK_STATS * stats, int num)
+{
+    int i;
 
-int main(int argc, char * argv[])
+    fprintf(out, "  \"%s\": [", name);
+    for (i = 0; i < num; i++)
+    {
+        fprintf(out, "%s\n    {\"task\": %d, \"worker_id\": %d, \"status\": %d, \"start_ns\": %lld, \"wall_ns\": %lld, "
+                "\"cpu_ns\": %lld, \"bytes_read\": %lld, \"bytes_written\": %lld, \"records\": %lld, \"spills\": %lld, \"attempts\": %d, \"cached\": %d, \"node\": %d}",
+                i ? "," : "", i, stats[i].worker_id, stats[i].status, (long long)stats[i].start_ns, (long long)stats[i].wall_ns,
+                (long long)stats[i].cpu_ns, (long long)stats[i].bytes_read, (long long)stats[i].bytes_written,
+                (long long)stats[i].records, (long long)stats[i].spills, stats[i].attempts, stats[i].cached, stats[i].node);
+    }
+    fprintf(out, "\n  ],\n");
+}
+
+void write_worker_stats_json(FILE * out, const char * name, const MAPREDUCE_WORKER_STATS * stats, int num, int is_last)
+{
+    int i;
+
+    fprintf(out, "  \"%s\": [", name);
+    for (i = 0; i < num; i++)
+    {
+        fprintf(out, "%s\n    {\"worker_id\": %d, \"task_num\": %d, \"start_ns\": %lld, \"wall_ns\": %lld, "
+                "\"user_ns\": %lld, \"sys_ns\": %lld, \"max_rss_kb\": %ld}",
+                i ? "," : "", stats[i].worker_id, stats[i].task_num, (long long)stats[i].start_ns,
+                (long long)stats[i].wall_ns, (long long)stats[i].user_ns, (long long)stats[i].sys_ns, stats[i].max_rss_kb);
+    }
+    fprintf(out, "\n  ]%s\n", is_last ? "" : ",");
+}
+
+/* Write the timings and counters of a mapreduce() call as one JSON object */
+int write_stats_json(char * file_path, char * task_name, MAPREDUCE_SPEC * spec, MAPREDUCE_RESULT * result)
+{
+    FILE * out = fopen(file_path, "w");
+
+    if (NULL == out)
+    {
+        return 0;
+    }
+    fprintf(out, "{\n  \"task\": \"%s\",\n  \"split_num\": %d,\n  \"reduce_num\": %d,\n", task_name, spec->split_num, spec->reduce_num);
+    fprintf(out, "  \"engine\": \"%s\",\n", spec->engine == ENGINE_THREADS ? "threads" : spec->engine == ENGINE_CLUSTER ? "cluster" : "fork");
+    fprintf(out, "  \"phases\": {\"total_ns\": %lld, \"split_ns\": %lld, \"map_spawn_ns\": %lld, \"map_ns\": %lld, "
+            "\"reduce_spawn_ns\": %lld, \"reduce_ns\": %lld},\n",
+            (long long)result->total_ns, (long long)result->split_ns, (long long)result->map_spawn_ns,
+            (long long)result->map_ns, (long long)result->reduce_spawn_ns, (long long)result->reduce_ns);
+    write_task_stats_json(out, "map_tasks", result->map_task_stats, spec->split_num);
+    write_task_stats_json(out, "reduce_tasks", result->reduce_task_stats, spec->reduce_num);
+    write_worker_stats_json(out, "map_workers", result->map_worker_stats, result->map_worker_num, 0);
+    write_worker_stats_json(out, "reduce_workers", result->reduce_worker_stats, result->reduce_worker_num, 1);
+    fprintf(out, "}\n");
+
+    return 0 == fclose(out);
+}
+
+/* Write the sidecar index of each binary finder result file; returns whether all were written */
+int write_result_indexes(int reduce_num, const char * const * words, int word_num)
 {
-    int i = 0, is_letter_counter = 0;
+    char path[64];
+    int part;
+
+    for (part = 0; part < reduce_num; part++)
+    {
+        if (reduce_num == 1)
+        {
+            snprintf(path, sizeof(path), "%s", MR_RESULT_FILE);
+        }
+        else
+        {
+            snprintf(path, sizeof(path), MR_RESULT_PART_FILE_FMT, part);
+        }
+        if (result_write_index(path, words, word_num) != 0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+enum
+{
+    OPT_SPLIT_MODE = 256,
+    OPT_COMBINE,
+    OPT_REDUCE_NUM,
+    OPT_ENGINE,
+    OPT_TRANSPORT,
+    OPT_CLUSTER,
+    OPT_CLUSTER_WORKER,
+    OPT_WORKER_NUM,
+    OPT_STREAM_REDUCE,
+    OPT_STATS_JSON,
+    OPT_EMIT_BUFFER,
+    OPT_IO,
+    OPT_COMPRESS,
+    OPT_ATTEMPTS,
+    OPT_SPECULATE,
+    OPT_CACHE,
+    OPT_TOP,
+    OPT_PIN_WORKERS,
+    OPT_CHUNK_SIZE,
+    OPT_RESULT_FORMAT,
+    OPT_INDEX,
+    OPT_TRACE,
+    OPT_MEMORY_BUDGET,
+    OPT_MAX_INFLIGHT
+};
+
+static struct option long_options[] =
+{
+    {"split-mode", required_argument, NULL, OPT_SPLIT_MODE},
+    {"combine", no_argument, NULL, OPT_COMBINE},
+    {"reduce-num", required_argument, NULL, OPT_REDUCE_NUM},
+    {"engine", required_argument, NULL, OPT_ENGINE},
+    {"transport", required_argument, NULL, OPT_TRANSPORT},
+    {"cluster", required_argument, NULL, OPT_CLUSTER},
+    {"cluster-worker", required_argument, NULL, OPT_CLUSTER_WORKER},
+    {"worker-num", required_argument, NULL, OPT_WORKER_NUM},
+    {"stream-reduce", no_argument, NULL, OPT_STREAM_REDUCE},
+    {"stats-json", required_argument, NULL, OPT_STATS_JSON},
+    {"emit-buffer", required_argument, NULL, OPT_EMIT_BUFFER},
+    {"io", required_argument, NULL, OPT_IO},
+    {"compress", no_argument, NULL, OPT_COMPRESS},
+    {"attempts", required_argument, NULL, OPT_ATTEMPTS},
+    {"speculate", no_argument, NULL, OPT_SPECULATE},
+    {"cache", required_argument, NULL, OPT_CACHE},
+    {"top", required_argument, NULL, OPT_TOP},
+    {"pin-workers", no_argument, NULL, OPT_PIN_WORKERS},
+    {"chunk-size", required_argument, NULL, OPT_CHUNK_SIZE},
+    {"result-format", required_argument, NULL, OPT_RESULT_FORMAT},
+    {"index", optional_argument, NULL, OPT_INDEX},
+    {"trace", required_argument, NULL, OPT_TRACE},
+    {"memory-budget", required_argument, NULL, OPT_MEMORY_BUDGET},
+    {"max-inflight", required_argument, NULL, OPT_MAX_INFLIGHT},
+    {NULL, 0, NULL, 0}
+};
+
+
+/* Build the index file from the result files of an index job, and remove them; returns whether it was built */
+int build_index(char * index_path, char * input_path, int reduce_num)
+{
+    char (* paths)[64] = malloc(reduce_num * sizeof(*paths));
+    const char ** part_paths = malloc(reduce_num * sizeof(*part_paths));
+    struct stat input_stat;
+    int part, built = 0;
+
+    if (NULL != paths && NULL != part_paths)
+    {
+        for (part = 0; part < reduce_num; part++)
+        {
+            if (reduce_num == 1)
+            {
+                snprintf(paths[part], sizeof(paths[part]), "%s", MR_RESULT_FILE);
+            }
+            else
+            {
+                snprintf(paths[part], sizeof(paths[part]), MR_RESULT_PART_FILE_FMT, part);
+            }
+            part_paths[part] = paths[part];
+        }
+        // The size of the input lets a lookup tell a stale index; a stream has none
+        built = 0 == inverted_build(index_path, part_paths, reduce_num,
+                                    (0 == stat(input_path, &input_stat) && S_ISREG(input_stat.st_mode)) ? input_stat.st_size : 0);
+        for (part = 0; built && part < reduce_num; part++)
+        {
+            unlink(paths[part]);
+        }
+    }
+    free(paths);
+    free(part_paths);
+    return built;
+}
+
+/* Run one job described by a run-mapreduce command line (without --serve or --connect) */
+int run_job(int argc, char * argv[])
+{
+    int i = 0, is_letter_counter = 0, is_word_count = 0, is_top_words = 0, is_distinct_words = 0, use_combiner = 0, opt;
+    int top_num = TOP_WORDS_DEFAULT, binary_result = 0, is_index = 0;
+    char * cmd_name = argv[0];
+    char * index_path = NULL;
+    char * stats_path = NULL;
+    char * cache_tag = NULL;
+    int status = 0; // What the job returns: 0, or 1 or 2 on error
     
     MAPREDUCE_SPEC spec;
     MAPREDUCE_RESULT result;
+    WORD_LIST word_list;
 
     setbuf(stdout, NULL); // no bufferring for stdio
 
+    memset(&spec, 0, sizeof(spec));
+    memset(&result, 0, sizeof(result));
+
+    // options come before the positional arguments; optind = 0 starts getopt over for each job of a server
+    optind = 0;
+    while ((opt = getopt_long(argc, argv, "+", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case OPT_SPLIT_MODE:
+            if (!strcmp(optarg, "files"))
+            {
+                spec.split_mode = SPLIT_MODE_FILES;
+            }
+            else if (!strcmp(optarg, "range"))
+            {
+                spec.split_mode = SPLIT_MODE_RANGE;
+            }
+            else if (!strcmp(optarg, "mmap"))
+            {
+                spec.split_mode = SPLIT_MODE_MMAP;
+            }
+            else if (!strcmp(optarg, "stream"))
+            {
+                spec.split_mode = SPLIT_MODE_STREAM;
+            }
+            else
+            {
+                print_usage(cmd_name);
+                return 1;
+            }
+            break;
+        case OPT_COMBINE:
+            use_combiner = 1;
+            break;
+        case OPT_REDUCE_NUM:
+            if (!str_is_decimal_num(optarg) || atoi(optarg) < 1)
+            {
+                printf("%s is not a valid number of reduce workers.\n", optarg);
+                return 1;
+            }
+            spec.reduce_num = atoi(optarg);
+            break;
+        case OPT_WORKER_NUM:
+            if (!str_is_decimal_num(optarg) || atoi(optarg) < 1)
+            {
+                printf("%s is not a valid number of workers.\n", optarg);
+                return 1;
+            }
+            spec.worker_num = atoi(optarg);
+            break;
+        case OPT_STREAM_REDUCE:
+            spec.stream_reduce = 1;
+            use_combiner = 1; // the combine function merges the intermediate files
+            break;
+        case OPT_EMIT_BUFFER:
+            if (!str_is_decimal_num(optarg) || atol(optarg) < 1)
+            {
+                printf("%s is not a valid buffer size.\n", optarg);
+                return 1;
+            }
+            spec.emit_buffer_size = atol(optarg);
+            break;
+        case OPT_COMPRESS:
+            spec.compress_intermediate = 1;
+            break;
+        case OPT_ATTEMPTS:
+            if (!str_is_decimal_num(optarg) || atoi(optarg) < 1)
+            {
+                printf("%s is not a valid number of attempts.\n", optarg);
+                return 1;
+            }
+            spec.task_attempts = atoi(optarg);
+            break;
+        case OPT_SPECULATE:
+            spec.speculate = 1;
+            break;
+        case OPT_CACHE:
+            spec.cache_dir = optarg;
+            break;
+        case OPT_TOP:
+            if (!str_is_decimal_num(optarg) || atoi(optarg) < 1 || atoi(optarg) > SKETCH_TOPK_MAX)
+            {
+                printf("%s is not a valid number of words.\n", optarg);
+                return 1;
+            }
+            top_num = atoi(optarg);
+            break;
+        case OPT_PIN_WORKERS:
+            spec.pin_workers = 1;
+            break;
+        case OPT_RESULT_FORMAT:
+            if (!strcmp(optarg, "text") || !strcmp(optarg, "binary"))
+            {
+                binary_result = !strcmp(optarg, "binary");
+            }
+            else
+            {
+                print_usage(cmd_name);
+                return 1;
+            }
+            break;
+        case OPT_INDEX:
+            index_path = optarg != NULL ? optarg : INVERTED_DEFAULT_FILE;
+            break;
+        case OPT_TRACE:
+            spec.trace_path = optarg;
+            break;
+        case OPT_MEMORY_BUDGET:
+            if (!str_is_decimal_num(optarg) || atol(optarg) < 1)
+            {
+                printf("%s is not a valid memory budget.\n", optarg);
+                return 1;
+            }
+            spec.memory_budget = atol(optarg);
+            break;
+        case OPT_MAX_INFLIGHT:
+            if (!str_is_decimal_num(optarg) || atoi(optarg) < 1)
+            {
+                printf("%s is not a valid number of tasks.\n", optarg);
+                return 1;
+            }
+            spec.max_inflight = atoi(optarg);
+            break;
+        case OPT_CHUNK_SIZE:
+            if (!str_is_decimal_num(optarg) || atol(optarg) < 1)
+            {
+                printf("%s is not a valid chunk size.\n", optarg);
+                return 1;
+            }
+            spec.stream_chunk_size = atol(optarg);
+            break;
+        case OPT_STATS_JSON:
+            stats_path = optarg;
+            break;
+        case OPT_ENGINE:
+            if (!strcmp(optarg, "fork"))
+            {
+                spec.engine = ENGINE_FORK;
+            }
+            else if (!strcmp(optarg, "threads"))
+            {
+                spec.engine = ENGINE_THREADS;
+            }
+            else
+            {
+                print_usage(cmd_name);
+                return 1;
+            }
+            break;
+        case OPT_TRANSPORT:
+            if (!strcmp(optarg, "files"))
+            {
+                spec.transport = TRANSPORT_FILES;
+            }
+            else if (!strcmp(optarg, "memory"))
+            {
+                spec.transport = TRANSPORT_MEMORY;
+            }
+            else
+            {
+                print_usage(cmd_name);
+                return 1;
+            }
+            break;
+        case OPT_CLUSTER:
+            spec.engine = ENGINE_CLUSTER;
+            spec.cluster_address = optarg;
+            break;
+        case OPT_CLUSTER_WORKER:
+            spec.engine = ENGINE_CLUSTER;
+            spec.cluster_address = optarg;
+            spec.cluster_worker = 1;
+            break;
+        case OPT_IO:
+            if (!strcmp(optarg, "read"))
+            {
+                spec.io_backend = IO_BACKEND_READ;
+            }
+            else if (!strcmp(optarg, "direct"))
+            {
+                spec.io_backend = IO_BACKEND_DIRECT;
+            }
+            else if (!strcmp(optarg, "uring"))
+            {
+                spec.io_backend = IO_BACKEND_URING;
+            }
+            else if (!strcmp(optarg, "auto"))
+            {
+                spec.io_backend = IO_BACKEND_AUTO;
+            }
+            else
+            {
+                print_usage(cmd_name);
+                return 1;
+            }
+            break;
+        default:
+            print_usage(cmd_name);
+            return 1;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
     if (argc < 4)
     {
-        print_usage(argv[0]);
-        exit(1);
+        print_usage(cmd_name);
+        return 1;
     }
 
     /* argv[1] must be either "counter", meaning the "Letter counter" task,
-       or "finder", meaning the "Word finder" task*/
+       or "finder", meaning the "Word finder" task,
+       or "wordcount", meaning the "Word count" task,
+       or "topk" and "distinct", meaning the approximate "Top words" and "Distinct words" tasks,
+       or "index", meaning the "Index" task, which builds the inverted index that finder --index reads*/
     if (!strcmp(argv[1], "counter"))
     {
         is_letter_counter = 1;
     }
+    else if (!strcmp(argv[1], "wordcount"))
+    {
+        is_word_count = 1;
+    }
+    else if (!strcmp(argv[1], "topk"))
+    {
+        is_top_words = 1;
+    }
+    else if (!strcmp(argv[1], "distinct"))
+    {
+        is_distinct_words = 1;
+    }
+    else if (!strcmp(argv[1], "index"))
+    {
+        is_index = 1;
+    }
     else if (!strcmp(argv[1], "finder"))
     {
         is_letter_counter = 0;
         if (argc < 5) // there must be a argv[4], which is the word to find
         {
-            print_usage(argv[0]);
-            exit(1);
+            print_usage(cmd_name);
+            return 1;
         }
     }
     else
     {
-        print_usage(argv[0]);
-        exit(1);
+        print_usage(cmd_name);
+        return 1;
     }
 
-    // argv[2] is the input data file
-    if (!is_regular_file(argv[2]))
+    // argv[2] is the input data file, or the input stream
+    if (!strcmp(argv[2], MR_STREAM_INPUT))
+    {
+        spec.split_mode = SPLIT_MODE_STREAM;
+    }
+    if (spec.split_mode != SPLIT_MODE_STREAM && !is_regular_file(argv[2]))
     {
         printf("Regular file %s does not exist.\n", argv[2]);
-        exit(0);
+        return 0;
     }
 
     // argv[3] is the number of the splits
     if (!str_is_decimal_num(argv[3]))
     {
         printf("%s is not a valide split size. It should be a decimal number. \n", argv[3]);
-        exit(0);
+        return 0;
     }
 
 
     spec.input_data_filepath = argv[2]; // argv[2] is the input data file
     spec.split_num = atoi(argv[3]); // argv[3] is the number of the splits
 
+    if (binary_result && !is_letter_counter && (is_word_count || is_top_words || is_distinct_words || is_index))
+    {
+        printf("--result-format=binary is only available for the counter and finder tasks.\n");
+        return 1;
+    }
+
+    if (index_path != NULL && !is_index && (is_letter_counter || is_word_count || is_top_words || is_distinct_words))
+    {
+        printf("--index is only available for the index and finder tasks.\n");
+        return 1;
+    }
+
+    if (index_path != NULL && !is_index)
+    {
+        // finder --index: no job, the words are looked up in the index and the lines read from the input
+        int fd_out, looked_up;
+        struct timeval start, end;
+
+        if (binary_result || spec.split_mode == SPLIT_MODE_STREAM)
+        {
+            printf("finder --index writes text results, from a regular input file.\n");
+            return 1;
+        }
+        word_list.word_num = argc - 4;
+        word_list.words = &argv[4];
+        word_list.positions = 0;
+        gettimeofday(&start, NULL);
+        fd_out = open(MR_RESULT_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        looked_up = fd_out >= 0 && 0 == word_finder_index_lookup(index_path, argv[2], &word_list, fd_out);
+        if (fd_out >= 0 && 0 != close(fd_out))
+        {
+            looked_up = 0;
+        }
+        gettimeofday(&end, NULL);
+        if (!looked_up)
+        {
+            printf("Unable to look the words up in the index %s.\n", index_path);
+            return 1;
+        }
+        printf("***** RESULT ***** \n");
+        printf("Result file: %s\n", MR_RESULT_FILE);
+        printf("Index file: %s\n", index_path);
+        printf("Processing time (us): %ld\n", (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec));
+        return 0;
+    }
+
     if (is_letter_counter)
     {
         spec.map_func = letter_counter_map;
-        spec.reduce_func = letter_counter_reduce;
+        spec.reduce_func = binary_result ? letter_counter_binary_reduce : letter_counter_reduce;
+        spec.combine_func = use_combiner ? letter_counter_combine : NULL;
         spec.usr_data = NULL;
     }
+    else if (is_word_count)
+    {
+        if (use_combiner)
+        {
+            printf("--combine and --stream-reduce are not available for the wordcount task.\n");
+            return 1;
+        }
+        spec.emit_map_func = word_count_map; // records are summed in the map workers' aggregation buffers
+        spec.merge_func = word_count_merge;
+        spec.group_reduce_func = word_count_reduce; // called once per word on the merged sorted runs
+        spec.usr_data = NULL;
+    }
+    else if (is_index)
+    {
+        if (use_combiner)
+        {
+            printf("--combine and --stream-reduce are not available for the index task.\n");
+            return 1;
+        }
+        // Each map worker writes the posting lists of its split, merged per term by the group reduce function
+        spec.map_func = index_words_map;
+        spec.group_reduce_func = inverted_reduce;
+        spec.usr_data = NULL;
+        if (index_path == NULL)
+        {
+            index_path = INVERTED_DEFAULT_FILE;
+        }
+    }
+    else if (is_top_words || is_distinct_words)
+    {
+        // Each map worker writes a sketch of fixed size, merged by the combine and reduce functions
+        spec.map_func = is_top_words ? top_words_map : distinct_words_map;
+        spec.reduce_func = sketch_reduce;
+        spec.combine_func = use_combiner ? sketch_combine : NULL;
+        spec.usr_data = is_top_words ? &top_num : NULL;
+    }
     else
     {
+        if (spec.stream_reduce)
+        {
+            printf("--stream-reduce is not available for the finder task.\n");
+            return 1;
+        }
         spec.map_func = word_finder_map;
         spec.reduce_func = word_finder_reduce;
-        spec.usr_data = argv[4]; // argv[4] is the word to find
+        word_list.word_num = argc - 4; // argv[4], argv[5], ... are the words to find
+        word_list.words = &argv[4];
+        word_list.positions = binary_result;
+        spec.usr_data = &word_list;
+        if (binary_result)
+        {
+            // Every partition gets the line count of every split, to number the lines of its matches
+            spec.reduce_func = word_finder_binary_reduce;
+            spec.partition_func = word_finder_partition;
+        }
+    }
+
+    if (spec.reduce_num == 0)
+    {
+        spec.reduce_num = 1;
     }
 
-    result.filepath = "mr.rst"; // name of the output file (placed in the working directory)
+    if (spec.cache_dir != NULL)
+    {
+        // The task and the words to find (or the number of top words) decide the map output: "finder\nword\nword..."
+        int word_end = (is_letter_counter || is_word_count || is_top_words || is_distinct_words || is_index) ? 4 : argc;
+        size_t tag_len = strlen(argv[1]) + 16;
+        for (i = 4; i < word_end; i++) tag_len += strlen(argv[i]) + 1;
+        cache_tag = malloc(tag_len);
+        if (NULL == cache_tag)
+        {
+            printf("Memory allocation failed!\n");
+            status = 2;
+            goto out;
+        }
+        strcpy(cache_tag, argv[1]);
+        for (i = 4; i < word_end; i++)
+        {
+            strcat(cache_tag, "\n");
+            strcat(cache_tag, argv[i]);
+        }
+        if (is_top_words)
+        {
+            sprintf(cache_tag + strlen(cache_tag), "\n%d", top_num);
+        }
+        if (binary_result && !is_letter_counter)
+        {
+            strcat(cache_tag, "\npositions"); // fits in the 16 spare bytes
+        }
+        // The positioned finder and the index record the offsets of the lines (and splits) in the input
+        spec.cache_positions = (binary_result && !is_letter_counter) || is_index;
+        spec.cache_tag = cache_tag;
+    }
+
+    result.filepath = MR_RESULT_FILE; // name of the output file (placed in the working directory)
     result.map_worker_pid = malloc(spec.split_num * sizeof(*result.map_worker_pid));
-	if (NULL == result.map_worker_pid)
+    result.reduce_worker_pid = malloc(spec.reduce_num * sizeof(*result.reduce_worker_pid));
+	if (NULL == result.map_worker_pid || NULL == result.reduce_worker_pid)
 	{
         printf("Memory allocation failed!\n");
-		exit(2);
+		status = 2;
+		goto out;
 	}
+    if (spec.engine == ENGINE_CLUSTER && !spec.cluster_worker)
+    {
+        // pids are only unique per host: the workers are also named "host:pid"
+        result.map_worker_name = malloc(spec.split_num * sizeof(*result.map_worker_name));
+        result.reduce_worker_name = malloc(spec.reduce_num * sizeof(*result.reduce_worker_name));
+        if (NULL == result.map_worker_name || NULL == result.reduce_worker_name)
+        {
+            printf("Memory allocation failed!\n");
+            status = 2;
+            goto out;
+        }
+    }
+    if (stats_path != NULL)
+    {
+        result.map_task_stats = malloc(spec.split_num * sizeof(*result.map_task_stats));
+        result.reduce_task_stats = malloc(spec.reduce_num * sizeof(*result.reduce_task_stats));
+        result.map_worker_stats = malloc(spec.split_num * sizeof(*result.map_worker_stats));
+        result.reduce_worker_stats = malloc(spec.reduce_num * sizeof(*result.reduce_worker_stats));
+        if (NULL == result.map_task_stats || NULL == result.reduce_task_stats ||
+            NULL == result.map_worker_stats || NULL == result.reduce_worker_stats)
+        {
+            printf("Memory allocation failed!\n");
+            status = 2;
+            goto out;
+        }
+    }
     
     mapreduce(&spec, &result); // run the mapreduce task
 
+    if (spec.cluster_worker)
+    {
+        printf("Ran %d map and %d reduce tasks for %s\n", result.map_worker_num, result.reduce_worker_num, spec.cluster_address);
+        goto out;
+    }
+
+    if (is_index && !build_index(index_path, argv[2], spec.reduce_num))
+    {
+        printf("Unable to build the index %s.\n", index_path);
+        status = 1;
+        goto out;
+    }
+
     // print the result
     printf("***** RESULT ***** \n");
-    printf("Result file: %s\n", result.filepath);
+    if (is_index)
+    {
+        printf("Index file: %s\n", index_path);
+    }
+    else if (spec.reduce_num == 1)
+    {
+        printf("Result file: %s\n", result.filepath);
+    }
+    else
+    {
+        printf("Result files: ");
+        for (i = 0; i < spec.reduce_num; i++) printf(MR_RESULT_PART_FILE_FMT " ", i);
+        printf("\n");
+    }
     
-    printf("Map worker pids: "); 
-    for (i = 0; i < spec.split_num; i++) printf("%d ", result.map_worker_pid[i]); 
-    printf("\n");
+    if (NULL != result.map_worker_name)
+    {
+        printf("Map workers: ");
+        for (i = 0; i < spec.split_num; i++) printf("%s ", result.map_worker_name[i]);
+        printf("\n");
 
-    printf("Reduce worker pid: %d\n", result.reduce_worker_pid);
-    printf("Processing time (us): %d\n", result.processing_time);
-    
-    exit(0);
+        printf("Reduce workers: ");
+        for (i = 0; i < spec.reduce_num; i++) printf("%s ", result.reduce_worker_name[i]);
+        printf("\n");
+    }
+    else
+    {
+        printf("Map worker pids: "); 
+        for (i = 0; i < spec.split_num; i++) printf("%d ", result.map_worker_pid[i]); 
+        printf("\n");
+
+        printf("Reduce worker pids: ");
+        for (i = 0; i < spec.reduce_num; i++) printf("%d ", result.reduce_worker_pid[i]);
+        printf("\n");
+    }
+    if (spec.cache_dir != NULL)
+    {
+        printf("Cached splits: %d of %d\n", result.cached_split_num, spec.split_num);
+    }
+    printf("Processing time (us): %lld\n", (long long)(result.total_ns / 1000));
+
+    if (binary_result && !is_letter_counter && !write_result_indexes(spec.reduce_num, (const char * const *)word_list.words, word_list.word_num))
+    {
+        printf("Unable to write the index of the result files.\n");
+        status = 1;
+        goto out;
+    }
+
+    if (stats_path != NULL && !write_stats_json(stats_path, argv[1], &spec, &result))
+    {
+        printf("Unable to write the statistics to %s.\n", stats_path);
+        status = 1;
+        goto out;
+    }
+
+out:
+    // Every exit after an allocation comes here, so that the jobs of a --serve runner leak nothing
+    free(result.map_worker_pid);
+    free(result.reduce_worker_pid);
+    free(result.map_worker_name);
+    free(result.reduce_worker_name);
+    free(result.map_task_stats);
+    free(result.reduce_task_stats);
+    free(result.map_worker_stats);
+    free(result.reduce_worker_stats);
+    free(cache_tag);
+    return status;
+}
+
+int main(int argc, char * argv[])
+{
+    int runner_num = sysconf(_SC_NPROCESSORS_ONLN);
+
+    // --serve=SOCKET [--runners=N] runs a server; --connect=SOCKET runs the rest of the command line on it
+    if (argc >= 2 && !strncmp(argv[1], "--serve=", strlen("--serve=")))
+    {
+        if (argc == 3 && !strncmp(argv[2], "--runners=", strlen("--runners=")) &&
+            str_is_decimal_num(argv[2] + strlen("--runners=")) && atoi(argv[2] + strlen("--runners=")) > 0)
+        {
+            runner_num = atoi(argv[2] + strlen("--runners="));
+        }
+        else if (argc != 2)
+        {
+            print_usage(argv[0]);
+            exit(1);
+        }
+        exit(mapreduce_serve(argv[1] + strlen("--serve="), runner_num > 0 ? runner_num : 1, run_job) == 0 ? 0 : 1);
+    }
+    if (argc >= 2 && !strncmp(argv[1], "--connect=", strlen("--connect=")))
+    {
+        char * socket_path = argv[1] + strlen("--connect=");
+        int status;
+
+        argv[1] = argv[0]; // the job's command line, without --connect
+        if ((status = mapreduce_submit(socket_path, argc - 1, argv + 1)) < 0)
+        {
+            printf("Unable to reach the server at %s.\n", socket_path);
+            exit(1);
+        }
+        exit(status);
+    }
+
+    exit(run_job(argc, argv));
 }
 
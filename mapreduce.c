@@ -1,181 +1,2304 @@
+#define _GNU_SOURCE /* memfd_create(), gettid() */
+
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/time.h>
+#include <stdarg.h>
+#include <time.h>
 #include "mapreduce.h"
+#include "itm.h"
+#include "arena.h"
+#include "aggregate.h"
+#include "merge.h"
+#include "scheduler.h"
+#include "input.h"
+#include "cluster.h"
+#include "cache.h"
+#include "placement.h"
+#include "stream.h"
+#include "trace.h"
 #include "common.h"
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <signal.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
 
-void mapreduce(MAPREDUCE_SPEC *spec, MAPREDUCE_RESULT *result) {
-    struct timeval start_time, end_time;
-    gettimeofday(&start_time, NULL);
+// State of one mapreduce() call, shared by the parent and the map and reduce workers
+typedef struct _job
+{
+    MAPREDUCE_SPEC * spec;
+    const char * input_path; // The file the splits come from: the input file, or its decompressed copy
+    int split_num;
+    int reduce_num;
+    int map_worker_num; // Concurrent map workers
+    int reduce_worker_num; // Concurrent reduce workers
+    char ** split_filenames; // [split], NULL when the split is read from the input file directly
+    off_t * split_offsets; // [split], where the split starts in the input (a split-N file starts with it)
+    off_t * split_sizes; // [split]
+    uint64_t * split_keys; // [split], the cache keys of the splits' contents with spec->cache_dir, else NULL
+    char ** intermediate_filenames; // [split * reduce_num + partition]
+    int * intermediate_fds; // [split * reduce_num + partition], in-memory intermediate data (ENGINE_THREADS or TRANSPORT_MEMORY), else NULL
+    char ** result_filenames; // [partition]
+    int * result_fds; // [partition], in-memory result files of an ENGINE_CLUSTER worker, else NULL
+    int * stream_pipes; // [partition * 2], pipes announcing finished splits to the streaming reducers, else NULL
+    int64_t start_ns; // When mapreduce() started
+    MAPREDUCE_TASK_STATS * task_stats; // [split_num + reduce_num], map tasks then reduce tasks, shared with the workers
+    MAPREDUCE_WORKER_STATS * worker_stats; // [split_num + reduce_num], map workers then reduce workers, shared as well
+    int task_attempts; // Attempts of a task before it fails
+    PLACEMENT * placement; // The CPUs and nodes the workers are placed on with spec->pin_workers, else NULL
+    STREAM_QUEUE * stream; // The chunks of the input with SPLIT_MODE_STREAM, else NULL
+    int stream_fd; // The input stream, read into the queue by the producer thread while the map tasks run
+    pthread_t stream_producer;
+    TRACE * trace; // The event rings of the workers with spec->trace_path, else NULL
+    size_t emit_budget; // The memory of each map worker's aggregation buffer that triggers a spill
+    int spill_to_disk; // With spec->memory_budget: the worker buffers are temporary files, and spills are runs of their own
+    ARENA arena; // The file names and split ranges, released at once at the end of the call
+}JOB;
 
-    if (spec == NULL || result == NULL) {
-        EXIT_ERROR(ERROR, "Error: 'spec' or 'result' is NULL.\n");
+#define COMMITTED_ATTEMPT -1 // The attempt argument of open_intermediate() for the committed data
+#define SPILL_FANIN 64 // The most spilled runs of an aggregation buffer kept apart; more are merged into one first
+
+// Run attempt 'attempt' (from 0) of a task
+typedef int (*RUN_TASK)(JOB * job, int task_idx, int attempt, MAPREDUCE_TASK_STATS * stats);
+
+// Keep the output of a finished attempt as the task's (committed), or drop it
+typedef void (*COMMIT_TASK)(JOB * job, int task_idx, int attempt, int committed);
+
+// The output of an emit_map_func: an aggregation table written out in sorted runs, or a plain record buffer
+struct _emitter
+{
+    ITM_WRITER writer;
+    AGG_TABLE table;
+    int aggregate; // Whether records go through the table (the job has a merge_func)
+    size_t budget; // Memory of the table that triggers a spill
+    int64_t spills;
+    JOB * job;
+    int run_fds[SPILL_FANIN]; // [run_num] with job->spill_to_disk: the spills, each a sorted run of its own
+    int run_num;
+};
+
+// One worker of a phase: runs the tasks handed out by the scheduler until none is left
+typedef struct _phase_worker
+{
+    JOB * job;
+    SCHEDULER * scheduler;
+    RUN_TASK run_task;
+    COMMIT_TASK commit_task; // NULL when a task writes its output in place
+    int worker_idx;
+    const char * name; // "Map" or "Reduce", the name of its ring in the trace
+    MAPREDUCE_TASK_STATS * task_stats; // [task] of the phase
+    MAPREDUCE_WORKER_STATS * stats; // This worker's
+}PHASE_WORKER;
+
+static int64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t timeval_ns(const struct timeval *tv) {
+    return (int64_t)tv->tv_sec * 1000000000 + (int64_t)tv->tv_usec * 1000;
+}
+
+// Fill in the CPU time and peak RSS of a worker
+static void record_rusage(MAPREDUCE_WORKER_STATS *stats, const struct rusage *usage) {
+    stats->user_ns = timeval_ns(&usage->ru_utime);
+    stats->sys_ns = timeval_ns(&usage->ru_stime);
+    stats->max_rss_kb = usage->ru_maxrss;
+}
+
+// Add the records and size of intermediate data fd to *records and *bytes
+static void count_intermediate(int fd, int64_t *records, int64_t *bytes) {
+    uint64_t record_num, byte_num;
+
+    if (itm_stat(fd, &record_num, &byte_num) == SUCCESS) {
+        *records += record_num;
+        *bytes += byte_num;
     }
+}
 
-    // Variables initialization
-    long input_file_size;
-    int i, worker_exit_status;
-    int total_splits = spec->split_num;
+// Allocate from the job's arena; running out of memory here ends the call
+static void *job_alloc(JOB *job, size_t size) {
+    void *memory = arena_alloc(&job->arena, size);
 
-    // Open the input file
-    FILE *input_file = fopen(spec->input_data_filepath, "r");
-    if (input_file == NULL) {
-        EXIT_ERROR(ERROR, "Error: Unable to open input file: %s\n", spec->input_data_filepath);
+    if (memory == NULL) {
+        EXIT_ERROR(ERROR, "Error: Memory allocation failed for the job.\n");
     }
+    return memory;
+}
 
-    // Calculate input file size
-    fseek(input_file, 0, SEEK_END);
-    input_file_size = ftell(input_file);
-    rewind(input_file);
+static char *make_filename(JOB *job, const char *fmt, ...) {
+    char *filename;
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    filename = job_alloc(job, len + 1);
+    va_start(args, fmt);
+    vsnprintf(filename, len + 1, fmt, args);
+    va_end(args);
+    return filename;
+}
 
-    long split_size = input_file_size / total_splits;
+// Name the intermediate and result files; with a single partition, keep the historical mr-N.itm and mr.rst names
+static void name_job_files(JOB *job) {
+    int i, part;
 
-    // Allocate memory for split and intermediate file names
-    char **split_filenames = malloc(total_splits * sizeof(char *));
-    char **intermediate_filenames = malloc(total_splits * sizeof(char *));
-    if (split_filenames == NULL || intermediate_filenames == NULL) {
-        fclose(input_file);
-        EXIT_ERROR(ERROR, "Error: Memory allocation failed for file name arrays.\n");
+    job->intermediate_filenames = job_alloc(job, job->split_num * job->reduce_num * sizeof(char *));
+    job->result_filenames = job_alloc(job, job->reduce_num * sizeof(char *));
+    for (i = 0; i < job->split_num; i++) {
+        for (part = 0; part < job->reduce_num; part++) {
+            job->intermediate_filenames[i * job->reduce_num + part] = (job->reduce_num == 1) ? make_filename(job, "mr-%d.itm", i)
+                                                                                             : make_filename(job, "mr-%d-%d.itm", i, part);
+        }
     }
+    for (part = 0; part < job->reduce_num; part++) {
+        job->result_filenames[part] = (job->reduce_num == 1) ? make_filename(job, MR_RESULT_FILE)
+                                                             : make_filename(job, MR_RESULT_PART_FILE_FMT, part);
+    }
+}
 
-    // Phase 1: Splitting the input file into chunks
-    for (i = 0; i < total_splits; i++) {
-        split_filenames[i] = malloc(20);
-        snprintf(split_filenames[i], 20, "split-%d", i);
+int mapreduce_default_partition(const char *key, uint32_t key_len, int reduce_num) {
+    return itm_hash(key, key_len) % reduce_num;
+}
+
+/* A buffer of a worker (a map output, a spilled run, an in-memory intermediate or result file): a memory
+   file, or under a memory budget an unlinked temporary file in the working directory, whose pages the
+   kernel can write back and evict.
+   @ret: Its descriptor, or -1 on error.
+ */
+static int create_buffer(JOB *job, const char *name) {
+    char path[] = "mr-spill-XXXXXX";
+    int fd;
+
+    if (!job->spill_to_disk) {
+        return memfd_create(name, 0);
+    }
+    if ((fd = open(".", O_TMPFILE | O_RDWR, 0600)) < 0 && (fd = mkstemp(path)) >= 0) {
+        unlink(path); // No O_TMPFILE on this file system
+    }
+    return fd;
+}
+
+// Write the aggregation table of emitter out as a sorted run of its own, merged with the others at the end of the task.
+// Once SPILL_FANIN runs are kept, they are merged into one beforehand, which bounds the files and maps of a task.
+static int spill_run(EMITTER *emitter) {
+    ITM_WRITER *writer = malloc(sizeof(ITM_WRITER));
+    int fd = -1, ret = ERROR;
 
-        FILE *split_file = fopen(split_filenames[i], "w");
-        if (split_file == NULL) {
-            fclose(input_file);
-            EXIT_ERROR(ERROR, "Error: Failed to create split file: %s\n", split_filenames[i]);
+    if (writer == NULL || (fd = create_buffer(emitter->job, "mr-spill")) < 0) {
+        ERR_MSG("Error: Unable to create a spill file of the aggregation buffer.\n");
+        free(writer);
+        return ERROR;
+    }
+    itm_writer_open(writer, fd);
+    writer->sorted = 1;
+    if (emitter->run_num == SPILL_FANIN) {
+        TRACE_BEGIN("merge spills", emitter->run_num);
+        ret = merge_runs(emitter->run_fds, emitter->run_num, writer, emitter->job->spec->merge_func);
+        TRACE_END("merge spills", emitter->run_num);
+        while (emitter->run_num > 0) {
+            close(emitter->run_fds[--emitter->run_num]);
+        }
+        emitter->run_fds[emitter->run_num++] = fd;
+        if (ret != SUCCESS || itm_writer_close(writer) != SUCCESS || (fd = create_buffer(emitter->job, "mr-spill")) < 0) {
+            ERR_MSG("Error: Unable to merge the spill files of the aggregation buffer.\n");
+            free(writer);
+            return ERROR;
         }
+        itm_writer_open(writer, fd);
+        writer->sorted = 1;
+        ret = ERROR;
+    }
+    TRACE_BEGIN("spill", emitter->run_num);
+    if (agg_table_write(&emitter->table, writer) == SUCCESS && itm_writer_close(writer) == SUCCESS) {
+        ret = SUCCESS;
+    }
+    TRACE_END("spill", emitter->run_num);
+    emitter->run_fds[emitter->run_num++] = fd;
+    free(writer);
+    return ret;
+}
+
+int mapreduce_emit(EMITTER *emitter, const void *key, uint32_t key_len, const void *value, uint32_t value_len) {
+    if (!emitter->aggregate) {
+        return itm_write(&emitter->writer, key, key_len, value, value_len);
+    }
+    if (agg_table_add(&emitter->table, key, key_len, value, value_len) != SUCCESS) {
+        return ERROR;
+    }
+    if (emitter->table.memory >= emitter->budget) {
+        // Spill: the buffered records become one sorted run of the map output
+        emitter->spills++;
+        return emitter->job->spill_to_disk ? spill_run(emitter) : agg_table_write(&emitter->table, &emitter->writer);
+    }
+    return SUCCESS;
+}
+
+// Take chunks of the input stream until it ends, and call map_chunk on each as a split mapped in memory,
+// whose fd is positioned at the chunk in the memory file of the queue
+typedef int (*MAP_CHUNK)(JOB * job, DATA_SPLIT * split, void * ctx);
+
+static int map_stream_chunks(JOB *job, MAP_CHUNK map_chunk, void *ctx, MAPREDUCE_TASK_STATS *stats) {
+    DATA_SPLIT split = {0};
+    char path[64];
+    int slot, taken, ret = SUCCESS;
 
-        char buffer[1024];
-        long bytes_read = 0;
+    // A descriptor of the task's own, with an offset of its own
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", job->stream->fd);
+    if ((split.fd = open(path, O_RDONLY)) < 0) {
+        ERR_MSG("Error: Unable to open the chunks of the input stream.\n");
+        return ERROR;
+    }
+    split.io_backend = job->spec->io_backend;
+    split.usr_data = job->spec->usr_data;
 
-        // Write data to split files
-        while (bytes_read < split_size && fgets(buffer, sizeof(buffer), input_file)) {
-            fputs(buffer, split_file);
-            bytes_read += strlen(buffer);
+    TRACE_BEGIN("take chunk", 0);
+    while ((taken = stream_queue_take(job->stream, &slot)) > 0) {
+        TRACE_END("take chunk", slot);
+        off_t offset = (off_t)slot * job->stream->chunk_size;
+        split.size = split.length = job->stream->lengths[slot];
+        split.offset = job->stream->offsets[slot];
+        split.base = job->stream->slots + offset;
+        stats->bytes_read += split.size;
+        // After a failure, keep taking the chunks so that the producer does not wait for this task
+        TRACE_BEGIN("map function", slot);
+        if (ret == SUCCESS && (lseek(split.fd, offset, SEEK_SET) < 0 || map_chunk(job, &split, ctx) != SUCCESS)) {
+            ret = ERROR;
         }
+        TRACE_END("map function", slot);
+        stream_queue_release(job->stream, slot);
+        TRACE_BEGIN("take chunk", 0);
+    }
+    TRACE_END("take chunk", -1);
+    close(split.fd);
+
+    if (taken < 0) {
+        ERR_MSG("Error: The input stream could not be read to its end.\n");
+        ret = ERROR;
+    }
+    return ret;
+}
+
+static int emit_chunk(JOB *job, DATA_SPLIT *split, void *emitter) {
+    return job->spec->emit_map_func(split, emitter);
+}
 
-        fclose(split_file);
+// Run the emit_map_func of the job on a split, or on every chunk of the input stream when split is NULL,
+// with its records written to fd_out
+static int run_emit_map(JOB *job, DATA_SPLIT *split, int fd_out, MAPREDUCE_TASK_STATS *stats) {
+    EMITTER *emitter = malloc(sizeof(EMITTER));
+    int ret;
 
-        // Allocate memory for intermediate file names
-        intermediate_filenames[i] = malloc(20);
-        snprintf(intermediate_filenames[i], 20, "mr-%d.itm", i);
+    if (emitter == NULL) {
+        ERR_MSG("Error: Memory allocation failed for the emit buffer.\n");
+        return ERROR;
     }
-    fclose(input_file);
+    itm_writer_open(&emitter->writer, fd_out);
+    emitter->aggregate = job->spec->merge_func != NULL;
+    emitter->budget = job->emit_budget;
+    // Keep the arena chunks well under the budget, so that a spill does not follow every new chunk
+    agg_table_init(&emitter->table, job->spec->merge_func, emitter->budget / 8 < AGG_CHUNK_SIZE ? emitter->budget / 8 + 1 : AGG_CHUNK_SIZE);
+    emitter->spills = 0;
+    emitter->job = job;
+    emitter->run_num = 0;
 
-    // Phase 2: Forking processes for map phase
-    int *map_worker_pids = malloc(total_splits * sizeof(int));
-    if (map_worker_pids == NULL) {
-        EXIT_ERROR(ERROR, "Error: Memory allocation failed for map worker PIDs.\n");
+    ret = split != NULL ? job->spec->emit_map_func(split, emitter) : map_stream_chunks(job, emit_chunk, emitter, stats);
+    if (ret == SUCCESS && emitter->run_num > 0) {
+        // The spills went to runs of their own: merge them with the last table into one sorted run
+        if ((ret = spill_run(emitter)) == SUCCESS) {
+            TRACE_BEGIN("merge spills", emitter->run_num);
+            emitter->writer.sorted = 1;
+            ret = merge_runs(emitter->run_fds, emitter->run_num, &emitter->writer, job->spec->merge_func);
+            TRACE_END("merge spills", emitter->run_num);
+        }
+    } else if (ret == SUCCESS && emitter->aggregate) {
+        emitter->writer.sorted = (emitter->spills == 0); // A single table is a single sorted run
+        ret = agg_table_write(&emitter->table, &emitter->writer);
     }
+    if (ret == SUCCESS) {
+        ret = itm_writer_close(&emitter->writer);
+    }
+    stats->spills = emitter->spills;
+    while (emitter->run_num > 0) {
+        close(emitter->run_fds[--emitter->run_num]);
+    }
+    agg_table_clear(&emitter->table);
+    free(emitter);
+    return ret;
+}
 
-    for (i = 0; i < total_splits; i++) {
-        if ((map_worker_pids[i] = fork()) == 0) {
-            // Child process logic
-            DATA_SPLIT split = {0};
-            split.fd = open(split_filenames[i], O_RDONLY);
-            split.usr_data = spec->usr_data;
+// The map output of a task of the input stream, which map_func_chunk() appends the records of each chunk to
+typedef struct _chunk_output
+{
+    ITM_WRITER writer;
+    int chunk_fd; // The output of map_func for the current chunk
+}CHUNK_OUTPUT;
+
+static int map_func_chunk(JOB *job, DATA_SPLIT *split, void *ctx) {
+    CHUNK_OUTPUT *output = ctx;
+    ITM_READER reader;
+    const char *key, *value;
+    uint32_t key_len, value_len;
+    int ret;
+
+    if (ftruncate(output->chunk_fd, 0) != 0 || lseek(output->chunk_fd, 0, SEEK_SET) < 0 ||
+        job->spec->map_func(split, output->chunk_fd) != SUCCESS || itm_reader_open(&reader, output->chunk_fd) != SUCCESS) {
+        return ERROR;
+    }
+    while ((ret = itm_read(&reader, &key, &key_len, &value, &value_len)) > 0) {
+        if (itm_write(&output->writer, key, key_len, value, value_len) != SUCCESS) {
+            ret = -1;
+            break;
+        }
+    }
+    itm_reader_close(&reader);
+    return ret < 0 ? ERROR : SUCCESS;
+}
+
+// Run the map_func of the job on every chunk of the input stream, with the records of all of them written to fd_out
+static int run_stream_map(JOB *job, int fd_out, MAPREDUCE_TASK_STATS *stats) {
+    CHUNK_OUTPUT *output = malloc(sizeof(CHUNK_OUTPUT));
+    int ret = ERROR;
+
+    if (output == NULL) {
+        ERR_MSG("Error: Memory allocation failed for the map output.\n");
+        return ERROR;
+    }
+    itm_writer_open(&output->writer, fd_out);
+    if ((output->chunk_fd = create_buffer(job, "mr-chunk-output")) >= 0) {
+        ret = map_stream_chunks(job, map_func_chunk, output, stats);
+        close(output->chunk_fd);
+    }
+    if (ret == SUCCESS) {
+        ret = itm_writer_close(&output->writer);
+    }
+    free(output);
+    return ret;
+}
+
+// Return the first line start at or after 'pos': 0, or the byte following a '\n'.
+// Returns 'file_size' if no newline follows 'pos'.
+static off_t find_line_start(int fd, off_t pos, off_t file_size) {
+    char buffer[4096];
+    ssize_t bytes_read;
+
+    if (pos <= 0) {
+        return 0;
+    }
+
+    // Start one byte early so a split that already begins on a line start is kept as is
+    pos -= 1;
+    while (pos < file_size && (bytes_read = pread(fd, buffer, sizeof(buffer), pos)) > 0) {
+        char *newline = memchr(buffer, '\n', bytes_read);
+        if (newline != NULL) {
+            return pos + (newline - buffer) + 1;
+        }
+        pos += bytes_read;
+    }
+
+    return file_size;
+}
+
+// Phase 1, shared by the splitter threads: split i is the lines starting in [i, i + 1) * file_size / split_num
+typedef struct _split_planner
+{
+    JOB * job;
+    int fd; // The input file
+    off_t file_size;
+    int copy; // Whether each split is also copied into its split-N file
+    off_t split_size; // With a cache, the nominal size of every split but the last, else 0
+    uint64_t cache_seed; // With a cache, the seed of the split keys (before the split offset with spec->cache_positions)
+    int next_split; // The next split to plan, taken atomically
+    int status; // SUCCESS, or ERROR once a split could not be read or copied
+}SPLIT_PLANNER;
+
+// The nominal start of split i, before it is moved to a line start
+static off_t nominal_split_offset(const SPLIT_PLANNER *planner, int i) {
+    int split_num = planner->job->split_num;
+
+    if (planner->split_size > 0) {
+        return planner->split_size * i;
+    }
+    return planner->file_size / split_num * i + planner->file_size % split_num * i / split_num;
+}
+
+// The nominal split size with a cache, so that appending to the input changes the last split only:
+// the largest step of a geometric ladder of ratio (split_num + 1) / (split_num - 1/2) not above
+// file_size / (split_num - 1/2). It stays the same until the input grows by about 1.5 splits,
+// and the last split gets between half and twice as many bytes as the others.
+static off_t stable_split_size(off_t file_size, int split_num) {
+    off_t limit = file_size * 2 / (2 * split_num - 1), size = 1, next;
+
+    if (split_num == 1 || limit <= 1) {
+        return split_num == 1 ? file_size : 1;
+    }
+    while ((next = size + (size * 3 / (2 * split_num - 1) > 0 ? size * 3 / (2 * split_num - 1) : 1)) <= limit) {
+        size = next;
+    }
+    return size;
+}
+
+// Copy [offset, offset + size) of fd_in into a new file at path
+static int copy_split(int fd_in, off_t offset, off_t size, const char *path) {
+    int fd_out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666), ret;
+
+    if (fd_out < 0) {
+        return ERROR;
+    }
+    ret = input_copy_range(fd_in, offset, size, fd_out);
+    close(fd_out);
+    return ret;
+}
+
+// Plan (and copy) splits until none is left. Each end is found from its nominal offset alone, so
+// the threads need not wait for each other.
+static void *split_planner_thread(void *arg) {
+    SPLIT_PLANNER *planner = arg;
+    JOB *job = planner->job;
+    int i;
+
+    while ((i = __atomic_fetch_add(&planner->next_split, 1, __ATOMIC_RELAXED)) < job->split_num) {
+        off_t start = find_line_start(planner->fd, nominal_split_offset(planner, i), planner->file_size);
+        off_t end = i + 1 < job->split_num ? find_line_start(planner->fd, nominal_split_offset(planner, i + 1), planner->file_size)
+                                           : planner->file_size;
 
-            if (split.fd < 0) {
-                _EXIT_ERROR(ERROR, "Error: Unable to open split file: %s\n", split_filenames[i]);
+        job->split_sizes[i] = end - start;
+        job->split_offsets[i] = start;
+
+        // A split found in the cache is not copied: if its entry goes away, the map task reads the input
+        if (job->split_keys != NULL) {
+            uint64_t seed = planner->cache_seed;
+            if (job->spec->cache_positions) {
+                CACHE_HASHER hasher;
+                int64_t offset = start;
+                cache_hash_init(&hasher, seed);
+                cache_hash_update(&hasher, &offset, sizeof(offset));
+                seed = cache_hash_final(&hasher);
+            }
+            if (cache_hash_range(planner->fd, start, end - start, seed, &job->split_keys[i]) != SUCCESS) {
+                ERR_MSG("Error: Unable to read split %d of the input.\n", i);
+                __atomic_store_n(&planner->status, ERROR, __ATOMIC_RELAXED);
+            } else if (planner->copy && cache_lookup(job->spec->cache_dir, job->split_keys[i], job->reduce_num)) {
+                job->split_filenames[i] = NULL;
+                continue;
+            }
+        }
+        if (planner->copy) {
+            if (copy_split(planner->fd, start, end - start, job->split_filenames[i]) != SUCCESS) {
+                ERR_MSG("Error: Failed to write split file: %s\n", job->split_filenames[i]);
+                __atomic_store_n(&planner->status, ERROR, __ATOMIC_RELAXED);
             }
+        }
+    }
+    return NULL;
+}
+
+// Phase 1: cut the input file fd into newline-aligned splits of about the same number of bytes, on
+// one thread per online CPU, and copy them into split-N files if copy is set (split_filenames are set).
+// With a cache, the splits are also hashed into their keys, seeded with cache_seed (and their offset with spec->cache_positions).
+// @ret: 0 on success, -1 if a split could not be read or written.
+static int plan_splits(JOB *job, int fd, off_t file_size, int copy, uint64_t cache_seed) {
+    SPLIT_PLANNER planner = {job, fd, file_size, copy, 0, 0, 0, SUCCESS};
+    long cpu_num = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_num = cpu_num > 1 ? (cpu_num < job->split_num ? cpu_num : job->split_num) : 1, i;
+    pthread_t *threads = thread_num > 1 ? malloc((thread_num - 1) * sizeof(pthread_t)) : NULL;
+
+    if (job->split_keys != NULL) {
+        planner.split_size = stable_split_size(file_size, job->split_num);
+        planner.cache_seed = cache_seed;
+    }
+
+    // This thread is one of them; if no other can start, it plans every split itself
+    for (i = 0; threads != NULL && i < thread_num - 1; i++) {
+        if (pthread_create(&threads[i], NULL, split_planner_thread, &planner) != 0) {
+            break;
+        }
+    }
+    split_planner_thread(&planner);
+    while (i-- > 0) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    return planner.status;
+}
+
+// The file an attempt of a map task writes intermediate data 'idx' to, before it is committed
+static void attempt_filename(JOB *job, int idx, int attempt, char *path, size_t size) {
+    snprintf(path, size, "%s.%d", job->intermediate_filenames[idx], attempt);
+}
+
+// Open intermediate data 'idx' as written by an attempt of its map task, for writing (map side) or reading,
+// or its committed data (COMMITTED_ATTEMPT, reduce side). In the file system each attempt has its own file;
+// a memory file has one writer at a time, and a new attempt starts it over.
+static int open_intermediate(JOB *job, int idx, int attempt, int for_write) {
+    char path[PATH_MAX];
+
+    if (job->intermediate_fds != NULL) {
+        int fd = dup(job->intermediate_fds[idx]);
+        if (fd >= 0 && for_write && (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) < 0)) {
+            close(fd);
+            return ERROR;
+        }
+        return fd;
+    }
+    if (attempt == COMMITTED_ATTEMPT) {
+        return open(job->intermediate_filenames[idx], O_RDONLY);
+    }
+    attempt_filename(job, idx, attempt, path, sizeof(path));
+    if (for_write) {
+        unlink(path); // A leftover may be a hard link to a cache entry, which must not be truncated
+        return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+    return open(path, O_RDONLY);
+}
+
+// Move the intermediate files of a map attempt into place with rename(), which is atomic, or remove them
+static int commit_intermediate(JOB *job, int split_idx, int attempt, int committed) {
+    char path[PATH_MAX];
+    int part, ret = SUCCESS;
+
+    if (job->intermediate_fds != NULL) {
+        return SUCCESS; // Written in place
+    }
+    for (part = 0; part < job->reduce_num; part++) {
+        int idx = split_idx * job->reduce_num + part;
+        attempt_filename(job, idx, attempt, path, sizeof(path));
+        if (!committed) {
+            unlink(path);
+        } else if (rename(path, job->intermediate_filenames[idx]) != 0) {
+            ERR_MSG("Error: Unable to commit intermediate file: %s\n", job->intermediate_filenames[idx]);
+            ret = ERROR;
+        }
+    }
+    return ret;
+}
+
+// Take the intermediate files of an attempt of a map task from the cache, if the split's entry is there
+// @ret: 0 on success, -1 on a miss (the attempt then maps the split).
+static int fetch_cached_split(JOB *job, int split_idx, int attempt, MAPREDUCE_TASK_STATS *stats) {
+    char path[PATH_MAX];
+    int part, fd, ret = SUCCESS;
+
+    for (part = 0; part < job->reduce_num && ret == SUCCESS; part++) {
+        int idx = split_idx * job->reduce_num + part;
+        if (job->intermediate_fds == NULL) {
+            attempt_filename(job, idx, attempt, path, sizeof(path));
+            ret = cache_fetch(job->spec->cache_dir, job->split_keys[split_idx], part, path, -1);
+        } else if ((fd = open_intermediate(job, idx, attempt, 1)) < 0) {
+            ret = ERROR;
+        } else {
+            ret = cache_fetch(job->spec->cache_dir, job->split_keys[split_idx], part, NULL, fd);
+            close(fd);
+        }
+    }
+    if (ret != SUCCESS) {
+        // The files fetched so far may be links to the entry: the map function must not write them
+        for (part = 0; job->intermediate_fds == NULL && part < job->reduce_num; part++) {
+            attempt_filename(job, split_idx * job->reduce_num + part, attempt, path, sizeof(path));
+            unlink(path);
+        }
+        return ERROR;
+    }
+    for (part = 0; part < job->reduce_num; part++) {
+        if ((fd = open_intermediate(job, split_idx * job->reduce_num + part, attempt, 0)) >= 0) {
+            count_intermediate(fd, &stats->records, &stats->bytes_written);
+            close(fd);
+        }
+    }
+    stats->cached = 1;
+    return SUCCESS;
+}
+
+// Keep the committed intermediate files of a split in the cache, unless its entry is there already
+static void store_cached_split(JOB *job, int split_idx) {
+    int part, fd;
+
+    if (cache_lookup(job->spec->cache_dir, job->split_keys[split_idx], job->reduce_num)) {
+        return;
+    }
+    for (part = 0; part < job->reduce_num; part++) {
+        int idx = split_idx * job->reduce_num + part, ret = ERROR;
+        if (job->intermediate_fds == NULL) {
+            ret = cache_store(job->spec->cache_dir, job->split_keys[split_idx], part, job->intermediate_filenames[idx], -1);
+        } else if ((fd = open_intermediate(job, idx, COMMITTED_ATTEMPT, 0)) >= 0) {
+            ret = cache_store(job->spec->cache_dir, job->split_keys[split_idx], part, NULL, fd);
+            close(fd);
+        }
+        if (ret != SUCCESS) {
+            ERR_MSG("Error: Unable to cache intermediate file: %s\n", job->intermediate_filenames[idx]);
+            return;
+        }
+    }
+}
+
+// Open the result file of partition 'part' for the reduce function
+static int open_result(JOB *job, int part) {
+    if (job->result_fds != NULL) {
+        return dup(job->result_fds[part]);
+    }
+    return open(job->result_filenames[part], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+}
+
+// Distribute the records of the map (or combine) output fd_in over the split's partitioned intermediate files
+static int partition_records(JOB *job, int split_idx, int attempt, int fd_in) {
+    int (*partition_func)(const char *, uint32_t, int) = job->spec->partition_func ? job->spec->partition_func : mapreduce_default_partition;
+    ITM_WRITER *writers = malloc(job->reduce_num * sizeof(ITM_WRITER));
+    ITM_READER reader;
+    const char *key, *value;
+    uint32_t key_len, value_len;
+    int part, ret = SUCCESS, record_status;
+
+    if (writers == NULL) {
+        ERR_MSG("Error: Memory allocation failed for partition writers.\n");
+        return ERROR;
+    }
+    if (itm_reader_open(&reader, fd_in) != SUCCESS) {
+        ERR_MSG("Error: Map output of split %d is corrupted.\n", split_idx);
+        free(writers);
+        return ERROR;
+    }
+
+    for (part = 0; part < job->reduce_num; part++) {
+        const char *filename = job->intermediate_filenames[split_idx * job->reduce_num + part];
+        int fd = open_intermediate(job, split_idx * job->reduce_num + part, attempt, 1);
+        if (fd < 0) {
+            ERR_MSG("Error: Unable to create intermediate file: %s\n", filename);
+            ret = ERROR;
+            break;
+        }
+        itm_writer_open(&writers[part], fd);
+        writers[part].sorted = reader.sorted; // Splitting a sorted run keeps each part sorted
+    }
+    int opened = part;
 
-            // Create intermediate file for map output
-            int intermediate_fd = open(intermediate_filenames[i], O_WRONLY | O_CREAT | O_TRUNC, 0666);
-            if (intermediate_fd < 0) {
-                _EXIT_ERROR(ERROR, "Error: Unable to create intermediate file: %s\n", intermediate_filenames[i]);
+    while (ret == SUCCESS && (record_status = itm_read(&reader, &key, &key_len, &value, &value_len)) != 0) {
+        if (record_status < 0) {
+            ERR_MSG("Error: Map output of split %d is corrupted.\n", split_idx);
+            ret = ERROR;
+            break;
+        }
+        int first = partition_func(key, key_len, job->reduce_num), last = first;
+        if (first == MR_ALL_PARTITIONS) {
+            first = 0;
+            last = job->reduce_num - 1;
+        } else if (first < 0 || first >= job->reduce_num) {
+            ERR_MSG("Error: Partition function returned %d for %d partitions.\n", first, job->reduce_num);
+            ret = ERROR;
+            break;
+        }
+        for (part = first; part <= last && ret == SUCCESS; part++) {
+            if (itm_write(&writers[part], key, key_len, value, value_len) != SUCCESS) {
+                ERR_MSG("Error: Unable to write intermediate file: %s\n", job->intermediate_filenames[split_idx * job->reduce_num + part]);
+                ret = ERROR;
             }
+        }
+    }
+
+    for (part = 0; part < opened; part++) {
+        if (ret == SUCCESS && itm_writer_close(&writers[part]) != SUCCESS) {
+            ERR_MSG("Error: Unable to write intermediate file: %s\n", job->intermediate_filenames[split_idx * job->reduce_num + part]);
+            ret = ERROR;
+        }
+        close(writers[part].fd);
+    }
+    itm_reader_close(&reader);
+    free(writers);
+    return ret;
+}
+
+// Run the map function of the job on a split of the input file, with its records written to fd_out
+static int map_split(JOB *job, int split_idx, int fd_out, MAPREDUCE_TASK_STATS *stats) {
+    MAPREDUCE_SPEC *spec = job->spec;
+    const char *split_path = job->split_filenames[split_idx] ? job->split_filenames[split_idx] : job->input_path;
+    off_t split_offset = job->split_filenames[split_idx] ? 0 : job->split_offsets[split_idx]; // In split_path
+    DATA_SPLIT split = {0};
+
+    split.fd = open(split_path, O_RDONLY);
+    split.size = job->split_sizes[split_idx];
+    split.offset = job->split_offsets[split_idx];
+    split.io_backend = spec->io_backend;
+    split.usr_data = spec->usr_data;
+    stats->bytes_read = split.size;
+
+    if (split.fd < 0) {
+        ERR_MSG("Error: Unable to open split file: %s\n", split_path);
+        return ERROR;
+    }
+
+    // Position the descriptor at the start of this worker's range
+    if (lseek(split.fd, split_offset, SEEK_SET) < 0) {
+        ERR_MSG("Error: Unable to seek to split %d in: %s\n", split_idx, split_path);
+        close(split.fd);
+        return ERROR;
+    }
+
+    // Map the range so the map function can scan it in place; fd stays usable as well
+    void *mapping = NULL;
+    size_t mapping_length = 0;
+    if (spec->split_mode == SPLIT_MODE_MMAP && split.size > 0) {
+        off_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+        off_t map_offset = split_offset & ~page_mask;
+        size_t lead = split_offset - map_offset;
 
-            // Execute map function
-            int map_status = spec->map_func(&split, intermediate_fd);
+        mapping_length = lead + split.size;
+        mapping = mmap(NULL, mapping_length, PROT_READ, MAP_PRIVATE, split.fd, map_offset);
+        if (mapping == MAP_FAILED) {
+            ERR_MSG("Error: Unable to map split %d of: %s\n", split_idx, split_path);
             close(split.fd);
-            close(intermediate_fd);
+            return ERROR;
+        }
+        madvise(mapping, mapping_length, MADV_SEQUENTIAL);
+
+        split.base = (const char *)mapping + lead;
+        split.length = split.size;
+    }
+
+    // Execute map function
+    TRACE_BEGIN("map function", split_idx);
+    int map_status = spec->emit_map_func != NULL ? run_emit_map(job, &split, fd_out, stats)
+                                                 : spec->map_func(&split, fd_out);
+    TRACE_END("map function", split_idx);
+    if (mapping != NULL) {
+        munmap(mapping, mapping_length);
+    }
+    close(split.fd);
+    return map_status;
+}
+
+// The work of one map worker: map (and optionally combine) one split into its intermediate file(s).
+// With the input stream, the split is a lane that maps chunks until the stream ends.
+static int run_map_task(JOB *job, int split_idx, int attempt, MAPREDUCE_TASK_STATS *stats) {
+    MAPREDUCE_SPEC *spec = job->spec;
+    const char *split_path = job->stream != NULL ? "the input stream"
+                             : job->split_filenames[split_idx] ? job->split_filenames[split_idx] : job->input_path;
+
+    // A split that this job mapped before (same contents and cache tag) takes its output from the cache
+    if (job->split_keys != NULL && fetch_cached_split(job, split_idx, attempt, stats) == SUCCESS) {
+        return SUCCESS;
+    }
+
+    // The map output goes straight to the intermediate file unless it still has to be combined, sorted or partitioned
+    int sort_output = spec->group_reduce_func != NULL;
+    int intermediate_fd = -1;
+    if (job->reduce_num == 1) {
+        const char *filename = job->intermediate_filenames[split_idx];
+        intermediate_fd = open_intermediate(job, split_idx, attempt, 1);
+        if (intermediate_fd < 0) {
+            ERR_MSG("Error: Unable to create intermediate file: %s\n", filename);
+            return ERROR;
+        }
+    }
 
-            if (map_status != SUCCESS) {
-                _EXIT_ERROR(ERROR, "Error: Map function failed for split file: %s\n", split_filenames[i]);
+    int map_output_fd = intermediate_fd;
+    if (spec->combine_func != NULL || sort_output || job->reduce_num > 1) {
+        map_output_fd = create_buffer(job, "mr-map-output");
+        if (map_output_fd < 0) {
+            ERR_MSG("Error: Unable to create map output buffer for split %d\n", split_idx);
+            if (intermediate_fd >= 0) {
+                close(intermediate_fd);
             }
+            return ERROR;
+        }
+    }
 
-            _exit(SUCCESS);
-        } else if (map_worker_pids[i] < 0) {
-            EXIT_ERROR(ERROR, "Error: Fork failed for map worker %d.\n", i);
+    // Execute map function
+    int map_status;
+    if (job->stream == NULL) {
+        map_status = map_split(job, split_idx, map_output_fd, stats);
+    } else if (spec->emit_map_func != NULL) {
+        map_status = run_emit_map(job, NULL, map_output_fd, stats);
+    } else {
+        map_status = run_stream_map(job, map_output_fd, stats);
+    }
+
+    // Execute combine function
+    if (map_status == SUCCESS && spec->combine_func != NULL) {
+        int combine_output_fd = intermediate_fd;
+        if ((sort_output || job->reduce_num > 1) && (combine_output_fd = create_buffer(job, "mr-combine-output")) < 0) {
+            ERR_MSG("Error: Unable to create combine output buffer for split %d\n", split_idx);
+            map_status = ERROR;
         } else {
-            // Parent process: Store the PID in result->map_worker_pid
-            result->map_worker_pid[i] = map_worker_pids[i];
+            TRACE_BEGIN("combine", split_idx);
+            map_status = spec->combine_func(&map_output_fd, 1, combine_output_fd);
+            TRACE_END("combine", split_idx);
+            close(map_output_fd);
+            map_output_fd = combine_output_fd;
         }
     }
 
-    // Phase 3: Wait for all map workers to complete
-    for (i = 0; i < total_splits; i++) {
-        waitpid(map_worker_pids[i], &worker_exit_status, 0);
-        if (WIFEXITED(worker_exit_status) && WEXITSTATUS(worker_exit_status) != SUCCESS) {
-            fprintf(stderr, "Error: Map worker %d failed.\n", i);
+    // Sort the records by key for the merge in the reduce workers
+    if (map_status == SUCCESS && sort_output) {
+        int sorted_fd = intermediate_fd;
+        if (job->reduce_num > 1 && (sorted_fd = create_buffer(job, "mr-sorted-output")) < 0) {
+            ERR_MSG("Error: Unable to create sort output buffer for split %d\n", split_idx);
+            map_status = ERROR;
+        } else {
+            TRACE_BEGIN("sort", split_idx);
+            map_status = itm_sort(map_output_fd, sorted_fd);
+            TRACE_END("sort", split_idx);
+            close(map_output_fd);
+            map_output_fd = sorted_fd;
+        }
+    }
+
+    // Shuffle the records into one intermediate file per partition
+    if (map_status == SUCCESS && job->reduce_num > 1) {
+        TRACE_BEGIN("partition", split_idx);
+        map_status = partition_records(job, split_idx, attempt, map_output_fd);
+        TRACE_END("partition", split_idx);
+    }
+
+    if (map_output_fd != intermediate_fd) {
+        close(map_output_fd);
+    }
+    if (intermediate_fd >= 0) {
+        close(intermediate_fd);
+    }
+
+    if (map_status != SUCCESS) {
+        ERR_MSG("Error: Map function failed for split %d of: %s\n", split_idx, split_path);
+        return ERROR;
+    }
+
+    int part;
+    for (part = 0; part < job->reduce_num; part++) {
+        int fd = open_intermediate(job, split_idx * job->reduce_num + part, attempt, 0);
+        if (fd >= 0) {
+            count_intermediate(fd, &stats->records, &stats->bytes_written);
+            close(fd);
         }
     }
+    return SUCCESS;
+}
+
+// Commit the output of a map attempt, or drop it; a committed split is cached, and announced to the streaming reducers
+static void commit_map_attempt(JOB *job, int split_idx, int attempt, int committed) {
+    int part;
 
-    // Phase 4: Fork a reduce worker process
-    int reduce_worker_pid;
-    if ((reduce_worker_pid = fork()) == 0) {
-        // Child process logic for reduce
-        int *intermediate_fds = malloc(total_splits * sizeof(int));
-        if (intermediate_fds == NULL) {
-            _EXIT_ERROR(ERROR, "Error: Memory allocation failed for intermediate file descriptors.\n");
+    if (commit_intermediate(job, split_idx, attempt, committed) != SUCCESS || !committed) {
+        return;
+    }
+    if (job->split_keys != NULL) {
+        store_cached_split(job, split_idx);
+    }
+    if (job->stream_pipes == NULL) {
+        return;
+    }
+    // Writes of an int are atomic on a pipe
+    for (part = 0; part < job->reduce_num; part++) {
+        if (write(job->stream_pipes[part * 2 + 1], &split_idx, sizeof(split_idx)) != sizeof(split_idx)) {
+            ERR_MSG("Error: Unable to notify reduce worker %d of split %d\n", part, split_idx);
         }
+    }
+}
 
-        // Open intermediate files
-        for (i = 0; i < total_splits; i++) {
-            intermediate_fds[i] = open(intermediate_filenames[i], O_RDONLY);
-            if (intermediate_fds[i] < 0) {
-                _EXIT_ERROR(ERROR, "Error: Unable to open intermediate file: %s\n", intermediate_filenames[i]);
-            }
+// Move a reduce task to the node whose map tasks wrote most of its intermediate files fds[split], so that
+// it reads them from local memory
+static void place_reduce_task(JOB *job, const int *fds) {
+    int64_t node_bytes[PLACEMENT_MAX_NODES] = {0};
+    int i, node = 0;
+
+    for (i = 0; i < job->split_num; i++) {
+        struct stat st;
+        if (fstat(fds[i], &st) == 0 && job->task_stats[i].node < PLACEMENT_MAX_NODES) {
+            node_bytes[job->task_stats[i].node] += st.st_size;
+        }
+    }
+    for (i = 1; i < job->placement->node_num; i++) {
+        if (node_bytes[i] > node_bytes[node]) {
+            node = i;
         }
+    }
+    placement_pin_node(job->placement, node);
+}
 
-        int result_fd = open("mr.rst", O_WRONLY | O_CREAT | O_TRUNC, 0666);
-        if (result_fd < 0) {
-            _EXIT_ERROR(ERROR, "Error: Unable to create result file.\n");
+// The work of one reduce worker: reduce the intermediate files of one partition into its result file
+static int run_reduce_task(JOB *job, int part, int attempt, MAPREDUCE_TASK_STATS *stats) {
+    int i, ret = SUCCESS;
+    int *intermediate_fds = malloc(job->split_num * sizeof(int));
+    if (intermediate_fds == NULL) {
+        ERR_MSG("Error: Memory allocation failed for intermediate file descriptors.\n");
+        return ERROR;
+    }
+
+    // Open intermediate files
+    for (i = 0; i < job->split_num; i++) {
+        const char *filename = job->intermediate_filenames[i * job->reduce_num + part];
+        intermediate_fds[i] = open_intermediate(job, i * job->reduce_num + part, COMMITTED_ATTEMPT, 0);
+        if (intermediate_fds[i] < 0) {
+            ERR_MSG("Error: Unable to open intermediate file: %s\n", filename);
+            ret = ERROR;
+            break;
         }
+        count_intermediate(intermediate_fds[i], &stats->records, &stats->bytes_read);
+    }
+    int opened = i;
 
-        // Execute reduce function
-        if (spec->reduce_func(intermediate_fds, total_splits, result_fd) != SUCCESS) {
+    if (ret == SUCCESS && job->placement != NULL) {
+        place_reduce_task(job, intermediate_fds);
+    }
+    if (ret == SUCCESS) {
+        int result_fd = open_result(job, part);
+        if (result_fd < 0) {
+            ERR_MSG("Error: Unable to create result file: %s\n", job->result_filenames[part]);
+            ret = ERROR;
+        } else {
+            // Execute reduce function, or merge the sorted runs for the group reduce function
+            TRACE_BEGIN("reduce function", part);
+            int reduce_status = job->spec->group_reduce_func != NULL
+                                    ? merge_reduce(intermediate_fds, job->split_num, result_fd, job->spec->group_reduce_func)
+                                    : job->spec->reduce_func(intermediate_fds, job->split_num, result_fd);
+            TRACE_END("reduce function", part);
+            if (reduce_status != SUCCESS) {
+                ERR_MSG("Error: Reduce function execution failed for partition %d.\n", part);
+                ret = ERROR;
+            }
+            stats->bytes_written = lseek(result_fd, 0, SEEK_END);
             close(result_fd);
-            _EXIT_ERROR(ERROR, "Error: Reduce function execution failed.\n");
         }
+    }
+
+    for (i = 0; i < opened; i++) {
+        close(intermediate_fds[i]);
+    }
+    free(intermediate_fds);
+    return ret;
+}
+
+// The work of one streaming reduce worker: fold each intermediate file into an accumulator with the
+// combine function as soon as its map task announces it, then reduce the accumulator alone
+static int run_streaming_reduce_task(JOB *job, int part, int attempt, MAPREDUCE_TASK_STATS *stats) {
+    int split_indices[256];
+    int fds[1 + 256];
+    int accumulator_fd = -1, received = 0, ret = SUCCESS;
+    ssize_t bytes_read;
+
+    // Each read returns every announcement queued so far; they are combined in one pass
+    while ((bytes_read = read(job->stream_pipes[part * 2], split_indices, sizeof(split_indices))) > 0 || (bytes_read < 0 && errno == EINTR)) {
+        int i, fd_num = 0, new_num = bytes_read / sizeof(int);
+
+        if (ret != SUCCESS || bytes_read < 0) {
+            continue; // Keep draining so that map workers never block on a full pipe
+        }
+        if (accumulator_fd >= 0) {
+            fds[fd_num++] = accumulator_fd;
+        }
+        for (i = 0; i < new_num; i++) {
+            int idx = split_indices[i] * job->reduce_num + part;
+            if ((fds[fd_num] = open_intermediate(job, idx, COMMITTED_ATTEMPT, 0)) < 0) {
+                ERR_MSG("Error: Unable to open intermediate file: %s\n", job->intermediate_filenames[idx]);
+                ret = ERROR;
+                break;
+            }
+            count_intermediate(fds[fd_num], &stats->records, &stats->bytes_read);
+            fd_num++;
+        }
+        received += new_num;
 
-        close(result_fd);
-        for (i = 0; i < total_splits; i++) {
-            close(intermediate_fds[i]);
+        if (ret == SUCCESS && fd_num == 1) {
+            accumulator_fd = fds[0]; // The first file becomes the accumulator as is
+            continue;
         }
-        free(intermediate_fds);
-        _exit(SUCCESS);
-    } else if (reduce_worker_pid < 0) {
-        EXIT_ERROR(ERROR, "Error: Fork failed for reduce worker.\n");
-    } else {
-        result->reduce_worker_pid = reduce_worker_pid; // Store reduce worker PID
+        int combined_fd = (ret == SUCCESS) ? memfd_create("mr-stream-reduce", 0) : -1;
+        TRACE_BEGIN("combine", fd_num);
+        if (ret == SUCCESS && (combined_fd < 0 || job->spec->combine_func(fds, fd_num, combined_fd) != SUCCESS)) {
+            ERR_MSG("Error: Combine function failed in reduce worker %d.\n", part);
+            ret = ERROR;
+        }
+        TRACE_END("combine", fd_num);
+        for (i = 0; i < fd_num; i++) {
+            close(fds[i]);
+        }
+        accumulator_fd = combined_fd;
+    }
+
+    if (ret == SUCCESS && received != job->split_num) {
+        ERR_MSG("Error: Reduce worker %d received %d of %d intermediate files.\n", part, received, job->split_num);
+        ret = ERROR;
+    }
+    if (ret == SUCCESS) {
+        int result_fd = open_result(job, part);
+        if (result_fd < 0) {
+            ERR_MSG("Error: Unable to create result file: %s\n", job->result_filenames[part]);
+            ret = ERROR;
+        } else {
+            // Execute reduce function
+            TRACE_BEGIN("reduce function", part);
+            if (job->spec->reduce_func(&accumulator_fd, 1, result_fd) != SUCCESS) {
+                ERR_MSG("Error: Reduce function execution failed for partition %d.\n", part);
+                ret = ERROR;
+            }
+            TRACE_END("reduce function", part);
+            stats->bytes_written = lseek(result_fd, 0, SEEK_END);
+            close(result_fd);
+        }
+    }
+    if (accumulator_fd >= 0) {
+        close(accumulator_fd);
     }
+    return ret;
+}
+
+// Run one task and record its timings in stats (the task itself counts its bytes and records)
+static int run_timed_task(JOB *job, RUN_TASK run_task, int task_idx, int attempt, MAPREDUCE_TASK_STATS *stats, int owner_id) {
+    int64_t start_ns = clock_ns(CLOCK_MONOTONIC), cpu_start_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    const char *trace_name = run_task == run_map_task ? "map task" : "reduce task";
 
-    // Wait for reduce worker to complete
-    waitpid(reduce_worker_pid, &worker_exit_status, 0);
-    if (WIFEXITED(worker_exit_status) && WEXITSTATUS(worker_exit_status) != SUCCESS) {
-        fprintf(stderr, "Error: Reduce worker execution failed.\n");
+    memset(stats, 0, sizeof(*stats));
+    stats->worker_id = owner_id;
+    stats->start_ns = start_ns - job->start_ns;
+    stats->attempts = attempt + 1;
+    TRACE_BEGIN(trace_name, task_idx);
+    stats->status = run_task(job, task_idx, attempt, stats);
+    TRACE_END(trace_name, task_idx);
+    stats->node = job->placement != NULL ? placement_current_node(job->placement) : 0;
+    stats->wall_ns = clock_ns(CLOCK_MONOTONIC) - start_ns;
+    stats->cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start_ns;
+    return stats->status;
+}
+
+static void run_scheduled_tasks(PHASE_WORKER *worker, int owner_id) {
+    int64_t start_ns = clock_ns(CLOCK_MONOTONIC);
+    int task_idx, attempt;
+
+    trace_attach(worker->job->trace, worker->name, worker->worker_idx);
+    worker->stats->worker_id = owner_id;
+    worker->stats->start_ns = start_ns - worker->job->start_ns;
+    if (worker->job->placement != NULL) {
+        placement_pin_worker(worker->job->placement, worker->worker_idx);
     }
+    while ((task_idx = scheduler_next(worker->scheduler, worker->worker_idx, &attempt)) >= 0) {
+        MAPREDUCE_TASK_STATS stats;
+        int status = run_timed_task(worker->job, worker->run_task, task_idx, attempt, &stats, owner_id);
+        int outcome = scheduler_finish(worker->scheduler, task_idx, owner_id, status);
 
-    // Phase 5: Cleanup resources
+        // Only the attempt that decides the task leaves its output and counters
+        if (worker->commit_task != NULL) {
+            worker->commit_task(worker->job, task_idx, attempt, outcome == ATTEMPT_COMMITTED);
+        }
+        if (outcome != ATTEMPT_DISCARDED) {
+            worker->task_stats[task_idx] = stats;
+            scheduler_settle(worker->scheduler, task_idx);
+        } else if (status != SUCCESS) {
+            fprintf(stderr, "Error: Attempt %d of task %d failed; it runs again unless another attempt succeeds.\n",
+                    attempt + 1, task_idx);
+        }
+        worker->stats->task_num++;
+    }
+    worker->stats->wall_ns = clock_ns(CLOCK_MONOTONIC) - start_ns;
+    trace_detach();
+}
+
+static void *phase_thread(void *arg) {
+    PHASE_WORKER *worker = arg;
+    struct rusage usage;
+
+    run_scheduled_tasks(worker, syscall(SYS_gettid));
+    getrusage(RUSAGE_THREAD, &usage);
+    record_rusage(worker->stats, &usage);
+    return NULL;
+}
+
+// Start the workers of slots[0, slot_num) (threads or forked processes, per the engine) and wait for them.
+// Once every task is over, forked workers still running a losing attempt are killed. *spawn_ns receives the
+// time taken to start the workers.
+// @ret: The number of forked workers that died on their own, whose slots are stored in lost[].
+static int run_workers(JOB *job, SCHEDULER *scheduler, PHASE_WORKER *workers, const int *slots, int slot_num,
+                       const char *worker_name, int *lost, int64_t *spawn_ns) {
+    int64_t start_ns = clock_ns(CLOCK_MONOTONIC);
+    int i, lost_num = 0, worker_exit_status;
+
+    if (job->spec->engine == ENGINE_THREADS) {
+        pthread_t *threads = malloc(slot_num * sizeof(pthread_t));
+        if (threads == NULL) {
+            EXIT_ERROR(ERROR, "Error: Memory allocation failed for the thread pool.\n");
+        }
+        for (i = 0; i < slot_num; i++) {
+            TRACE_BEGIN("spawn", slots[i]);
+            if (pthread_create(&threads[i], NULL, phase_thread, &workers[slots[i]]) != 0) {
+                EXIT_ERROR(ERROR, "Error: Unable to start %s thread %d.\n", worker_name, slots[i]);
+            }
+            TRACE_END("spawn", slots[i]);
+        }
+        *spawn_ns = clock_ns(CLOCK_MONOTONIC) - start_ns;
+        TRACE_BEGIN("join", slot_num);
+        for (i = 0; i < slot_num; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        TRACE_END("join", slot_num);
+        free(threads);
+        return 0;
+    }
+
+    pid_t *worker_pids = malloc(slot_num * sizeof(pid_t));
+    struct pollfd *pidfds = malloc(slot_num * sizeof(struct pollfd));
+    if (worker_pids == NULL || pidfds == NULL) {
+        EXIT_ERROR(ERROR, "Error: Memory allocation failed for %s worker PIDs.\n", worker_name);
+    }
+    for (i = 0; i < slot_num; i++) {
+        TRACE_BEGIN("fork", slots[i]);
+        if ((worker_pids[i] = fork()) == 0) {
+            // Child process logic: keep taking tasks until none is left
+            run_scheduled_tasks(&workers[slots[i]], getpid());
+            _exit(SUCCESS);
+        } else if (worker_pids[i] < 0) {
+            EXIT_ERROR(ERROR, "Error: Fork failed for %s worker %d.\n", worker_name, slots[i]);
+        }
+        TRACE_END("fork", worker_pids[i]);
+    }
+    *spawn_ns = clock_ns(CLOCK_MONOTONIC) - start_ns;
+
+    // With backups, the worker of a straggler may outlive its task: wait for whichever worker exits first
+    // through pidfds, so that the others can be killed once every task is over. Without pidfds (or backups),
+    // the workers are waited for in order.
+    int waitable = scheduler->backups;
+    for (i = 0; i < slot_num; i++) {
+        pidfds[i].fd = waitable ? syscall(SYS_pidfd_open, worker_pids[i], 0) : -1;
+        pidfds[i].events = POLLIN;
+        waitable = waitable && pidfds[i].fd >= 0;
+    }
+    int left = slot_num, killed = 0;
+    while (left > 0) {
+        for (i = 0; i < slot_num && worker_pids[i] < 0; i++) {
+        }
+        TRACE_BEGIN("waitpid", left);
+        if (waitable && poll(pidfds, slot_num, -1) > 0) {
+            for (i = 0; i < slot_num && (worker_pids[i] < 0 || pidfds[i].revents == 0); i++) {
+            }
+        }
+        if (i == slot_num) {
+            TRACE_END("waitpid", -1);
+            continue;
+        }
+
+        struct rusage usage;
+        if (wait4(worker_pids[i], &worker_exit_status, 0, &usage) == worker_pids[i]) {
+            record_rusage(workers[slots[i]].stats, &usage);
+        }
+        TRACE_END("waitpid", worker_pids[i]);
+        if (!killed && !WIFEXITED(worker_exit_status)) {
+            fprintf(stderr, "Error: %s worker process %d was terminated.\n", worker_name, worker_pids[i]);
+        }
+        if (!killed && (!WIFEXITED(worker_exit_status) || WEXITSTATUS(worker_exit_status) != SUCCESS)) {
+            lost[lost_num++] = slots[i];
+        }
+        if (pidfds[i].fd >= 0) {
+            close(pidfds[i].fd);
+        }
+        pidfds[i].fd = -1; // Ignored by poll() from now on
+        worker_pids[i] = -1;
+        left--;
+
+        if (waitable && !killed && left > 0 && scheduler_is_done(scheduler)) {
+            for (i = 0; i < slot_num; i++) {
+                if (worker_pids[i] > 0) {
+                    kill(worker_pids[i], SIGKILL);
+                }
+            }
+            killed = 1;
+        }
+    }
+    free(pidfds);
+    free(worker_pids);
+    return lost_num;
+}
+
+// Run tasks [0, task_num) on at most worker_num workers (threads or forked processes, per the engine)
+// and wait for all of them. A failed task runs again, up to job->task_attempts attempts in all, and so does
+// the task of a forked worker that dies, on a new worker. With a commit_task, each attempt writes its own
+// output and commit_task keeps the first successful one; then, with spec->speculate, stragglers also get
+// backup attempts near the end of the phase. worker_ids[task] receives the ID of the worker that ran each
+// task, task_stats[task] and worker_stats[worker] their counters. *spawn_ns and *phase_ns receive the
+// time taken to start the workers and the whole phase.
+// @ret: The number of workers that ran.
+static int run_phase(JOB *job, int task_num, int worker_num, RUN_TASK run_task, COMMIT_TASK commit_task, const char *worker_name,
+                     int *worker_ids, MAPREDUCE_TASK_STATS *task_stats, MAPREDUCE_WORKER_STATS *worker_stats,
+                     int64_t *spawn_ns, int64_t *phase_ns) {
+    int64_t start_ns = clock_ns(CLOCK_MONOTONIC);
+    int i;
+
+    if (worker_num > task_num) {
+        worker_num = task_num;
+    }
+    if (worker_num <= 0) {
+        *spawn_ns = *phase_ns = 0;
+        return 0;
+    }
+
+    // Backups need each attempt to write its own files, so not with memory files, nor chunks of a stream taken once
+    int backups = job->spec->speculate && commit_task != NULL && job->intermediate_fds == NULL && job->stream == NULL;
+    SCHEDULER *scheduler = scheduler_create(task_num, worker_num, job->task_attempts, backups);
+    PHASE_WORKER *workers = malloc(worker_num * sizeof(PHASE_WORKER));
+    int *slots = malloc(2 * worker_num * sizeof(int)), *lost = slots + worker_num;
+    if (scheduler == NULL || workers == NULL || slots == NULL) {
+        EXIT_ERROR(ERROR, "Error: Unable to set up the %s workers.\n", worker_name);
+    }
+    for (i = 0; i < worker_num; i++) {
+        workers[i].job = job;
+        workers[i].scheduler = scheduler;
+        workers[i].run_task = run_task;
+        workers[i].commit_task = commit_task;
+        workers[i].worker_idx = i;
+        workers[i].name = worker_name;
+        workers[i].task_stats = task_stats;
+        workers[i].stats = &worker_stats[i];
+        memset(&worker_stats[i], 0, sizeof(worker_stats[i]));
+        slots[i] = i;
+    }
+    for (i = 0; i < task_num; i++) {
+        memset(&task_stats[i], 0, sizeof(task_stats[i]));
+        task_stats[i].status = TASK_NOT_RUN;
+    }
+
+    // Replace the workers that died while their tasks have attempts left
+    int lost_num = run_workers(job, scheduler, workers, slots, worker_num, worker_name, lost, spawn_ns), waiting;
+    while (lost_num > 0 && (waiting = scheduler_requeue_lost(scheduler)) > 0) {
+        int64_t respawn_ns;
+        fprintf(stderr, "Error: %d %s workers died; %d tasks run again.\n", lost_num, worker_name, waiting);
+        memcpy(slots, lost, lost_num * sizeof(int));
+        lost_num = run_workers(job, scheduler, workers, slots, lost_num < waiting ? lost_num : waiting, worker_name, lost, &respawn_ns);
+    }
+
+    // Report every task that did not complete
+    for (i = 0; i < task_num; i++) {
+        worker_ids[i] = scheduler->task_owner[i];
+        task_stats[i].attempts = scheduler->task_attempts[i];
+        if (scheduler->task_status[i] != SUCCESS) {
+            task_stats[i].status = scheduler->task_status[i];
+            fprintf(stderr, "Error: %s worker %d failed.\n", worker_name, i);
+        }
+    }
+
+    free(slots);
+    free(workers);
+    scheduler_destroy(scheduler);
+    *phase_ns = clock_ns(CLOCK_MONOTONIC) - start_ns;
+    return worker_num;
+}
+
+// After the map phase: remove what attempts that did not commit may have left (a dead worker does not clean up).
+// @ret: 0 if every split was mapped, -1 otherwise.
+static int finish_map_phase(JOB *job) {
+    char path[PATH_MAX];
+    int i, part, attempt, ret = SUCCESS;
+
+    for (i = 0; i < job->split_num; i++) {
+        if (job->task_stats[i].status != SUCCESS) {
+            ret = ERROR;
+        }
+        if (job->intermediate_fds != NULL || (job->task_stats[i].attempts <= 1 && job->task_stats[i].status == SUCCESS)) {
+            continue;
+        }
+        for (attempt = 0; attempt < job->task_stats[i].attempts; attempt++) {
+            for (part = 0; part < job->reduce_num; part++) {
+                attempt_filename(job, i * job->reduce_num + part, attempt, path, sizeof(path));
+                unlink(path);
+            }
+        }
+    }
+    return ret;
+}
+
+// Keep the intermediate data in memory files (temporary files under a memory budget), shared by the threads
+// or inherited by the forked workers
+static void create_intermediate_buffers(JOB *job) {
+    int i, intermediate_num = job->split_num * job->reduce_num;
+
+    job->intermediate_fds = malloc(intermediate_num * sizeof(int));
+    if (job->intermediate_fds == NULL) {
+        EXIT_ERROR(ERROR, "Error: Memory allocation failed for intermediate buffers.\n");
+    }
+    for (i = 0; i < intermediate_num; i++) {
+        if ((job->intermediate_fds[i] = create_buffer(job, job->intermediate_filenames[i])) < 0) {
+            EXIT_ERROR(ERROR, "Error: Unable to create intermediate buffer: %s\n", job->intermediate_filenames[i]);
+        }
+    }
+}
+
+static void close_intermediate_buffers(JOB *job) {
+    int i, intermediate_num = job->split_num * job->reduce_num;
+
+    for (i = 0; i < intermediate_num; i++) {
+        close(job->intermediate_fds[i]);
+    }
+    free(job->intermediate_fds);
+    job->intermediate_fds = NULL;
+}
+
+// The producer of SPLIT_MODE_STREAM: reads the input into the queue until it ends, or until the map phase is over
+static void *stream_producer_thread(void *arg) {
+    JOB *job = arg;
+
+    trace_attach(job->trace, "Stream producer", -1);
+    stream_queue_fill(job->stream, job->stream_fd);
+    trace_detach();
+    return NULL;
+}
+
+// Phases 2-3: run the map tasks; with the input stream, they take its chunks until it ends
+static void run_map_phase(JOB *job, MAPREDUCE_RESULT *result) {
+    TRACE_BEGIN("map phase", job->split_num);
+    result->map_worker_num = run_phase(job, job->split_num, job->map_worker_num, run_map_task, commit_map_attempt, "Map", result->map_worker_pid,
+                                       job->task_stats, job->worker_stats, &result->map_spawn_ns, &result->map_ns);
+    if (job->stream != NULL) {
+        stream_queue_close(job->stream); // Stops a producer that still waits for a slot
+        pthread_join(job->stream_producer, NULL);
+        if (job->stream->ended < 0) {
+            fprintf(stderr, "Error: Unable to read the input stream: %s\n", job->input_path);
+        }
+        stream_queue_destroy(job->stream);
+        close(job->stream_fd);
+        job->stream = NULL;
+    }
+    TRACE_END("map phase", result->map_worker_num);
+}
+
+// Run the reduce tasks once the map phase is over, unless a split could not be mapped in any attempt
+static void run_reduce_phase(JOB *job, MAPREDUCE_RESULT *result) {
+    if (finish_map_phase(job) != SUCCESS) {
+        fprintf(stderr, "Error: Some splits failed every attempt; the reduce phase is skipped.\n");
+        result->reduce_worker_num = 0;
+        return;
+    }
+    TRACE_BEGIN("reduce phase", job->reduce_num);
+    result->reduce_worker_num = run_phase(job, job->reduce_num, job->reduce_worker_num, run_reduce_task, NULL, "Reduce", result->reduce_worker_pid,
+                                          job->task_stats + job->split_num, job->worker_stats + job->split_num,
+                                          &result->reduce_spawn_ns, &result->reduce_ns);
+    TRACE_END("reduce phase", result->reduce_worker_num);
+}
+
+// Phases 2-4 with ENGINE_THREADS: intermediate data stays in memory files, tasks run on the thread pool
+static void run_with_threads(JOB *job, MAPREDUCE_RESULT *result) {
+    create_intermediate_buffers(job);
+
+    // The pool threads share the I/O buffer pool; it is emptied once each phase is over
+    run_map_phase(job, result);
+    io_buffer_pool_reset();
+    run_reduce_phase(job, result);
+    io_buffer_pool_reset();
+    close_intermediate_buffers(job);
+}
+
+// Phases 2-4 with ENGINE_FORK and stream_reduce: the reduce workers are started first and
+// combine each intermediate file as soon as its map task is done
+static void run_streaming_with_processes(JOB *job, MAPREDUCE_RESULT *result) {
+    int part, i, worker_exit_status;
+
+    job->stream_pipes = malloc(job->reduce_num * 2 * sizeof(int));
+    if (job->stream_pipes == NULL) {
+        EXIT_ERROR(ERROR, "Error: Memory allocation failed for the reduce worker pipes.\n");
+    }
+    for (part = 0; part < job->reduce_num; part++) {
+        if (pipe(&job->stream_pipes[part * 2]) < 0) {
+            EXIT_ERROR(ERROR, "Error: Unable to create the pipe of reduce worker %d.\n", part);
+        }
+    }
+
+    // Phase 2a: Fork one reduce worker per partition, waiting for intermediate files
+    int64_t spawn_start_ns = clock_ns(CLOCK_MONOTONIC);
+    for (part = 0; part < job->reduce_num; part++) {
+        int reduce_worker_pid;
+        TRACE_BEGIN("fork", part);
+        if ((reduce_worker_pid = fork()) == 0) {
+            MAPREDUCE_WORKER_STATS *stats = &job->worker_stats[job->split_num + part];
+            int64_t start_ns = clock_ns(CLOCK_MONOTONIC);
+
+            trace_attach(job->trace, "Reduce", part);
+            // Only the map workers and the parent may hold write ends, so the pipe ends once the map phase is over
+            for (i = 0; i < job->reduce_num; i++) {
+                close(job->stream_pipes[i * 2 + 1]);
+            }
+            memset(stats, 0, sizeof(*stats));
+            stats->worker_id = getpid();
+            stats->start_ns = start_ns - job->start_ns;
+            stats->task_num = 1;
+            int status = run_timed_task(job, run_streaming_reduce_task, part, 0, &job->task_stats[job->split_num + part], getpid());
+            stats->wall_ns = clock_ns(CLOCK_MONOTONIC) - start_ns;
+            _exit(status == SUCCESS ? SUCCESS : ERROR);
+        } else if (reduce_worker_pid < 0) {
+            EXIT_ERROR(ERROR, "Error: Fork failed for reduce worker %d.\n", part);
+        } else {
+            result->reduce_worker_pid[part] = reduce_worker_pid; // Store reduce worker PID
+        }
+        TRACE_END("fork", reduce_worker_pid);
+    }
+
+    result->reduce_spawn_ns = clock_ns(CLOCK_MONOTONIC) - spawn_start_ns;
+    result->reduce_worker_num = job->reduce_num;
+
+    // Phases 2b-3: Fork the map workers and wait for them; each finished split is announced to the reducers
+    run_map_phase(job, result);
+
+    finish_map_phase(job);
+
+    // Phase 4: Close the pipes and let the reducers finish
+    int64_t tail_start_ns = clock_ns(CLOCK_MONOTONIC);
+    for (part = 0; part < job->reduce_num; part++) {
+        close(job->stream_pipes[part * 2]);
+        close(job->stream_pipes[part * 2 + 1]);
+    }
+    for (part = 0; part < job->reduce_num; part++) {
+        struct rusage usage;
+        TRACE_BEGIN("waitpid", part);
+        if (wait4(result->reduce_worker_pid[part], &worker_exit_status, 0, &usage) == result->reduce_worker_pid[part]) {
+            record_rusage(&job->worker_stats[job->split_num + part], &usage);
+        }
+        TRACE_END("waitpid", result->reduce_worker_pid[part]);
+        if (!WIFEXITED(worker_exit_status) || WEXITSTATUS(worker_exit_status) != SUCCESS) {
+            fprintf(stderr, "Error: Reduce worker %d failed.\n", part);
+        }
+    }
+    result->reduce_ns = clock_ns(CLOCK_MONOTONIC) - tail_start_ns;
+    free(job->stream_pipes);
+    job->stream_pipes = NULL;
+}
+
+// Phases 2-4 of ENGINE_FORK without streaming: the reducers start once every split is mapped
+static void run_map_reduce_with_processes(JOB *job, MAPREDUCE_RESULT *result) {
+    // Phases 2-3: Fork the map workers, which take splits from the scheduler, and wait for them
+    run_map_phase(job, result);
+
+    // Phase 4: Fork the reduce workers, one per partition unless worker_num is lower; they run concurrently
+    run_reduce_phase(job, result);
+}
+
+// Phases 2-4 with ENGINE_FORK: map and reduce workers are processes, intermediate data in files or memory files
+static void run_with_processes(JOB *job, MAPREDUCE_RESULT *result) {
+    if (job->spec->transport == TRANSPORT_MEMORY) {
+        create_intermediate_buffers(job);
+    }
+    if (job->spec->stream_reduce) {
+        run_streaming_with_processes(job, result);
+    } else {
+        run_map_reduce_with_processes(job, result);
+    }
+    if (job->intermediate_fds != NULL) {
+        close_intermediate_buffers(job);
+    }
+}
+
+// A worker connected to the coordinator of ENGINE_CLUSTER
+typedef struct _cluster_peer
+{
+    int sock; // -1 once the worker is gone
+    int pid;
+    char name[MR_WORKER_NAME_SIZE]; // "host:pid"
+    int task; // The task it runs in the current phase, or -1 when idle
+    int64_t task_start_ns;
+    int64_t last_seen_ns; // The last message from the worker, heartbeats included
+    int worker_idx; // Its worker stats in the current phase, or -1 until it finishes a task of the phase
+}CLUSTER_PEER;
+
+typedef struct _cluster
+{
+    int listen_fd;
+    int peer_num; // Slots of peers in use, some of them possibly gone
+    char input_path[PATH_MAX]; // The absolute path of the input, as the workers see it on the shared storage
+    CLUSTER_PEER peers[CLUSTER_MAX_WORKERS];
+}CLUSTER;
+
+typedef enum _cluster_task_state
+{
+    CLUSTER_TASK_PENDING = 0,
+    CLUSTER_TASK_RUNNING,
+    CLUSTER_TASK_DONE
+}CLUSTER_TASK_STATE;
+
+// The map or reduce phase of ENGINE_CLUSTER, with the result arrays of the phase
+typedef struct _cluster_phase
+{
+    int is_map;
+    int task_num;
+    char * task_state; // [task], CLUSTER_TASK_STATE
+    int * task_attempts; // [task], the attempts started
+    int max_attempts;
+    int done_num;
+    int worker_num; // The workers that finished tasks of the phase
+    int * worker_ids; // [task]
+    char (* worker_names)[MR_WORKER_NAME_SIZE]; // [task], or NULL
+    MAPREDUCE_TASK_STATS * task_stats; // [task]
+    MAPREDUCE_WORKER_STATS * worker_stats; // [task]
+}CLUSTER_PHASE;
+
+// Take in a new worker: its CLUSTER_MSG_HELLO, then the shape and input of the job
+static void accept_peer(JOB *job, CLUSTER *cluster) {
+    CLUSTER_MESSAGE message, fields = {0};
+    char name[MR_WORKER_NAME_SIZE];
+    int sock = cluster_accept(cluster->listen_fd), slot;
+
+    if (sock < 0) {
+        return;
+    }
+    for (slot = 0; slot < cluster->peer_num && cluster->peers[slot].sock >= 0; slot++) {
+    }
+    fields.split_num = job->split_num;
+    fields.reduce_num = job->reduce_num;
+    if (slot == CLUSTER_MAX_WORKERS || cluster_receive(sock, &message, name, sizeof(name) - 1) != SUCCESS ||
+        message.type != CLUSTER_MSG_HELLO ||
+        cluster_send(sock, CLUSTER_MSG_JOB, &fields, cluster->input_path, strlen(cluster->input_path) + 1) != SUCCESS) {
+        close(sock);
+        return;
+    }
+    name[message.length] = '\0';
+
+    CLUSTER_PEER *peer = &cluster->peers[slot];
+    peer->sock = sock;
+    peer->pid = message.task;
+    snprintf(peer->name, sizeof(peer->name), "%s", name);
+    peer->task = -1;
+    peer->worker_idx = -1;
+    peer->last_seen_ns = clock_ns(CLOCK_MONOTONIC);
+    if (slot == cluster->peer_num) {
+        cluster->peer_num++;
+    }
+}
+
+// Drop a worker that is gone or misbehaves; its running task goes back to the pending ones, unless
+// it has no attempt left
+static void lose_peer(CLUSTER_PHASE *phase, CLUSTER_PEER *peer, const char *reason) {
+    if (peer->task >= 0 && phase->task_attempts[peer->task] < phase->max_attempts) {
+        fprintf(stderr, "Error: Cluster worker %s %s; %s task %d runs again.\n", peer->name, reason,
+                phase->is_map ? "map" : "reduce", peer->task);
+        phase->task_state[peer->task] = CLUSTER_TASK_PENDING;
+    } else if (peer->task >= 0) {
+        fprintf(stderr, "Error: Cluster worker %s %s; %s task %d has no attempt left.\n", peer->name, reason,
+                phase->is_map ? "map" : "reduce", peer->task);
+        phase->task_state[peer->task] = CLUSTER_TASK_DONE; // Its status stays TASK_NOT_RUN
+        phase->done_num++;
+    }
+    peer->task = -1;
+    close(peer->sock);
+    peer->sock = -1;
+}
+
+// Send a task to a worker: the range of a split, or a partition followed by its intermediate files
+static int send_cluster_task(JOB *job, CLUSTER_PEER *peer, int is_map, int task) {
+    CLUSTER_MESSAGE fields = {0};
+    int i;
+
+    fields.task = task;
+    if (is_map) {
+        fields.offset = job->split_offsets[task];
+        fields.size = job->split_sizes[task];
+        return cluster_send(peer->sock, CLUSTER_MSG_MAP, &fields, NULL, 0);
+    }
+    if (cluster_send(peer->sock, CLUSTER_MSG_REDUCE, &fields, NULL, 0) != SUCCESS) {
+        return ERROR;
+    }
+    for (i = 0; i < job->split_num; i++) {
+        // The intermediate file of a failed map task may be missing: the reduce task fails on the empty file instead
+        int fd = open_intermediate(job, i * job->reduce_num + task, COMMITTED_ATTEMPT, 0);
+        int ret = cluster_send_file(peer->sock, fd);
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (ret != SUCCESS) {
+            return ERROR;
+        }
+    }
+    return SUCCESS;
+}
+
+// Receive the files a worker streams after a finished task into the intermediate or result files; the
+// intermediate files of a map attempt are committed once they are all in
+static int receive_task_output(JOB *job, CLUSTER_PEER *peer, int is_map, int task, int attempt) {
+    int part, fd, ret = SUCCESS;
+
+    if (!is_map) {
+        if ((fd = open(job->result_filenames[task], O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+            EXIT_ERROR(ERROR, "Error: Unable to create result file: %s\n", job->result_filenames[task]);
+        }
+        ret = cluster_receive_file(peer->sock, fd, NULL);
+        close(fd);
+        return ret;
+    }
+    for (part = 0; part < job->reduce_num && ret == SUCCESS; part++) {
+        if ((fd = open_intermediate(job, task * job->reduce_num + part, attempt, 1)) < 0) {
+            EXIT_ERROR(ERROR, "Error: Unable to create intermediate file: %s\n", job->intermediate_filenames[task * job->reduce_num + part]);
+        }
+        ret = cluster_receive_file(peer->sock, fd, NULL);
+        close(fd);
+    }
+    if (commit_intermediate(job, task, attempt, ret == SUCCESS) != SUCCESS) {
+        ret = ERROR;
+    }
+    return ret;
+}
+
+// Handle the next message of a worker: a heartbeat, or its finished task and the task's output
+static int receive_from_peer(JOB *job, CLUSTER_PHASE *phase, CLUSTER_PEER *peer) {
+    CLUSTER_MESSAGE message;
+    MAPREDUCE_TASK_STATS stats;
+
+    if (cluster_receive(peer->sock, &message, &stats, sizeof(stats)) != SUCCESS) {
+        return ERROR;
+    }
+    peer->last_seen_ns = clock_ns(CLOCK_MONOTONIC);
+    if (message.type == CLUSTER_MSG_HEARTBEAT) {
+        return SUCCESS;
+    }
+    if (message.type != (phase->is_map ? CLUSTER_MSG_MAP_DONE : CLUSTER_MSG_REDUCE_DONE) || message.task != peer->task ||
+        message.length != sizeof(stats)) {
+        return ERROR;
+    }
+    int task = peer->task, attempt = phase->task_attempts[task] - 1;
+    if (message.status == SUCCESS && receive_task_output(job, peer, phase->is_map, task, attempt) != SUCCESS) {
+        return ERROR;
+    }
+    if (message.status != SUCCESS && phase->task_attempts[task] < phase->max_attempts) {
+        fprintf(stderr, "Error: Attempt %d of %s task %d failed on cluster worker %s; it runs again.\n", attempt + 1,
+                phase->is_map ? "map" : "reduce", task, peer->name);
+        phase->task_state[task] = CLUSTER_TASK_PENDING;
+        peer->task = -1;
+        return SUCCESS;
+    }
+
+    // The task's own counters, with the start on this host's clock
+    phase->task_stats[task] = stats;
+    phase->task_stats[task].status = message.status;
+    phase->task_stats[task].worker_id = peer->pid;
+    phase->task_stats[task].start_ns = peer->task_start_ns - job->start_ns;
+    phase->task_stats[task].attempts = attempt + 1;
+    phase->worker_ids[task] = peer->pid;
+    if (phase->worker_names != NULL) {
+        snprintf(phase->worker_names[task], MR_WORKER_NAME_SIZE, "%s", peer->name);
+    }
+    if (peer->worker_idx < 0) {
+        peer->worker_idx = phase->worker_num++;
+        memset(&phase->worker_stats[peer->worker_idx], 0, sizeof(MAPREDUCE_WORKER_STATS));
+        phase->worker_stats[peer->worker_idx].worker_id = peer->pid;
+        phase->worker_stats[peer->worker_idx].start_ns = peer->task_start_ns - job->start_ns;
+    }
+    MAPREDUCE_WORKER_STATS *worker = &phase->worker_stats[peer->worker_idx];
+    worker->task_num++;
+    worker->wall_ns = peer->last_seen_ns - job->start_ns - worker->start_ns;
+
+    phase->task_state[task] = CLUSTER_TASK_DONE;
+    phase->done_num++;
+    peer->task = -1;
+    return SUCCESS;
+}
+
+// One phase of ENGINE_CLUSTER: hand the tasks to the connected workers one at a time (taking in the
+// workers that join meanwhile) until all of them are done; the task of a lost worker runs again elsewhere.
+// @ret: The number of workers that ran tasks of the phase.
+static int run_cluster_phase(JOB *job, CLUSTER *cluster, CLUSTER_PHASE *phase, int64_t *phase_ns) {
+    int64_t start_ns = clock_ns(CLOCK_MONOTONIC);
+    struct pollfd fds[1 + CLUSTER_MAX_WORKERS];
+    int i, task, next_task = 0;
+
+    phase->task_state = calloc(phase->task_num, 1);
+    phase->task_attempts = calloc(phase->task_num, sizeof(int));
+    if (phase->task_state == NULL || phase->task_attempts == NULL) {
+        EXIT_ERROR(ERROR, "Error: Memory allocation failed for the cluster tasks.\n");
+    }
+    for (task = 0; task < phase->task_num; task++) {
+        memset(&phase->task_stats[task], 0, sizeof(MAPREDUCE_TASK_STATS));
+        phase->task_stats[task].status = TASK_NOT_RUN;
+        phase->worker_ids[task] = 0;
+    }
+    for (i = 0; i < cluster->peer_num; i++) {
+        cluster->peers[i].task = -1;
+        cluster->peers[i].worker_idx = -1;
+    }
+
+    while (phase->done_num < phase->task_num) {
+        // Hand a pending task to each idle worker
+        for (i = 0; i < cluster->peer_num; i++) {
+            CLUSTER_PEER *peer = &cluster->peers[i];
+            if (peer->sock < 0 || peer->task >= 0) {
+                continue;
+            }
+            for (task = next_task; task < phase->task_num && phase->task_state[task] != CLUSTER_TASK_PENDING; task++) {
+            }
+            if (task == phase->task_num) {
+                for (task = 0; task < next_task && phase->task_state[task] != CLUSTER_TASK_PENDING; task++) {
+                }
+                if (task == next_task) {
+                    break; // Every task is running or done
+                }
+            }
+            next_task = task + 1;
+            peer->task = task;
+            peer->task_start_ns = clock_ns(CLOCK_MONOTONIC);
+            phase->task_state[task] = CLUSTER_TASK_RUNNING;
+            phase->task_attempts[task]++;
+            if (send_cluster_task(job, peer, phase->is_map, task) != SUCCESS) {
+                lose_peer(phase, peer, "is unreachable");
+            }
+        }
+
+        // Wait for messages and new workers; a worker's heartbeats keep it alive while it runs a task
+        int polled_num = cluster->peer_num;
+        fds[0].fd = cluster->listen_fd;
+        fds[0].events = POLLIN;
+        for (i = 0; i < polled_num; i++) {
+            fds[1 + i].fd = cluster->peers[i].sock; // Ignored by poll() once negative
+            fds[1 + i].events = POLLIN;
+            fds[1 + i].revents = 0;
+        }
+        if (poll(fds, 1 + polled_num, CLUSTER_HEARTBEAT_MS) < 0 && errno != EINTR) {
+            EXIT_ERROR(ERROR, "Error: Waiting for the cluster workers failed.\n");
+        }
+        int64_t now_ns = clock_ns(CLOCK_MONOTONIC);
+        for (i = 0; i < polled_num; i++) {
+            CLUSTER_PEER *peer = &cluster->peers[i];
+            if (peer->sock < 0) {
+                continue;
+            }
+            if (fds[1 + i].revents != 0) {
+                if (receive_from_peer(job, phase, peer) != SUCCESS) {
+                    lose_peer(phase, peer, "disconnected");
+                }
+            } else if (now_ns - peer->last_seen_ns > (int64_t)CLUSTER_TIMEOUT_MS * 1000000) {
+                lose_peer(phase, peer, "stopped sending heartbeats");
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            accept_peer(job, cluster);
+        }
+    }
+
+    for (task = 0; task < phase->task_num; task++) {
+        phase->task_stats[task].attempts = phase->task_attempts[task];
+    }
+    free(phase->task_attempts);
+    free(phase->task_state);
+    phase->task_attempts = NULL;
+    phase->task_state = NULL;
+    *phase_ns = clock_ns(CLOCK_MONOTONIC) - start_ns;
+    return phase->worker_num;
+}
+
+// Phases 2-4 with ENGINE_CLUSTER: this process coordinates the workers that connect over TCP, and keeps
+// the intermediate data they stream back in files or memory files, per the transport
+static void run_with_cluster(JOB *job, MAPREDUCE_RESULT *result) {
+    CLUSTER *cluster = calloc(1, sizeof(CLUSTER));
+    CLUSTER_PHASE phase = {0};
+    int i;
+
+    if (cluster == NULL) {
+        EXIT_ERROR(ERROR, "Error: Memory allocation failed for the cluster.\n");
+    }
+    if (realpath(job->input_path, cluster->input_path) == NULL) {
+        EXIT_ERROR(ERROR, "Error: Unable to resolve the path of input file: %s\n", job->input_path);
+    }
+    if ((cluster->listen_fd = cluster_listen(job->spec->cluster_address)) < 0) {
+        EXIT_ERROR(ERROR, "Error: Unable to listen for cluster workers on %s\n", job->spec->cluster_address);
+    }
+    if (job->spec->transport == TRANSPORT_MEMORY) {
+        create_intermediate_buffers(job);
+    }
+
+    // The coordinator starts no worker: the spawn times stay 0
+    result->map_spawn_ns = result->reduce_spawn_ns = 0;
+    phase.is_map = 1;
+    phase.task_num = job->split_num;
+    phase.max_attempts = job->task_attempts;
+    phase.worker_ids = result->map_worker_pid;
+    phase.worker_names = result->map_worker_name;
+    phase.task_stats = job->task_stats;
+    phase.worker_stats = job->worker_stats;
+    TRACE_BEGIN("map phase", job->split_num);
+    result->map_worker_num = run_cluster_phase(job, cluster, &phase, &result->map_ns);
+    TRACE_END("map phase", result->map_worker_num);
+
+    // Like run_reduce_phase()
+    if (finish_map_phase(job) != SUCCESS) {
+        fprintf(stderr, "Error: Some splits failed every attempt; the reduce phase is skipped.\n");
+        result->reduce_worker_num = 0;
+    } else {
+        memset(&phase, 0, sizeof(phase));
+        phase.task_num = job->reduce_num;
+        phase.max_attempts = job->task_attempts;
+        phase.worker_ids = result->reduce_worker_pid;
+        phase.worker_names = result->reduce_worker_name;
+        phase.task_stats = job->task_stats + job->split_num;
+        phase.worker_stats = job->worker_stats + job->split_num;
+        TRACE_BEGIN("reduce phase", job->reduce_num);
+        result->reduce_worker_num = run_cluster_phase(job, cluster, &phase, &result->reduce_ns);
+        TRACE_END("reduce phase", result->reduce_worker_num);
+    }
+
+    // Report every task that did not complete, like run_phase()
+    for (i = 0; i < job->split_num + job->reduce_num; i++) {
+        if (job->task_stats[i].status != SUCCESS) {
+            fprintf(stderr, "Error: %s worker %d failed.\n", i < job->split_num ? "Map" : "Reduce",
+                    i < job->split_num ? i : i - job->split_num);
+        }
+    }
+
+    for (i = 0; i < cluster->peer_num; i++) {
+        if (cluster->peers[i].sock >= 0) {
+            cluster_send(cluster->peers[i].sock, CLUSTER_MSG_EXIT, NULL, NULL, 0);
+            close(cluster->peers[i].sock);
+        }
+    }
+    close(cluster->listen_fd);
+    free(cluster);
+    if (job->intermediate_fds != NULL) {
+        close_intermediate_buffers(job);
+    }
+}
+
+/* Admission control: bound the map and reduce workers by spec->max_inflight, and by the workers whose
+   tasks spec->memory_budget holds at once. A worker runs one task at a time, so the admitted workers are
+   the tasks in flight; the scheduler hands out the rest as they finish. The budget left over is shared
+   out to the aggregation buffers of the map workers. At least one worker of each phase always runs.
+ */
+static void admit_workers(JOB *job) {
+    MAPREDUCE_SPEC *spec = job->spec;
+    size_t task_memory = MR_TASK_MEMORY + (size_t)job->reduce_num * sizeof(ITM_WRITER); // The partition writers
+    size_t emit_budget = spec->emit_buffer_size > 0 ? spec->emit_buffer_size : MR_EMIT_BUFFER_SIZE;
+    int admitted;
+
+    if (spec->max_inflight > 0) {
+        job->map_worker_num = job->map_worker_num < spec->max_inflight ? job->map_worker_num : spec->max_inflight;
+        job->reduce_worker_num = job->reduce_worker_num < spec->max_inflight ? job->reduce_worker_num : spec->max_inflight;
+    }
+    if (spec->memory_budget > 0) {
+        if (spec->split_mode == SPLIT_MODE_STREAM) {
+            task_memory += 2 * (spec->stream_chunk_size > 0 ? spec->stream_chunk_size : MR_STREAM_CHUNK_SIZE); // Its chunk slots
+        }
+        size_t emit_min = (spec->emit_map_func != NULL && spec->merge_func != NULL) ? MR_EMIT_SHARE_MIN : 0;
+        admitted = spec->memory_budget / (task_memory + emit_min);
+        admitted = admitted > 0 ? admitted : 1;
+        job->map_worker_num = job->map_worker_num < admitted ? job->map_worker_num : admitted;
+        admitted = spec->memory_budget / task_memory;
+        admitted = admitted > 0 ? admitted : 1;
+        job->reduce_worker_num = job->reduce_worker_num < admitted ? job->reduce_worker_num : admitted;
+
+        size_t share = spec->memory_budget / job->map_worker_num;
+        share = share > task_memory + MR_EMIT_SHARE_MIN ? share - task_memory : MR_EMIT_SHARE_MIN;
+        emit_budget = emit_budget < share ? emit_budget : share;
+        emit_budget = emit_budget > MR_EMIT_SHARE_MIN ? emit_budget : MR_EMIT_SHARE_MIN; // Each spill is a file of its own
+        job->spill_to_disk = 1;
+    }
+    job->emit_budget = emit_budget;
+}
+
+// Start recording the trace of spec->trace_path, with a ring for the calling thread and ring_num - 1 for the workers
+static void start_trace(JOB *job, int ring_num, const char *name) {
+    if (job->spec->trace_path == NULL) {
+        return;
+    }
+    if ((job->trace = trace_create(ring_num)) == NULL) {
+        fprintf(stderr, "Error: Unable to trace the job (was it built with TRACE=0?); no trace is written.\n");
+        return;
+    }
+    trace_attach(job->trace, name, -1);
+}
+
+static void finish_trace(JOB *job) {
+    if (job->trace == NULL) {
+        return;
+    }
+    trace_detach();
+    if (trace_write(job->trace, job->spec->trace_path) != SUCCESS) {
+        fprintf(stderr, "Error: Unable to write the trace file: %s\n", job->spec->trace_path);
+    }
+    trace_destroy(job->trace);
+    job->trace = NULL;
+}
+
+// The connection of an ENGINE_CLUSTER worker to its coordinator, shared with the heartbeat thread
+typedef struct _cluster_link
+{
+    int sock;
+    pthread_mutex_t lock; // Held for a whole message, files included
+    pthread_mutex_t stop_lock;
+    pthread_cond_t stop_cond;
+    int stopping;
+}CLUSTER_LINK;
+
+static void *heartbeat_thread(void *arg) {
+    CLUSTER_LINK *link = arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&link->stop_lock);
+    while (!link->stopping) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += CLUSTER_HEARTBEAT_MS / 1000;
+        deadline.tv_nsec += (CLUSTER_HEARTBEAT_MS % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if (pthread_cond_timedwait(&link->stop_cond, &link->stop_lock, &deadline) == ETIMEDOUT) {
+            pthread_mutex_lock(&link->lock);
+            cluster_send(link->sock, CLUSTER_MSG_HEARTBEAT, NULL, NULL, 0);
+            pthread_mutex_unlock(&link->lock);
+        }
+    }
+    pthread_mutex_unlock(&link->stop_lock);
+    return NULL;
+}
+
+// Empty an in-memory file of a worker for its next use, giving its memory back
+static void reset_buffer(int fd) {
+    if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) < 0) {
+        EXIT_ERROR(ERROR, "Error: Unable to reset an in-memory file.\n");
+    }
+}
+
+// Run one task of the coordinator on this worker and stream its result back
+static void run_cluster_worker_task(JOB *job, CLUSTER_LINK *link, const CLUSTER_MESSAGE *message) {
+    int is_map = message->type == CLUSTER_MSG_MAP, task = message->task, i, ret = SUCCESS;
+    int task_num = is_map ? job->split_num : job->reduce_num;
+    CLUSTER_MESSAGE fields = {0};
+    MAPREDUCE_TASK_STATS stats;
+
+    if (task < 0 || task >= task_num) {
+        EXIT_ERROR(ERROR, "Error: The coordinator sent %s task %d of %d.\n", is_map ? "map" : "reduce", task, task_num);
+    }
+    if (is_map) {
+        job->split_offsets[task] = message->offset;
+        job->split_sizes[task] = message->size;
+    } else {
+        // The intermediate files of the partition follow the task
+        for (i = 0; i < job->split_num; i++) {
+            if (cluster_receive_file(link->sock, job->intermediate_fds[i * job->reduce_num + task], NULL) != SUCCESS) {
+                EXIT_ERROR(ERROR, "Error: Lost the coordinator while receiving reduce task %d.\n", task);
+            }
+        }
+        reset_buffer(job->result_fds[task]);
+    }
+
+    fields.task = task;
+    fields.status = run_timed_task(job, is_map ? run_map_task : run_reduce_task, task, 0, &stats, getpid());
+
+    pthread_mutex_lock(&link->lock);
+    ret = cluster_send(link->sock, is_map ? CLUSTER_MSG_MAP_DONE : CLUSTER_MSG_REDUCE_DONE, &fields, &stats, sizeof(stats));
+    if (fields.status == SUCCESS) {
+        if (is_map) {
+            for (i = 0; i < job->reduce_num && ret == SUCCESS; i++) {
+                ret = cluster_send_file(link->sock, job->intermediate_fds[task * job->reduce_num + i]);
+            }
+        } else if (ret == SUCCESS) {
+            ret = cluster_send_file(link->sock, job->result_fds[task]);
+        }
+    }
+    pthread_mutex_unlock(&link->lock);
+    if (ret != SUCCESS) {
+        EXIT_ERROR(ERROR, "Error: Lost the coordinator while sending %s task %d.\n", is_map ? "map" : "reduce", task);
+    }
+
+    // Whatever was sent is the coordinator's now
+    for (i = 0; i < (is_map ? job->reduce_num : job->split_num); i++) {
+        reset_buffer(job->intermediate_fds[is_map ? task * job->reduce_num + i : i * job->reduce_num + task]);
+    }
+    if (!is_map) {
+        reset_buffer(job->result_fds[task]);
+    }
+}
+
+// mapreduce() of an ENGINE_CLUSTER worker: run the tasks of the coordinator, with the intermediate and
+// result data in memory files, until the coordinator ends the job
+static void run_cluster_worker(MAPREDUCE_SPEC *spec, MAPREDUCE_RESULT *result, int64_t start_ns) {
+    char name[MR_WORKER_NAME_SIZE], host[64], input_path[CLUSTER_MAX_PAYLOAD + 1];
+    CLUSTER_MESSAGE message, fields = {0};
+    CLUSTER_LINK link = {0};
+    pthread_t heartbeat;
+    JOB job = {0};
+    int i;
+
+    if (spec->cluster_address == NULL || (link.sock = cluster_connect(spec->cluster_address, CLUSTER_CONNECT_TIMEOUT_MS)) < 0) {
+        EXIT_ERROR(ERROR, "Error: Unable to reach the cluster coordinator at %s\n", spec->cluster_address ? spec->cluster_address : "(none)");
+    }
+    if (gethostname(host, sizeof(host)) != 0) {
+        strcpy(host, "localhost");
+    }
+    host[sizeof(host) - 1] = '\0';
+    snprintf(name, sizeof(name), "%s:%d", host, getpid());
+    fields.task = getpid();
+    if (cluster_send(link.sock, CLUSTER_MSG_HELLO, &fields, name, strlen(name)) != SUCCESS ||
+        cluster_receive(link.sock, &message, input_path, sizeof(input_path) - 1) != SUCCESS || message.type != CLUSTER_MSG_JOB ||
+        message.split_num <= 0 || message.reduce_num <= 0) {
+        EXIT_ERROR(ERROR, "Error: The cluster coordinator at %s did not send a job.\n", spec->cluster_address);
+    }
+    input_path[message.length] = '\0';
+
+    // The job as the coordinator planned it; the splits' ranges come with their tasks
+    job.spec = spec;
+    job.input_path = input_path;
+    job.split_num = message.split_num;
+    job.reduce_num = message.reduce_num;
+    job.map_worker_num = job.reduce_worker_num = 1;
+    admit_workers(&job);
+    job.start_ns = start_ns;
+    start_trace(&job, 1, "Cluster worker"); // Its tasks run on this thread
+    arena_init(&job.arena, 0);
+    job.split_filenames = job_alloc(&job, job.split_num * sizeof(char *));
+    job.split_offsets = job_alloc(&job, job.split_num * sizeof(off_t));
+    job.split_sizes = job_alloc(&job, job.split_num * sizeof(off_t));
+    for (i = 0; i < job.split_num; i++) {
+        job.split_filenames[i] = NULL;
+    }
+    name_job_files(&job);
+    itm_set_compression(spec->compress_intermediate);
+    create_intermediate_buffers(&job);
+    job.result_fds = job_alloc(&job, job.reduce_num * sizeof(int));
+    for (i = 0; i < job.reduce_num; i++) {
+        if ((job.result_fds[i] = create_buffer(&job, job.result_filenames[i])) < 0) {
+            EXIT_ERROR(ERROR, "Error: Unable to create result buffer: %s\n", job.result_filenames[i]);
+        }
+    }
+
+    pthread_mutex_init(&link.lock, NULL);
+    pthread_mutex_init(&link.stop_lock, NULL);
+    pthread_cond_init(&link.stop_cond, NULL);
+    if (pthread_create(&heartbeat, NULL, heartbeat_thread, &link) != 0) {
+        EXIT_ERROR(ERROR, "Error: Unable to start the heartbeat thread.\n");
+    }
+
+    for (;;) {
+        if (cluster_receive(link.sock, &message, NULL, 0) != SUCCESS) {
+            EXIT_ERROR(ERROR, "Error: Lost the cluster coordinator at %s\n", spec->cluster_address);
+        }
+        if (message.type == CLUSTER_MSG_EXIT) {
+            break;
+        }
+        if (message.type != CLUSTER_MSG_MAP && message.type != CLUSTER_MSG_REDUCE) {
+            EXIT_ERROR(ERROR, "Error: Unexpected message %u from the cluster coordinator.\n", message.type);
+        }
+        if (message.type == CLUSTER_MSG_MAP) {
+            result->map_worker_num++;
+        } else {
+            result->reduce_worker_num++;
+        }
+        run_cluster_worker_task(&job, &link, &message);
+    }
+
+    pthread_mutex_lock(&link.stop_lock);
+    link.stopping = 1;
+    pthread_cond_signal(&link.stop_cond);
+    pthread_mutex_unlock(&link.stop_lock);
+    pthread_join(heartbeat, NULL);
+    close(link.sock);
+
+    for (i = 0; i < job.reduce_num; i++) {
+        close(job.result_fds[i]);
+    }
+    close_intermediate_buffers(&job);
+    arena_reset(&job.arena);
+    io_buffer_pool_reset();
+    finish_trace(&job);
+    result->total_ns = clock_ns(CLOCK_MONOTONIC) - start_ns;
+    result->processing_time = result->total_ns / 1000;
+}
+
+// The seed of the cache keys: what decides the intermediate files of a split besides its bytes
+static uint64_t cache_seed(MAPREDUCE_SPEC *spec, int reduce_num) {
+    int shape[] = {reduce_num, spec->combine_func != NULL, spec->group_reduce_func != NULL, spec->emit_map_func != NULL,
+                   spec->merge_func != NULL, spec->partition_func != NULL, spec->compress_intermediate};
+    CACHE_HASHER hasher;
+
+    if (spec->cache_tag == NULL) {
+        return 0;
+    }
+    cache_hash_init(&hasher, CACHE_VERSION);
+    cache_hash_update(&hasher, spec->cache_tag, strlen(spec->cache_tag) + 1);
+    cache_hash_update(&hasher, shape, sizeof(shape));
+    return cache_hash_final(&hasher);
+}
+
+// Copy counters out of the shared stats mapping into an optional result array
+static void copy_stats(void *dst, const void *src, size_t size) {
+    if (dst != NULL) {
+        memcpy(dst, src, size);
+    }
+}
+
+void mapreduce(MAPREDUCE_SPEC *spec, MAPREDUCE_RESULT *result) {
+    int64_t start_ns = clock_ns(CLOCK_MONOTONIC);
+
+    if (spec == NULL || result == NULL) {
+        EXIT_ERROR(ERROR, "Error: 'spec' or 'result' is NULL.\n");
+    }
+    if (spec->engine == ENGINE_CLUSTER && spec->cluster_worker) {
+        run_cluster_worker(spec, result, start_ns);
+        return;
+    }
+
+    // Variables initialization
+    off_t input_file_size;
+    int i;
+    int total_splits = spec->split_num;
+    int reduce_num = spec->reduce_num > 0 ? spec->reduce_num : 1;
+    struct stat input_stat;
+    JOB job = {0};
+
+    if (total_splits <= 0) {
+        EXIT_ERROR(ERROR, "Error: Invalid number of splits: %d\n", total_splits);
+    }
+    if (spec->stream_reduce && spec->combine_func == NULL) {
+        EXIT_ERROR(ERROR, "Error: 'stream_reduce' needs a combine function to merge the intermediate files.\n");
+    }
+    if (spec->stream_reduce && spec->group_reduce_func != NULL) {
+        EXIT_ERROR(ERROR, "Error: 'stream_reduce' cannot be used with a group reduce function.\n");
+    }
+    if (spec->engine == ENGINE_CLUSTER && (spec->cluster_address == NULL || spec->stream_reduce)) {
+        EXIT_ERROR(ERROR, "Error: ENGINE_CLUSTER needs a 'cluster_address', and cannot be used with 'stream_reduce'.\n");
+    }
+    if (spec->cache_dir != NULL && (spec->cache_tag == NULL || spec->engine == ENGINE_CLUSTER)) {
+        EXIT_ERROR(ERROR, "Error: 'cache_dir' needs a 'cache_tag', and cannot be used with ENGINE_CLUSTER.\n");
+    }
+    if (spec->cache_dir != NULL && mkdir(spec->cache_dir, 0777) != 0 && errno != EEXIST) {
+        EXIT_ERROR(ERROR, "Error: Unable to create cache directory: %s\n", spec->cache_dir);
+    }
+    if (spec->pin_workers && spec->engine == ENGINE_CLUSTER) {
+        EXIT_ERROR(ERROR, "Error: 'pin_workers' cannot be used with ENGINE_CLUSTER.\n");
+    }
+    if ((spec->memory_budget > 0 || spec->max_inflight > 0) && spec->stream_reduce) {
+        EXIT_ERROR(ERROR, "Error: 'memory_budget' and 'max_inflight' cannot be used with 'stream_reduce', whose reducers all run at once.\n");
+    }
+    if (spec->memory_budget > 0 && spec->compress_intermediate) {
+        EXIT_ERROR(ERROR, "Error: 'memory_budget' cannot be used with 'compress_intermediate', read back a whole file at a time.\n");
+    }
+    int stream_input = spec->split_mode == SPLIT_MODE_STREAM;
+    if (stream_input && (spec->engine == ENGINE_CLUSTER || spec->cache_dir != NULL)) {
+        EXIT_ERROR(ERROR, "Error: SPLIT_MODE_STREAM cannot be used with ENGINE_CLUSTER or a 'cache_dir'.\n");
+    }
+
+    // A compressed input cannot be cut at arbitrary offsets: decompress it once, and split the copy
+    int64_t split_start_ns = clock_ns(CLOCK_MONOTONIC);
+    job.input_path = spec->input_data_filepath;
+    if (!stream_input && input_is_compressed(job.input_path)) {
+        if (input_decompress(job.input_path, MR_INPUT_COPY_FILE) != SUCCESS) {
+            EXIT_ERROR(ERROR, "Error: Unable to decompress input file: %s\n", spec->input_data_filepath);
+        }
+        job.input_path = MR_INPUT_COPY_FILE;
+    }
+    itm_set_compression(spec->compress_intermediate);
+
+    // Open the input file, or the input stream, which has no size
+    int input_fd = stream_input ? stream_open(job.input_path) : open(job.input_path, O_RDONLY);
+    if (input_fd < 0) {
+        EXIT_ERROR(ERROR, "Error: Unable to open input file: %s\n", job.input_path);
+    }
+
+    // Calculate input file size
+    if (!stream_input && fstat(input_fd, &input_stat) < 0) {
+        close(input_fd);
+        EXIT_ERROR(ERROR, "Error: Unable to stat input file: %s\n", job.input_path);
+    }
+    input_file_size = stream_input ? 0 : input_stat.st_size;
+
+    // Allocate memory for split, intermediate and result file names, and the split ranges
+    job.spec = spec;
+    job.split_num = total_splits;
+    job.reduce_num = reduce_num;
+    if (spec->worker_num > 0) {
+        job.map_worker_num = job.reduce_worker_num = spec->worker_num;
+    } else if (spec->engine == ENGINE_THREADS) {
+        long cpu_num = sysconf(_SC_NPROCESSORS_ONLN);
+        job.map_worker_num = job.reduce_worker_num = cpu_num > 0 ? cpu_num : 1;
+    } else {
+        // One process per split and per partition
+        job.map_worker_num = total_splits;
+        job.reduce_worker_num = reduce_num;
+    }
+    admit_workers(&job);
+    // The parent, the stream producer, then the workers, with as many again for the ones that replace lost workers
+    start_trace(&job, 2 + 2 * (job.map_worker_num + job.reduce_worker_num), "mapreduce");
+    TRACE_BEGIN("split", total_splits);
+    job.task_attempts = spec->task_attempts > 0 ? spec->task_attempts : MR_TASK_ATTEMPTS;
+    if (stream_input) {
+        job.task_attempts = 1; // The chunks a failed attempt took are gone
+    }
+    arena_init(&job.arena, 0);
+    job.split_filenames = job_alloc(&job, total_splits * sizeof(char *));
+    job.split_offsets = job_alloc(&job, total_splits * sizeof(off_t));
+    job.split_sizes = job_alloc(&job, total_splits * sizeof(off_t));
+    job.split_keys = spec->cache_dir != NULL ? job_alloc(&job, total_splits * sizeof(uint64_t)) : NULL;
+    if (spec->pin_workers) {
+        job.placement = job_alloc(&job, sizeof(PLACEMENT));
+        if (placement_init(job.placement) != SUCCESS) {
+            fprintf(stderr, "Error: Unable to read the CPUs of the process; the workers are not pinned.\n");
+            job.placement = NULL;
+        }
+    }
+
+    // The workers report their counters through shared memory, which also works across fork()
+    job.start_ns = start_ns;
+    size_t stats_length = (total_splits + reduce_num) * (sizeof(MAPREDUCE_TASK_STATS) + sizeof(MAPREDUCE_WORKER_STATS));
+    job.task_stats = mmap(NULL, stats_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (job.task_stats == MAP_FAILED) {
+        close(input_fd);
+        EXIT_ERROR(ERROR, "Error: Unable to allocate the worker counters.\n");
+    }
+    job.worker_stats = (MAPREDUCE_WORKER_STATS *)(job.task_stats + total_splits + reduce_num);
+
+    name_job_files(&job);
+
+    // Phase 1: Splitting the input file into chunks; the workers of a cluster only see the input file
+    int copy_splits = spec->split_mode == SPLIT_MODE_FILES && spec->engine != ENGINE_CLUSTER;
+    for (i = 0; i < total_splits; i++) {
+        job.split_filenames[i] = copy_splits ? make_filename(&job, "split-%d", i) : NULL;
+    }
+    if (stream_input) {
+        // The lanes take the chunks the producer cuts while they run, up to two per map worker at a time
+        size_t chunk_size = spec->stream_chunk_size > 0 ? spec->stream_chunk_size : MR_STREAM_CHUNK_SIZE;
+        memset(job.split_offsets, 0, total_splits * sizeof(off_t));
+        memset(job.split_sizes, 0, total_splits * sizeof(off_t));
+        job.stream_fd = input_fd;
+        job.stream = stream_queue_create(chunk_size, 2 * job.map_worker_num);
+        if (job.stream == NULL || pthread_create(&job.stream_producer, NULL, stream_producer_thread, &job) != 0) {
+            close(input_fd);
+            EXIT_ERROR(ERROR, "Error: Unable to start reading the input stream: %s\n", job.input_path);
+        }
+    } else {
+        if (plan_splits(&job, input_fd, input_file_size, copy_splits, cache_seed(spec, reduce_num)) != SUCCESS) {
+            close(input_fd);
+            EXIT_ERROR(ERROR, "Error: Failed to split input file: %s\n", job.input_path);
+        }
+        close(input_fd);
+    }
+    result->split_ns = clock_ns(CLOCK_MONOTONIC) - split_start_ns;
+    TRACE_END("split", total_splits);
+
+    // Phases 2-4: map, then reduce
+    if (spec->engine == ENGINE_THREADS) {
+        run_with_threads(&job, result);
+    } else if (spec->engine == ENGINE_CLUSTER) {
+        run_with_cluster(&job, result);
+    } else {
+        run_with_processes(&job, result);
+    }
+
+    // Phase 5: Cleanup resources
+    if (job.input_path != spec->input_data_filepath) {
+        unlink(job.input_path);
+    }
+    arena_reset(&job.arena);
+    io_buffer_pool_reset();
+
+    result->cached_split_num = 0;
     for (i = 0; i < total_splits; i++) {
-        free(split_filenames[i]);
-        free(intermediate_filenames[i]);
+        result->cached_split_num += job.task_stats[i].cached;
     }
-    free(split_filenames);
-    free(intermediate_filenames);
-    free(map_worker_pids);
+    copy_stats(result->map_task_stats, job.task_stats, total_splits * sizeof(MAPREDUCE_TASK_STATS));
+    copy_stats(result->reduce_task_stats, job.task_stats + total_splits, reduce_num * sizeof(MAPREDUCE_TASK_STATS));
+    copy_stats(result->map_worker_stats, job.worker_stats, result->map_worker_num * sizeof(MAPREDUCE_WORKER_STATS));
+    copy_stats(result->reduce_worker_stats, job.worker_stats + total_splits, result->reduce_worker_num * sizeof(MAPREDUCE_WORKER_STATS));
+    munmap(job.task_stats, stats_length);
+    finish_trace(&job);
 
     // Record processing time
-    gettimeofday(&end_time, NULL);
-    result->processing_time = (end_time.tv_sec - start_time.tv_sec) * US_PER_SEC + (end_time.tv_usec - start_time.tv_usec);
+    result->total_ns = clock_ns(CLOCK_MONOTONIC) - start_ns;
+    result->processing_time = result->total_ns / 1000;
 }
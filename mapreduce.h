@@ -3,34 +3,217 @@
 #ifndef _MAPREDUCE_H
 #define _MAPREDUCE_H
 
+#include <stdio.h>
+#include <sys/types.h>
+#include <stdint.h>
+
+#define MR_RESULT_FILE "mr.rst" /* The result file when there is a single reduce worker */
+#define MR_RESULT_PART_FILE_FMT "mr-%d.rst" /* The result file of each partition when there are several reduce workers */
+#define MR_INPUT_COPY_FILE "mr-input" /* The decompressed copy of a compressed input file, removed at the end */
+#define MR_EMIT_BUFFER_SIZE (64 * 1024 * 1024) /* The default memory budget of the aggregation buffer of mapreduce_emit() */
+#define MR_WORKER_NAME_SIZE 80 /* "host:pid" of a worker of ENGINE_CLUSTER, NUL included */
+#define MR_TASK_ATTEMPTS 3 /* The default attempts of a failed task, or of the task of a lost worker, before the task fails */
+#define MR_STREAM_CHUNK_SIZE (4 * 1024 * 1024) /* The default size of the chunks of SPLIT_MODE_STREAM */
+#define MR_TASK_MEMORY (8 * 1024 * 1024) /* What memory_budget reckons a running task takes besides its aggregation buffer and
+                                            partition writers: the read-ahead and stdio buffers, the merge state, the stack */
+#define MR_EMIT_SHARE_MIN (4 * 1024 * 1024) /* The smallest aggregation buffer memory_budget leaves an admitted map worker */
+#define MR_STREAM_INPUT "-" /* The input_data_filepath of SPLIT_MODE_STREAM for the standard input */
+#define MR_ALL_PARTITIONS -1 /* The partition_func result of a record that goes to every partition */
+
+/* How the input file is divided among the map workers */
+typedef enum _split_mode
+{
+    SPLIT_MODE_FILES = 0, /* Copy each split into its own "split-N" file before the map phase (default) */
+    SPLIT_MODE_RANGE,     /* Only plan newline-aligned byte ranges; each map worker reads its range of the input file */
+    SPLIT_MODE_MMAP,      /* Like SPLIT_MODE_RANGE, and each map worker also maps its range into memory (DATA_SPLIT.base) */
+    SPLIT_MODE_STREAM     /* Read the input as a stream (MR_STREAM_INPUT, a pipe, a FIFO or a Unix-domain socket) while the map
+                             workers run, in newline-aligned chunks handed out through a bounded queue (see stream.h). Each of
+                             the split_num splits is then a lane: its map task maps chunks, in memory (DATA_SPLIT.base), until
+                             the stream ends. ENGINE_FORK or ENGINE_THREADS, without cache_dir; a task runs once, without backups */
+}SPLIT_MODE;
+
+/* How the map and reduce workers are run */
+typedef enum _engine
+{
+    ENGINE_FORK = 0, /* One forked process per map or reduce worker, intermediate data in mr-*.itm files (default) */
+    ENGINE_THREADS,  /* A pool of threads in this process, intermediate data in memory */
+    ENGINE_CLUSTER   /* Workers on other hosts connect over TCP (see cluster.h) and run the tasks; this process coordinates
+                        them and keeps the intermediate data. The input file must be on storage shared by all hosts */
+}ENGINE;
+
+/* Where the intermediate data goes with ENGINE_FORK, and on the coordinator of ENGINE_CLUSTER (ENGINE_THREADS always keeps it in memory) */
+typedef enum _transport
+{
+    TRANSPORT_FILES = 0, /* mr-*.itm files in the working directory (default): they can be inspected, and may exceed memory */
+    TRANSPORT_MEMORY     /* Memory files (memfd) created by the parent before the workers are forked: the map workers write
+                            them and the reduce workers map them directly, with nothing in the file system */
+}TRANSPORT;
+
+/* How a map function reads its split through DATA_SPLIT.fd (with an INPUT_READER, see input.h) */
+typedef enum _io_backend
+{
+    IO_BACKEND_READ = 0, /* Plain read() (default) */
+    IO_BACKEND_DIRECT,   /* O_DIRECT reads into aligned buffers, bypassing the page cache; read() where not supported */
+    IO_BACKEND_URING,    /* Several reads in flight with io_uring, O_DIRECT where supported; O_DIRECT or read() without io_uring */
+    IO_BACKEND_AUTO      /* IO_BACKEND_URING for large splits, IO_BACKEND_READ for small ones */
+}IO_BACKEND;
+
 /* The data split type */
 typedef struct _data_split
 {
     int fd;  /* The file descriptor of the input data file */
-    int size; /* The size of the split */
-    void * usr_data;  /* This field is used only by the "Word finder" program: it records the word to find in the input data file */
+    off_t size; /* The size of the split, in bytes, starting at the current offset of fd */
+    off_t offset; /* Where the split starts in the input (where the chunk starts in the stream, with SPLIT_MODE_STREAM) */
+    const char * base; /* The split's bytes mapped in memory, or NULL when the split is only readable through fd */
+    size_t length; /* The number of bytes readable at base */
+    IO_BACKEND io_backend; /* How to read the split through fd */
+    void * usr_data;  /* This field is used only by the "Word finder" program: it records the words to find (a WORD_LIST) in the input data file */
 }DATA_SPLIT;
 
+/* The context of mapreduce_emit(), given to MAPREDUCE_SPEC.emit_map_func */
+typedef struct _emitter EMITTER;
+
+/* The values of one key group, given to MAPREDUCE_SPEC.group_reduce_func and read with mapreduce_next_value() */
+typedef struct _reduce_values REDUCE_VALUES;
+
 typedef struct _mapreduce_spec
 {
-    char * input_data_filepath; /* The path of the (large) input data file */
+    char * input_data_filepath; /* The path of the (large) input data file; a gzip file is decompressed first */
     int split_num; /* The number of splits */
+    SPLIT_MODE split_mode; /* How the splits are handed to the map workers */
     int (*map_func)(DATA_SPLIT * split, int fd_out); /* Function pointer to the user-defined map function */
     int (*reduce_func)(int * p_fd_in, int fd_in_num, int fd_out); /* Function pointer to the user-defined reduce function */
-    void * usr_data; /* This field is used only by the "Word finder" program: it records the word to find in the input data file */
+    int (*combine_func)(int * p_fd_in, int fd_in_num, int fd_out); /* Optional: run in the map worker on the map function's output, writing the intermediate file */
+    int reduce_num; /* The number of partitions and concurrent reduce workers (0 is treated as 1) */
+    int (*partition_func)(const char * key, uint32_t key_len, int reduce_num); /* Optional: the partition [0, reduce_num) of a key, or
+                          MR_ALL_PARTITIONS to copy the record to each; mapreduce_default_partition() if NULL */
+    ENGINE engine; /* Processes for crash isolation, or threads for throughput */
+    TRANSPORT transport; /* Optional, ENGINE_FORK or ENGINE_CLUSTER: intermediate files in the file system or in memory */
+    const char * cluster_address; /* ENGINE_CLUSTER: "HOST:PORT" the coordinator listens on (":PORT" for every interface),
+                                     or the coordinator a worker connects to */
+    int cluster_worker; /* Optional, ENGINE_CLUSTER: run this process as a worker of the coordinator at cluster_address until
+                           its job is over, instead of coordinating a job. The task functions and usr_data must be those of
+                           the coordinator's job; the input and the splits come from the coordinator.
+                           mapreduce() returns with map_worker_num and reduce_worker_num set to the tasks this worker ran */
+    int stream_reduce; /* Optional, ENGINE_FORK only: start the reduce workers with the map workers and merge each intermediate file
+                          with combine_func as soon as it is written; needs an associative combine_func */
+    int worker_num; /* Optional: the number of concurrent map (and reduce) workers; splits are handed out to them dynamically.
+                       0 means one process per split and per partition with ENGINE_FORK, one thread per online CPU with ENGINE_THREADS */
+    int (*emit_map_func)(DATA_SPLIT * split, EMITTER * emitter); /* Optional: used instead of map_func; the map function passes its
+                                                                    records to mapreduce_emit() instead of writing fd_out */
+    int (*merge_func)(char * value, uint32_t value_len, const char * other, uint32_t other_len); /* Optional, with emit_map_func: merge the
+                          value other of a record emitted again into the buffered value of its key, in place; 0 on success, -1 on error */
+    int (*group_reduce_func)(const char * key, uint32_t key_len, REDUCE_VALUES * values, FILE * output); /* Optional: used instead of
+                          reduce_func. The map workers sort their output by key, and each reduce worker merges the sorted runs
+                          and calls it once per key, in key order, with the values of that key; not with stream_reduce */
+    size_t emit_buffer_size; /* Optional, with merge_func: the memory budget of each map worker's aggregation buffer (MR_EMIT_BUFFER_SIZE if 0);
+                                the buffer is written out as a run of records sorted by key each time it is reached */
+    IO_BACKEND io_backend; /* Optional: how the map functions read their split when it is not mapped */
+    int compress_intermediate; /* Optional: write the intermediate files in LZ blocks (ITM_FLAG_COMPRESSED), read back transparently */
+    int task_attempts; /* Optional: the attempts of a map or reduce task before it fails (MR_TASK_ATTEMPTS if 0). A failed task,
+                          or the task of a worker that died, runs again; if a split fails every attempt, the reduce phase is skipped */
+    int speculate; /* Optional, ENGINE_FORK with TRANSPORT_FILES: once most splits are mapped, idle map workers run backup attempts
+                      of the slowest running ones. Each attempt writes its own files, and the first to finish is committed
+                      by renaming them into place; the workers still running the other attempts are killed */
+    const char * cache_dir; /* Optional, not with ENGINE_CLUSTER: keep the intermediate files of each split in this directory (created
+                               if needed), keyed by a hash of the split's bytes and cache_tag, and reuse them instead of mapping a
+                               split again. The splits are then laid out so that appending to the input changes the last one only */
+    const char * cache_tag; /* With cache_dir: names the map, combine and partition functions and usr_data, which the cache cannot
+                               look into; jobs with different tags never share entries */
+    int cache_positions; /* With cache_dir: the map output records where the split lies in the input (offsets into it), so
+                            the offset of a split is part of its key too. A split that moved is then mapped again */
+    size_t stream_chunk_size; /* Optional, SPLIT_MODE_STREAM: the size of the chunks (MR_STREAM_CHUNK_SIZE if 0); the queue holds
+                                 two per map worker. A longer line is cut */
+    int pin_workers; /* Optional, not with ENGINE_CLUSTER: pin the map (and reduce) workers round-robin to the CPUs, spread over
+                        the NUMA nodes, and have each prefer the memory of its node. A reduce task then moves to the node
+                        whose map tasks wrote most of its intermediate data (not with stream_reduce, whose reducers start first) */
+    const char * trace_path; /* Optional: record begin and end events of the phases, forks, waits, tasks and read and write batches
+                                of every worker, and write them to this file at the end in the Chrome trace format (see trace.h).
+                                A cluster worker writes the events of its own tasks */
+    size_t memory_budget; /* Optional, not with stream_reduce or compress_intermediate: the memory the running tasks may take
+                             together (unbounded if 0). Only as many workers run as the budget admits, each reckoned at
+                             MR_TASK_MEMORY, its partition writers and an aggregation buffer of at least MR_EMIT_SHARE_MIN;
+                             the rest of the budget is shared out to the aggregation buffers (at most emit_buffer_size,
+                             and at least MR_EMIT_SHARE_MIN, each).
+                             The in-memory buffers of the workers then go to unlinked temporary files in the working
+                             directory, and each spill of an aggregation buffer becomes a sorted run of its own, merged
+                             at the end of the task one record of each run at a time */
+    int max_inflight; /* Optional, not with stream_reduce: the most map (or reduce) tasks running at once (unbounded if 0) */
+    void * usr_data; /* This field is used only by the "Word finder" program: it records the words to find (a WORD_LIST) in the input data file */
 }MAPREDUCE_SPEC;
 
+/* The counters of one map task (split) or reduce task (partition). Times are in nanoseconds from a monotonic clock. */
+typedef struct _mapreduce_task_stats
+{
+    int worker_id; /* The process ID (thread ID with ENGINE_THREADS, remote process ID with ENGINE_CLUSTER) of the worker that ran the task */
+    int status; /* 0 if the task succeeded */
+    int64_t start_ns; /* When the task started, from the start of mapreduce() */
+    int64_t wall_ns; /* The wall time of the task */
+    int64_t cpu_ns; /* The CPU time (user and system) of the worker thread during the task */
+    int64_t bytes_read; /* The split for a map task, the intermediate files for a reduce task */
+    int64_t bytes_written; /* The intermediate files for a map task, the result file for a reduce task */
+    int64_t records; /* The intermediate records written by a map task, or read by a reduce task */
+    int64_t spills; /* The times the aggregation buffer of a map task reached its budget (emit_map_func with merge_func) */
+    int attempts; /* The attempts of the task that started, backups included; the other counters are those of the committed one */
+    int cached; /* 1 if the intermediate files of a map task came from the cache (cache_dir), without mapping the split */
+    int node; /* With pin_workers: the NUMA node the task ran on (when it finished) */
+}MAPREDUCE_TASK_STATS;
+
+/* The counters of one map or reduce worker, which may run several tasks */
+typedef struct _mapreduce_worker_stats
+{
+    int worker_id; /* The process ID (thread ID with ENGINE_THREADS) */
+    int task_num; /* The number of tasks the worker ran */
+    int64_t start_ns; /* When the worker started, from the start of mapreduce() */
+    int64_t wall_ns; /* From the start of the worker until it ran out of tasks */
+    int64_t user_ns; /* User CPU time, from wait4() for a process or RUSAGE_THREAD for a thread */
+    int64_t sys_ns; /* System CPU time */
+    long max_rss_kb; /* The peak RSS of the worker process (of the whole process with ENGINE_THREADS) */
+}MAPREDUCE_WORKER_STATS;
+
 typedef struct _mapreduce_result
 {
     char * filepath; /* The path of the result file */
-    int processing_time; /* The time used (in microseconds) for the mapreduce task */
-    int * map_worker_pid; /* To record the process IDs of the map worker processes */
-    int reduce_worker_pid; /* To record the process ID of the reduce worker */
+    int64_t processing_time; /* The time used (in microseconds) for the mapreduce task, total_ns / 1000 */
+    int * map_worker_pid; /* To record the process IDs of the map worker processes (thread IDs with ENGINE_THREADS) */
+    int * reduce_worker_pid; /* To record the process IDs of the reduce workers, one per partition (thread IDs with ENGINE_THREADS) */
+    char (* map_worker_name)[MR_WORKER_NAME_SIZE]; /* Optional, ENGINE_CLUSTER: [split_num], "host:pid" of the worker of each map task,
+                                                      as the pids of map_worker_pid are only unique per host */
+    char (* reduce_worker_name)[MR_WORKER_NAME_SIZE]; /* Optional, ENGINE_CLUSTER: [reduce_num], "host:pid" of the worker of each partition */
+    int64_t total_ns; /* The whole mapreduce() call, in nanoseconds from a monotonic clock */
+    int64_t split_ns; /* Phase 1: copying the splits, or planning their ranges */
+    int64_t map_spawn_ns; /* Starting the map workers (fork() or pthread_create()) */
+    int64_t map_ns; /* Phases 2-3: from starting the map workers until the last one is done */
+    int64_t reduce_spawn_ns; /* Starting the reduce workers */
+    int64_t reduce_ns; /* Phase 4: from starting the reduce workers until the last one is done. With stream_reduce,
+                          the reduce workers start before the map workers and this only covers the time after the map phase */
+    int map_worker_num; /* Set by mapreduce(): the number of map workers that ran, at most split_num */
+    int reduce_worker_num; /* Set by mapreduce(): the number of reduce workers that ran, at most reduce_num */
+    int cached_split_num; /* Set by mapreduce() with cache_dir: the splits whose intermediate files came from the cache */
+    MAPREDUCE_TASK_STATS * map_task_stats; /* Optional: [split_num], filled by mapreduce() unless NULL */
+    MAPREDUCE_TASK_STATS * reduce_task_stats; /* Optional: [reduce_num] */
+    MAPREDUCE_WORKER_STATS * map_worker_stats; /* Optional: [split_num], the first map_worker_num entries are filled */
+    MAPREDUCE_WORKER_STATS * reduce_worker_stats; /* Optional: [reduce_num], the first reduce_worker_num entries are filled */
 }MAPREDUCE_RESULT;
 
 
 void mapreduce(MAPREDUCE_SPEC * spec, MAPREDUCE_RESULT * result);
 
+/* The default partition function: a hash of the key modulo reduce_num */
+int mapreduce_default_partition(const char * key, uint32_t key_len, int reduce_num);
+
+/* Emit one intermediate record from emit_map_func. With a merge_func, the record is merged into
+   the aggregation buffer of the map worker; otherwise it is buffered and written as is.
+   @ret: 0 on success, -1 on error.
+ */
+int mapreduce_emit(EMITTER * emitter, const void * key, uint32_t key_len, const void * value, uint32_t value_len);
+
+/* Get the next value of the key group in group_reduce_func. The value stays valid until the reduce
+   worker is done.
+   @ret: 1 if a value was read, 0 once the values of the key are exhausted.
+ */
+int mapreduce_next_value(REDUCE_VALUES * values, const char ** value, uint32_t * value_len);
+
 
 
 #endif
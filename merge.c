@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "merge.h"
+#include "arena.h"
+
+// Whether source a goes before source b: the smaller next key, then the earlier run for equal keys
+static int source_before(const MERGE_SOURCE *sources, int a, int b) {
+    int diff = itm_compare_keys(sources[a].key, sources[a].key_len, sources[b].key, sources[b].key_len);
+    return diff < 0 || (diff == 0 && a < b);
+}
+
+static void sift_down(REDUCE_VALUES *values, int pos) {
+    int *heap = values->heap;
+
+    for (;;) {
+        int smallest = pos, left = 2 * pos + 1, right = 2 * pos + 2;
+        if (left < values->heap_size && source_before(values->sources, heap[left], heap[smallest])) {
+            smallest = left;
+        }
+        if (right < values->heap_size && source_before(values->sources, heap[right], heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == pos) {
+            return;
+        }
+        int swap = heap[pos];
+        heap[pos] = heap[smallest];
+        heap[smallest] = swap;
+        pos = smallest;
+    }
+}
+
+// Read the next record of a source. @ret: 1 if there is one, 0 at the end of the run, -1 if the run is corrupted.
+static int advance_source(MERGE_SOURCE *source) {
+    return itm_read(&source->reader, &source->key, &source->key_len, &source->value, &source->value_len);
+}
+
+int mapreduce_next_value(REDUCE_VALUES *values, const char **value, uint32_t *value_len) {
+    if (values->heap_size == 0) {
+        return 0;
+    }
+
+    MERGE_SOURCE *source = &values->sources[values->heap[0]];
+    if (itm_compare_keys(source->key, source->key_len, values->key, values->key_len) != 0) {
+        return 0; // The next key group starts
+    }
+    *value = source->value;
+    *value_len = source->value_len;
+
+    // The record stays mapped while the source moves on
+    int status = advance_source(source);
+    if (status <= 0) {
+        if (status < 0) {
+            values->error = 1;
+        }
+        values->heap[0] = values->heap[--values->heap_size];
+    }
+    sift_down(values, 0);
+    return 1;
+}
+
+/* Merge the sorted runs p_fd_in[0, fd_in_num) and call group_reduce_func once per key, in key
+   order, with an iterator over the values of that key. The values a group reduce function does not
+   read are skipped.
+   @param fd_out: The result file; group_reduce_func writes to a buffered stream on it.
+   @ret: 0 on success, -1 if a run is missing, not sorted or corrupted, or if group_reduce_func failed.
+ */
+// Open the sorted runs p_fd_in[0, fd_in_num) into values, each on the heap by its first record.
+// *opened receives the number of runs to close with close_runs(), even on error. @ret: 0 on success, -1 on error.
+static int open_runs(REDUCE_VALUES *values, int *p_fd_in, int fd_in_num, int *opened) {
+    int pos;
+
+    *opened = 0;
+    values->sources = calloc(fd_in_num, sizeof(MERGE_SOURCE));
+    values->heap = malloc(fd_in_num * sizeof(int));
+    if (values->sources == NULL || values->heap == NULL) {
+        ERR_MSG("Error: Memory allocation failed for the merge of %d runs.\n", fd_in_num);
+        return ERROR;
+    }
+
+    for (; *opened < fd_in_num; (*opened)++) {
+        MERGE_SOURCE *source = &values->sources[*opened];
+        if (itm_reader_open(&source->reader, p_fd_in[*opened]) != SUCCESS || !source->reader.sorted) {
+            ERR_MSG("Error: Intermediate file %d is corrupted or not a sorted run.\n", *opened);
+            (*opened)++;
+            return ERROR;
+        }
+        int status = advance_source(source);
+        if (status < 0) {
+            ERR_MSG("Error: Intermediate file %d is corrupted.\n", *opened);
+            (*opened)++;
+            return ERROR;
+        }
+        if (status > 0) {
+            values->heap[values->heap_size++] = *opened;
+        }
+    }
+    for (pos = values->heap_size / 2 - 1; pos >= 0; pos--) {
+        sift_down(values, pos);
+    }
+    return SUCCESS;
+}
+
+static void close_runs(REDUCE_VALUES *values, int opened) {
+    while (opened > 0) {
+        itm_reader_close(&values->sources[--opened].reader);
+    }
+    free(values->sources);
+    free(values->heap);
+}
+
+int merge_reduce(int *p_fd_in, int fd_in_num, int fd_out,
+                 int (*group_reduce_func)(const char *key, uint32_t key_len, REDUCE_VALUES *values, FILE *output)) {
+    REDUCE_VALUES values = {0};
+    FILE *output = NULL;
+    char *output_buffer = io_buffer_get(); // The stdio buffer of the result file
+    int opened, ret = SUCCESS;
+
+    if ((ret = open_runs(&values, p_fd_in, fd_in_num, &opened)) == SUCCESS) {
+        if ((output = fdopen(dup(fd_out), "w")) == NULL) {
+            ERR_MSG("Error: Unable to open the result file for the merge.\n");
+            ret = ERROR;
+        } else {
+            setvbuf(output, output_buffer, _IOFBF, IO_BUFFER_SIZE); // stdio picks its own buffer if the pool had none
+        }
+    }
+
+    while (ret == SUCCESS && values.heap_size > 0) {
+        MERGE_SOURCE *first = &values.sources[values.heap[0]];
+        const char *value;
+        uint32_t value_len;
+
+        values.key = first->key;
+        values.key_len = first->key_len;
+        if (group_reduce_func(values.key, values.key_len, &values, output) != SUCCESS) {
+            ERR_MSG("Error: Reduce function failed for a key group.\n");
+            ret = ERROR;
+        }
+        while (mapreduce_next_value(&values, &value, &value_len) > 0) {
+            // Skip what the reduce function left of the group
+        }
+        if (values.error) {
+            ERR_MSG("Error: An intermediate file is corrupted.\n");
+            ret = ERROR;
+        }
+    }
+
+    if (output != NULL && fclose(output) != 0) {
+        ERR_MSG("Error: Unable to write the result file.\n");
+        ret = ERROR;
+    }
+    io_buffer_put(output_buffer);
+    close_runs(&values, opened);
+    return ret;
+}
+
+/* Merge the sorted runs p_fd_in[0, fd_in_num) into one sorted run written to writer, with the values
+   of each key merged into its first one by merge (only the first is kept when merge is NULL): the
+   runs an aggregation buffer spilled to files under a memory budget. Besides the mapped runs, only the
+   value being merged is held in memory.
+   @ret: 0 on success, -1 if a run is not sorted or corrupted, if merge failed or on a write error.
+ */
+int merge_runs(int *p_fd_in, int fd_in_num, ITM_WRITER *writer, AGG_MERGE merge) {
+    REDUCE_VALUES values = {0};
+    char *merged = NULL; // The value of the key group, merged so far
+    uint32_t merged_len, merged_capacity = 0;
+    int opened, ret;
+
+    ret = open_runs(&values, p_fd_in, fd_in_num, &opened);
+    while (ret == SUCCESS && values.heap_size > 0) {
+        MERGE_SOURCE *first = &values.sources[values.heap[0]];
+        const char *value;
+        uint32_t value_len;
+
+        values.key = first->key;
+        values.key_len = first->key_len;
+        mapreduce_next_value(&values, &value, &value_len);
+        if (value_len > merged_capacity) {
+            char *grown = realloc(merged, value_len);
+            if (grown == NULL) {
+                ERR_MSG("Error: Memory allocation failed for the merge of the spilled runs.\n");
+                ret = ERROR;
+                break;
+            }
+            merged = grown;
+            merged_capacity = value_len;
+        }
+        memcpy(merged, value, value_len);
+        merged_len = value_len;
+        while (mapreduce_next_value(&values, &value, &value_len) > 0) {
+            if (merge != NULL && ret == SUCCESS && merge(merged, merged_len, value, value_len) != SUCCESS) {
+                ERR_MSG("Error: Unable to merge the values of a key of the spilled runs.\n");
+                ret = ERROR;
+            }
+        }
+        if (values.error) {
+            ERR_MSG("Error: A spilled run is corrupted.\n");
+            ret = ERROR;
+        }
+        if (ret == SUCCESS && itm_write(writer, values.key, values.key_len, merged, merged_len) != SUCCESS) {
+            ret = ERROR;
+        }
+    }
+    free(merged);
+    close_runs(&values, opened);
+    return ret;
+}
@@ -0,0 +1,39 @@
+/* The reduce side of the sort-merge shuffle: a k-way merge, with a min-heap, of the sorted runs
+   written by the map workers, calling the group reduce function once per key. The same merge puts
+   together the runs an aggregation buffer spills to files under a memory budget (merge_runs()). */
+
+#ifndef _MERGE_H
+#define _MERGE_H
+
+#include <stdio.h>
+
+#include "itm.h"
+#include "aggregate.h"
+#include "mapreduce.h"
+
+/* One sorted run being merged, with its next record */
+typedef struct _merge_source
+{
+    ITM_READER reader; /* The run, mapped with MADV_SEQUENTIAL */
+    const char * key;
+    uint32_t key_len;
+    const char * value;
+    uint32_t value_len;
+}MERGE_SOURCE;
+
+/* The values of the key group being reduced (REDUCE_VALUES in mapreduce.h) */
+struct _reduce_values
+{
+    MERGE_SOURCE * sources;
+    int * heap; /* Indices of the sources that have a record left, ordered by their next key */
+    int heap_size;
+    const char * key; /* The key of the group */
+    uint32_t key_len;
+    int error; /* Set when a run turns out to be corrupted */
+};
+
+int merge_reduce(int * p_fd_in, int fd_in_num, int fd_out,
+                 int (*group_reduce_func)(const char * key, uint32_t key_len, REDUCE_VALUES * values, FILE * output));
+int merge_runs(int * p_fd_in, int fd_in_num, ITM_WRITER * writer, AGG_MERGE merge);
+
+#endif
@@ -0,0 +1,159 @@
+#define _GNU_SOURCE /* sched_setaffinity(), sched_getcpu() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "common.h"
+#include "placement.h"
+
+// Parse a sysfs CPU list such as "0-3,8-11" into the flags set[0, PLACEMENT_MAX_CPUS).
+// @ret: 0 on success, -1 if the file cannot be read.
+static int read_cpu_list(const char *path, char *set) {
+    char list[4096], *pos = list, *end;
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL) {
+        return ERROR;
+    }
+    if (fgets(list, sizeof(list), file) == NULL) {
+        list[0] = '\0';
+    }
+    fclose(file);
+
+    while (*pos >= '0' && *pos <= '9') {
+        long first = strtol(pos, &end, 10), last = first;
+        if (*end == '-') {
+            last = strtol(end + 1, &end, 10);
+        }
+        for (; first <= last && first < PLACEMENT_MAX_CPUS; first++) {
+            set[first] = 1;
+        }
+        pos = *end == ',' ? end + 1 : end;
+    }
+    return SUCCESS;
+}
+
+// Whether cpu is the first of the hardware threads of its core (or its siblings are unknown)
+static int is_first_sibling(int cpu) {
+    char path[96], siblings[PLACEMENT_MAX_CPUS] = {0};
+    int i;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+    if (read_cpu_list(path, siblings) != SUCCESS) {
+        return 1;
+    }
+    for (i = 0; i < cpu && !siblings[i]; i++) {
+    }
+    return i == cpu;
+}
+
+// [cpu], the placement order of each CPU for compare_cpus(): its pass (first hardware threads, then their
+// siblings), then its rank among the CPUs of its node in that pass, then its node
+static int64_t cpu_keys[PLACEMENT_MAX_CPUS];
+
+static int compare_cpus(const void *a, const void *b) {
+    int64_t key = cpu_keys[*(const int *)a], other = cpu_keys[*(const int *)b];
+
+    return key < other ? -1 : key > other;
+}
+
+/* Read the CPUs the process may run on and their nodes, and order them for placement_pin_worker():
+   one CPU of each node in turn, taking the first hardware thread of every core before the others.
+   @ret: 0 on success, -1 if the CPUs cannot be read.
+ */
+int placement_init(PLACEMENT *placement) {
+    char path[96], node_cpus[PLACEMENT_MAX_CPUS];
+    int ranks[2][PLACEMENT_MAX_NODES] = {{0}}; // [pass][node], the CPUs ordered so far
+    int cpu, node;
+    cpu_set_t allowed;
+
+    memset(placement, 0, sizeof(*placement));
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return ERROR;
+    }
+    for (node = 0; node < PLACEMENT_MAX_NODES; node++) {
+        memset(node_cpus, 0, sizeof(node_cpus));
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        if (read_cpu_list(path, node_cpus) != SUCCESS) {
+            continue;
+        }
+        for (cpu = 0; cpu < PLACEMENT_MAX_CPUS; cpu++) {
+            if (node_cpus[cpu]) {
+                placement->cpu_nodes[cpu] = node;
+            }
+        }
+    }
+
+    for (cpu = 0; cpu < PLACEMENT_MAX_CPUS; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        int pass = !is_first_sibling(cpu);
+        node = placement->cpu_nodes[cpu];
+        cpu_keys[cpu] = ((int64_t)pass * PLACEMENT_MAX_CPUS + ranks[pass][node]++) * PLACEMENT_MAX_NODES + node;
+        placement->cpus[placement->cpu_num++] = cpu;
+        if (node >= placement->node_num) {
+            placement->node_num = node + 1;
+        }
+    }
+    qsort(placement->cpus, placement->cpu_num, sizeof(int), compare_cpus);
+    return placement->cpu_num > 0 ? SUCCESS : ERROR;
+}
+
+// Prefer the memory of node for the allocations of the calling thread
+static int prefer_node(int node) {
+    unsigned long mask[PLACEMENT_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    return syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, PLACEMENT_MAX_NODES + 1) == 0 ? SUCCESS : ERROR;
+}
+
+/* Pin the calling thread (or process) to the CPU of worker worker_idx, round-robin over the CPUs in
+   placement order, and prefer the memory of its node.
+   @ret: The node, or -1 on error.
+ */
+int placement_pin_worker(const PLACEMENT *placement, int worker_idx) {
+    int cpu = placement->cpus[worker_idx % placement->cpu_num];
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        return ERROR;
+    }
+    prefer_node(placement->cpu_nodes[cpu]); // Only a hint: the thread still runs where it should
+    return placement->cpu_nodes[cpu];
+}
+
+/* Let the calling thread (or process) run on any CPU of node, and prefer the memory of node.
+   @ret: 0 on success, -1 on error.
+ */
+int placement_pin_node(const PLACEMENT *placement, int node) {
+    cpu_set_t set;
+    int i;
+
+    CPU_ZERO(&set);
+    for (i = 0; i < placement->cpu_num; i++) {
+        if (placement->cpu_nodes[placement->cpus[i]] == node) {
+            CPU_SET(placement->cpus[i], &set);
+        }
+    }
+    if (CPU_COUNT(&set) == 0 || sched_setaffinity(0, sizeof(set), &set) != 0) {
+        return ERROR;
+    }
+    prefer_node(node);
+    return SUCCESS;
+}
+
+/* @ret: The node of the CPU the calling thread runs on, 0 when it cannot be told. */
+int placement_current_node(const PLACEMENT *placement) {
+    int cpu = sched_getcpu();
+
+    return cpu >= 0 && cpu < PLACEMENT_MAX_CPUS ? placement->cpu_nodes[cpu] : 0;
+}
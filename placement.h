@@ -0,0 +1,29 @@
+/* Worker placement for MAPREDUCE_SPEC.pin_workers: the CPUs the process may run on, and the NUMA
+   node of each, read from sched_getaffinity() and /sys/devices/system/node (a machine without that
+   directory is a single node 0).
+
+   The CPUs are ordered so that consecutive workers spread over the nodes, and over the physical
+   cores of a node before their other hardware threads. A pinned worker also prefers the memory of
+   its node (set_mempolicy(MPOL_PREFERRED)), for its buffers and for the page cache of the files it
+   writes; it falls back to other nodes when that one is full. */
+
+#ifndef _PLACEMENT_H
+#define _PLACEMENT_H
+
+#define PLACEMENT_MAX_CPUS 1024 /* CPU_SETSIZE */
+#define PLACEMENT_MAX_NODES 64
+
+typedef struct _placement
+{
+    int cpu_num; /* The CPUs the process may run on */
+    int node_num; /* The highest node of these CPUs, plus 1 */
+    int cpus[PLACEMENT_MAX_CPUS]; /* [cpu_num], in placement order */
+    int cpu_nodes[PLACEMENT_MAX_CPUS]; /* [cpu], the node of each CPU, by CPU number */
+}PLACEMENT;
+
+int placement_init(PLACEMENT * placement);
+int placement_pin_worker(const PLACEMENT * placement, int worker_idx);
+int placement_pin_node(const PLACEMENT * placement, int node);
+int placement_current_node(const PLACEMENT * placement);
+
+#endif
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "result.h"
+
+/* Write a counts table of row_num rows, counts[row] being the count of key first_key + row.
+   @ret: 0 on success, -1 on error.
+ */
+int result_write_counts(int fd, uint32_t first_key, const uint64_t *counts, uint32_t row_num) {
+    RESULT_COUNTS_HEADER header = {RESULT_TYPE_COUNTS, row_num, first_key, 0};
+    FILE *output = fdopen(dup(fd), "w");
+
+    if (output == NULL) {
+        return ERROR;
+    }
+    int written = fwrite(&header, sizeof(header), 1, output) == 1 && fwrite(counts, sizeof(uint64_t), row_num, output) == row_num;
+    return fclose(output) == 0 && written ? SUCCESS : ERROR;
+}
+
+static int compare_by_offset(const void *a, const void *b) {
+    const RESULT_HIT *hit = &((const RESULT_LINE_HIT *)a)->hit, *other = &((const RESULT_LINE_HIT *)b)->hit;
+
+    if (hit->offset != other->offset) {
+        return hit->offset < other->offset ? -1 : 1;
+    }
+    return hit->word < other->word ? -1 : hit->word > other->word;
+}
+
+static int compare_by_word(const void *a, const void *b) {
+    const RESULT_HIT *hit = &((const RESULT_LINE_HIT *)a)->hit, *other = &((const RESULT_LINE_HIT *)b)->hit;
+
+    if (hit->word != other->word) {
+        return hit->word < other->word ? -1 : 1;
+    }
+    return hit->offset < other->offset ? -1 : hit->offset > other->offset;
+}
+
+/* Write a hits file of the hits, which are reordered. The text of each distinct line is written in
+   input order after the table, which is then written sorted by word and offset.
+   @ret: 0 on success, -1 on error.
+ */
+int result_write_hits(int fd, RESULT_LINE_HIT *hits, size_t hit_num) {
+    RESULT_HITS_HEADER header = {RESULT_TYPE_HITS, 0, hit_num, sizeof(RESULT_HITS_HEADER) + hit_num * sizeof(RESULT_HIT), 0};
+    FILE *output = fdopen(dup(fd), "w");
+    off_t start = output != NULL ? ftello(output) : -1;
+    size_t i;
+    int written;
+
+    if (start < 0) {
+        if (output != NULL) {
+            fclose(output);
+        }
+        return ERROR;
+    }
+
+    // The text first, from the end of the table
+    qsort(hits, hit_num, sizeof(RESULT_LINE_HIT), compare_by_offset);
+    written = fseeko(output, start + header.text_offset, SEEK_SET) == 0;
+    for (i = 0; i < hit_num && written; i++) {
+        if (i > 0 && hits[i].hit.offset == hits[i - 1].hit.offset) {
+            hits[i].hit.text = hits[i - 1].hit.text;
+            continue;
+        }
+        hits[i].hit.text = header.text_size;
+        header.text_size += hits[i].hit.length + 1;
+        written = fwrite(hits[i].line, 1, hits[i].hit.length, output) == hits[i].hit.length && fputc('\n', output) != EOF;
+    }
+
+    // Then the header and the table
+    qsort(hits, hit_num, sizeof(RESULT_LINE_HIT), compare_by_word);
+    written = written && fseeko(output, start, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, output) == 1;
+    for (i = 0; i < hit_num && written; i++) {
+        written = fwrite(&hits[i].hit, sizeof(RESULT_HIT), 1, output) == 1;
+    }
+    return fclose(output) == 0 && written ? SUCCESS : ERROR;
+}
+
+/* Write the sidecar index of the hits file at result_path, for the word_num words searched.
+   @ret: 0 on success, -1 if the result file cannot be read, or the index cannot be written.
+ */
+int result_write_index(const char *result_path, const char *const *words, int word_num) {
+    RESULT_INDEX_HEADER header = {RESULT_TYPE_INDEX, word_num, 0};
+    RESULT_INDEX_ENTRY *entries = calloc(word_num > 0 ? word_num : 1, sizeof(RESULT_INDEX_ENTRY));
+    char index_path[PATH_MAX];
+    uint32_t name_offset = 0;
+    RESULT_MAP map;
+    uint64_t i;
+    int word, ret = SUCCESS;
+
+    if (entries == NULL || result_map(&map, result_path) != SUCCESS) {
+        free(entries);
+        return ERROR;
+    }
+    const RESULT_HITS_HEADER *hits_header = (const RESULT_HITS_HEADER *)map.data;
+    const RESULT_HIT *hits = (const RESULT_HIT *)(hits_header + 1);
+
+    header.hit_num = map.type == RESULT_TYPE_HITS ? hits_header->hit_num : 0;
+    for (i = 0; i < header.hit_num && ret == SUCCESS; i++) {
+        if (hits[i].word >= (uint32_t)word_num) {
+            ret = ERROR; // Not the result of these words
+        } else if (entries[hits[i].word].hit_num++ == 0) {
+            entries[hits[i].word].first_hit = i;
+        }
+    }
+    for (word = 0; word < word_num; word++) {
+        entries[word].name_offset = name_offset;
+        entries[word].name_length = strlen(words[word]);
+        name_offset += entries[word].name_length;
+    }
+    result_unmap(&map);
+
+    FILE *output = NULL;
+    if (map.type != RESULT_TYPE_HITS || ret != SUCCESS ||
+        snprintf(index_path, sizeof(index_path), "%s%s", result_path, RESULT_INDEX_SUFFIX) >= (int)sizeof(index_path) ||
+        (output = fopen(index_path, "w")) == NULL) {
+        free(entries);
+        return ERROR;
+    }
+    int written = fwrite(&header, sizeof(header), 1, output) == 1 &&
+                  fwrite(entries, sizeof(RESULT_INDEX_ENTRY), word_num, output) == (size_t)word_num;
+    for (word = 0; word < word_num && written; word++) {
+        written = fwrite(words[word], 1, entries[word].name_length, output) == entries[word].name_length;
+    }
+    free(entries);
+    return fclose(output) == 0 && written ? SUCCESS : ERROR;
+}
+
+// Whether a mapped file of that length has the layout its type says
+static int check_layout(const char *data, size_t length, uint32_t type) {
+    if (type == RESULT_TYPE_COUNTS) {
+        const RESULT_COUNTS_HEADER *header = (const RESULT_COUNTS_HEADER *)data;
+        return length >= sizeof(*header) && (length - sizeof(*header)) / sizeof(uint64_t) >= header->row_num;
+    }
+    if (type == RESULT_TYPE_HITS) {
+        const RESULT_HITS_HEADER *header = (const RESULT_HITS_HEADER *)data;
+        return length >= sizeof(*header) && (length - sizeof(*header)) / sizeof(RESULT_HIT) >= header->hit_num &&
+               header->text_offset == sizeof(*header) + header->hit_num * sizeof(RESULT_HIT) &&
+               length - header->text_offset >= header->text_size;
+    }
+    if (type == RESULT_TYPE_INDEX) {
+        const RESULT_INDEX_HEADER *header = (const RESULT_INDEX_HEADER *)data;
+        return length >= sizeof(*header) && (length - sizeof(*header)) / sizeof(RESULT_INDEX_ENTRY) >= header->word_num;
+    }
+    return 0;
+}
+
+/* Map the binary result (or index) file at path, and check its layout.
+   @ret: 0 on success, -1 if it cannot be mapped or is not a binary result file.
+ */
+int result_map(RESULT_MAP *map, const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+
+    memset(map, 0, sizeof(*map));
+    if (fd < 0) {
+        return ERROR;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(uint32_t)) {
+        close(fd);
+        return ERROR;
+    }
+    map->length = st.st_size;
+    map->data = mmap(NULL, map->length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map->data == MAP_FAILED) {
+        map->data = NULL;
+        return ERROR;
+    }
+    memcpy(&map->type, map->data, sizeof(map->type));
+    if (!check_layout(map->data, map->length, map->type)) {
+        result_unmap(map);
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+void result_unmap(RESULT_MAP *map) {
+    if (map->data != NULL) {
+        munmap((void *)map->data, map->length);
+        map->data = NULL;
+    }
+}
@@ -0,0 +1,93 @@
+/* Binary result files, for consumers that map them instead of parsing mr.rst (--result-format=binary).
+
+   A counts table (RESULT_TYPE_COUNTS) is a RESULT_COUNTS_HEADER and row_num uint64_t counts, the
+   count of key first_key + row at row: the letter counter's count of a letter is one load at a fixed
+   offset. Its rows are all there, 0 for a key that was not seen (or that is in another partition).
+
+   A hits file (RESULT_TYPE_HITS) is a RESULT_HITS_HEADER, hit_num RESULT_HITs sorted by word then by
+   offset in the input, then the text of the lines, each followed by '\n', in input order. A line
+   matched by several words is stored once. Its sidecar index (path RESULT_INDEX_SUFFIX, written by
+   result_write_index()) is a RESULT_INDEX_HEADER and one RESULT_INDEX_ENTRY per word searched, in
+   command line order, then their names: the hits of a word are a range of the table, and within the
+   range they can be looked up by offset or line with a binary search.
+
+   Everything is in host byte order; the tables are 8-byte aligned in the file. */
+
+#ifndef _RESULT_H
+#define _RESULT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RESULT_INDEX_SUFFIX ".idx"
+
+/* The type of a binary result file, its first 4 bytes */
+#define RESULT_TYPE_COUNTS 0x3143524d /* "MRC1" */
+#define RESULT_TYPE_HITS 0x3148524d /* "MRH1" */
+#define RESULT_TYPE_INDEX 0x3149524d /* "MRI1" */
+
+typedef struct _result_counts_header
+{
+    uint32_t type; /* RESULT_TYPE_COUNTS */
+    uint32_t row_num;
+    uint32_t first_key; /* The key of row 0 */
+    uint32_t reserved;
+}RESULT_COUNTS_HEADER;
+
+typedef struct _result_hits_header
+{
+    uint32_t type; /* RESULT_TYPE_HITS */
+    uint32_t reserved;
+    uint64_t hit_num;
+    uint64_t text_offset; /* Where the text of the lines starts in the file */
+    uint64_t text_size;
+}RESULT_HITS_HEADER;
+
+/* A line that matched a word */
+typedef struct _result_hit
+{
+    uint64_t offset; /* The offset of the line in the input */
+    uint64_t line; /* Its line number in the input, from 1 */
+    uint64_t text; /* The offset of its text from RESULT_HITS_HEADER.text_offset */
+    uint32_t length; /* The bytes of the line, '\n' excluded */
+    uint32_t word; /* The index of the word among the words searched */
+}RESULT_HIT;
+
+typedef struct _result_index_header
+{
+    uint32_t type; /* RESULT_TYPE_INDEX */
+    uint32_t word_num;
+    uint64_t hit_num; /* The hits of the result file */
+}RESULT_INDEX_HEADER;
+
+typedef struct _result_index_entry
+{
+    uint64_t first_hit; /* The hits of the word are [first_hit, first_hit + hit_num) of the result file */
+    uint64_t hit_num;
+    uint32_t name_offset; /* From the end of the entries */
+    uint32_t name_length;
+}RESULT_INDEX_ENTRY;
+
+/* A hit for result_write_hits(), whose text is at line (hit.text is set when it is written) */
+typedef struct _result_line_hit
+{
+    RESULT_HIT hit;
+    const char * line;
+}RESULT_LINE_HIT;
+
+/* A result file mapped in memory, read-only */
+typedef struct _result_map
+{
+    const char * data;
+    size_t length;
+    uint32_t type; /* One of the RESULT_TYPE_* values; result_map() checks the rest of the layout */
+}RESULT_MAP;
+
+int result_write_counts(int fd, uint32_t first_key, const uint64_t * counts, uint32_t row_num);
+int result_write_hits(int fd, RESULT_LINE_HIT * hits, size_t hit_num);
+int result_write_index(const char * result_path, const char * const * words, int word_num);
+
+int result_map(RESULT_MAP * map, const char * path);
+void result_unmap(RESULT_MAP * map);
+
+#endif
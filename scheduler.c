@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "scheduler.h"
+
+static int64_t monotonic_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Create a scheduler for task_num tasks run by worker_num workers. It is placed in shared memory
+   so that it keeps working across fork().
+   @param max_attempts: The attempts of a task before it fails (values below 1 mean 1).
+   @param backups: Whether straggling tasks get backup attempts near the end of the phase.
+   @ret: The scheduler, or NULL on error.
+ */
+SCHEDULER *scheduler_create(int task_num, int worker_num, int max_attempts, int backups) {
+    size_t map_length = sizeof(SCHEDULER) + task_num * sizeof(int64_t) + (2 * worker_num + 6 * task_num) * sizeof(int);
+    pthread_mutexattr_t attr;
+    SCHEDULER *scheduler;
+    int i;
+
+    if (task_num < 0 || worker_num <= 0) {
+        return NULL;
+    }
+
+    scheduler = mmap(NULL, map_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (scheduler == MAP_FAILED) {
+        return NULL;
+    }
+
+    scheduler->task_num = task_num;
+    scheduler->worker_num = worker_num;
+    scheduler->max_attempts = max_attempts > 0 ? max_attempts : 1;
+    scheduler->backups = backups;
+    scheduler->map_length = map_length;
+    scheduler->task_start_ns = (int64_t *)(scheduler + 1);
+    scheduler->next = (int *)(scheduler->task_start_ns + task_num);
+    scheduler->end = scheduler->next + worker_num;
+    scheduler->task_owner = scheduler->end + worker_num;
+    scheduler->task_status = scheduler->task_owner + task_num;
+    scheduler->task_attempts = scheduler->task_status + task_num;
+    scheduler->task_running = scheduler->task_attempts + task_num;
+    scheduler->task_settled = scheduler->task_running + task_num;
+    scheduler->retry = scheduler->task_settled + task_num;
+
+    // Deal out contiguous ranges so that each worker first reads neighbouring splits
+    for (i = 0; i < worker_num; i++) {
+        scheduler->next[i] = (long)task_num * i / worker_num;
+        scheduler->end[i] = (long)task_num * (i + 1) / worker_num;
+    }
+    for (i = 0; i < task_num; i++) {
+        scheduler->task_owner[i] = 0;
+        scheduler->task_status[i] = TASK_NOT_RUN;
+    }
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&scheduler->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    return scheduler;
+}
+
+// The running task most worth a backup attempt, or -1: the one running the longest, if longer than
+// the average finished task, and only once most tasks are done. A task has one backup at a time, and
+// at most one attempt beyond max_attempts. Called with the lock held.
+static int pick_backup(SCHEDULER *scheduler) {
+    int64_t now_ns = monotonic_ns(), oldest_ns = now_ns;
+    int task_idx, backup = -1;
+
+    if (!scheduler->backups || scheduler->done_num == 0 ||
+        scheduler->done_num * 100 < (int64_t)scheduler->task_num * SCHEDULER_BACKUP_PERCENT) {
+        return -1;
+    }
+    for (task_idx = 0; task_idx < scheduler->task_num; task_idx++) {
+        if (scheduler->task_running[task_idx] == 1 && scheduler->task_status[task_idx] == TASK_NOT_RUN &&
+            scheduler->task_attempts[task_idx] < scheduler->max_attempts + 1 && scheduler->task_start_ns[task_idx] < oldest_ns) {
+            oldest_ns = scheduler->task_start_ns[task_idx];
+            backup = task_idx;
+        }
+    }
+    if (backup >= 0 && now_ns - oldest_ns <= scheduler->done_wall_ns / scheduler->done_num) {
+        backup = -1;
+    }
+    return backup;
+}
+
+/* Get the next task for a worker: from its own range, stolen from the most loaded worker when its
+   own range is done, then a failed task to run again, then a backup attempt of a straggler.
+   @param worker_idx: The worker asking, in [0, worker_num).
+   @param attempt: Receives the attempt number of the task, from 0.
+   @ret: The task index, or -1 when no task is left for this worker.
+ */
+int scheduler_next(SCHEDULER *scheduler, int worker_idx, int *attempt) {
+    int task_idx = -1;
+
+    pthread_mutex_lock(&scheduler->lock);
+    if (scheduler->next[worker_idx] >= scheduler->end[worker_idx]) {
+        // Own range exhausted: take the upper half of the largest remaining range
+        int victim = -1, victim_left = 0, i;
+        for (i = 0; i < scheduler->worker_num; i++) {
+            int left = scheduler->end[i] - scheduler->next[i];
+            if (left > victim_left) {
+                victim = i;
+                victim_left = left;
+            }
+        }
+        if (victim >= 0) {
+            int middle = scheduler->end[victim] - (victim_left + 1) / 2;
+            scheduler->next[worker_idx] = middle;
+            scheduler->end[worker_idx] = scheduler->end[victim];
+            scheduler->end[victim] = middle;
+        }
+    }
+    if (scheduler->next[worker_idx] < scheduler->end[worker_idx]) {
+        task_idx = scheduler->next[worker_idx]++;
+    } else if (scheduler->retry_num > 0) {
+        task_idx = scheduler->retry[--scheduler->retry_num];
+    } else {
+        task_idx = pick_backup(scheduler);
+    }
+    if (task_idx >= 0) {
+        if (scheduler->task_running[task_idx]++ == 0) {
+            scheduler->task_start_ns[task_idx] = monotonic_ns();
+        }
+        *attempt = scheduler->task_attempts[task_idx]++;
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+
+    return task_idx;
+}
+
+/* Record the outcome of an attempt of a task.
+   @param owner_id: The pid or tid of the worker that ran it.
+   @param status: The attempt's return value (SUCCESS on success).
+   @ret: ATTEMPT_COMMITTED for the first successful attempt, ATTEMPT_FAILED for the last attempt of a
+         task that failed, ATTEMPT_DISCARDED otherwise (a failed task with attempts left runs again).
+         The caller settles the task with scheduler_settle() once it has handled either of the first two.
+ */
+int scheduler_finish(SCHEDULER *scheduler, int task_idx, int owner_id, int status) {
+    int outcome = ATTEMPT_DISCARDED;
+
+    pthread_mutex_lock(&scheduler->lock);
+    if (scheduler->task_status[task_idx] != TASK_NOT_RUN) {
+        // The task is over: a backup or the original finished first
+    } else if (status == SUCCESS) {
+        scheduler->task_owner[task_idx] = owner_id;
+        scheduler->task_status[task_idx] = SUCCESS;
+        scheduler->done_num++;
+        scheduler->done_wall_ns += monotonic_ns() - scheduler->task_start_ns[task_idx];
+        outcome = ATTEMPT_COMMITTED;
+    } else if (scheduler->task_running[task_idx] > 1) {
+        // Another attempt is still running and may succeed
+    } else if (scheduler->task_attempts[task_idx] < scheduler->max_attempts) {
+        scheduler->retry[scheduler->retry_num++] = task_idx;
+    } else {
+        scheduler->task_owner[task_idx] = owner_id;
+        scheduler->task_status[task_idx] = status;
+        scheduler->done_num++;
+        outcome = ATTEMPT_FAILED;
+    }
+    if (outcome == ATTEMPT_DISCARDED) {
+        scheduler->task_running[task_idx]--; // The deciding attempt keeps running until it settles
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+    return outcome;
+}
+
+/* Settle a task after its deciding attempt (ATTEMPT_COMMITTED or ATTEMPT_FAILED) committed its output
+   and counters. */
+void scheduler_settle(SCHEDULER *scheduler, int task_idx) {
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->task_running[task_idx]--;
+    scheduler->task_settled[task_idx] = 1;
+    scheduler->settled_num++;
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+/* Once every worker is gone, take back the tasks whose workers died during an attempt, or before the
+   deciding attempt settled: those with attempts left will run again, the others fail (with TASK_NOT_RUN).
+   @ret: The number of tasks waiting to run again, for new workers.
+ */
+int scheduler_requeue_lost(SCHEDULER *scheduler) {
+    int task_idx, waiting;
+
+    pthread_mutex_lock(&scheduler->lock);
+    for (task_idx = 0; task_idx < scheduler->task_num; task_idx++) {
+        if (scheduler->task_running[task_idx] == 0 || scheduler->task_settled[task_idx]) {
+            scheduler->task_running[task_idx] = 0;
+            continue;
+        }
+        scheduler->task_running[task_idx] = 0;
+        if (scheduler->task_status[task_idx] != TASK_NOT_RUN) {
+            // Decided, but its output may not be in place
+            scheduler->task_status[task_idx] = TASK_NOT_RUN;
+            scheduler->done_num--;
+        }
+        if (scheduler->task_attempts[task_idx] < scheduler->max_attempts) {
+            scheduler->retry[scheduler->retry_num++] = task_idx;
+        } else {
+            scheduler->done_num++;
+            scheduler->task_settled[task_idx] = 1;
+            scheduler->settled_num++;
+        }
+    }
+    waiting = scheduler->retry_num;
+    pthread_mutex_unlock(&scheduler->lock);
+    return waiting;
+}
+
+/* @ret: Whether every task is settled (a losing attempt may still be running). */
+int scheduler_is_done(SCHEDULER *scheduler) {
+    int done;
+
+    pthread_mutex_lock(&scheduler->lock);
+    done = scheduler->settled_num == scheduler->task_num;
+    pthread_mutex_unlock(&scheduler->lock);
+    return done;
+}
+
+void scheduler_destroy(SCHEDULER *scheduler) {
+    if (scheduler != NULL) {
+        pthread_mutex_destroy(&scheduler->lock);
+        munmap(scheduler, scheduler->map_length);
+    }
+}
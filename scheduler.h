@@ -0,0 +1,59 @@
+/* A work-stealing task scheduler shared by the workers of one phase, whether they are threads
+   or forked processes. Tasks [0, task_num) are first dealt out as contiguous ranges, one per
+   worker; a worker whose range is exhausted steals the upper half of the largest remaining one.
+
+   A task that fails runs again, up to max_attempts attempts in all. With backups enabled, once
+   SCHEDULER_BACKUP_PERCENT of the tasks are done and none is left to hand out, an idle worker
+   gets a backup attempt of the task that has been running the longest (if longer than the
+   average finished task). Each attempt has its own number, so that it can write its own output;
+   scheduler_finish() tells the first successful attempt to commit it, and the others to drop theirs.
+   The task is settled once that attempt has called scheduler_settle(): until then, the worker
+   running it must not be stopped, and if it dies the task runs again. */
+
+#ifndef _SCHEDULER_H
+#define _SCHEDULER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define TASK_NOT_RUN 1 /* task_status of a task that never completed */
+#define SCHEDULER_BACKUP_PERCENT 75 /* The share of finished tasks after which stragglers get backups */
+
+/* What scheduler_finish() decides for an attempt */
+#define ATTEMPT_DISCARDED 0 /* Another attempt won, is still running, or will run: drop this one's output */
+#define ATTEMPT_COMMITTED 1 /* The first successful attempt of the task: its output is the task's */
+#define ATTEMPT_FAILED 2 /* The last attempt of a task that failed every time: the task failed */
+
+typedef struct _scheduler
+{
+    pthread_mutex_t lock; /* Process-shared */
+    int task_num;
+    int worker_num;
+    int max_attempts; /* Attempts of a task before it fails, at least 1 */
+    int backups; /* Whether stragglers get backup attempts */
+    int done_num; /* Tasks with a final status */
+    int settled_num; /* Tasks whose deciding attempt has committed its output */
+    int retry_num; /* Tasks waiting in retry */
+    int64_t done_wall_ns; /* The total wall time of the committed attempts, for the average */
+    size_t map_length; /* The scheduler lives in one shared anonymous mapping of this size */
+    int64_t * task_start_ns; /* [task], when the oldest running attempt started */
+    int * next; /* [worker], the next task of the worker's range */
+    int * end; /* [worker], the end of the worker's range */
+    int * task_owner; /* [task], the ID (pid or tid) of the worker that ran the task */
+    int * task_status; /* [task], the task's return value, or TASK_NOT_RUN */
+    int * task_attempts; /* [task], the attempts started */
+    int * task_running; /* [task], the attempts running, the deciding one included until it settles */
+    int * task_settled; /* [task], whether the task is settled */
+    int * retry; /* [task], a stack of the failed tasks to run again */
+}SCHEDULER;
+
+SCHEDULER * scheduler_create(int task_num, int worker_num, int max_attempts, int backups);
+int scheduler_next(SCHEDULER * scheduler, int worker_idx, int * attempt);
+int scheduler_finish(SCHEDULER * scheduler, int task_idx, int owner_id, int status);
+void scheduler_settle(SCHEDULER * scheduler, int task_idx);
+int scheduler_requeue_lost(SCHEDULER * scheduler);
+int scheduler_is_done(SCHEDULER * scheduler);
+void scheduler_destroy(SCHEDULER * scheduler);
+
+#endif
@@ -0,0 +1,364 @@
+#define _GNU_SOURCE /* on_exit() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "common.h"
+#include "server.h"
+
+static pid_t runner_pid = -1; // This process, when it is a runner
+static int current_conn = -1; // The client of the job running in this runner
+static volatile sig_atomic_t stopping; // Set by SIGINT or SIGTERM in the server
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t written = write(fd, p, len);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return ERROR;
+        }
+        p += written;
+        len -= written;
+    }
+    return SUCCESS;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t bytes_read = read(fd, p, len);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            return ERROR;
+        }
+        p += bytes_read;
+        len -= bytes_read;
+    }
+    return SUCCESS;
+}
+
+static void reply(int conn, int status) {
+    int32_t value = status;
+    write_all(conn, &value, sizeof(value));
+}
+
+// on_exit() handler of a runner: a job that exits the runner (EXIT_ERROR) still reports its status
+static void report_exit(int status, void *arg) {
+    if (getpid() == runner_pid && current_conn >= 0) {
+        fflush(stdout);
+        fflush(stderr);
+        reply(current_conn, status & 0xff); // As the shell would see it
+        current_conn = -1;
+    }
+}
+
+// The client's standard input, output and error, passed with each request
+#define STD_FD_NUM 3
+
+static void close_std_fds(int fds[STD_FD_NUM]) {
+    int i;
+
+    for (i = 0; i < STD_FD_NUM; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+}
+
+// Receive a request; returns its payload (NUL-terminated), with the client's stdin, stdout and stderr in fds, or NULL
+static char *receive_request(int conn, SERVER_REQUEST *request, int fds[STD_FD_NUM]) {
+    union
+    {
+        char buf[CMSG_SPACE(STD_FD_NUM * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {request, sizeof(*request)};
+    struct msghdr msg = {0};
+    struct cmsghdr *cmsg;
+    char *payload = NULL;
+
+    fds[0] = fds[1] = fds[2] = -1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (recvmsg(conn, &msg, MSG_WAITALL) != sizeof(*request)) {
+        return NULL;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(STD_FD_NUM * sizeof(int))) {
+        memcpy(fds, CMSG_DATA(cmsg), STD_FD_NUM * sizeof(int));
+    }
+
+    if (request->magic == SERVER_MAGIC && fds[0] >= 0 && fds[1] >= 0 && fds[2] >= 0 && request->argc > 0 &&
+        request->length > 0 && request->length <= SERVER_MAX_REQUEST_SIZE &&
+        (payload = malloc(request->length + 1)) != NULL && read_all(conn, payload, request->length) == SUCCESS) {
+        payload[request->length] = '\0';
+        return payload;
+    }
+    free(payload);
+    close_std_fds(fds);
+    return NULL;
+}
+
+// Cut a payload into the working directory and the argc arguments; returns them NULL-terminated, or NULL
+static char **parse_arguments(char *payload, uint32_t length, uint32_t argc) {
+    char **strings = malloc((argc + 2) * sizeof(char *));
+    char *p = payload, *end = payload + length;
+    uint32_t idx;
+
+    if (strings == NULL) {
+        return NULL;
+    }
+    for (idx = 0; idx < argc + 1; idx++) {
+        if (p >= end) {
+            free(strings);
+            return NULL;
+        }
+        strings[idx] = p;
+        p += strlen(p) + 1;
+    }
+    strings[argc + 1] = NULL;
+    return strings;
+}
+
+// Run the job of one client with its directory and standard input, output and error
+static void run_request(int conn, SERVER_JOB_FUNC run_job) {
+    SERVER_REQUEST request;
+    int fds[STD_FD_NUM], status = 1;
+    char *payload = receive_request(conn, &request, fds);
+    char **strings = payload != NULL ? parse_arguments(payload, request.length, request.argc) : NULL;
+
+    if (strings == NULL) {
+        if (payload != NULL) {
+            close_std_fds(fds);
+        }
+        free(payload);
+        reply(conn, 2);
+        return;
+    }
+
+    int saved_in = dup(STDIN_FILENO), saved_out = dup(STDOUT_FILENO), saved_err = dup(STDERR_FILENO);
+    fflush(stdout);
+    fflush(stderr);
+    dup2(fds[0], STDIN_FILENO); // A job may read its input from there (SPLIT_MODE_STREAM)
+    dup2(fds[1], STDOUT_FILENO);
+    dup2(fds[2], STDERR_FILENO);
+    if (chdir(strings[0]) != 0) {
+        fprintf(stderr, "Unable to enter the directory %s.\n", strings[0]);
+    } else {
+        current_conn = conn;
+        status = run_job(request.argc, strings + 1);
+        current_conn = -1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_in, STDIN_FILENO);
+    dup2(saved_out, STDOUT_FILENO);
+    dup2(saved_err, STDERR_FILENO);
+    close(saved_in);
+    close(saved_out);
+    close(saved_err);
+    close_std_fds(fds);
+
+    reply(conn, status);
+    free(strings);
+    free(payload);
+}
+
+// The loop of a runner: one job per accepted connection, until the server stops it
+static void run_runner(int listen_fd, SERVER_JOB_FUNC run_job) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN); // A client that goes away must not kill the runner
+    runner_pid = getpid();
+    on_exit(report_exit, NULL);
+
+    for (;;) {
+        int conn = accept(listen_fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            _EXIT_ERROR(ERROR, "Error: The server socket failed: %s\n", strerror(errno));
+        }
+        run_request(conn, run_job);
+        close(conn);
+    }
+}
+
+static pid_t spawn_runner(int listen_fd, SERVER_JOB_FUNC run_job) {
+    fflush(stdout); // Or the runner would write what is buffered again
+    pid_t pid = fork();
+    if (pid == 0) {
+        run_runner(listen_fd, run_job);
+    }
+    return pid;
+}
+
+static void stop(int sig) {
+    stopping = 1;
+}
+
+/* Serve jobs on a Unix-domain socket at socket_path until SIGINT or SIGTERM, with runner_num
+   pre-forked runners (each runs one job at a time). An existing socket file is replaced.
+   @ret: 0 once stopped, -1 if the socket or the runners could not be set up.
+ */
+int mapreduce_serve(const char *socket_path, int runner_num, SERVER_JOB_FUNC run_job) {
+    struct sockaddr_un addr = {0};
+    struct sigaction action = {0};
+    pid_t *runners;
+    int listen_fd, idx, ret = SUCCESS;
+
+    if (runner_num <= 0 || strlen(socket_path) >= sizeof(addr.sun_path)) {
+        ERR_MSG("Error: Invalid server socket path or number of runners.\n");
+        return ERROR;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        ERR_MSG("Error: Unable to create the server socket.\n");
+        return ERROR;
+    }
+    unlink(socket_path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, SERVER_BACKLOG) != 0) {
+        ERR_MSG("Error: Unable to listen on %s: %s\n", socket_path, strerror(errno));
+        close(listen_fd);
+        return ERROR;
+    }
+    if ((runners = calloc(runner_num, sizeof(pid_t))) == NULL) {
+        close(listen_fd);
+        unlink(socket_path);
+        return ERROR;
+    }
+
+    // No SA_RESTART: the signal interrupts waitpid()
+    action.sa_handler = stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    for (idx = 0; idx < runner_num && ret == SUCCESS; idx++) {
+        if ((runners[idx] = spawn_runner(listen_fd, run_job)) < 0) {
+            ERR_MSG("Error: Unable to fork a server runner.\n");
+            ret = ERROR;
+        }
+    }
+    if (ret == SUCCESS) {
+        printf("Serving on %s with %d runners (pid %d)\n", socket_path, runner_num, getpid());
+    }
+
+    // Replace the runners that exit
+    while (ret == SUCCESS && !stopping) {
+        pid_t pid = waitpid(-1, NULL, 0);
+        if (pid < 0) {
+            if (errno != EINTR) {
+                ret = ERROR;
+            }
+            continue;
+        }
+        for (idx = 0; idx < runner_num; idx++) {
+            if (runners[idx] == pid && (runners[idx] = spawn_runner(listen_fd, run_job)) < 0) {
+                ERR_MSG("Error: Unable to fork a server runner.\n");
+                ret = ERROR;
+            }
+        }
+    }
+
+    for (idx = 0; idx < runner_num; idx++) {
+        if (runners[idx] > 0) {
+            kill(runners[idx], SIGTERM);
+            waitpid(runners[idx], NULL, 0);
+        }
+    }
+    free(runners);
+    close(listen_fd);
+    unlink(socket_path);
+    return ret;
+}
+
+/* Run a job on the server at socket_path, as if argv (argv[0] included) had been run in the
+   current directory; its output goes to this process's standard output and error.
+   @ret: The exit status of the job, or -1 if the server cannot be reached.
+ */
+int mapreduce_submit(const char *socket_path, int argc, char *argv[]) {
+    struct sockaddr_un addr = {0};
+    char cwd[PATH_MAX];
+    size_t length;
+    int idx, fd;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path) || getcwd(cwd, sizeof(cwd)) == NULL) {
+        return ERROR;
+    }
+    length = strlen(cwd) + 1;
+    for (idx = 0; idx < argc; idx++) {
+        length += strlen(argv[idx]) + 1;
+    }
+    if (length > SERVER_MAX_REQUEST_SIZE) {
+        return ERROR;
+    }
+    char *payload = malloc(length), *p = payload;
+    if (payload == NULL) {
+        return ERROR;
+    }
+    p = stpcpy(p, cwd) + 1;
+    for (idx = 0; idx < argc; idx++) {
+        p = stpcpy(p, argv[idx]) + 1;
+    }
+
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(payload);
+        return ERROR;
+    }
+
+    // The request header carries our standard input, output and error
+    SERVER_REQUEST request = {SERVER_MAGIC, argc, length};
+    int std_fds[STD_FD_NUM] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(std_fds))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {&request, sizeof(request)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(std_fds));
+    memcpy(CMSG_DATA(cmsg), std_fds, sizeof(std_fds));
+
+    int32_t status = ERROR;
+    fflush(stdout);
+    fflush(stderr);
+    if (sendmsg(fd, &msg, 0) != sizeof(request) || write_all(fd, payload, length) != SUCCESS ||
+        read_all(fd, &status, sizeof(status)) != SUCCESS) {
+        fprintf(stderr, "The server did not finish the job.\n");
+        status = 1;
+    }
+    close(fd);
+    free(payload);
+    return status;
+}
@@ -0,0 +1,35 @@
+/* A long-lived server running jobs for many short-lived clients, to save them the process start
+   of every job.
+
+   The server pre-forks runner_num runners that wait in accept() on a Unix-domain socket. A client
+   sends one request: its working directory and the command line of a job, with its standard
+   output and error passed along (SCM_RIGHTS). The runner that accepts it moves to that directory,
+   writes to those descriptors, runs the job function on the command line (which builds a
+   MAPREDUCE_SPEC and calls mapreduce() like a one-off run) and replies with the exit status.
+
+   A runner that exits during a job (EXIT_ERROR) still replies, and is replaced by a new one. */
+
+#ifndef _SERVER_H
+#define _SERVER_H
+
+#include <stdint.h>
+
+#define SERVER_MAGIC 0x3152534d /* "MSR1" */
+#define SERVER_BACKLOG 128
+#define SERVER_MAX_REQUEST_SIZE (1024 * 1024) /* The largest command line (with the directory) of a request */
+
+/* Runs one job; argv[0] is the command name. @ret: The exit status of the job. */
+typedef int (*SERVER_JOB_FUNC)(int argc, char * argv[]);
+
+/* Sent by the client, followed by length bytes: the working directory then argc arguments, each NUL-terminated */
+typedef struct _server_request
+{
+    uint32_t magic; /* SERVER_MAGIC */
+    uint32_t argc;
+    uint32_t length;
+}SERVER_REQUEST;
+
+int mapreduce_serve(const char * socket_path, int runner_num, SERVER_JOB_FUNC run_job);
+int mapreduce_submit(const char * socket_path, int argc, char * argv[]);
+
+#endif
@@ -0,0 +1,581 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "itm.h"
+#include "sketch.h"
+
+#define FNV64_OFFSET_BASIS 14695981039346656037ULL
+#define FNV64_PRIME 1099511628211ULL
+#define LN2 0.69314718055994530942
+
+/* A 64-bit hash of key[0, len): FNV-1a, with the finalizer of MurmurHash3 so that every bit
+   depends on every byte (the HyperLogLog reads the high bits, the Count-Min Sketch both halves). */
+uint64_t sketch_hash(const void *key, size_t len) {
+    const unsigned char *p = key;
+    uint64_t hash = FNV64_OFFSET_BASIS;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * FNV64_PRIME;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// The counter of a hash in a row: the rows use h1 + row * h2 (Kirsch-Mitzenmacher), h1 and h2 being the halves of the hash
+static size_t counter_idx(uint64_t hash, int row) {
+    uint32_t h1 = hash, h2 = (hash >> 32) | 1;
+    return (size_t)row * SKETCH_CMS_WIDTH + ((h1 + (uint32_t)row * h2) & (SKETCH_CMS_WIDTH - 1));
+}
+
+static uint64_t estimate_hash(const TOPK_SKETCH *sketch, uint64_t hash) {
+    uint64_t estimate = UINT64_MAX;
+    int row;
+
+    for (row = 0; row < SKETCH_CMS_DEPTH; row++) {
+        uint64_t count = sketch->counters[counter_idx(hash, row)];
+        if (count < estimate) {
+            estimate = count;
+        }
+    }
+    return estimate;
+}
+
+/* Create an empty sketch of the top_num most frequent keys, in [1, SKETCH_TOPK_MAX].
+   @ret: The sketch, or NULL on error.
+ */
+TOPK_SKETCH *topk_create(int top_num) {
+    TOPK_SKETCH *sketch;
+    int index_size = 1;
+
+    if (top_num < 1 || top_num > SKETCH_TOPK_MAX || (sketch = calloc(1, sizeof(TOPK_SKETCH))) == NULL) {
+        return NULL;
+    }
+    sketch->top_num = top_num;
+    sketch->capacity = top_num * SKETCH_TOPK_SLACK;
+    while (index_size < 2 * sketch->capacity) {
+        index_size *= 2;
+    }
+    sketch->index_mask = index_size - 1;
+    sketch->counters = calloc(SKETCH_CMS_DEPTH * SKETCH_CMS_WIDTH, sizeof(uint64_t));
+    sketch->candidates = malloc(sketch->capacity * sizeof(TOPK_CANDIDATE));
+    sketch->heap = malloc(sketch->capacity * sizeof(int));
+    sketch->index = malloc(index_size * sizeof(int));
+    if (sketch->counters == NULL || sketch->candidates == NULL || sketch->heap == NULL || sketch->index == NULL) {
+        topk_destroy(sketch);
+        return NULL;
+    }
+    memset(sketch->index, -1, index_size * sizeof(int));
+    return sketch;
+}
+
+void topk_destroy(TOPK_SKETCH *sketch) {
+    if (sketch != NULL) {
+        free(sketch->counters);
+        free(sketch->candidates);
+        free(sketch->heap);
+        free(sketch->index);
+        free(sketch);
+    }
+}
+
+// The index slot of a key: the one holding its candidate, or the empty slot ending its probe sequence
+static int find_slot(const TOPK_SKETCH *sketch, uint64_t hash, const char *key, uint32_t len) {
+    int slot = hash & sketch->index_mask;
+
+    while (sketch->index[slot] >= 0) {
+        const TOPK_CANDIDATE *candidate = &sketch->candidates[sketch->index[slot]];
+        if (candidate->hash == hash && candidate->key_len == len && memcmp(candidate->key, key, len) == 0) {
+            break;
+        }
+        slot = (slot + 1) & sketch->index_mask;
+    }
+    return slot;
+}
+
+// Empty an index slot, moving back the candidates after it whose probe sequence went through it
+static void clear_slot(TOPK_SKETCH *sketch, int slot) {
+    int next = slot;
+
+    while (1) {
+        next = (next + 1) & sketch->index_mask;
+        if (sketch->index[next] < 0) {
+            break;
+        }
+        int home = sketch->candidates[sketch->index[next]].hash & sketch->index_mask;
+        // Move it unless its home lies cyclically in (slot, next]
+        if (slot <= next ? (home <= slot || home > next) : (home <= slot && home > next)) {
+            sketch->index[slot] = sketch->index[next];
+            slot = next;
+        }
+    }
+    sketch->index[slot] = -1;
+}
+
+static void heap_swap(TOPK_SKETCH *sketch, int pos, int other) {
+    int candidate = sketch->heap[pos];
+
+    sketch->heap[pos] = sketch->heap[other];
+    sketch->heap[other] = candidate;
+    sketch->candidates[sketch->heap[pos]].heap_pos = pos;
+    sketch->candidates[sketch->heap[other]].heap_pos = other;
+}
+
+static uint64_t heap_count(const TOPK_SKETCH *sketch, int pos) {
+    return sketch->candidates[sketch->heap[pos]].count;
+}
+
+static void sift_down(TOPK_SKETCH *sketch, int pos) {
+    while (1) {
+        int child = 2 * pos + 1, smallest = pos;
+        if (child < sketch->candidate_num && heap_count(sketch, child) < heap_count(sketch, smallest)) {
+            smallest = child;
+        }
+        if (child + 1 < sketch->candidate_num && heap_count(sketch, child + 1) < heap_count(sketch, smallest)) {
+            smallest = child + 1;
+        }
+        if (smallest == pos) {
+            return;
+        }
+        heap_swap(sketch, pos, smallest);
+        pos = smallest;
+    }
+}
+
+static void sift_up(TOPK_SKETCH *sketch, int pos) {
+    while (pos > 0 && heap_count(sketch, (pos - 1) / 2) > heap_count(sketch, pos)) {
+        heap_swap(sketch, pos, (pos - 1) / 2);
+        pos = (pos - 1) / 2;
+    }
+}
+
+// Make a key with the given estimate a candidate if it beats the least frequent one
+static void offer_candidate(TOPK_SKETCH *sketch, uint64_t hash, const char *key, uint32_t len, uint64_t estimate) {
+    TOPK_CANDIDATE *candidate;
+    int slot = find_slot(sketch, hash, key, len), idx;
+
+    if (sketch->index[slot] >= 0) {
+        // Already a candidate: estimates only grow
+        candidate = &sketch->candidates[sketch->index[slot]];
+        if (estimate > candidate->count) {
+            candidate->count = estimate;
+            sift_down(sketch, candidate->heap_pos);
+        }
+        return;
+    }
+
+    if (sketch->candidate_num < sketch->capacity) {
+        idx = sketch->candidate_num++;
+        sketch->heap[idx] = idx;
+        sketch->candidates[idx].heap_pos = idx;
+    } else if (estimate > heap_count(sketch, 0)) {
+        // Evict the least frequent candidate, whose slot is then reused
+        idx = sketch->heap[0];
+        candidate = &sketch->candidates[idx];
+        clear_slot(sketch, find_slot(sketch, candidate->hash, candidate->key, candidate->key_len));
+        slot = find_slot(sketch, hash, key, len);
+    } else {
+        return;
+    }
+    candidate = &sketch->candidates[idx];
+    candidate->count = estimate;
+    candidate->hash = hash;
+    candidate->key_len = len;
+    memcpy(candidate->key, key, len);
+    sketch->index[slot] = idx;
+    sift_down(sketch, candidate->heap_pos);
+    sift_up(sketch, candidate->heap_pos);
+}
+
+/* Count one occurrence of key[0, len) (its first SKETCH_KEY_MAX bytes). */
+void topk_add(TOPK_SKETCH *sketch, const void *key, size_t len) {
+    uint64_t hash, estimate = UINT64_MAX;
+    int row;
+
+    if (len > SKETCH_KEY_MAX) {
+        len = SKETCH_KEY_MAX;
+    }
+    hash = sketch_hash(key, len);
+    for (row = 0; row < SKETCH_CMS_DEPTH; row++) {
+        uint64_t count = ++sketch->counters[counter_idx(hash, row)];
+        if (count < estimate) {
+            estimate = count;
+        }
+    }
+    // A key whose estimate does not beat the least frequent of a full heap is not a candidate, or one
+    // whose count is already that estimate: nothing to update
+    if (sketch->candidate_num == sketch->capacity && estimate <= heap_count(sketch, 0)) {
+        return;
+    }
+    offer_candidate(sketch, hash, key, len, estimate);
+}
+
+/* @ret: The estimated count of key[0, len), never below its actual count. */
+uint64_t topk_estimate(const TOPK_SKETCH *sketch, const void *key, size_t len) {
+    return estimate_hash(sketch, sketch_hash(key, len < SKETCH_KEY_MAX ? len : SKETCH_KEY_MAX));
+}
+
+/* Merge the serialized sketch data[0, size), written by topk_write() for the same top_num, into sketch:
+   the counters are added, and both sets of candidates are re-estimated from the sum.
+   @ret: 0 on success, -1 if data is not such a sketch.
+ */
+int topk_merge(TOPK_SKETCH *sketch, const char *data, size_t size) {
+    size_t counters_size = SKETCH_CMS_DEPTH * SKETCH_CMS_WIDTH * sizeof(uint64_t), pos;
+    SKETCH_HEADER header;
+    uint64_t count;
+    uint32_t i, len;
+
+    if (size < sizeof(header) + counters_size) {
+        return ERROR;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.type != SKETCH_TYPE_TOPK || header.param != (uint32_t)sketch->top_num ||
+        header.capacity != (uint32_t)sketch->capacity || header.candidate_num > header.capacity) {
+        return ERROR;
+    }
+    for (i = 0; i < SKETCH_CMS_DEPTH * SKETCH_CMS_WIDTH; i++) {
+        memcpy(&count, data + sizeof(header) + i * sizeof(count), sizeof(count));
+        sketch->counters[i] += count;
+    }
+
+    // Every estimate grew: re-estimate the candidates and rebuild the heap
+    for (i = 0; i < (uint32_t)sketch->candidate_num; i++) {
+        sketch->candidates[i].count = estimate_hash(sketch, sketch->candidates[i].hash);
+    }
+    for (i = sketch->candidate_num / 2; i-- > 0;) {
+        sift_down(sketch, i);
+    }
+
+    pos = sizeof(header) + counters_size;
+    for (i = 0; i < header.candidate_num; i++) {
+        if (size - pos < sizeof(len)) {
+            return ERROR;
+        }
+        memcpy(&len, data + pos, sizeof(len));
+        pos += sizeof(len);
+        if (len > SKETCH_KEY_MAX || size - pos < len) {
+            return ERROR;
+        }
+        uint64_t hash = sketch_hash(data + pos, len);
+        offer_candidate(sketch, hash, data + pos, len, estimate_hash(sketch, hash));
+        pos += len;
+    }
+    return pos == size ? SUCCESS : ERROR;
+}
+
+/* Write the sketch as one intermediate record, with name as key.
+   @ret: 0 on success, -1 on error.
+ */
+int topk_write(const TOPK_SKETCH *sketch, ITM_WRITER *writer, const char *name) {
+    size_t counters_size = SKETCH_CMS_DEPTH * SKETCH_CMS_WIDTH * sizeof(uint64_t), size = sizeof(SKETCH_HEADER) + counters_size;
+    SKETCH_HEADER header = {SKETCH_TYPE_TOPK, sketch->top_num, sketch->capacity, sketch->candidate_num};
+    char *data;
+    int i, ret;
+
+    for (i = 0; i < sketch->candidate_num; i++) {
+        size += sizeof(uint32_t) + sketch->candidates[i].key_len;
+    }
+    if ((data = malloc(size)) == NULL) {
+        return ERROR;
+    }
+    memcpy(data, &header, sizeof(header));
+    memcpy(data + sizeof(header), sketch->counters, counters_size);
+    size = sizeof(header) + counters_size;
+    for (i = 0; i < sketch->candidate_num; i++) {
+        memcpy(data + size, &sketch->candidates[i].key_len, sizeof(uint32_t));
+        memcpy(data + size + sizeof(uint32_t), sketch->candidates[i].key, sketch->candidates[i].key_len);
+        size += sizeof(uint32_t) + sketch->candidates[i].key_len;
+    }
+    ret = itm_write(writer, name, strlen(name), data, size);
+    free(data);
+    return ret;
+}
+
+// Most frequent first, then in key order
+static int compare_candidates(const void *a, const void *b) {
+    const TOPK_CANDIDATE *candidate = a, *other = b;
+
+    if (candidate->count != other->count) {
+        return candidate->count > other->count ? -1 : 1;
+    }
+    return itm_compare_keys(candidate->key, candidate->key_len, other->key, other->key_len);
+}
+
+/* Write the top_num most frequent keys to output, one "key estimate" line each, most frequent first.
+   The candidates are sorted in place: the sketch may only be destroyed afterwards.
+   @ret: 0 on success, -1 on error.
+ */
+int topk_report(TOPK_SKETCH *sketch, FILE *output) {
+    int i;
+
+    qsort(sketch->candidates, sketch->candidate_num, sizeof(TOPK_CANDIDATE), compare_candidates);
+    for (i = 0; i < sketch->candidate_num && i < sketch->top_num; i++) {
+        const TOPK_CANDIDATE *candidate = &sketch->candidates[i];
+        if (fwrite(candidate->key, 1, candidate->key_len, output) != candidate->key_len ||
+            fprintf(output, " %llu\n", (unsigned long long)candidate->count) < 0) {
+            return ERROR;
+        }
+    }
+    return SUCCESS;
+}
+
+HLL_SKETCH *hll_create(void) {
+    return calloc(1, sizeof(HLL_SKETCH));
+}
+
+void hll_destroy(HLL_SKETCH *sketch) {
+    free(sketch);
+}
+
+/* Count key[0, len) as seen: its register, picked by the high bits of its hash, keeps the highest
+   rank (the position of the first 1 bit) of the other bits. */
+void hll_add(HLL_SKETCH *sketch, const void *key, size_t len) {
+    uint64_t hash = sketch_hash(key, len), rest = hash << SKETCH_HLL_PRECISION;
+    int reg = hash >> (64 - SKETCH_HLL_PRECISION);
+    uint8_t rank = rest != 0 ? __builtin_clzll(rest) + 1 : 64 - SKETCH_HLL_PRECISION + 1;
+
+    if (rank > sketch->registers[reg]) {
+        sketch->registers[reg] = rank;
+    }
+}
+
+// ln(x) for x > 0, without libm: x = m * 2^e with m in [1, 2), ln(m) = 2 atanh((m - 1) / (m + 1))
+static double natural_log(double x) {
+    double y, y2, term, sum = 0;
+    int exponent = 0, k;
+
+    while (x >= 2) {
+        x /= 2;
+        exponent++;
+    }
+    while (x < 1) {
+        x *= 2;
+        exponent--;
+    }
+    y = (x - 1) / (x + 1);
+    y2 = y * y;
+    term = y;
+    for (k = 1; k < 40; k += 2) {
+        sum += term / k;
+        term *= y2;
+    }
+    return 2 * sum + exponent * LN2;
+}
+
+/* @ret: The estimated number of distinct keys added: the harmonic mean of the registers, with linear
+         counting while some registers are empty and the estimate is small. */
+uint64_t hll_estimate(const HLL_SKETCH *sketch) {
+    double m = SKETCH_HLL_REGISTERS, sum = 0, estimate;
+    int reg, zeros = 0;
+
+    for (reg = 0; reg < SKETCH_HLL_REGISTERS; reg++) {
+        sum += 1.0 / (double)(1ULL << sketch->registers[reg]);
+        zeros += sketch->registers[reg] == 0;
+    }
+    estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    if (estimate <= 2.5 * m && zeros > 0) {
+        estimate = m * natural_log(m / zeros);
+    }
+    return (uint64_t)(estimate + 0.5);
+}
+
+/* Merge the serialized sketch data[0, size), written by hll_write(), into sketch: each register keeps the higher rank.
+   @ret: 0 on success, -1 if data is not such a sketch.
+ */
+int hll_merge(HLL_SKETCH *sketch, const char *data, size_t size) {
+    SKETCH_HEADER header;
+    const uint8_t *registers = (const uint8_t *)data + sizeof(header);
+    int reg;
+
+    if (size != sizeof(header) + SKETCH_HLL_REGISTERS) {
+        return ERROR;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.type != SKETCH_TYPE_HLL || header.param != SKETCH_HLL_PRECISION) {
+        return ERROR;
+    }
+    for (reg = 0; reg < SKETCH_HLL_REGISTERS; reg++) {
+        if (registers[reg] > sketch->registers[reg]) {
+            sketch->registers[reg] = registers[reg];
+        }
+    }
+    return SUCCESS;
+}
+
+/* Write the sketch as one intermediate record, with name as key.
+   @ret: 0 on success, -1 on error.
+ */
+int hll_write(const HLL_SKETCH *sketch, ITM_WRITER *writer, const char *name) {
+    char data[sizeof(SKETCH_HEADER) + SKETCH_HLL_REGISTERS];
+    SKETCH_HEADER header = {SKETCH_TYPE_HLL, SKETCH_HLL_PRECISION, 0, 0};
+
+    memcpy(data, &header, sizeof(header));
+    memcpy(data + sizeof(header), sketch->registers, SKETCH_HLL_REGISTERS);
+    return itm_write(writer, name, strlen(name), data, sizeof(data));
+}
+
+// The sketches of one name, merged
+typedef struct _named_sketch
+{
+    char name[SKETCH_KEY_MAX + 1];
+    uint32_t type;
+    TOPK_SKETCH * topk;
+    HLL_SKETCH * hll;
+}NAMED_SKETCH;
+
+typedef struct _sketch_set
+{
+    NAMED_SKETCH * sketches;
+    int sketch_num;
+}SKETCH_SET;
+
+static void free_sketch_set(SKETCH_SET *set) {
+    int i;
+
+    for (i = 0; i < set->sketch_num; i++) {
+        topk_destroy(set->sketches[i].topk);
+        hll_destroy(set->sketches[i].hll);
+    }
+    free(set->sketches);
+}
+
+// Merge one sketch record into the sketch of its name in set, created from the first record of the name
+static int merge_record(SKETCH_SET *set, const char *key, uint32_t key_len, const char *value, uint32_t value_len) {
+    SKETCH_HEADER header;
+    NAMED_SKETCH *sketch = NULL;
+    int i;
+
+    if (key_len > SKETCH_KEY_MAX || value_len < sizeof(header)) {
+        return ERROR;
+    }
+    memcpy(&header, value, sizeof(header));
+    for (i = 0; i < set->sketch_num; i++) {
+        if (strlen(set->sketches[i].name) == key_len && memcmp(set->sketches[i].name, key, key_len) == 0) {
+            sketch = &set->sketches[i];
+            break;
+        }
+    }
+    if (sketch == NULL) {
+        NAMED_SKETCH *sketches = realloc(set->sketches, (set->sketch_num + 1) * sizeof(NAMED_SKETCH));
+        if (sketches == NULL) {
+            return ERROR;
+        }
+        set->sketches = sketches;
+        sketch = &sketches[set->sketch_num++];
+        memcpy(sketch->name, key, key_len);
+        sketch->name[key_len] = '\0';
+        sketch->type = header.type;
+        sketch->topk = header.type == SKETCH_TYPE_TOPK ? topk_create(header.param) : NULL;
+        sketch->hll = header.type == SKETCH_TYPE_HLL ? hll_create() : NULL;
+    }
+    if (sketch->type != header.type) {
+        return ERROR;
+    }
+    if (sketch->topk != NULL) {
+        return topk_merge(sketch->topk, value, value_len);
+    }
+    return sketch->hll != NULL ? hll_merge(sketch->hll, value, value_len) : ERROR;
+}
+
+// Merge the sketch records of the intermediate files p_fd_in[0, fd_in_num) by name into set
+static int merge_sketch_files(int *p_fd_in, int fd_in_num, SKETCH_SET *set, const char *func_name) {
+    for (int fd_idx = 0; fd_idx < fd_in_num; fd_idx++) {
+        ITM_READER reader;
+        const char *key, *value;
+        uint32_t key_len, value_len;
+        int ret;
+
+        if (itm_reader_open(&reader, p_fd_in[fd_idx]) != SUCCESS) {
+            fprintf(stderr, "Error: Intermediate file %d is missing or corrupted (%s).\n", fd_idx, func_name);
+            return -1;
+        }
+        while ((ret = itm_read(&reader, &key, &key_len, &value, &value_len)) > 0) {
+            if (merge_record(set, key, key_len, value, value_len) != SUCCESS) {
+                ret = -1;
+                break;
+            }
+        }
+        itm_reader_close(&reader);
+
+        if (ret < 0) {
+            fprintf(stderr, "Error: Intermediate file %d holds an invalid sketch (%s).\n", fd_idx, func_name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Built-in combine function for the map functions writing sketches: merges the sketch records of
+   the same name (key) of p_fd_in[0, fd_in_num) into one. It is associative, for stream_reduce.
+   @ret: 0 on success, -1 on error.
+ */
+int sketch_combine(int *p_fd_in, int fd_in_num, int fd_out) {
+    SKETCH_SET set = {NULL, 0};
+    ITM_WRITER writer;
+    int i, ret;
+
+    if (!p_fd_in || fd_in_num <= 0) {
+        fprintf(stderr, "Error: Invalid input file descriptors or count in combine function.\n");
+        return -1;
+    }
+    ret = merge_sketch_files(p_fd_in, fd_in_num, &set, "sketch_combine");
+    if (ret == 0) {
+        itm_writer_open(&writer, fd_out);
+        for (i = 0; i < set.sketch_num && ret == 0; i++) {
+            const NAMED_SKETCH *sketch = &set.sketches[i];
+            ret = sketch->topk != NULL ? topk_write(sketch->topk, &writer, sketch->name) : hll_write(sketch->hll, &writer, sketch->name);
+        }
+        if (ret != 0 || itm_writer_close(&writer) != SUCCESS) {
+            perror("Error writing to intermediate file in combine function");
+            ret = -1;
+        }
+    }
+    free_sketch_set(&set);
+    return ret;
+}
+
+/* Built-in reduce function for the map functions writing sketches: merges the sketch records of the
+   same name (key) of p_fd_in[0, fd_in_num), then writes each merged sketch, in the order its name was
+   first read. A TOPK_SKETCH is written with topk_report(), an HLL_SKETCH as a "name estimate" line.
+   @ret: 0 on success, -1 on error.
+ */
+int sketch_reduce(int *p_fd_in, int fd_in_num, int fd_out) {
+    SKETCH_SET set = {NULL, 0};
+    FILE *output = NULL;
+    int i, ret;
+
+    if (!p_fd_in || fd_in_num <= 0) {
+        fprintf(stderr, "Error: Invalid input file descriptors or count in reduce function.\n");
+        return -1;
+    }
+    ret = merge_sketch_files(p_fd_in, fd_in_num, &set, "sketch_reduce");
+    if (ret == 0) {
+        if ((output = fdopen(dup(fd_out), "w")) == NULL) {
+            perror("Error opening output file (sketch_reduce)");
+            ret = -1;
+        }
+        for (i = 0; i < set.sketch_num && ret == 0; i++) {
+            NAMED_SKETCH *sketch = &set.sketches[i];
+            if (sketch->topk != NULL) {
+                ret = topk_report(sketch->topk, output);
+            } else if (fprintf(output, "%s %llu\n", sketch->name, (unsigned long long)hll_estimate(sketch->hll)) < 0) {
+                ret = -1;
+            }
+        }
+        if (output != NULL && fclose(output) != 0) {
+            ret = -1;
+        }
+        if (ret != 0) {
+            perror("Error writing data to output file (sketch_reduce)");
+        }
+    }
+    free_sketch_set(&set);
+    return ret;
+}
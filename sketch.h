@@ -0,0 +1,94 @@
+/* Mergeable sketches of fixed size for approximate aggregation: a Count-Min Sketch with a heap of
+   heavy hitters for the most frequent keys (TOPK_SKETCH), and a HyperLogLog for the number of
+   distinct keys (HLL_SKETCH). A map function adds its keys to a sketch and writes it out as a single
+   intermediate record, named by its key; sketch_combine() and sketch_reduce() merge the records of
+   the same name, so that neither the intermediate data nor the reduce workers grow with the number
+   of distinct keys.
+
+   The Count-Min Sketch has SKETCH_CMS_DEPTH rows of SKETCH_CMS_WIDTH counters: the estimate of a key
+   (the smallest of its counters) is never below its count, and exceeds it by at most about
+   e / SKETCH_CMS_WIDTH of all the keys added, with a probability of 1 - exp(-SKETCH_CMS_DEPTH). The heap
+   tracks SKETCH_TOPK_SLACK candidates per key to report, re-estimated from the merged counters on each
+   merge. The HyperLogLog has 2^SKETCH_HLL_PRECISION registers, for a standard error of about
+   1.04 / 2^(SKETCH_HLL_PRECISION / 2), i.e. 0.8%.
+
+   Serialized sketches are a SKETCH_HEADER followed by the counters and the candidates (each a uint32_t
+   key length then the key bytes) of a TOPK_SKETCH, or the registers of an HLL_SKETCH, in host byte order. */
+
+#ifndef _SKETCH_H
+#define _SKETCH_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "itm.h"
+
+#define SKETCH_CMS_DEPTH 4
+#define SKETCH_CMS_WIDTH 4096 /* A power of two */
+#define SKETCH_TOPK_MAX 1000 /* The most keys a TOPK_SKETCH reports */
+#define SKETCH_TOPK_SLACK 4 /* The candidates tracked per key reported */
+#define SKETCH_KEY_MAX 256 /* Longer keys are counted by their prefix */
+#define SKETCH_HLL_PRECISION 14
+#define SKETCH_HLL_REGISTERS (1 << SKETCH_HLL_PRECISION)
+
+/* SKETCH_HEADER.type */
+#define SKETCH_TYPE_TOPK 0x4b504f54 /* "TOPK" */
+#define SKETCH_TYPE_HLL 0x314c4c48 /* "HLL1" */
+
+typedef struct _sketch_header
+{
+    uint32_t type; /* SKETCH_TYPE_TOPK or SKETCH_TYPE_HLL */
+    uint32_t param; /* The keys reported by a TOPK_SKETCH, the precision of an HLL_SKETCH */
+    uint32_t capacity; /* The candidates a TOPK_SKETCH tracks, 0 for an HLL_SKETCH */
+    uint32_t candidate_num; /* The candidates that follow the counters, 0 for an HLL_SKETCH */
+}SKETCH_HEADER;
+
+/* A key that may be among the most frequent ones */
+typedef struct _topk_candidate
+{
+    uint64_t count; /* Its estimate when last seen */
+    uint64_t hash;
+    int heap_pos; /* Its position in TOPK_SKETCH.heap */
+    uint32_t key_len;
+    char key[SKETCH_KEY_MAX];
+}TOPK_CANDIDATE;
+
+typedef struct _topk_sketch
+{
+    int top_num; /* The keys reported */
+    int capacity; /* The candidates tracked, top_num * SKETCH_TOPK_SLACK */
+    int candidate_num;
+    uint64_t * counters; /* [row * SKETCH_CMS_WIDTH + column] */
+    TOPK_CANDIDATE * candidates; /* [capacity] */
+    int * heap; /* [capacity], a min-heap of candidates by count */
+    int * index; /* [index_mask + 1], an open-addressing table of the candidates by key, -1 for an empty slot */
+    int index_mask;
+}TOPK_SKETCH;
+
+typedef struct _hll_sketch
+{
+    uint8_t registers[SKETCH_HLL_REGISTERS];
+}HLL_SKETCH;
+
+uint64_t sketch_hash(const void * key, size_t len);
+
+TOPK_SKETCH * topk_create(int top_num);
+void topk_add(TOPK_SKETCH * sketch, const void * key, size_t len);
+uint64_t topk_estimate(const TOPK_SKETCH * sketch, const void * key, size_t len);
+int topk_merge(TOPK_SKETCH * sketch, const char * data, size_t size);
+int topk_write(const TOPK_SKETCH * sketch, ITM_WRITER * writer, const char * name);
+int topk_report(TOPK_SKETCH * sketch, FILE * output);
+void topk_destroy(TOPK_SKETCH * sketch);
+
+HLL_SKETCH * hll_create(void);
+void hll_add(HLL_SKETCH * sketch, const void * key, size_t len);
+uint64_t hll_estimate(const HLL_SKETCH * sketch);
+int hll_merge(HLL_SKETCH * sketch, const char * data, size_t size);
+int hll_write(const HLL_SKETCH * sketch, ITM_WRITER * writer, const char * name);
+void hll_destroy(HLL_SKETCH * sketch);
+
+int sketch_combine(int * p_fd_in, int fd_in_num, int fd_out);
+int sketch_reduce(int * p_fd_in, int fd_in_num, int fd_out);
+
+#endif
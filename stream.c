@@ -0,0 +1,218 @@
+#define _GNU_SOURCE /* memfd_create(), memrchr() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "common.h"
+#include "stream.h"
+#include "trace.h"
+
+/* Open the stream at path: standard input for "-", a connection to a Unix-domain socket, or else
+   the file itself (a FIFO, a character device, or even a regular file, read through once).
+   @ret: The file descriptor, or -1 on error.
+ */
+int stream_open(const char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    struct stat st;
+    int fd;
+
+    if (strcmp(path, "-") == 0) {
+        return dup(STDIN_FILENO);
+    }
+    if (stat(path, &st) != 0 || !S_ISSOCK(st.st_mode)) {
+        return open(path, O_RDONLY);
+    }
+    if (strlen(path) >= sizeof(address.sun_path) || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return ERROR;
+    }
+    strcpy(address.sun_path, path);
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        close(fd);
+        return ERROR;
+    }
+    shutdown(fd, SHUT_WR); // Only read from
+    return fd;
+}
+
+/* Create an empty queue of slot_num (at least 2) slots of chunk_size bytes, in shared memory so
+   that it keeps working across fork().
+   @ret: The queue, or NULL on error.
+ */
+STREAM_QUEUE *stream_queue_create(size_t chunk_size, int slot_num) {
+    size_t map_length = sizeof(STREAM_QUEUE) + slot_num * (sizeof(size_t) + sizeof(int64_t) + 2 * sizeof(int));
+    pthread_mutexattr_t mutex_attr;
+    pthread_condattr_t cond_attr;
+    STREAM_QUEUE *queue;
+
+    if (chunk_size == 0 || slot_num < 2) {
+        return NULL;
+    }
+    queue = mmap(NULL, map_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (queue == MAP_FAILED) {
+        return NULL;
+    }
+    queue->map_length = map_length;
+    queue->chunk_size = chunk_size;
+    queue->slot_num = slot_num;
+    queue->offsets = (int64_t *)(queue + 1);
+    queue->lengths = (size_t *)(queue->offsets + slot_num);
+    queue->busy = (int *)(queue->lengths + slot_num);
+    queue->ready = queue->busy + slot_num;
+    queue->fd = memfd_create("mr-stream", 0);
+    if (queue->fd < 0 || ftruncate(queue->fd, (off_t)chunk_size * slot_num) != 0 ||
+        (queue->slots = mmap(NULL, chunk_size * slot_num, PROT_READ | PROT_WRITE, MAP_SHARED, queue->fd, 0)) == MAP_FAILED) {
+        if (queue->fd >= 0) {
+            close(queue->fd);
+        }
+        munmap(queue, map_length);
+        return NULL;
+    }
+
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&queue->lock, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&queue->slot_free, &cond_attr);
+    pthread_cond_init(&queue->chunk_ready, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    return queue;
+}
+
+// Wait for a free slot and take it for filling. @ret: The slot, or -1 once the queue is closed.
+static int acquire_slot(STREAM_QUEUE *queue) {
+    int slot = -1, i;
+
+    pthread_mutex_lock(&queue->lock);
+    while (slot < 0 && !queue->closed) {
+        for (i = 0; i < queue->slot_num && queue->busy[i]; i++) {
+        }
+        if (i < queue->slot_num) {
+            queue->busy[i] = 1;
+            slot = i;
+        } else {
+            pthread_cond_wait(&queue->slot_free, &queue->lock);
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return slot;
+}
+
+// Queue the chunk in a slot (an empty one is released instead), and end the stream with ended != 0
+static void queue_chunk(STREAM_QUEUE *queue, int slot, size_t length, int ended) {
+    pthread_mutex_lock(&queue->lock);
+    if (length > 0) {
+        queue->lengths[slot] = length;
+        queue->offsets[slot] = queue->queued_bytes;
+        queue->queued_bytes += length;
+        queue->ready[(queue->ready_head + queue->ready_num) % queue->slot_num] = slot;
+        queue->ready_num++;
+        queue->chunk_num++;
+    } else {
+        queue->busy[slot] = 0;
+    }
+    queue->ended = ended;
+    pthread_cond_broadcast(&queue->chunk_ready);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/* Read the stream fd_in into the queue until its end (or until the queue is closed), from the thread
+   of the producer.
+   @ret: 0 at the end of the stream, -1 on a read error or if the queue was closed first.
+ */
+int stream_queue_fill(STREAM_QUEUE *queue, int fd_in) {
+    int slot = acquire_slot(queue);
+    size_t filled = 0;
+    ssize_t bytes;
+
+    while (slot >= 0) {
+        char *data = queue->slots + (size_t)slot * queue->chunk_size;
+        TRACE_BEGIN("read", queue->bytes);
+        bytes = read(fd_in, data + filled, queue->chunk_size - filled);
+        TRACE_END("read", bytes);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            queue_chunk(queue, slot, bytes < 0 ? 0 : filled, bytes < 0 ? -1 : 1);
+            return bytes < 0 ? ERROR : SUCCESS;
+        }
+        filled += bytes;
+        __atomic_add_fetch(&queue->bytes, bytes, __ATOMIC_RELAXED);
+        if (filled < queue->chunk_size) {
+            continue;
+        }
+
+        // The slot is full: queue it up to its last line, and start the next slot with the rest
+        const char *last_newline = memrchr(data, '\n', filled);
+        size_t cut = last_newline != NULL ? (size_t)(last_newline - data) + 1 : filled;
+        int next = acquire_slot(queue);
+        if (next >= 0) {
+            memcpy(queue->slots + (size_t)next * queue->chunk_size, data + cut, filled - cut);
+        }
+        queue_chunk(queue, slot, cut, 0);
+        filled -= cut;
+        slot = next;
+    }
+    return ERROR;
+}
+
+/* Take the oldest queued chunk for mapping, waiting for the producer if none is queued. Its bytes are
+   queue->slots + slot * queue->chunk_size, queue->lengths[slot] of them, and the same bytes of queue->fd;
+   they start at queue->offsets[slot] in the stream.
+   @ret: 1 with a chunk in *slot, 0 at the end of the stream, -1 if the stream could not be read to its end.
+ */
+int stream_queue_take(STREAM_QUEUE *queue, int *slot) {
+    int ret;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->ready_num == 0 && queue->ended == 0) {
+        pthread_cond_wait(&queue->chunk_ready, &queue->lock);
+    }
+    if (queue->ready_num > 0) {
+        *slot = queue->ready[queue->ready_head];
+        queue->ready_head = (queue->ready_head + 1) % queue->slot_num;
+        queue->ready_num--;
+        ret = 1;
+    } else {
+        ret = queue->ended > 0 ? 0 : -1;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return ret;
+}
+
+/* Give back the slot of a chunk that was mapped, to be filled again. */
+void stream_queue_release(STREAM_QUEUE *queue, int slot) {
+    pthread_mutex_lock(&queue->lock);
+    queue->busy[slot] = 0;
+    pthread_cond_signal(&queue->slot_free);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/* Stop the producer once the map workers are gone, if the stream did not end before. */
+void stream_queue_close(STREAM_QUEUE *queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->slot_free);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void stream_queue_destroy(STREAM_QUEUE *queue) {
+    if (queue != NULL) {
+        munmap(queue->slots, queue->chunk_size * queue->slot_num);
+        close(queue->fd);
+        pthread_cond_destroy(&queue->slot_free);
+        pthread_cond_destroy(&queue->chunk_ready);
+        pthread_mutex_destroy(&queue->lock);
+        munmap(queue, queue->map_length);
+    }
+}
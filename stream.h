@@ -0,0 +1,51 @@
+/* The input of SPLIT_MODE_STREAM: a bounded queue of chunks between the parent, which reads the
+   stream (standard input, a pipe, a FIFO or a Unix-domain socket) and the map workers, which map
+   the chunks as they come.
+
+   The queue has slot_num slots of chunk_size bytes in one memory file, mapped before the workers are
+   forked, so that threads and forked workers see the same chunks. The producer fills a free slot with
+   large reads and queues it once it is full, cut after its last newline (a line that does not fit in a
+   slot is cut); the rest of the slot starts the next one. It waits for a free slot when every slot is
+   queued or being mapped, so the memory taken stays slot_num * chunk_size however long the stream,
+   and a slow map phase slows the reads down instead. */
+
+#ifndef _STREAM_H
+#define _STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+typedef struct _stream_queue
+{
+    pthread_mutex_t lock; /* Process-shared, like the condition variables */
+    pthread_cond_t slot_free; /* A slot was released, or the queue was closed */
+    pthread_cond_t chunk_ready; /* A chunk was queued, or the stream ended */
+    int fd; /* The memory file of the slots */
+    size_t chunk_size;
+    int slot_num;
+    int ready_head; /* The oldest queued chunk in ready[] */
+    int ready_num; /* The chunks queued */
+    int ended; /* 1 once the stream ended and its last chunk was queued, -1 after a read error */
+    int closed; /* Set by stream_queue_close(): no worker takes chunks anymore */
+    int64_t bytes; /* The bytes read from the stream */
+    int64_t chunk_num; /* The chunks queued */
+    int64_t queued_bytes; /* The bytes of the chunks queued */
+    size_t map_length; /* The control block below lives in one shared anonymous mapping of this size */
+    char * slots; /* [slot * chunk_size], the mapped memory file */
+    size_t * lengths; /* [slot], the bytes of the chunk in the slot */
+    int64_t * offsets; /* [slot], where the chunk in the slot starts in the stream */
+    int * busy; /* [slot], whether the slot is being filled, queued or mapped */
+    int * ready; /* [slot_num], a ring of the queued slots */
+}STREAM_QUEUE;
+
+int stream_open(const char * path);
+
+STREAM_QUEUE * stream_queue_create(size_t chunk_size, int slot_num);
+int stream_queue_fill(STREAM_QUEUE * queue, int fd_in);
+int stream_queue_take(STREAM_QUEUE * queue, int * slot);
+void stream_queue_release(STREAM_QUEUE * queue, int slot);
+void stream_queue_close(STREAM_QUEUE * queue);
+void stream_queue_destroy(STREAM_QUEUE * queue);
+
+#endif
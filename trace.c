@@ -0,0 +1,142 @@
+#define _GNU_SOURCE /* gettid() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "trace.h"
+
+__thread TRACE_RING *trace_ring = NULL;
+
+static int64_t trace_now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Create a trace of ring_num rings (at most TRACE_RING_MAX), in shared memory so that the workers
+   forked after it record into it. The rings only take memory once they are written to.
+   @ret: The trace, or NULL on error or when tracing is compiled out.
+ */
+TRACE *trace_create(int ring_num) {
+#ifdef MR_NO_TRACE
+    (void)ring_num;
+    return NULL;
+#else
+    size_t map_length;
+    TRACE *trace;
+
+    if (ring_num < 1) {
+        return NULL;
+    }
+    if (ring_num > TRACE_RING_MAX) {
+        ring_num = TRACE_RING_MAX;
+    }
+    map_length = sizeof(TRACE) + (size_t)ring_num * sizeof(TRACE_RING);
+    trace = mmap(NULL, map_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (trace == MAP_FAILED) {
+        return NULL;
+    }
+    trace->map_length = map_length;
+    trace->ring_num = ring_num;
+    trace->rings = (TRACE_RING *)(trace + 1);
+    trace->start_ns = trace_now_ns();
+    return trace;
+#endif
+}
+
+/* Give the calling thread a ring of its own, named name (followed by idx unless it is negative) in the
+   trace. With no trace, or once every ring is taken, the thread is not traced: a forked worker must not
+   go on writing to the ring of its parent.
+ */
+void trace_attach(TRACE *trace, const char *name, int idx) {
+    TRACE_RING *ring;
+    int slot;
+
+    trace_ring = NULL;
+    if (trace == NULL || (slot = __atomic_fetch_add(&trace->ring_next, 1, __ATOMIC_RELAXED)) >= trace->ring_num) {
+        return;
+    }
+    ring = &trace->rings[slot];
+    ring->pid = (int)getpid();
+    ring->tid = (int)gettid();
+    if (idx >= 0) {
+        snprintf(ring->name, sizeof(ring->name), "%s %d", name, idx);
+    } else {
+        snprintf(ring->name, sizeof(ring->name), "%s", name);
+    }
+    trace_ring = ring;
+}
+
+// Stop tracing the calling thread, whose ring stays in the trace
+void trace_detach(void) {
+    trace_ring = NULL;
+}
+
+/* Record an event in ring, which only the calling thread writes to: store it, then publish it by
+   moving head on. Called by TRACE_BEGIN() and TRACE_END().
+ */
+void trace_record(TRACE_RING *ring, int phase, const char *name, int64_t arg) {
+    uint64_t head = ring->head;
+    TRACE_EVENT *event = &ring->events[head % TRACE_RING_EVENTS];
+
+    event->ts_ns = trace_now_ns();
+    event->name = name;
+    event->arg = arg;
+    event->phase = phase;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Write the events of trace to path in the JSON Trace Event Format: one "B" or "E" event per record,
+   with its time in microseconds since trace_create(), the process and thread of its ring and its
+   argument, and the name of each ring as "M" thread_name metadata. Call it once the workers are gone.
+   @ret: 0 on success, -1 on error.
+ */
+int trace_write(const TRACE *trace, const char *path) {
+    FILE *output = fopen(path, "w");
+    uint64_t dropped = 0;
+    int ring_num, i, first = 1;
+
+    if (output == NULL) {
+        return ERROR;
+    }
+    ring_num = __atomic_load_n(&trace->ring_next, __ATOMIC_ACQUIRE);
+    if (ring_num > trace->ring_num) {
+        ring_num = trace->ring_num;
+    }
+    fprintf(output, "{\"traceEvents\":[\n");
+    for (i = 0; i < ring_num; i++) {
+        const TRACE_RING *ring = &trace->rings[i];
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t e = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+
+        dropped += e;
+        fprintf(output, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", ring->pid, ring->tid, ring->name);
+        first = 0;
+        for (; e < head; e++) {
+            const TRACE_EVENT *event = &ring->events[e % TRACE_RING_EVENTS];
+            int64_t ts_ns = event->ts_ns - trace->start_ns;
+
+            fprintf(output, ",\n{\"name\":\"%s\",\"cat\":\"mapreduce\",\"ph\":\"%c\",\"ts\":%lld.%03lld,\"pid\":%d,\"tid\":%d,\"args\":{\"arg\":%lld}}",
+                    event->name, (char)event->phase, (long long)(ts_ns / 1000), (long long)(ts_ns % 1000),
+                    ring->pid, ring->tid, (long long)event->arg);
+        }
+    }
+    fprintf(output, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_events\":%llu}}\n", (unsigned long long)dropped);
+    return fclose(output) == 0 ? SUCCESS : ERROR;
+}
+
+void trace_destroy(TRACE *trace) {
+    if (trace != NULL) {
+        if (trace_ring >= trace->rings && trace_ring < trace->rings + trace->ring_num) {
+            trace_ring = NULL;
+        }
+        munmap(trace, trace->map_length);
+    }
+}
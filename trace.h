@@ -0,0 +1,70 @@
+/* Tracing of mapreduce() (MAPREDUCE_SPEC.trace_path): timestamped begin and end events of the phases,
+   the forks, the waits, the tasks and each read and write batch of the workers, written at the end of
+   the call as a Chrome trace (the JSON Trace Event Format), which chrome://tracing and Perfetto open.
+
+   Each worker (thread or forked process) takes a TRACE_RING of its own from one shared anonymous
+   mapping created before the workers start, so the parent sees the events of the forked workers too.
+   A ring has a single writer: an event is stored, then published by a release store of head, without
+   locks or atomic read-modify-writes. A full ring overwrites its oldest events, which the trace counts
+   as dropped. The parent reads the rings once the workers are gone.
+
+   The TRACE_BEGIN() and TRACE_END() hooks cost a test of a thread-local pointer when tracing is off,
+   and a clock read and a store when it is on. Built with -DMR_NO_TRACE (make TRACE=0) they compile to
+   nothing, and trace_create() fails. */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_RING_EVENTS 32768 /* The events a ring keeps, a power of two */
+#define TRACE_RING_MAX 1024 /* The most rings of a trace; the workers after them are not traced */
+#define TRACE_NAME_SIZE 32
+
+typedef struct _trace_event
+{
+    int64_t ts_ns; /* CLOCK_MONOTONIC */
+    const char * name; /* A string literal, at the same address in the forked workers */
+    int64_t arg; /* A task or worker index, a byte count, a process ID */
+    int32_t phase; /* 'B' or 'E' */
+    int32_t reserved;
+}TRACE_EVENT;
+
+typedef struct _trace_ring
+{
+    uint64_t head; /* The events written so far; the last TRACE_RING_EVENTS are in events[head % TRACE_RING_EVENTS] */
+    int pid;
+    int tid;
+    char name[TRACE_NAME_SIZE]; /* The thread name in the trace, "Map worker 3" */
+    TRACE_EVENT events[TRACE_RING_EVENTS];
+}TRACE_RING;
+
+typedef struct _trace
+{
+    int64_t start_ns; /* The time 0 of the trace */
+    size_t map_length;
+    int ring_num;
+    int ring_next; /* The rings handed out, shared across fork() */
+    TRACE_RING * rings; /* [ring_num] */
+}TRACE;
+
+/* The ring of the calling thread, NULL when it is not traced */
+extern __thread TRACE_RING * trace_ring;
+
+#ifdef MR_NO_TRACE
+#define TRACE_BEGIN(name, arg) ((void)(name), (void)(arg)) /* Nothing left once optimized */
+#define TRACE_END(name, arg) ((void)(name), (void)(arg))
+#else
+#define TRACE_BEGIN(name, arg) do { if (trace_ring != NULL) trace_record(trace_ring, 'B', name, arg); } while (0)
+#define TRACE_END(name, arg) do { if (trace_ring != NULL) trace_record(trace_ring, 'E', name, arg); } while (0)
+#endif
+
+TRACE * trace_create(int ring_num);
+void trace_attach(TRACE * trace, const char * name, int idx);
+void trace_detach(void);
+void trace_record(TRACE_RING * ring, int phase, const char * name, int64_t arg);
+int trace_write(const TRACE * trace, const char * path);
+void trace_destroy(TRACE * trace);
+
+#endif
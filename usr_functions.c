@@ -1,18 +1,69 @@
+#define _GNU_SOURCE /* memrchr() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <ctype.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "common.h"
+#include "itm.h"
+#include "arena.h"
+#include "input.h"
+#include "histogram.h"
+#include "finder.h"
+#include "sketch.h"
+#include "result.h"
+#include "inverted.h"
+#include "kernel.h"
 #include "usr_functions.h"
 
+// Count the letters of a chunk of the split into letter_frequencies[LETTER_NUM]
+static int count_chunk(void *letter_frequencies, const char *buf, size_t len) {
+    count_letters(buf, len, letter_frequencies);
+    return 0;
+}
+
+// Sum the counts of a letter
+static void add_count(uint64_t *count, uint64_t other) {
+    *count += other;
+}
+
+// Write a letter and its count to the result file
+static int put_letter(FILE *output, char letter, uint64_t count) {
+    return fprintf(output, "%c %llu\n", letter, (unsigned long long)count) < 0 ? -1 : 0;
+}
+
+// The "Letter counter" job: one record per letter, the letter as key and its uint64_t count as value
+KERNEL_JOB(letter_job, char, uint64_t, count_split, add_count, put_letter)
+
+// Count the letters A-Z of each chunk of the split where it was read, or of the whole split when it is mapped
+static int count_split(DATA_SPLIT *split, struct letter_job_table *table) {
+    uint64_t letter_frequencies[LETTER_NUM] = {0};
+
+    if (kernel_split_chunks(split, count_chunk, letter_frequencies, "letter_counter_map") != 0) {
+        return -1;
+    }
+    for (int letter_idx = 0; letter_idx < LETTER_NUM; letter_idx++) {
+        if (letter_frequencies[letter_idx] > 0 && letter_job_add(table, 'A' + letter_idx, letter_frequencies[letter_idx]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 /* User-defined map function for the "Letter counter" task.  
    This map function is called in a map worker process.
    @param split: The data split that the map function is going to work on.
                  Note that the file offset of the file descripter split->fd should be set to the properly
-                 position when this map function is called.
+                 position when this map function is called, and that only split->size bytes from that
+                 position belong to this split. When split->base is not NULL the same bytes can be
+                 scanned in memory instead (split->length bytes).
    @param fd_out: The file descriptor of the itermediate data file output by the map function.
+                  One record per letter is written: the letter as key, its uint64_t count as value.
    @ret: 0 on success, -1 on error.
  */
 
@@ -23,43 +74,19 @@ int letter_counter_map(DATA_SPLIT *split, int fd_out) {
         return -1;
     }
 
-    // Initialize an array to store counts for letters A-Z
-    int letter_frequencies[26] = {0};
-    char read_buffer[1024]; // Buffer to hold file data during reads
-    ssize_t bytes_read;
-
-    // Read data from the input file
-    while ((bytes_read = read(split->fd, read_buffer, sizeof(read_buffer))) > 0) {
-        // Process each character in the buffer
-        for (ssize_t idx = 0; idx < bytes_read; idx++) {
-            if (read_buffer[idx] >= 'A' && read_buffer[idx] <= 'Z') {
-                letter_frequencies[read_buffer[idx] - 'A']++;
-            } else if (read_buffer[idx] >= 'a' && read_buffer[idx] <= 'z') {
-                letter_frequencies[read_buffer[idx] - 'a']++;
-            }
-        }
-    }
-
-    // Check if reading encountered an error
-    if (bytes_read < 0) {
-        perror("File read error in map function");
-        return -1;
-    }
+    return letter_job_map(split, fd_out);
+}
 
-    // Write the letter counts to the intermediate file
-    for (int letter_idx = 0; letter_idx < 26; letter_idx++) {
-        if (letter_frequencies[letter_idx] > 0) {
-            char output_line[16];
-            int output_length = snprintf(output_line, sizeof(output_line), "%c %d\n", 'A' + letter_idx, letter_frequencies[letter_idx]);
-            
-            if (output_length < 0 || write(fd_out, output_line, output_length) != output_length) {
-                perror("Error writing to intermediate file in map function");
-                return -1;
-            }
-        }
-    }
+/* User-defined combine function for the "Letter counter" task.
+   This combine function is called in a map worker process, on the output of the map function.
+   @param p_fd_in: The address of the buffer holding the file descriptors of the map function's output.
+   @param fd_in_num: The number of the files.
+   @param fd_out: The file descriptor of the itermediate data file output by the map worker.
+   @ret: 0 on success, -1 on error.
+ */
 
-    return 0; // Indicate successful completion
+int letter_counter_combine(int *p_fd_in, int fd_in_num, int fd_out) {
+    return letter_job_combine(p_fd_in, fd_in_num, fd_out);
 }
 
 
@@ -77,132 +104,199 @@ int letter_counter_map(DATA_SPLIT *split, int fd_out) {
 */
 
 int letter_counter_reduce(int *p_fd_in, int fd_in_num, int fd_out) {
-    // Validate input: Ensure file descriptor array and count are valid
-    if (!p_fd_in || fd_in_num <= 0) {
-        fprintf(stderr, "Error: Invalid input file descriptors or count in reduce function.\n");
+    // The letters counted at least once, in alphabetical order
+    return letter_job_reduce(p_fd_in, fd_in_num, fd_out);
+}
+
+/* The reduce function of the "Letter counter" task with --result-format=binary: the counts of the
+   letters A-Z as a RESULT_TYPE_COUNTS table of LETTER_NUM rows (see result.h), 0 for a letter
+   that was not seen.
+   @ret: 0 on success, -1 on error.
+ */
+int letter_counter_binary_reduce(int *p_fd_in, int fd_in_num, int fd_out) {
+    struct letter_job_table table = {0};
+    uint64_t aggregated_counts[LETTER_NUM] = {0};
+    int ret = letter_job_gather(p_fd_in, fd_in_num, &table);
+
+    for (size_t idx = 0; ret == 0 && idx < table.entry_num; idx++) {
+        char letter = table.entries[idx].key;
+        if (letter >= 'A' && letter <= 'Z') {
+            aggregated_counts[letter - 'A'] = table.entries[idx].value;
+        }
+    }
+    letter_job_clear(&table);
+    if (ret != 0) {
         return -1;
     }
+    if (result_write_counts(fd_out, 'A', aggregated_counts, LETTER_NUM) != SUCCESS) {
+        perror("Error writing the letter counts to the output file (letter_counter_binary_reduce)");
+        return -1;
+    }
+    return 0;
+}
 
-    // Initialize an array to store the aggregated letter counts
-    int aggregated_counts[26] = {0};
-    char read_buffer[256]; // Buffer for reading lines from intermediate files
+// The key of a FINDER_SPLIT_LINES record, which cannot be a line
+#define FINDER_LINES_KEY "\n"
+
+// The value of a match with WORD_LIST.positions. The line number is still relative to the split: the
+// reduce function adds the lines of the splits before it, from their FINDER_SPLIT_LINES records
+typedef struct _finder_position
+{
+    int64_t offset; // Where the line starts in the input
+    int64_t split_offset; // Where its split starts
+    int64_t split_line; // The line in the split, from 0
+    uint32_t word; // The index of the word in WORD_LIST.words
+}FINDER_POSITION;
+
+// The value of the FINDER_LINES_KEY record of a split with WORD_LIST.positions, which goes to every partition
+typedef struct _finder_split_lines
+{
+    int64_t split_offset;
+    int64_t newlines; // The newlines of the split
+}FINDER_SPLIT_LINES;
+
+// Write a matching line to the result file, after its word when several words were searched
+static int put_match(FILE *output, KERNEL_BYTES line, KERNEL_BYTES word) {
+    if ((word.len > 0 && (fwrite(word.data, 1, word.len, output) != word.len || fputc('\t', output) == EOF)) ||
+        fwrite(line.data, 1, line.len, output) != line.len || fputc('\n', output) == EOF) {
+        return -1;
+    }
+    return 0;
+}
 
-    // Iterate over each input file descriptor
-    for (int fd_idx = 0; fd_idx < fd_in_num; fd_idx++) {
-        // Reset file position to the beginning of the current file
-        if (lseek(p_fd_in[fd_idx], 0, SEEK_SET) < 0) {
-            perror("Error resetting file position in intermediate file (reduce function)");
-            return -1;
-        }
+// The "Word finder" job: one record per matching line, the line as key and the word (or nothing) as value
+KERNEL_STREAM_JOB(finder_job, KERNEL_BYTES, BYTES, KERNEL_BYTES, BYTES, scan_split, put_match)
+
+// With WORD_LIST.positions: the records of the matches, with a FINDER_POSITION value, and of the newlines
+// of the splits, whose key is FINDER_LINES_KEY
+KERNEL_CODEC_RECORD(finder_hit_record, KERNEL_BYTES, BYTES, FINDER_POSITION, FIXED)
+KERNEL_RECORD(finder_lines_record, char, FINDER_SPLIT_LINES)
+
+// Where word_finder_map() sends the matches found by the finder
+typedef struct _finder_output
+{
+    ITM_WRITER * writer;
+    WORD_LIST * word_list;
+    FINDER * finder;
+    int64_t split_offset; // With positions: where the split starts in the input
+    const char * buffer; // The buffer being scanned, which starts at buffer_offset in the input
+    int64_t buffer_offset;
+    const char * counted; // The newlines of the split before this byte of the buffer are counted
+    int64_t newlines;
+}FINDER_OUTPUT;
+
+static int64_t count_newlines(const char *pos, const char *end) {
+    int64_t newlines = 0;
+
+    while ((pos = memchr(pos, '\n', end - pos)) != NULL) {
+        newlines++;
+        pos++;
+    }
+    return newlines;
+}
 
-        ssize_t bytes_read;
-        // Read lines from the current file
-        while ((bytes_read = read(p_fd_in[fd_idx], read_buffer, sizeof(read_buffer) - 1)) > 0) {
-            read_buffer[bytes_read] = '\0'; // Null-terminate the buffer for safe string manipulation
-            char *line = strtok(read_buffer, "\n"); // Tokenize the buffer by line
+// Emit a matching line as an intermediate record: the line as key, and the word as value when there are
+// several words, or the FINDER_POSITION of the line with WORD_LIST.positions
+static int write_line(void *ctx, const char *line, size_t line_len, int word_idx) {
+    FINDER_OUTPUT *output = ctx;
+    KERNEL_BYTES key = {line, line_len}, word = {output->word_list->words[word_idx], 0};
+    int ret;
+
+    if (output->word_list->positions) {
+        output->newlines += count_newlines(output->counted, line);
+        output->counted = line;
+        FINDER_POSITION position = {output->buffer_offset + (line - output->buffer), output->split_offset, output->newlines, word_idx};
+        ret = finder_hit_record_write(output->writer, key, position);
+    } else {
+        word.len = output->word_list->word_num > 1 ? strlen(word.data) : 0;
+        ret = finder_job_record_write(output->writer, key, word);
+    }
+    if (ret != SUCCESS) {
+        perror("Error writing matching line to output file (word_finder_map function)");
+        return -1;
+    }
+    return 0;
+}
 
-            // Parse each line to extract letter counts
-            while (line) {
-                char letter;
-                int count;
-                if (sscanf(line, "%c %d", &letter, &count) == 2 && letter >= 'A' && letter <= 'Z') {
-                    aggregated_counts[letter - 'A'] += count; // Update the aggregated count
-                }
-                line = strtok(NULL, "\n"); // Get the next line
-            }
-        }
+// Search the lines of a buffer from kernel_split_lines()
+static int scan_buffer(void *ctx, const char *buffer, size_t len, size_t end, int64_t offset) {
+    FINDER_OUTPUT *output = ctx;
+    int ret;
 
-        // Check for errors during file reading
-        if (bytes_read < 0) {
-            perror("Error reading from intermediate file (reduce function)");
-            return -1;
-        }
+    output->buffer = output->counted = buffer;
+    output->buffer_offset = offset;
+    ret = finder_scan(output->finder, buffer, len, write_line, output);
+    if (output->word_list->positions) {
+        output->newlines += count_newlines(output->counted, buffer + end);
     }
+    return ret;
+}
 
-    // Write the aggregated letter counts to the output file
-    for (int letter_idx = 0; letter_idx < 26; letter_idx++) {
-        if (aggregated_counts[letter_idx] > 0) {
-            char output_line[16];
-            int output_length = snprintf(output_line, sizeof(output_line), "%c %d\n", 'A' + letter_idx, aggregated_counts[letter_idx]);
-            
-            if (output_length < 0 || write(fd_out, output_line, output_length) != output_length) {
-                perror("Error writing aggregated results to output file mr.rst(reduce function)");
-                return -1;
-            }
-        }
+// With WORD_LIST.positions: record the newlines of the split
+static int write_split_lines(FINDER_OUTPUT *output) {
+    FINDER_SPLIT_LINES lines = {output->split_offset, output->newlines};
+
+    if (finder_lines_record_write(output->writer, FINDER_LINES_KEY[0], lines) != SUCCESS) {
+        perror("Error writing the line count to output file (word_finder_map function)");
+        return -1;
     }
+    return 0;
+}
 
-    return 0; // Indicate successful completion
+/* The partition function of the "Word finder" task with WORD_LIST.positions: every partition gets the
+   line counts of the splits (MR_ALL_PARTITIONS), and mapreduce_default_partition() places the lines.
+ */
+int word_finder_partition(const char *key, uint32_t key_len, int reduce_num) {
+    if (key_len == 1 && key[0] == FINDER_LINES_KEY[0]) {
+        return MR_ALL_PARTITIONS;
+    }
+    return mapreduce_default_partition(key, key_len, reduce_num);
 }
 
 /* User-defined map function for the "Word finder" task.  
    This map function is called in a map worker process.
    @param split: The data split that the map function is going to work on.
                  Note that the file offset of the file descripter split->fd should be set to the properly
-                 position when this map function is called.
+                 position when this map function is called, and that only split->size bytes from that
+                 position belong to this split. When split->base is not NULL the same bytes can be
+                 scanned in memory instead (split->length bytes).
+                 split->usr_data is the WORD_LIST of the words to find.
    @param fd_out: The file descriptor of the itermediate data file output by the map function.
+                  One record per matching line and word: the line as key, and the word (several words)
+                  or the position of the line (WORD_LIST.positions) as value.
    @ret: 0 on success, -1 on error.
  */
 
-
 int word_finder_map(DATA_SPLIT *split, int fd_out) {
-    // Validate input: Ensure DATA_SPLIT, user data (word to find), and file descriptor are valid
+    // Validate input: Ensure DATA_SPLIT, user data (words to find), and file descriptor are valid
     if (!split || !split->usr_data || split->fd < 0) {
         fprintf(stderr, "Error: Invalid input parameters to word_finder_map function.\n");
         return -1;
     }
 
-    char *target_word = (char *)split->usr_data; // Word to search for
-    size_t target_word_len = strlen(target_word); // Length of the word to find
-    char read_buffer[1024]; // Buffer for file reading
-    char current_line[1024]; // Buffer for constructing a line
-    char original_line_copy[1024]; // Copy of the current line for output
-    ssize_t bytes_read; // Bytes read from the file
-    ssize_t current_line_len = 0; // Length of the current line being constructed
-
-    // Read data from the input file
-    while ((bytes_read = read(split->fd, read_buffer, sizeof(read_buffer))) > 0) {
-        for (ssize_t buffer_idx = 0; buffer_idx < bytes_read; buffer_idx++) {
-            // Check for end of a line or line length exceeding buffer size
-            if (read_buffer[buffer_idx] == '\n' || current_line_len == sizeof(current_line) - 1) {
-                current_line[current_line_len] = '\0'; // Null-terminate the line
-                strcpy(original_line_copy, current_line); // Create a copy for output
-
-                char *search_ptr = current_line; // Pointer for searching the target word
-                // Search for the target word in the line
-                while ((search_ptr = strstr(search_ptr, target_word)) != NULL) {
-                    // Check word boundaries to ensure an exact match
-                    if ((search_ptr == current_line || *(search_ptr - 1) == ' ') &&
-                        (*(search_ptr + target_word_len) == ',' || *(search_ptr + target_word_len) == '.' ||
-                         *(search_ptr + target_word_len) == ' ' || *(search_ptr + target_word_len) == '\0')) {
-                        // Write the matching line to the output file
-                        if (write(fd_out, original_line_copy, current_line_len) != current_line_len || 
-                            write(fd_out, "\n", 1) != 1) {
-                            perror("Error writing matching line to output file (word_finder_map function)");
-                            return -1;
-                        }
-                        break; // Stop searching the current line after a match
-                    }
-                    search_ptr += target_word_len; // Move past the current match
-                }
-                current_line_len = 0; // Reset the line length for the next line
-            } else {
-                current_line[current_line_len++] = read_buffer[buffer_idx]; // Append character to the current line
-            }
-        }
-    }
+    return finder_job_map(split, fd_out);
+}
+
+// Search the lines of the split for split->usr_data, and write a record per matching line (and word)
+static int scan_split(DATA_SPLIT *split, ITM_WRITER *writer) {
+    WORD_LIST *word_list = split->usr_data; // Words to search for
+    FINDER *finder = finder_create((const char **)word_list->words, word_list->word_num);
+    FINDER_OUTPUT output = {writer, word_list, finder, split->offset, NULL, split->offset, NULL, 0};
+    int ret = 0;
 
-    // Check for errors during file reading
-    if (bytes_read < 0) {
-        perror("Error reading input file (word_finder_map function)");
+    if (finder == NULL) {
+        fprintf(stderr, "Error: Unable to prepare the search (word_finder_map function).\n");
         return -1;
     }
+    ret = kernel_split_lines(split, scan_buffer, &output, "word_finder_map");
+    finder_destroy(finder);
 
-    return 0; // Indicate successful completion
+    if (ret == 0 && word_list->positions) {
+        ret = write_split_lines(&output);
+    }
+    return ret != 0 ? -1 : 0;
 }
 
-
-
 /* User-defined reduce function for the "Word finder" task.  
    This reduce function is called in a reduce worker process.
    @param p_fd_in: The address of the buffer holding the intermediate data files' file descriptors.
@@ -217,38 +311,474 @@ int word_finder_map(DATA_SPLIT *split, int fd_out) {
 */
 
 int word_finder_reduce(int *input_fds, int num_input_fds, int output_fd) {
-    // Validate input: Ensure file descriptor array and count are valid
+    // The matching lines are written in the order of the intermediate files, through a pooled buffer
+    return finder_job_reduce(input_fds, num_input_fds, output_fd);
+}
+
+static int compare_split_lines(const void *a, const void *b) {
+    const FINDER_SPLIT_LINES *lines = a, *other = b;
+
+    return lines->split_offset < other->split_offset ? -1 : lines->split_offset > other->split_offset;
+}
+
+// Read the matches and the line counts of the splits from an intermediate file; hits[].hit.text holds the
+// split offset of each match until its line number is resolved
+static int read_finder_records(int fd, ARENA *lines, RESULT_LINE_HIT **hits, size_t *hit_num, size_t *hit_capacity,
+                               FINDER_SPLIT_LINES **splits, size_t *split_num, size_t *split_capacity) {
+    ITM_READER reader;
+    const char *line, *value;
+    uint32_t line_len, value_len;
+    int ret;
+
+    if (itm_reader_open(&reader, fd) != SUCCESS) {
+        return -1;
+    }
+    while ((ret = itm_read(&reader, &line, &line_len, &value, &value_len)) > 0) {
+        char lines_key;
+        FINDER_SPLIT_LINES split_lines;
+        KERNEL_BYTES key;
+        FINDER_POSITION position;
+
+        if (finder_lines_record_decode(line, line_len, value, value_len, &lines_key, &split_lines) && lines_key == FINDER_LINES_KEY[0]) {
+            if (*split_num == *split_capacity) {
+                size_t capacity = *split_capacity > 0 ? *split_capacity * 2 : 64;
+                FINDER_SPLIT_LINES *grown = realloc(*splits, capacity * sizeof(FINDER_SPLIT_LINES));
+                if (grown == NULL) {
+                    ret = -1;
+                    break;
+                }
+                *splits = grown;
+                *split_capacity = capacity;
+            }
+            (*splits)[(*split_num)++] = split_lines;
+            continue;
+        }
+        if (!finder_hit_record_decode(line, line_len, value, value_len, &key, &position)) {
+            ret = -1; // Not the output of word_finder_map() with positions
+            break;
+        }
+        if (*hit_num == *hit_capacity) {
+            size_t capacity = *hit_capacity > 0 ? *hit_capacity * 2 : 1024;
+            RESULT_LINE_HIT *grown = realloc(*hits, capacity * sizeof(RESULT_LINE_HIT));
+            if (grown == NULL) {
+                ret = -1;
+                break;
+            }
+            *hits = grown;
+            *hit_capacity = capacity;
+        }
+        char *text = arena_alloc_bytes(lines, key.len > 0 ? key.len : 1);
+        RESULT_LINE_HIT *hit = &(*hits)[(*hit_num)++];
+        if (text == NULL) {
+            ret = -1;
+            break;
+        }
+        memcpy(text, key.data, key.len);
+        memset(hit, 0, sizeof(*hit));
+        hit->hit.offset = position.offset;
+        hit->hit.line = position.split_line;
+        hit->hit.text = position.split_offset;
+        hit->hit.length = key.len;
+        hit->hit.word = position.word;
+        hit->line = text;
+    }
+    itm_reader_close(&reader);
+    return ret < 0 ? -1 : 0;
+}
+
+/* User-defined reduce function for the "Word finder" task with --result-format=binary (WORD_LIST.positions).
+   The matching lines are written with their offsets and line numbers in the input, as a RESULT_TYPE_HITS
+   file (see result.h). The line numbers add up the line counts of the splits before each match, which
+   every partition gets from every split.
+   @ret: 0 on success, -1 on error.
+ */
+int word_finder_binary_reduce(int *input_fds, int num_input_fds, int output_fd) {
+    RESULT_LINE_HIT *hits = NULL;
+    FINDER_SPLIT_LINES *splits = NULL;
+    size_t hit_num = 0, hit_capacity = 0, split_num = 0, split_capacity = 0, i;
+    ARENA lines; // The text of the matching lines
+    int fd_idx, ret = 0;
+
     if (!input_fds || num_input_fds <= 0) {
-        fprintf(stderr, "Error: Invalid input file descriptors or count in word_finder_reduce.\n");
+        fprintf(stderr, "Error: Invalid input file descriptors or count in word_finder_binary_reduce.\n");
         return -1;
     }
+    arena_init(&lines, 0);
+    for (fd_idx = 0; fd_idx < num_input_fds && ret == 0; fd_idx++) {
+        if (read_finder_records(input_fds[fd_idx], &lines, &hits, &hit_num, &hit_capacity, &splits, &split_num, &split_capacity) != 0) {
+            fprintf(stderr, "Error: Intermediate file %d is missing or corrupted (word_finder_binary_reduce).\n", fd_idx);
+            ret = -1;
+        }
+    }
 
-    char read_buffer[1024]; // Buffer for reading data from intermediate files
-    ssize_t bytes_read;     // Number of bytes read in each read operation
+    // The newlines of each split become the lines before it, in input order
+    int64_t lines_before = 0;
+    qsort(splits, split_num, sizeof(FINDER_SPLIT_LINES), compare_split_lines);
+    for (i = 0; i < split_num; i++) {
+        int64_t newlines = splits[i].newlines;
+        splits[i].newlines = lines_before;
+        lines_before += newlines;
+    }
+    for (i = 0; i < hit_num && ret == 0; i++) {
+        FINDER_SPLIT_LINES key = {(int64_t)hits[i].hit.text, 0};
+        FINDER_SPLIT_LINES *split = bsearch(&key, splits, split_num, sizeof(FINDER_SPLIT_LINES), compare_split_lines);
+        if (split == NULL) {
+            fprintf(stderr, "Error: The line count of the split at %lld is missing (word_finder_binary_reduce).\n", (long long)key.split_offset);
+            ret = -1;
+            break;
+        }
+        hits[i].hit.line += split->newlines + 1;
+        hits[i].hit.text = 0;
+    }
 
-    // Loop through each intermediate file descriptor
-    for (int fd_idx = 0; fd_idx < num_input_fds; fd_idx++) {
-        // Reset the file offset to the beginning of the file
-        if (lseek(input_fds[fd_idx], 0, SEEK_SET) < 0) {
-            perror("Error resetting file position in intermediate file (word_finder_reduce)");
+    if (ret == 0 && result_write_hits(output_fd, hits, hit_num) != SUCCESS) {
+        perror("Error writing data to output file (word_finder_binary_reduce)");
+        ret = -1;
+    }
+    arena_reset(&lines);
+    free(hits);
+    free(splits);
+    return ret;
+}
+
+// Add the terms of the lines of a buffer from kernel_split_lines() to an INVERTED_TERMS
+static int index_lines(void *ctx, const char *buf, size_t len, size_t end, int64_t offset) {
+    const char *pos = buf, *buf_end = buf + len;
+
+    (void)end;
+    while (pos < buf_end) {
+        const char *line_end = memchr(pos, '\n', buf_end - pos);
+        if (line_end == NULL) {
+            line_end = buf_end;
+        }
+        if (inverted_add_line(ctx, pos, line_end - pos, offset + (pos - buf)) != SUCCESS) {
+            fprintf(stderr, "Error: Memory allocation failed (index_words_map).\n");
             return -1;
         }
+        pos = line_end + 1;
+    }
+    return 0;
+}
 
-        // Read data from the current intermediate file
-        while ((bytes_read = read(input_fds[fd_idx], read_buffer, sizeof(read_buffer))) > 0) {
-            // Write the read data to the final output file
-            if (write(output_fd, read_buffer, bytes_read) != bytes_read) {
-                perror("Error writing data to output file (word_finder_reduce)");
-                return -1;
+/* User-defined map function for the "Index" task: collects the terms of the lines of the split (the
+   words the finder would match, see inverted.h) with the offsets of their lines in the input.
+   @param split: The data split that the map function is going to work on (see letter_counter_map()).
+   @param fd_out: The file descriptor of the itermediate data file output by the map function.
+                  One record per term, in key order: the term as key, its posting list in the split as value.
+   @ret: 0 on success, -1 on error.
+ */
+
+int index_words_map(DATA_SPLIT *split, int fd_out) {
+    INVERTED_TERMS terms;
+    ITM_WRITER writer;
+    int ret;
+
+    if (!split || split->fd < 0) {
+        fprintf(stderr, "Error: Invalid input structure or file descriptor in index_words_map.\n");
+        return -1;
+    }
+    inverted_terms_init(&terms);
+    ret = kernel_split_lines(split, index_lines, &terms, "index_words_map");
+    if (ret == 0) {
+        itm_writer_open(&writer, fd_out);
+        if (inverted_terms_write(&terms, &writer) != SUCCESS) {
+            ret = -1;
+        }
+        writer.sorted = 1; // The group reduce function needs no sort of its own
+        if (ret != 0 || itm_writer_close(&writer) != SUCCESS) {
+            perror("Error writing to intermediate file in index_words_map");
+            ret = -1;
+        }
+    }
+    inverted_terms_clear(&terms);
+    return ret;
+}
+
+// Where word_finder_index_lookup() writes the lines it looked up
+typedef struct _lookup_output
+{
+    FILE * output;
+    WORD_LIST * word_list;
+}LOOKUP_OUTPUT;
+
+// Write a line of word_finder_index_lookup() after its word, as word_finder_reduce() does with several words
+static int write_lookup_line(void *ctx, const char *line, size_t line_len, int word_idx) {
+    LOOKUP_OUTPUT *lookup = ctx;
+    const char *word = lookup->word_list->words[word_idx];
+    size_t word_len = strlen(word);
+
+    if (fwrite(word, 1, word_len, lookup->output) != word_len || fputc('\t', lookup->output) == EOF ||
+        fwrite(line, 1, line_len, lookup->output) != line_len || fputc('\n', lookup->output) == EOF) {
+        perror("Error writing data to output file (word_finder_index_lookup)");
+        return -1;
+    }
+    return 0;
+}
+
+/* Answer the "Word finder" task from the index at index_path instead of scanning the input: each line
+   of the input at input_path that a word of word_list is in is written to fd_out as word_finder_reduce()
+   would (after the word when there are several), in input order. The words of a line that holds several
+   are found again in it by the finder, so that they come in the order the scan reports them. The index
+   must be that of this input, whose size it records.
+   @ret: 0 on success, -1 on error.
+ */
+int word_finder_index_lookup(const char *index_path, const char *input_path, WORD_LIST *word_list, int fd_out) {
+    int word_num = word_list->word_num, word, fd, ret = 0;
+    INVERTED_CURSOR *cursors = calloc(word_num, sizeof(INVERTED_CURSOR));
+    uint64_t *next = calloc(word_num, sizeof(uint64_t)); // The next line of each word, while has_next
+    int *has_next = calloc(word_num, sizeof(int));
+    INVERTED_INDEX index;
+    struct stat st;
+
+    for (word = 0; word < word_num && ret == 0; word++) {
+        size_t len = strlen(word_list->words[word]);
+        if (len == 0 || len > INVERTED_TERM_MAX || memchr(word_list->words[word], ' ', len) != NULL) {
+            fprintf(stderr, "Error: \"%s\" cannot be looked up in an index (word_finder_index_lookup).\n", word_list->words[word]);
+            ret = -1;
+        }
+    }
+    if (ret != 0 || cursors == NULL || next == NULL || has_next == NULL) {
+        free(cursors);
+        free(next);
+        free(has_next);
+        return -1;
+    }
+    if (inverted_open(&index, index_path) != SUCCESS) {
+        fprintf(stderr, "Error: %s is not an index file (word_finder_index_lookup).\n", index_path);
+        free(cursors);
+        free(next);
+        free(has_next);
+        return -1;
+    }
+
+    // The lines are read from the input, mapped
+    const char *input = NULL;
+    if ((fd = open(input_path, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Error: Unable to read %s (word_finder_index_lookup).\n", input_path);
+        ret = -1;
+    } else if (index.header->input_size != 0 && index.header->input_size != (uint64_t)st.st_size) {
+        fprintf(stderr, "Error: %s is not the index of %s, or is out of date (word_finder_index_lookup).\n", index_path, input_path);
+        ret = -1;
+    } else if (st.st_size > 0 && (input = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        perror("Error mapping the input (word_finder_index_lookup)");
+        input = NULL;
+        ret = -1;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    for (word = 0; word < word_num && ret == 0; word++) {
+        const INVERTED_TERM *term = inverted_find(&index, word_list->words[word], strlen(word_list->words[word]));
+        if (term != NULL && (inverted_cursor_init(&cursors[word], &index, term) != SUCCESS ||
+                             (has_next[word] = inverted_cursor_next(&cursors[word], &next[word])) < 0)) {
+            fprintf(stderr, "Error: The index %s is corrupted (word_finder_index_lookup).\n", index_path);
+            ret = -1;
+        }
+    }
+
+    FILE *output = ret == 0 ? fdopen(dup(fd_out), "w") : NULL;
+    char *output_buffer = output != NULL ? io_buffer_get() : NULL;
+    if (output_buffer != NULL) {
+        setvbuf(output, output_buffer, _IOFBF, IO_BUFFER_SIZE);
+    }
+    FINDER *finder = word_num > 1 ? finder_create((const char **)word_list->words, word_num) : NULL;
+    LOOKUP_OUTPUT lookup = {output, word_list};
+    if (word_num > 1 && finder == NULL) {
+        fprintf(stderr, "Error: Unable to prepare the search (word_finder_index_lookup).\n");
+        ret = -1;
+    }
+
+    // Merge the posting lists of the words by offset
+    while (output != NULL && ret == 0) {
+        int first = -1, tied = 0;
+        for (word = 0; word < word_num; word++) {
+            if (has_next[word] > 0 && first >= 0 && next[word] == next[first]) {
+                tied = 1;
+            } else if (has_next[word] > 0 && (first < 0 || next[word] < next[first])) {
+                first = word;
+                tied = 0;
+            }
+        }
+        if (first < 0) {
+            break;
+        }
+        uint64_t offset = next[first];
+        if (offset >= (uint64_t)st.st_size) {
+            ret = -1; // Not a line of this input
+            break;
+        }
+        const char *line = input + offset;
+        const char *line_end = memchr(line, '\n', st.st_size - offset);
+        size_t line_len = line_end != NULL ? (size_t)(line_end - line) : st.st_size - offset;
+        if (tied) {
+            // Several words are in the line: the finder reports them in the order of the scan
+            ret = finder_scan(finder, line, line_len, write_lookup_line, &lookup) != 0 ? -1 : 0;
+        } else if (word_num > 1) {
+            ret = write_lookup_line(&lookup, line, line_len, first);
+        } else if (fwrite(line, 1, line_len, output) != line_len || fputc('\n', output) == EOF) {
+            perror("Error writing data to output file (word_finder_index_lookup)");
+            ret = -1;
+        }
+        for (word = 0; word < word_num && ret == 0; word++) {
+            if (has_next[word] > 0 && next[word] == offset && (has_next[word] = inverted_cursor_next(&cursors[word], &next[word])) < 0) {
+                ret = -1;
             }
         }
+    }
+    finder_destroy(finder);
+    if (output == NULL) {
+        ret = -1;
+    } else if (fclose(output) != 0 || ret != 0) {
+        fprintf(stderr, "Error: Unable to answer from the index %s (word_finder_index_lookup).\n", index_path);
+        ret = -1;
+    }
+    io_buffer_put(output_buffer);
+
+    if (input != NULL) {
+        munmap((void *)input, st.st_size);
+    }
+    inverted_close(&index);
+    free(cursors);
+    free(next);
+    free(has_next);
+    return ret;
+}
+
+// Emit a word with a count of 1
+static int emit_word(void *ctx, const char *word, size_t len) {
+    const uint64_t one = 1;
+
+    return mapreduce_emit(ctx, word, len, &one, sizeof(one));
+}
+
+/* User-defined map function for the "Word count" task. Instead of writing an intermediate file,
+   it emits one (word, 1) record per word through mapreduce_emit(), and the records of the same
+   word are summed in the map worker's aggregation buffer by word_count_merge().
+   @param split: The data split that the map function is going to work on (see letter_counter_map()).
+   @param emitter: The context to pass to mapreduce_emit().
+   @ret: 0 on success, -1 on error.
+ */
+
+int word_count_map(DATA_SPLIT *split, EMITTER *emitter) {
+    return kernel_split_words(split, WORD_COUNT_MAX_LEN, emit_word, emitter, "word_count_map");
+}
+
+/* User-defined merge function for the "Word count" task: adds the uint64_t count other to the
+   uint64_t count value, in place.
+   @ret: 0 on success, -1 if the values are not counts.
+ */
+
+int word_count_merge(char *value, uint32_t value_len, const char *other, uint32_t other_len) {
+    uint64_t count, more;
 
-        // Check for errors during reading
-        if (bytes_read < 0) {
-            perror("Error reading from intermediate file (word_finder_reduce)");
+    if (value_len != sizeof(count) || other_len != sizeof(more)) {
+        return -1;
+    }
+    memcpy(&count, value, sizeof(count));
+    memcpy(&more, other, sizeof(more));
+    count += more;
+    memcpy(value, &count, sizeof(count));
+    return 0;
+}
+
+/* User-defined group reduce function for the "Word count" task. The framework merges the sorted
+   runs of the map workers and calls it once per word, in word order.
+   @param key: The word.
+   @param key_len: The length of the word.
+   @param values: The counts of the word, one per intermediate record, read with mapreduce_next_value().
+   @param output: The buffered result file, one "word count" line per word.
+   @ret: 0 on success, -1 on error.
+ */
+
+int word_count_reduce(const char *key, uint32_t key_len, REDUCE_VALUES *values, FILE *output) {
+    const char *value;
+    uint32_t value_len;
+    uint64_t total = 0, count;
+
+    while (mapreduce_next_value(values, &value, &value_len) > 0) {
+        if (value_len != sizeof(count)) {
+            fprintf(stderr, "Error: Invalid count in intermediate data (word_count_reduce).\n");
             return -1;
         }
+        memcpy(&count, value, sizeof(count));
+        total += count;
+    }
+
+    if (fwrite(key, 1, key_len, output) != key_len || fprintf(output, " %llu\n", (unsigned long long)total) < 0) {
+        perror("Error writing data to output file (word_count_reduce)");
+        return -1;
     }
+    return 0;
+}
 
-    return 0; // Indicate successful completion
+// Count a word in a TOPK_SKETCH
+static int add_top_word(void *ctx, const char *word, size_t len) {
+    topk_add(ctx, word, len);
+    return 0;
+}
+
+// Count a word in an HLL_SKETCH
+static int add_distinct_word(void *ctx, const char *word, size_t len) {
+    hll_add(ctx, word, len);
+    return 0;
+}
+
+/* User-defined map function for the "Top words" task: counts the words of the split in a Count-Min
+   Sketch with a heap of heavy hitters, and writes it as a single "top" record. Its size does not
+   depend on the words of the split; sketch_combine() and sketch_reduce() merge the sketches.
+   @param split: The data split that the map function is going to work on (see letter_counter_map()).
+                 split->usr_data points to the number of words to report (an int, at most SKETCH_TOPK_MAX).
+   @param fd_out: The file descriptor of the itermediate data file output by the map function.
+   @ret: 0 on success, -1 on error.
+ */
+
+int top_words_map(DATA_SPLIT *split, int fd_out) {
+    TOPK_SKETCH *sketch = topk_create(split && split->usr_data ? *(int *)split->usr_data : TOP_WORDS_DEFAULT);
+    ITM_WRITER writer;
+    int ret;
+
+    if (sketch == NULL) {
+        fprintf(stderr, "Error: Unable to create the sketch in top_words_map.\n");
+        return -1;
+    }
+    ret = kernel_split_words(split, WORD_COUNT_MAX_LEN, add_top_word, sketch, "top_words_map");
+    if (ret == 0) {
+        itm_writer_open(&writer, fd_out);
+        if (topk_write(sketch, &writer, "top") != SUCCESS || itm_writer_close(&writer) != SUCCESS) {
+            perror("Error writing to intermediate file in top_words_map");
+            ret = -1;
+        }
+    }
+    topk_destroy(sketch);
+    return ret;
+}
+
+/* User-defined map function for the "Distinct words" task: adds the words of the split to a
+   HyperLogLog, and writes it as a single "distinct" record of SKETCH_HLL_REGISTERS bytes, merged by
+   sketch_combine() and sketch_reduce().
+   @param split: The data split that the map function is going to work on (see letter_counter_map()).
+   @param fd_out: The file descriptor of the itermediate data file output by the map function.
+   @ret: 0 on success, -1 on error.
+ */
+
+int distinct_words_map(DATA_SPLIT *split, int fd_out) {
+    HLL_SKETCH *sketch = hll_create();
+    ITM_WRITER writer;
+    int ret;
+
+    if (sketch == NULL) {
+        fprintf(stderr, "Error: Unable to create the sketch in distinct_words_map.\n");
+        return -1;
+    }
+    ret = kernel_split_words(split, WORD_COUNT_MAX_LEN, add_distinct_word, sketch, "distinct_words_map");
+    if (ret == 0) {
+        itm_writer_open(&writer, fd_out);
+        if (hll_write(sketch, &writer, "distinct") != SUCCESS || itm_writer_close(&writer) != SUCCESS) {
+            perror("Error writing to intermediate file in distinct_words_map");
+            ret = -1;
+        }
+    }
+    hll_destroy(sketch);
+    return ret;
 }
@@ -5,12 +5,38 @@
 
 #include "mapreduce.h"
 
+#define WORD_COUNT_MAX_LEN 256 /* Longer words are counted by their prefix */
+#define TOP_WORDS_DEFAULT 10 /* The words reported by the "Top words" task without a usr_data */
+
+/* The usr_data of the "Word finder" task: the words to find, in one pass over the input */
+typedef struct _word_list
+{
+    int word_num;
+    char ** words;
+    int positions; /* Whether the matches carry their offset and line number, for word_finder_binary_reduce() */
+}WORD_LIST;
 
 int letter_counter_map(DATA_SPLIT * split, int fd_out);
 int letter_counter_reduce(int * p_fd_in, int fd_in_num, int fd_out);
+int letter_counter_combine(int * p_fd_in, int fd_in_num, int fd_out);
+int letter_counter_binary_reduce(int * p_fd_in, int fd_in_num, int fd_out);
 
 int word_finder_map(DATA_SPLIT * split, int fd_out);
 int word_finder_reduce(int * p_fd_in, int fd_in_num, int fd_out);
+int word_finder_binary_reduce(int * p_fd_in, int fd_in_num, int fd_out);
+int word_finder_partition(const char * key, uint32_t key_len, int reduce_num);
+int word_finder_index_lookup(const char * index_path, const char * input_path, WORD_LIST * word_list, int fd_out);
+
+int word_count_map(DATA_SPLIT * split, EMITTER * emitter);
+int word_count_merge(char * value, uint32_t value_len, const char * other, uint32_t other_len);
+int word_count_reduce(const char * key, uint32_t key_len, REDUCE_VALUES * values, FILE * output);
+
+/* Their combine and reduce functions are sketch_combine() and sketch_reduce() */
+int top_words_map(DATA_SPLIT * split, int fd_out);
+int distinct_words_map(DATA_SPLIT * split, int fd_out);
+
+/* Its group reduce function is inverted_reduce(), and inverted_build() puts the partitions together */
+int index_words_map(DATA_SPLIT * split, int fd_out);
 
 
 #endif